@@ -0,0 +1,321 @@
+//! Sweeps the process paths over resolution, scale, noise, tta, tile size and sync gap
+//! on the cpu and gpu, then writes the results as json to compare across ncnn bumps.
+//!
+//! Every axis is a comma separated list in an environment variable:
+//!
+//! REALCUGAN_BENCH_DEVICES    cpu,0          cpu and gpu indices
+//! REALCUGAN_BENCH_SIZES      256x256,640x480
+//! REALCUGAN_BENCH_SCALES     2,3,4
+//! REALCUGAN_BENCH_NOISE      0,3            0 no denoise, -1 conservative, 1 to 3 denoise
+//! REALCUGAN_BENCH_TTA        0              orientations per tile, 0 or 1 without tta, 2, 4 or 8
+//! REALCUGAN_BENCH_TILE_SIZES 0              0 picks the tile size from the gpu memory
+//! REALCUGAN_BENCH_SYNC_GAPS  0,1,2,3        0 process, 1 process_se, 2 se_rough, 3 se_very_rough
+//! REALCUGAN_BENCH_RUNS       5              timed runs after one warm up run
+//! REALCUGAN_BENCH_OUT        target/realcugan-bench.json
+//!
+//! A free argument only runs the cases whose name contains it: cargo bench -- cpu
+
+use std::time::Instant;
+
+use realcugan_rs::image::{DynamicImage, RgbImage};
+use realcugan_rs::{RealCugan, SyncGap};
+
+const MODELS: &str = "./models/models-se";
+
+struct Case {
+    device: i32,
+    width: u32,
+    height: u32,
+    scale: i32,
+    noise: i32,
+    tta: u32,
+    tile_size: u32,
+    sync_gap: i32,
+}
+
+impl Case {
+    fn name(&self) -> String {
+        format!(
+            "{} {}x{} scale{} noise{} tta{} tile{} syncgap{}",
+            device_name(self.device),
+            self.width,
+            self.height,
+            self.scale,
+            self.noise,
+            self.tta,
+            self.tile_size,
+            self.sync_gap
+        )
+    }
+
+    fn model(&self) -> Option<String> {
+        let name = match self.noise {
+            -1 => "conservative".to_string(),
+            0 => "no-denoise".to_string(),
+            noise => format!("denoise{}x", noise),
+        };
+        let model = format!("{}/up{}x-{}", MODELS, self.scale, name);
+        if std::path::Path::new(&format!("{}.bin", model)).exists() {
+            Some(model)
+        } else {
+            None
+        }
+    }
+}
+
+struct Result {
+    megapixels_per_second: f64,
+    p50_ms: f64,
+    p99_ms: f64,
+    rss_kb: u64,
+    peak_rss_kb: u64,
+    peak_vram_mb: u32,
+}
+
+fn device_name(device: i32) -> String {
+    if device == -1 {
+        "cpu".to_string()
+    } else {
+        format!("gpu{}", device)
+    }
+}
+
+fn list<T: std::str::FromStr>(name: &str, default: &str) -> Vec<T> {
+    let value = std::env::var(name).unwrap_or_else(|_| default.to_string());
+    value
+        .split(',')
+        .filter_map(|item| item.trim().parse().ok())
+        .collect()
+}
+
+fn devices() -> Vec<i32> {
+    let value = std::env::var("REALCUGAN_BENCH_DEVICES").unwrap_or_else(|_| "cpu,0".to_string());
+    value
+        .split(',')
+        .filter_map(|item| match item.trim() {
+            "cpu" => Some(-1),
+            gpu => gpu.parse::<u32>().ok().filter(|gpu| *gpu < RealCugan::gpu_count()).map(|gpu| gpu as i32),
+        })
+        .collect()
+}
+
+fn sizes() -> Vec<(u32, u32)> {
+    let value = std::env::var("REALCUGAN_BENCH_SIZES").unwrap_or_else(|_| "256x256,640x480".to_string());
+    value
+        .split(',')
+        .filter_map(|item| {
+            let (width, height) = item.trim().split_once('x')?;
+            Some((width.parse().ok()?, height.parse().ok()?))
+        })
+        .collect()
+}
+
+/// Deterministic noise, flat images would understate the cost of the se passes
+fn input(width: u32, height: u32) -> DynamicImage {
+    let mut state = 0x9e3779b9u32;
+    let mut bytes = vec![0u8; (width * height * 3) as usize];
+    for byte in bytes.iter_mut() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        *byte = (state >> 24) as u8;
+    }
+    DynamicImage::from(RgbImage::from_raw(width, height, bytes).unwrap())
+}
+
+/// Restarts the peak resident memory of this process at its current size, so each case
+/// reports its own peak instead of the largest one run so far
+fn reset_peak_rss() {
+    let _ = std::fs::write("/proc/self/clear_refs", "5");
+}
+
+/// Current and peak resident memory of this process since the last reset, zero where /proc is missing
+fn rss() -> (u64, u64) {
+    let status = std::fs::read_to_string("/proc/self/status").unwrap_or_default();
+    let field = |name: &str| {
+        status
+            .lines()
+            .find(|line| line.starts_with(name))
+            .and_then(|line| line[name.len()..].trim().trim_end_matches("kB").trim().parse().ok())
+            .unwrap_or(0)
+    };
+    (field("VmRSS:"), field("VmHWM:"))
+}
+
+/// Tracks the device memory a case takes on its gpu, from the usage the driver reports
+/// or, where it reports none, from how far the heap budget of the gpu drops
+struct Vram {
+    device: i32,
+    usage: u32,
+    budget: u32,
+    peak_mb: u32,
+}
+
+impl Vram {
+    fn new(device: i32) -> Vram {
+        let (usage, budget) = Vram::read(device);
+        Vram { device, usage, budget, peak_mb: 0 }
+    }
+
+    fn read(device: i32) -> (u32, u32) {
+        if device == -1 {
+            return (0, 0)
+        }
+        RealCugan::heap_usage(device as u32).unwrap_or((0, 0))
+    }
+
+    fn sample(&mut self) {
+        let (usage, budget) = Vram::read(self.device);
+        let taken = if usage != 0 {
+            usage.saturating_sub(self.usage)
+        } else {
+            self.budget.saturating_sub(budget)
+        };
+        self.peak_mb = self.peak_mb.max(taken);
+    }
+}
+
+fn percentile(sorted: &[f64], p: f64) -> f64 {
+    let index = ((sorted.len() - 1) as f64 * p).round() as usize;
+    sorted[index]
+}
+
+fn run(case: &Case, model: &str, runs: u32) -> std::result::Result<Result, String> {
+    let sync_gap = match case.sync_gap {
+        0 => SyncGap::Disabled,
+        1 => SyncGap::Loose,
+        2 => SyncGap::Moderate,
+        _ => SyncGap::Strict,
+    };
+    let param = format!("{}.param", model);
+    let bin = format!("{}.bin", model);
+    let builder = RealCugan::build()
+        .model_files(&param, &bin)
+        .scale(case.scale)
+        .noise(case.noise)
+        .tile_size(case.tile_size)
+        .sync_gap(sync_gap);
+    let builder = builder.tta_level(case.tta);
+    let builder = if case.device == -1 {
+        builder.cpu()
+    } else {
+        builder.gpu(case.device as u32)
+    };
+
+    // the memory of earlier cases is freed with their instances, only this one counts
+    reset_peak_rss();
+    let mut vram = Vram::new(case.device);
+
+    let realcugan = builder.build()?;
+
+    let image = input(case.width, case.height);
+    realcugan.process_image(image.clone())?;
+    vram.sample();
+
+    let mut latencies = Vec::with_capacity(runs as usize);
+    let start = Instant::now();
+    for _ in 0..runs {
+        let run_start = Instant::now();
+        realcugan.process_image(image.clone())?;
+        latencies.push(run_start.elapsed().as_secs_f64() * 1000.0);
+        vram.sample();
+    }
+    let elapsed = start.elapsed().as_secs_f64();
+    latencies.sort_by(|a, b| a.partial_cmp(b).unwrap());
+
+    let (rss_kb, peak_rss_kb) = rss();
+    Ok(Result {
+        megapixels_per_second: (case.width * case.height) as f64 * runs as f64 / elapsed / 1e6,
+        p50_ms: percentile(&latencies, 0.5),
+        p99_ms: percentile(&latencies, 0.99),
+        rss_kb,
+        peak_rss_kb,
+        peak_vram_mb: vram.peak_mb,
+    })
+}
+
+fn escape(text: &str) -> String {
+    text.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n")
+}
+
+fn main() {
+    let filter: Option<String> = std::env::args().skip(1).find(|arg| !arg.starts_with("--"));
+    let runs = list::<u32>("REALCUGAN_BENCH_RUNS", "5").first().copied().unwrap_or(5).max(1);
+    let out = std::env::var("REALCUGAN_BENCH_OUT").unwrap_or_else(|_| "target/realcugan-bench.json".to_string());
+
+    let mut cases = Vec::new();
+    for device in devices() {
+        for (width, height) in sizes() {
+            for scale in list::<i32>("REALCUGAN_BENCH_SCALES", "2,3,4") {
+                for noise in list::<i32>("REALCUGAN_BENCH_NOISE", "0,3") {
+                    for tta in list::<u32>("REALCUGAN_BENCH_TTA", "0") {
+                        for tile_size in list::<u32>("REALCUGAN_BENCH_TILE_SIZES", "0") {
+                            for sync_gap in list::<i32>("REALCUGAN_BENCH_SYNC_GAPS", "0,1,2,3") {
+                                cases.push(Case { device, width, height, scale, noise, tta, tile_size, sync_gap });
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    let mut entries = Vec::new();
+    for case in &cases {
+        let name = case.name();
+        if filter.as_ref().map_or(false, |filter| !name.contains(filter.as_str())) {
+            continue
+        }
+        let model = match case.model() {
+            Some(model) => model,
+            None => continue,
+        };
+
+        let fields = format!(
+            "\"name\": \"{}\", \"device\": \"{}\", \"width\": {}, \"height\": {}, \"scale\": {}, \"noise\": {}, \"tta\": {}, \"tile_size\": {}, \"sync_gap\": {}",
+            name,
+            device_name(case.device),
+            case.width,
+            case.height,
+            case.scale,
+            case.noise,
+            case.tta,
+            case.tile_size,
+            case.sync_gap
+        );
+        match run(case, &model, runs) {
+            Ok(result) => {
+                println!(
+                    "{:<60} {:>8.3} MP/s  p50 {:>9.2} ms  p99 {:>9.2} ms  peak rss {:>8} kB  peak vram {:>6} MB",
+                    name, result.megapixels_per_second, result.p50_ms, result.p99_ms, result.peak_rss_kb, result.peak_vram_mb
+                );
+                entries.push(format!(
+                    "    {{{}, \"megapixels_per_second\": {:.4}, \"p50_ms\": {:.3}, \"p99_ms\": {:.3}, \"rss_kb\": {}, \"peak_rss_kb\": {}, \"peak_vram_mb\": {}}}",
+                    fields,
+                    result.megapixels_per_second,
+                    result.p50_ms,
+                    result.p99_ms,
+                    result.rss_kb,
+                    result.peak_rss_kb,
+                    result.peak_vram_mb
+                ));
+            }
+            Err(e) => {
+                println!("{:<60} failed: {}", name, e);
+                entries.push(format!("    {{{}, \"error\": \"{}\"}}", fields, escape(&e)));
+            }
+        }
+    }
+
+    let json = format!(
+        "{{\n  \"ncnn_commit\": \"{}\",\n  \"runs\": {},\n  \"results\": [\n{}\n  ]\n}}\n",
+        option_env!("REALCUGAN_NCNN_COMMIT").unwrap_or("unknown"),
+        runs,
+        entries.join(",\n")
+    );
+    if let Some(dir) = std::path::Path::new(&out).parent() {
+        let _ = std::fs::create_dir_all(dir);
+    }
+    std::fs::write(&out, json).expect("Failed to write benchmark results");
+    println!("results written to {}", out);
+}
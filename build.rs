@@ -101,8 +101,11 @@ fn build_ncnn(output: &str) -> Result<(), String> {
 fn main() {
     let output = std::env::var("OUT_DIR").unwrap();
     if cfg!(feature = "system-ncnn") {
+        println!("cargo:rustc-env=REALCUGAN_NCNN_COMMIT={}", "system");
         println!("cargo:rustc-link-lib=dylib={}", "ncnn");
     } else {
+        // recorded by the benchmarks to compare results across ncnn bumps
+        println!("cargo:rustc-env=REALCUGAN_NCNN_COMMIT={}", NCNN_COMMIT_HASH);
         if let Err(e) = build_ncnn(&output) {
             panic!("Failed to build ncnn: {}", e);
         }
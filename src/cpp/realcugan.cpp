@@ -1,9 +1,16 @@
 // realcugan implemented with ncnn library
 
 #include "realcugan.h"
+#include "realcugan_kernels.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <thread>
 #include <vector>
+#include <list>
 #include <map>
 
 // ncnn
@@ -15,22 +22,205 @@
 #include "realcugan_preproc_tta.comp.hex.h"
 #include "realcugan_postproc_tta.comp.hex.h"
 #include "realcugan_4x_postproc_tta.comp.hex.h"
+#include "realcugan_feature_avg.comp.hex.h"
 
 // CUSTOM
 
-int RealCUGAN::load_files(FILE *param, FILE *bin)
+// on disk cache of the compiled shaders, keyed by the shader source, the device and the options
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t size)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= p[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// the options that change the code compile_spirv_module generates
+static std::string option_flags(const ncnn::Option& opt)
+{
+    char flags[8];
+    sprintf(flags, "%d%d%d%d%d%d", opt.use_fp16_packed, opt.use_fp16_storage, opt.use_fp16_arithmetic, opt.use_int8_storage, opt.use_int8_arithmetic, opt.use_shader_pack8);
+
+    return flags;
+}
+
+static std::string spirv_cache_path(const std::string& cache_dir, const char* name, const char* comp_data, int comp_data_size, const ncnn::VulkanDevice* vkdev, const ncnn::Option& opt)
+{
+    uint64_t hash = 14695981039346656037ull;
+    hash = fnv1a(hash, comp_data, comp_data_size);
+
+    const ncnn::GpuInfo& info = vkdev->info;
+    uint32_t ids[3] = {info.vendor_id(), info.device_id(), info.driver_version()};
+    hash = fnv1a(hash, ids, sizeof(ids));
+    hash = fnv1a(hash, info.pipeline_cache_uuid(), VK_UUID_SIZE);
+
+    const std::string flags = option_flags(opt);
+    hash = fnv1a(hash, flags.data(), flags.size());
+
+    char key[32];
+    sprintf(key, "%016llx", (unsigned long long)hash);
+
+    return cache_dir + "/" + name + "-" + key + ".spv";
+}
+
+static int compile_spirv_cached(const char* name, const char* comp_data, int comp_data_size, const ncnn::VulkanDevice* vkdev, const ncnn::Option& opt, const std::string& cache_dir, std::vector<uint32_t>& spirv)
+{
+    if (cache_dir.empty())
+        return ncnn::compile_spirv_module(comp_data, comp_data_size, opt, spirv);
+
+    const std::string path = spirv_cache_path(cache_dir, name, comp_data, comp_data_size, vkdev, opt);
+
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp)
+    {
+        fseek(fp, 0, SEEK_END);
+        long size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+
+        if (size > 0 && size % 4 == 0)
+        {
+            spirv.resize(size / 4);
+            if (fread(spirv.data(), 1, size, fp) != (size_t)size)
+                spirv.clear();
+        }
+
+        fclose(fp);
+
+        if (!spirv.empty())
+            return 0;
+    }
+
+    int ret = ncnn::compile_spirv_module(comp_data, comp_data_size, opt, spirv);
+    if (ret != 0)
+        return ret;
+
+    // best effort, written to a temporary file first so that another process never reads half a module
+    const std::string tmppath = path + "." + std::to_string((unsigned long long)std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+
+    fp = fopen(tmppath.c_str(), "wb");
+    if (fp)
+    {
+        bool written = fwrite(spirv.data(), 4, spirv.size(), fp) == spirv.size();
+        fclose(fp);
+
+        if (!written || rename(tmppath.c_str(), path.c_str()) != 0)
+            remove(tmppath.c_str());
+    }
+
+    return 0;
+}
+
+// compiled shaders shared by all instances of the process, one per shader variant and option set
+// so tta and plain instances loaded side by side each get their own kernels
+static void load_spirv(const char* name, const char* comp_data, int comp_data_size, const ncnn::VulkanDevice* vkdev, const ncnn::Option& opt, const std::string& cache_dir, std::vector<uint32_t>& spirv)
+{
+    static std::map<std::string, std::vector<uint32_t> > modules;
+    static ncnn::Mutex lock;
+
+    const std::string key = std::string(name) + "-" + option_flags(opt);
+
+    {
+        ncnn::MutexLockGuard guard(lock);
+
+        std::map<std::string, std::vector<uint32_t> >::const_iterator it = modules.find(key);
+        if (it != modules.end())
+        {
+            spirv = it->second;
+            return;
+        }
+    }
+
+    // compiled outside the lock, instances loading other shaders do not wait for this one
+    compile_spirv_cached(name, comp_data, comp_data_size, vkdev, opt, cache_dir, spirv);
+    if (spirv.empty())
+        return;
+
+    ncnn::MutexLockGuard guard(lock);
+    modules[key] = spirv;
+}
+
+void RealCUGAN::prepare_net()
 {
+    // levels between the supported ones round down, a single orientation is plain inference
+    tta_level = tta_level >= 8 ? 8 : tta_level >= 4 ? 4 : tta_level >= 2 ? 2 : 1;
+    if (tta_level == 1)
+        tta_mode = false;
+
     net.opt.use_vulkan_compute = vkdev ? true : false;
-    net.opt.use_fp16_packed = true;
-    net.opt.use_fp16_storage = vkdev ? true : false;
-    net.opt.use_fp16_arithmetic = false;
-    net.opt.use_int8_storage = true;
+    net.opt.use_fp16_packed = precision != 0;
+    net.opt.use_fp16_storage = vkdev && precision != 0 ? true : false;
+    // fp16 arithmetic only where the device has it, ncnn would silently ignore it otherwise
+    net.opt.use_fp16_arithmetic = precision == 2 && (!vkdev || vkdev->info.support_fp16_arithmetic());
+    // the preproc and postproc shaders take uint8 pixels only where the host uploads them so, with fp16 storage
+    net.opt.use_int8_storage = precision != 0;
+    // int8 layers of a quantized model, a float model has none and runs as with fp16 storage
+    net.opt.use_int8_inference = precision == 3;
+    net.opt.use_int8_arithmetic = precision == 3;
 
     net.set_vulkan_device(vkdev);
+}
+
+int RealCUGAN::load_files(FILE *param, FILE *bin)
+{
+    prepare_net();
 
     net.load_param(param);
     net.load_model(bin);
 
+    create_pipelines();
+
+    // every peer device holds its own copy of the model
+    for (size_t i = 0; i < peers.size(); i++)
+    {
+        rewind(param);
+        rewind(bin);
+
+        peers[i]->cache_dir = cache_dir;
+        peers[i]->precision = precision;
+        peers[i]->tta_level = tta_level;
+
+        int ret = peers[i]->load_files(param, bin);
+        if (ret != 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+int RealCUGAN::load_memory(const char* param, const unsigned char* bin)
+{
+    prepare_net();
+
+    int ret = net.load_param_mem(param);
+    if (ret != 0)
+        return ret;
+
+    // the weights are referenced in place instead of copied
+    if (net.load_model(bin) == 0)
+        return -1;
+
+    create_pipelines();
+
+    // the peer devices reference the same weights
+    for (size_t i = 0; i < peers.size(); i++)
+    {
+        peers[i]->cache_dir = cache_dir;
+        peers[i]->precision = precision;
+        peers[i]->tta_level = tta_level;
+
+        ret = peers[i]->load_memory(param, bin);
+        if (ret != 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+void RealCUGAN::create_pipelines()
+{
     // initialize preprocess and postprocess pipeline
     if (vkdev)
     {
@@ -41,183 +231,1408 @@ int RealCUGAN::load_files(FILE *param, FILE *bin)
         specializations[0].i = 0;
 #endif
 
+        // the tta shaders only touch the orientations of the tta level
+        std::vector<ncnn::vk_specialization_type> tta_specializations(2);
+        tta_specializations[0].i = specializations[0].i;
+        tta_specializations[1].i = tta_level;
+
         {
-            static std::vector<uint32_t> spirv;
-            static ncnn::Mutex lock;
-            {
-                ncnn::MutexLockGuard guard(lock);
-                if (spirv.empty())
-                {
-                    if (tta_mode)
-                        compile_spirv_module(realcugan_preproc_tta_comp_data, sizeof(realcugan_preproc_tta_comp_data), net.opt, spirv);
-                    else
-                        compile_spirv_module(realcugan_preproc_comp_data, sizeof(realcugan_preproc_comp_data), net.opt, spirv);
-                }
-            }
+            std::vector<uint32_t> spirv;
+            if (tta_mode)
+                load_spirv("realcugan_preproc_tta", realcugan_preproc_tta_comp_data, sizeof(realcugan_preproc_tta_comp_data), vkdev, net.opt, cache_dir, spirv);
+            else
+                load_spirv("realcugan_preproc", realcugan_preproc_comp_data, sizeof(realcugan_preproc_comp_data), vkdev, net.opt, cache_dir, spirv);
 
             realcugan_preproc = new ncnn::Pipeline(vkdev);
             realcugan_preproc->set_optimal_local_size_xyz(8, 8, 3);
-            realcugan_preproc->create(spirv.data(), spirv.size() * 4, specializations);
+            realcugan_preproc->create(spirv.data(), spirv.size() * 4, tta_mode ? tta_specializations : specializations);
         }
 
         {
-            static std::vector<uint32_t> spirv;
-            static ncnn::Mutex lock;
-            {
-                ncnn::MutexLockGuard guard(lock);
-                if (spirv.empty())
-                {
-                    if (tta_mode)
-                        compile_spirv_module(realcugan_postproc_tta_comp_data, sizeof(realcugan_postproc_tta_comp_data), net.opt, spirv);
-                    else
-                        compile_spirv_module(realcugan_postproc_comp_data, sizeof(realcugan_postproc_comp_data), net.opt, spirv);
-                }
-            }
+            std::vector<uint32_t> spirv;
+            if (tta_mode)
+                load_spirv("realcugan_postproc_tta", realcugan_postproc_tta_comp_data, sizeof(realcugan_postproc_tta_comp_data), vkdev, net.opt, cache_dir, spirv);
+            else
+                load_spirv("realcugan_postproc", realcugan_postproc_comp_data, sizeof(realcugan_postproc_comp_data), vkdev, net.opt, cache_dir, spirv);
 
             realcugan_postproc = new ncnn::Pipeline(vkdev);
             realcugan_postproc->set_optimal_local_size_xyz(8, 8, 3);
-            realcugan_postproc->create(spirv.data(), spirv.size() * 4, specializations);
+            realcugan_postproc->create(spirv.data(), spirv.size() * 4, tta_mode ? tta_specializations : specializations);
+        }
+
+        {
+            std::vector<uint32_t> spirv;
+            if (tta_mode)
+                load_spirv("realcugan_4x_postproc_tta", realcugan_4x_postproc_tta_comp_data, sizeof(realcugan_4x_postproc_tta_comp_data), vkdev, net.opt, cache_dir, spirv);
+            else
+                load_spirv("realcugan_4x_postproc", realcugan_4x_postproc_comp_data, sizeof(realcugan_4x_postproc_comp_data), vkdev, net.opt, cache_dir, spirv);
+
+            realcugan_4x_postproc = new ncnn::Pipeline(vkdev);
+            realcugan_4x_postproc->set_optimal_local_size_xyz(8, 8, 3);
+            realcugan_4x_postproc->create(spirv.data(), spirv.size() * 4, tta_mode ? tta_specializations : specializations);
+        }
+
+        {
+            std::vector<uint32_t> spirv;
+            load_spirv("realcugan_feature_avg", realcugan_feature_avg_comp_data, sizeof(realcugan_feature_avg_comp_data), vkdev, net.opt, cache_dir, spirv);
+
+            realcugan_feature_avg = new ncnn::Pipeline(vkdev);
+            realcugan_feature_avg->set_optimal_local_size_xyz(64, 1, 1);
+            realcugan_feature_avg->create(spirv.data(), spirv.size() * 4, std::vector<ncnn::vk_specialization_type>());
+        }
+    }
+}
+
+
+// END CUSTOM
+
+// features of each tile stored densely by gap, row, column and tta index
+// gap names are interned the first time they are seen, a se pass only has gap0 to gap3
+template<typename T>
+class FeatureGrid
+{
+public:
+    FeatureGrid() : bytes(0)
+    {
+    }
+
+    void clear()
+    {
+        feats.clear();
+        bytes = 0;
+    }
+
+    T& at(int yi, int xi, int ti)
+    {
+        if ((int)feats.size() <= yi)
+            feats.resize(yi + 1);
+        std::vector<std::vector<T> >& row = feats[yi];
+        if ((int)row.size() <= xi)
+            row.resize(xi + 1);
+        std::vector<T>& tile = row[xi];
+        if ((int)tile.size() <= ti)
+            tile.resize(ti + 1);
+        return tile[ti];
+    }
+
+    void load(int yi, int xi, int ti, T& feat) const
+    {
+        if (yi < (int)feats.size() && xi < (int)feats[yi].size() && ti < (int)feats[yi][xi].size())
+            feat = feats[yi][xi][ti];
+        else
+            feat = T();
+    }
+
+    void save(int yi, int xi, int ti, const T& feat)
+    {
+        T& slot = at(yi, xi, ti);
+        bytes -= slot.total() * slot.elemsize;
+        bytes += feat.total() * feat.elemsize;
+        slot = feat;
+    }
+
+public:
+    std::vector<std::vector<std::vector<T> > > feats;
+    // bytes referenced by the stored tiles, averaged features shared by many tiles count once per tile
+    size_t bytes;
+};
+
+class FeatureCache
+{
+public:
+    FeatureCache() : budget(0), peak_bytes(0), spilled(false)
+    {
+    }
+
+    void clear()
+    {
+        names.clear();
+        gpu_cache.clear();
+        cpu_cache.clear();
+        host_cache.clear();
+        spilled = false;
+    }
+
+    int gap(const std::string& name)
+    {
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            if (names[i] == name)
+                return (int)i;
+        }
+
+        names.push_back(name);
+        gpu_cache.resize(names.size());
+        cpu_cache.resize(names.size());
+        host_cache.resize(names.size());
+        return (int)names.size() - 1;
+    }
+
+    void load(int yi, int xi, int ti, const std::string& name, ncnn::VkMat& feat)
+    {
+        gpu_cache[gap(name)].load(yi, xi, ti, feat);
+    }
+
+    void save(int yi, int xi, int ti, const std::string& name, ncnn::VkMat& feat)
+    {
+        int g = gap(name);
+        gpu_cache[g].save(yi, xi, ti, feat);
+        // a fresh gpu feature replaces whatever was spilled for the tile
+        ncnn::Mat spilled_feat;
+        host_cache[g].load(yi, xi, ti, spilled_feat);
+        if (!spilled_feat.empty())
+            host_cache[g].save(yi, xi, ti, ncnn::Mat());
+        peak_bytes = std::max(peak_bytes, bytes());
+    }
+
+    // true with the host copy of a tile moved out of vram by spill
+    bool load_spilled(int yi, int xi, int ti, const std::string& name, ncnn::Mat& feat)
+    {
+        host_cache[gap(name)].load(yi, xi, ti, feat);
+        return !feat.empty();
+    }
+
+    // the gpu features of names outgrew the budget
+    bool over_budget(const std::vector<std::string>& names)
+    {
+        if (budget == 0)
+            return false;
+
+        size_t gpu_bytes = 0;
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            gpu_bytes += gpu_cache[gap(names[i])].bytes;
         }
 
+        return gpu_bytes > budget;
+    }
+
+    // download row yi of the gpu features of names to host memory and free the vram
+    // cmd must have nothing pending
+    int spill(int yi, const std::vector<std::string>& names, ncnn::VkCompute& cmd, const ncnn::Option& opt)
+    {
+        for (size_t i = 0; i < names.size(); i++)
         {
-            static std::vector<uint32_t> spirv;
-            static ncnn::Mutex lock;
+            int g = gap(names[i]);
+            if ((int)gpu_cache[g].feats.size() <= yi)
+                continue;
+
+            std::vector<std::vector<ncnn::VkMat> >& row = gpu_cache[g].feats[yi];
+            for (int xi = 0; xi < (int)row.size(); xi++)
             {
-                ncnn::MutexLockGuard guard(lock);
-                if (spirv.empty())
+                for (int ti = 0; ti < (int)row[xi].size(); ti++)
                 {
-                    if (tta_mode)
-                        compile_spirv_module(realcugan_4x_postproc_tta_comp_data, sizeof(realcugan_4x_postproc_tta_comp_data), net.opt, spirv);
-                    else
-                        compile_spirv_module(realcugan_4x_postproc_comp_data, sizeof(realcugan_4x_postproc_comp_data), net.opt, spirv);
+                    if (row[xi][ti].empty())
+                        continue;
+
+                    cmd.record_download(row[xi][ti], host_cache[g].at(yi, xi, ti), opt);
                 }
             }
+        }
 
-            realcugan_4x_postproc = new ncnn::Pipeline(vkdev);
-            realcugan_4x_postproc->set_optimal_local_size_xyz(8, 8, 3);
-            realcugan_4x_postproc->create(spirv.data(), spirv.size() * 4, specializations);
+        int ret = cmd.submit_and_wait();
+        cmd.reset();
+        if (ret != 0)
+            return ret;
+
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            int g = gap(names[i]);
+            if ((int)gpu_cache[g].feats.size() <= yi)
+                continue;
+
+            std::vector<std::vector<ncnn::VkMat> >& row = gpu_cache[g].feats[yi];
+            for (int xi = 0; xi < (int)row.size(); xi++)
+            {
+                for (int ti = 0; ti < (int)row[xi].size(); ti++)
+                {
+                    ncnn::Mat& host_feat = host_cache[g].at(yi, xi, ti);
+                    host_cache[g].bytes += host_feat.total() * host_feat.elemsize;
+                    gpu_cache[g].save(yi, xi, ti, ncnn::VkMat());
+                }
+            }
         }
+
+        spilled = true;
+        return 0;
     }
 
-    // bicubic 2x/3x/4x for alpha channel
+    // the averaged features of names took the place of their spilled rows
+    // the sync gaps that follow stay on the gpu once no other gap has rows left on the host
+    void drop_spilled(const std::vector<std::string>& names)
     {
-        bicubic_2x = ncnn::create_layer("Interp");
-        bicubic_2x->vkdev = vkdev;
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            host_cache[gap(names[i])].clear();
+        }
 
-        ncnn::ParamDict pd;
-        pd.set(0, 3);// bicubic
-        pd.set(1, 2.f);
-        pd.set(2, 2.f);
-        bicubic_2x->load_param(pd);
+        spilled = false;
+        for (size_t i = 0; i < host_cache.size(); i++)
+        {
+            spilled = spilled || host_cache[i].bytes != 0;
+        }
+    }
 
-        bicubic_2x->create_pipeline(net.opt);
+    void load(int yi, int xi, int ti, const std::string& name, ncnn::Mat& feat)
+    {
+        cpu_cache[gap(name)].load(yi, xi, ti, feat);
     }
+
+    void save(int yi, int xi, int ti, const std::string& name, ncnn::Mat& feat)
     {
-        bicubic_3x = ncnn::create_layer("Interp");
-        bicubic_3x->vkdev = vkdev;
+        cpu_cache[gap(name)].save(yi, xi, ti, feat);
+        peak_bytes = std::max(peak_bytes, bytes());
+    }
 
-        ncnn::ParamDict pd;
-        pd.set(0, 3);// bicubic
-        pd.set(1, 3.f);
-        pd.set(2, 3.f);
-        bicubic_3x->load_param(pd);
+    // memory held for one gap
+    size_t bytes(const std::string& name) const
+    {
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            if (names[i] == name)
+                return gpu_cache[i].bytes + cpu_cache[i].bytes + host_cache[i].bytes;
+        }
+        return 0;
+    }
 
-        bicubic_3x->create_pipeline(net.opt);
+    size_t bytes() const
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            total += gpu_cache[i].bytes + cpu_cache[i].bytes + host_cache[i].bytes;
+        }
+        return total;
     }
+
+public:
+    std::vector<std::string> names;
+    std::vector<FeatureGrid<ncnn::VkMat> > gpu_cache;
+    std::vector<FeatureGrid<ncnn::Mat> > cpu_cache;
+    // gpu features moved to host memory by spill, read back by the host sync gap
+    std::vector<FeatureGrid<ncnn::Mat> > host_cache;
+    // vram bytes of the features of one pass before rows spill to the host, 0 never spills
+    size_t budget;
+    size_t peak_bytes;
+    bool spilled;
+    // the ring of workers the gpu se passes record on, the cached features live in their allocators
+    std::vector<WorkerState*> workers;
+};
+
+// a device taking part in a se pass, with its own allocators and the features of the tiles it owns
+class SEDevice
+{
+public:
+    const RealCUGAN* realcugan;
+    WorkerState* worker;
+    ncnn::Option opt;
+    FeatureCache cache;
+};
+
+// run f(d) for every device concurrently and return the first error
+template<typename F>
+static int for_each_device(std::vector<SEDevice>& devices, F f)
+{
+    if (devices.size() == 1)
+        return f(0);
+
+    std::vector<int> results(devices.size(), 0);
+    std::vector<std::thread> threads;
+    for (size_t d = 1; d < devices.size(); d++)
     {
-        bicubic_4x = ncnn::create_layer("Interp");
-        bicubic_4x->vkdev = vkdev;
+        threads.push_back(std::thread([&, d]() { results[d] = f(d); }));
+    }
 
-        ncnn::ParamDict pd;
-        pd.set(0, 3);// bicubic
-        pd.set(1, 4.f);
-        pd.set(2, 4.f);
-        bicubic_4x->load_param(pd);
+    results[0] = f(0);
 
-        bicubic_4x->create_pipeline(net.opt);
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+
+    for (size_t d = 0; d < devices.size(); d++)
+    {
+        if (results[d] != 0)
+            return results[d];
     }
 
     return 0;
 }
 
+// edge of the grid of cell means that stands for a frame when comparing frames of a video
+#define REALCUGAN_THUMBNAIL_SIZE 16
 
-// END CUSTOM
+// mean of the first three channels over each cell, from a few samples per cell
+static void frame_thumbnail(const ncnn::Mat& inimage, std::vector<float>& thumbnail)
+{
+    const unsigned char* pixeldata = (const unsigned char*)inimage.data;
+    const int w = inimage.w;
+    const int h = inimage.h;
+    const int channels = inimage.elempack;
 
-class FeatureCache
+    const int size = REALCUGAN_THUMBNAIL_SIZE;
+
+    thumbnail.assign(size * size * 3, 0.f);
+
+    for (int cy = 0; cy < size; cy++)
+    {
+        const int y0 = std::min(cy * h / size, h - 1);
+        const int y1 = std::max((cy + 1) * h / size, y0 + 1);
+        const int sy = std::max((y1 - y0) / 8, 1);
+
+        for (int cx = 0; cx < size; cx++)
+        {
+            const int x0 = std::min(cx * w / size, w - 1);
+            const int x1 = std::max((cx + 1) * w / size, x0 + 1);
+            const int sx = std::max((x1 - x0) / 8, 1);
+
+            float sum[3] = {0.f, 0.f, 0.f};
+            int count = 0;
+            for (int y = y0; y < y1; y += sy)
+            {
+                for (int x = x0; x < x1; x += sx)
+                {
+                    const unsigned char* p = pixeldata + ((size_t)y * w + x) * channels;
+                    sum[0] += p[0];
+                    sum[1] += p[1];
+                    sum[2] += p[2];
+                    count++;
+                }
+            }
+
+            float* cell = &thumbnail[(cy * size + cx) * 3];
+            cell[0] = sum[0] / count;
+            cell[1] = sum[1] / count;
+            cell[2] = sum[2] / count;
+        }
+    }
+}
+
+// averaged gap features of the last key frame, later frames of the same shot reuse them instead of running stage0
+class TemporalFeatures
 {
 public:
-    void clear()
+    TemporalFeatures() : w(0), h(0), channels(0), syncgap(0), tilesize(0), prepadding(0)
     {
-        gpu_cache.clear();
-        cpu_cache.clear();
     }
 
-    std::string make_key(int yi, int xi, int ti, const std::string& name) const
+    // mean absolute difference to the key frame, -1 when its features do not apply to this frame and these settings
+    float distance(const ncnn::Mat& inimage, const std::vector<float>& _thumbnail, const std::vector<std::string>& _names, int _syncgap, int _tilesize, int _prepadding) const
     {
-        return std::to_string(yi) + "-" + std::to_string(xi) + "-" + std::to_string(ti) + "-" + name;
+        if (feats.empty() || names != _names)
+            return -1.f;
+
+        if (inimage.w != w || inimage.h != h || inimage.elempack != channels || _syncgap != syncgap || _tilesize != tilesize || _prepadding != prepadding)
+            return -1.f;
+
+        float diff = 0.f;
+        for (size_t i = 0; i < thumbnail.size(); i++)
+        {
+            diff += fabs(thumbnail[i] - _thumbnail[i]);
+        }
+        return diff / thumbnail.size();
     }
 
-    void load(int yi, int xi, int ti, const std::string& name, ncnn::VkMat& feat)
+public:
+    ncnn::Mutex lock;
+    int w;
+    int h;
+    int channels;
+    int syncgap;
+    int tilesize;
+    int prepadding;
+    std::vector<float> thumbnail;
+    std::vector<std::string> names;
+    std::vector<ncnn::Mat> feats;
+};
+
+// the rows of a frame held in memory, all of them unless the frame is streamed in bands
+struct FrameBand
+{
+    FrameBand(int _h, int _yi0 = 0, int _in_y0 = 0, int _out_y0 = 0) : h(_h), yi0(_yi0), in_y0(_in_y0), out_y0(_out_y0), format(REALCUGAN_FORMAT_PIXELS), xi0(0), xi1(-1), yi1(-1)
+    {
+    }
+
+    // height of the whole frame
+    int h;
+    // first tile row of the band
+    int yi0;
+    // first frame row of the input and output images
+    int in_y0;
+    int out_y0;
+    // yuv frames hold whole planes, see process_yuv
+    int format;
+    // tiles run when only a region of interest is processed, xi1 and yi1 are exclusive, -1 runs to the last tile
+    int xi0;
+    int xi1;
+    int yi1;
+};
+
+// yuv tiles start on even rows and columns, so that each 2x2 block of a chroma sample lies in one tile
+static void even_tiles(int& tile_w, int& tile_h)
+{
+    tile_w = std::max(tile_w / 2 * 2, 2);
+    tile_h = std::max(tile_h / 2 * 2, 2);
+}
+
+class RowQueue
+{
+public:
+    // rows of tiles of all frames, handed out frame after frame
+    RowQueue(const ncnn::Mat* inimages, int count, const RealCUGAN* realcugan, int format = REALCUGAN_FORMAT_PIXELS) : next(0)
+    {
+        offsets.push_back(0);
+        for (int i = 0; i < count; i++)
+        {
+            int tile_w;
+            int tile_h;
+            realcugan->plan_tiles(inimages[i].w, inimages[i].h, tile_w, tile_h);
+            if (format != REALCUGAN_FORMAT_PIXELS)
+                even_tiles(tile_w, tile_h);
+
+            const int ytiles = (inimages[i].h + tile_h - 1) / tile_h;
+            offsets.push_back(offsets.back() + ytiles);
+            bands.push_back(FrameBand(inimages[i].h));
+            bands.back().format = format;
+        }
+    }
+
+    // rows of tiles of one band of a frame
+    RowQueue(const FrameBand& _band, int ytiles) : next(0)
+    {
+        offsets.push_back(0);
+        offsets.push_back(ytiles);
+        bands.push_back(_band);
+    }
+
+    int size() const
+    {
+        return offsets.back();
+    }
+
+    bool pop(int& frame, int& yi)
+    {
+        const int i = next.fetch_add(1);
+        for (frame = 0; frame + 1 < (int)offsets.size(); frame++)
+        {
+            if (i < offsets[frame + 1])
+            {
+                yi = bands[frame].yi0 + i - offsets[frame];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const FrameBand& band(int frame) const
+    {
+        return bands[frame];
+    }
+
+private:
+    std::atomic<int> next;
+    std::vector<int> offsets;
+    std::vector<FrameBand> bands;
+};
+
+class TileQueue
+{
+public:
+    TileQueue(const FrameBand& _band, int _tiles) : next(0), tiles(_tiles), frame_band(_band)
+    {
+    }
+
+    int size() const
+    {
+        return tiles;
+    }
+
+    bool pop(int& tile)
+    {
+        tile = next.fetch_add(1);
+        return tile < tiles;
+    }
+
+    const FrameBand& band() const
+    {
+        return frame_band;
+    }
+
+private:
+    std::atomic<int> next;
+    const int tiles;
+    const FrameBand frame_band;
+};
+
+// a padded input tile and everything its output depends on
+struct TileKey
+{
+    uint64_t hash[2];
+    // noise, scale, tta, channels, crop size and how far the tile reaches past the crop on each side
+    int params[10];
+
+    bool operator<(const TileKey& other) const
+    {
+        if (hash[0] != other.hash[0])
+            return hash[0] < other.hash[0];
+        if (hash[1] != other.hash[1])
+            return hash[1] < other.hash[1];
+        return memcmp(params, other.params, sizeof(params)) < 0;
+    }
+};
+
+// rows of w * channels bytes, stride bytes apart
+static TileKey tile_key(const unsigned char* pixels, int stride, int w, int h, int channels, int noise, int scale, int tta, int pad_left, int pad_top, int pad_right, int pad_bottom)
+{
+    TileKey key;
+    key.hash[0] = 14695981039346656037ull;
+    key.hash[1] = 0x9e3779b97f4a7c15ull;
+    for (int y = 0; y < h; y++)
+    {
+        const unsigned char* p = pixels + (size_t)y * stride;
+
+        key.hash[0] = fnv1a(key.hash[0], p, (size_t)w * channels);
+
+        // a second independent lane so a 64 bit collision alone does not return a wrong tile
+        for (int i = 0; i < w * channels; i++)
+        {
+            key.hash[1] = (key.hash[1] ^ (p[i] + 1)) * 0xff51afd7ed558ccdull;
+            key.hash[1] ^= key.hash[1] >> 29;
+        }
+    }
+
+    key.params[0] = noise;
+    key.params[1] = scale;
+    key.params[2] = tta;
+    key.params[3] = channels;
+    key.params[4] = w;
+    key.params[5] = h;
+    key.params[6] = pad_left;
+    key.params[7] = pad_top;
+    key.params[8] = pad_right;
+    key.params[9] = pad_bottom;
+    return key;
+}
+
+// key of tile xi, yi with its prepadding, pixeldata holds the frame rows from in_y0
+static TileKey frame_tile_key(const unsigned char* pixeldata, int w, int h, int channels, int in_y0, int xi, int yi, int tile_w, int tile_h, int prepadding, int noise, int scale, int tta)
+{
+    const int align = scale == 2 || scale == 4 ? 2 : 4;
+
+    const int tile_w_nopad = std::min((xi + 1) * tile_w, w) - xi * tile_w;
+    const int tile_h_nopad = std::min((yi + 1) * tile_h, h) - yi * tile_h;
+
+    const int tile_x0 = xi * tile_w - prepadding;
+    const int tile_x1 = xi * tile_w + (tile_w_nopad + align - 1) / align * align + prepadding;
+    const int tile_y0 = yi * tile_h - prepadding;
+    const int tile_y1 = yi * tile_h + (tile_h_nopad + align - 1) / align * align + prepadding;
+
+    const int in_tile_x0 = std::max(tile_x0, 0);
+    const int in_tile_x1 = std::min(tile_x1, w);
+    const int in_tile_y0 = std::max(tile_y0, 0);
+    const int in_tile_y1 = std::min(tile_y1, h);
+
+    const unsigned char* pixels = pixeldata + ((size_t)(in_tile_y0 - in_y0) * w + in_tile_x0) * channels;
+
+    return tile_key(pixels, w * channels, in_tile_x1 - in_tile_x0, in_tile_y1 - in_tile_y0, channels, noise, scale, tta, in_tile_x0 - tile_x0, in_tile_y0 - tile_y0, tile_x1 - in_tile_x1, tile_y1 - in_tile_y1);
+}
+
+// copy rows of row_size bytes between buffers with different strides
+static void blit_rows(const unsigned char* src, int src_stride, unsigned char* dst, int dst_stride, int row_size, int h)
+{
+    for (int y = 0; y < h; y++)
+    {
+        memcpy(dst + (size_t)y * dst_stride, src + (size_t)y * src_stride, row_size);
+    }
+}
+
+// the unchanged input as output, copied into a preallocated output so a caller's buffer is written
+static void copy_frame(const ncnn::Mat& inimage, ncnn::Mat& outimage)
+{
+    const size_t size = inimage.total() * inimage.elemsize;
+    if (outimage.empty() || outimage.total() * outimage.elemsize != size)
+    {
+        outimage = inimage;
+        return;
+    }
+
+    if (outimage.data != inimage.data)
+        memcpy(outimage.data, inimage.data, size);
+}
+
+// rows y0 to y1 of a w x h yuv frame as the shaders address them, the luma rows then the chroma rows they touch
+static void pack_yuv_rows(const unsigned char* frame, int w, int h, int format, int y0, int y1, unsigned char* dst)
+{
+    const int cy0 = y0 / 2;
+    const int crows = (y1 + 1) / 2 - cy0;
+    const unsigned char* chroma = frame + (size_t)w * h;
+
+    memcpy(dst, frame + (size_t)y0 * w, (size_t)(y1 - y0) * w);
+    dst += (size_t)(y1 - y0) * w;
+
+    if (format == REALCUGAN_FORMAT_NV12)
+    {
+        memcpy(dst, chroma + (size_t)cy0 * w, (size_t)crows * w);
+    }
+    else
+    {
+        const int cw = w / 2;
+        memcpy(dst, chroma + (size_t)cy0 * cw, (size_t)crows * cw);
+        memcpy(dst + (size_t)crows * cw, chroma + (size_t)(h / 2 + cy0) * cw, (size_t)crows * cw);
+    }
+}
+
+// the inverse of pack_yuv_rows for the rows y0 to y1 of the output frame, both even
+static void unpack_yuv_rows(const unsigned char* src, int w, int h, int format, int y0, int y1, unsigned char* frame)
+{
+    const int cy0 = y0 / 2;
+    const int crows = (y1 - y0) / 2;
+    unsigned char* chroma = frame + (size_t)w * h;
+
+    memcpy(frame + (size_t)y0 * w, src, (size_t)(y1 - y0) * w);
+    src += (size_t)(y1 - y0) * w;
+
+    if (format == REALCUGAN_FORMAT_NV12)
+    {
+        memcpy(chroma + (size_t)cy0 * w, src, (size_t)crows * w);
+    }
+    else
+    {
+        const int cw = w / 2;
+        memcpy(chroma + (size_t)cy0 * cw, src, (size_t)crows * cw);
+        memcpy(chroma + (size_t)(h / 2 + cy0) * cw, src + (size_t)crows * cw, (size_t)crows * cw);
+    }
+}
+
+// output tiles of recently seen input tiles, least recently used ones are dropped beyond capacity bytes
+class TileCache
+{
+public:
+    TileCache() : capacity(0), bytes(0)
+    {
+    }
+
+    void set_capacity(size_t _capacity)
+    {
+        ncnn::MutexLockGuard guard(lock);
+
+        capacity = _capacity;
+        evict();
+    }
+
+    bool enabled()
+    {
+        ncnn::MutexLockGuard guard(lock);
+
+        return capacity > 0;
+    }
+
+    // copy the output tile of key into rows stride bytes apart
+    bool load(const TileKey& key, unsigned char* outpixels, int stride)
+    {
+        ncnn::MutexLockGuard guard(lock);
+
+        std::map<TileKey, std::list<Entry>::iterator>::iterator it = index.find(key);
+        if (it == index.end())
+            return false;
+
+        // most recently used first
+        entries.splice(entries.begin(), entries, it->second);
+
+        const Entry& entry = *it->second;
+        blit_rows(&entry.pixels[0], entry.row_size, outpixels, stride, entry.row_size, entry.h);
+
+        return true;
+    }
+
+    bool load(const TileKey& key, std::vector<unsigned char>& pixels)
+    {
+        ncnn::MutexLockGuard guard(lock);
+
+        std::map<TileKey, std::list<Entry>::iterator>::iterator it = index.find(key);
+        if (it == index.end())
+            return false;
+
+        entries.splice(entries.begin(), entries, it->second);
+
+        pixels = it->second->pixels;
+        return true;
+    }
+
+    void save(const TileKey& key, const unsigned char* outpixels, int stride, int row_size, int h)
+    {
+        const size_t size = (size_t)row_size * h;
+
+        // copied before taking the lock
+        std::vector<unsigned char> pixels(size);
+        blit_rows(outpixels, stride, &pixels[0], row_size, row_size, h);
+
+        ncnn::MutexLockGuard guard(lock);
+
+        if (size > capacity || index.find(key) != index.end())
+            return;
+
+        entries.push_front(Entry());
+        entries.front().key = key;
+        entries.front().row_size = row_size;
+        entries.front().h = h;
+        entries.front().pixels.swap(pixels);
+        index[key] = entries.begin();
+
+        bytes += size;
+        evict();
+    }
+
+private:
+    struct Entry
+    {
+        TileKey key;
+        int row_size;
+        int h;
+        std::vector<unsigned char> pixels;
+    };
+
+    void evict()
+    {
+        while (bytes > capacity && !entries.empty())
+        {
+            bytes -= entries.back().pixels.size();
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+    }
+
+    ncnn::Mutex lock;
+    size_t capacity;
+    size_t bytes;
+    std::list<Entry> entries;
+    std::map<TileKey, std::list<Entry>::iterator> index;
+};
+
+// counters of one device or context, relaxed atomics shared by concurrent calls
+class Stats
+{
+public:
+    Stats()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        tiles.store(0, std::memory_order_relaxed);
+        cached_tiles.store(0, std::memory_order_relaxed);
+        bytes_uploaded.store(0, std::memory_order_relaxed);
+        bytes_downloaded.store(0, std::memory_order_relaxed);
+        feature_cache_peak_bytes.store(0, std::memory_order_relaxed);
+        reused_frames.store(0, std::memory_order_relaxed);
+        spilled_passes.store(0, std::memory_order_relaxed);
+        host_sync_gaps.store(0, std::memory_order_relaxed);
+        for (int i = 0; i < REALCUGAN_STAGE_COUNT; i++)
+        {
+            host_ns[i].store(0, std::memory_order_relaxed);
+            gpu_ns[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void add(std::atomic<uint64_t>& counter, uint64_t value)
+    {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void peak(std::atomic<uint64_t>& counter, uint64_t value)
+    {
+        uint64_t current = counter.load(std::memory_order_relaxed);
+        while (value > current && !counter.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    // add to the totals in stats
+    void sum(RealCUGANStats& stats) const
+    {
+        stats.tiles += tiles.load(std::memory_order_relaxed);
+        stats.cached_tiles += cached_tiles.load(std::memory_order_relaxed);
+        stats.bytes_uploaded += bytes_uploaded.load(std::memory_order_relaxed);
+        stats.bytes_downloaded += bytes_downloaded.load(std::memory_order_relaxed);
+        stats.feature_cache_peak_bytes = std::max(stats.feature_cache_peak_bytes, (uint64_t)feature_cache_peak_bytes.load(std::memory_order_relaxed));
+        stats.reused_frames += reused_frames.load(std::memory_order_relaxed);
+        stats.spilled_passes += spilled_passes.load(std::memory_order_relaxed);
+        stats.host_sync_gaps += host_sync_gaps.load(std::memory_order_relaxed);
+        for (int i = 0; i < REALCUGAN_STAGE_COUNT; i++)
+        {
+            stats.host_ns[i] += host_ns[i].load(std::memory_order_relaxed);
+            stats.gpu_ns[i] += gpu_ns[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    std::atomic<uint64_t> tiles;
+    std::atomic<uint64_t> cached_tiles;
+    std::atomic<uint64_t> bytes_uploaded;
+    std::atomic<uint64_t> bytes_downloaded;
+    std::atomic<uint64_t> feature_cache_peak_bytes;
+    std::atomic<uint64_t> reused_frames;
+    std::atomic<uint64_t> spilled_passes;
+    std::atomic<uint64_t> host_sync_gaps;
+    std::atomic<uint64_t> host_ns[REALCUGAN_STAGE_COUNT];
+    std::atomic<uint64_t> gpu_ns[REALCUGAN_STAGE_COUNT];
+};
+
+// timestamp queries per submission, later stages of a longer submission fold into the last one
+#define REALCUGAN_STAGE_QUERIES 32
+
+// splits the wall time of a tile loop between its stages, lap closes the stage running since the previous lap
+// with NCNN_BENCHMARK the gpu work recorded in each stage is timed too
+class StageTimer
+{
+public:
+    StageTimer(Stats* _stats, ncnn::VkCompute* _cmd = 0, const ncnn::VulkanDevice* _vkdev = 0) : stats(_stats), cmd(_cmd), vkdev(_vkdev), queries(0)
+    {
+        last = std::chrono::steady_clock::now();
+        begin();
+    }
+
+    void lap(int stage)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        stats->add(stats->host_ns[stage], std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count());
+        last = now;
+
+#if NCNN_BENCHMARK
+        if (cmd && queries < REALCUGAN_STAGE_QUERIES)
+        {
+            query_stages[queries] = stage;
+            cmd->record_write_timestamp(queries++);
+        }
+#endif
+    }
+
+    // submit_and_wait and reset, the wait is a stage of its own, returns the result of the submission
+    int submit()
+    {
+        int ret = cmd->submit_and_wait();
+        lap(REALCUGAN_STAGE_WAIT);
+
+#if NCNN_BENCHMARK
+        if (queries > 1)
+        {
+            std::vector<uint64_t> results;
+            if (cmd->get_query_pool_results(0, queries, results) == 0)
+            {
+                const double period = vkdev->info.timestamp_period();
+                for (int i = 1; i < queries; i++)
+                {
+                    stats->add(stats->gpu_ns[query_stages[i]], (uint64_t)((results[i] - results[i - 1]) * period));
+                }
+            }
+        }
+#endif
+
+        cmd->reset();
+        queries = 0;
+        begin();
+
+        return ret;
+    }
+
+private:
+    void begin()
+    {
+#if NCNN_BENCHMARK
+        if (cmd)
+        {
+            query_stages[0] = REALCUGAN_STAGE_WAIT;
+            cmd->record_write_timestamp(queries++);
+        }
+#endif
+    }
+
+    Stats* stats;
+    ncnn::VkCompute* cmd;
+    const ncnn::VulkanDevice* vkdev;
+    std::chrono::steady_clock::time_point last;
+    int queries;
+    int query_stages[REALCUGAN_STAGE_QUERIES];
+};
+
+// wall time of a whole scope into one stage
+class StageScope
+{
+public:
+    StageScope(Stats* _stats, int _stage) : stats(_stats), stage(_stage)
+    {
+        start = std::chrono::steady_clock::now();
+    }
+
+    ~StageScope()
+    {
+        stats->add(stats->host_ns[stage], std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+
+private:
+    Stats* stats;
+    int stage;
+    std::chrono::steady_clock::time_point start;
+};
+
+// allocators and command buffer of one worker
+class WorkerState
+{
+public:
+    WorkerState(const ncnn::VulkanDevice* _vkdev) : vkdev(_vkdev), blob_vkallocator(0), staging_vkallocator(0), cmd(0)
+    {
+        if (vkdev)
+        {
+            blob_vkallocator = vkdev->acquire_blob_allocator();
+            staging_vkallocator = vkdev->acquire_staging_allocator();
+            cmd = new ncnn::VkCompute(vkdev);
+#if NCNN_BENCHMARK
+            cmd->create_query_pool(REALCUGAN_STAGE_QUERIES);
+#endif
+        }
+    }
+
+    ~WorkerState()
+    {
+        if (vkdev)
+        {
+            delete cmd;
+            vkdev->reclaim_blob_allocator(blob_vkallocator);
+            vkdev->reclaim_staging_allocator(staging_vkallocator);
+        }
+    }
+
+    const ncnn::VulkanDevice* vkdev;
+
+    // gpu
+    ncnn::VkAllocator* blob_vkallocator;
+    ncnn::VkAllocator* staging_vkallocator;
+    ncnn::VkCompute* cmd;
+
+    // cpu
+    ncnn::UnlockedPoolAllocator blob_allocator;
+    ncnn::PoolAllocator workspace_allocator;
+};
+
+// network evaluations recorded per batch in se passes, a tta tile counts once per orientation
+static const int SE_SUBMIT_EVALUATIONS = 8;
+
+// the tiles of a se pass are recorded as batches on the ring of workers of the feature cache, each with its own
+// command buffer and allocators, a full batch is submitted on a thread of its own while the next worker records
+// a worker is waited for before it records again, so one batch less than there are workers is in flight at most
+// batches end between rows only, the tiles of a row share its upload and download
+// the blobs bound by recorded tiles are held until their batch completes, and the intermediates the network frees
+// while recording only go back to the allocators of their own worker, so no batch in flight sees its memory reused
+class SEBatch
+{
+public:
+    SEBatch(const std::vector<WorkerState*>& workers, const ncnn::Option& opt, int _orientations) : orientations(_orientations), evaluations(0), current(0)
+    {
+        slots.resize(workers.size());
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            Slot& slot = slots[i];
+
+            slot.worker = workers[i];
+            slot.opt = opt;
+            slot.opt.blob_vkallocator = slot.worker->blob_vkallocator;
+            slot.opt.workspace_vkallocator = slot.worker->blob_vkallocator;
+            slot.opt.staging_vkallocator = slot.worker->staging_vkallocator;
+            slot.ret = 0;
+        }
+    }
+
+    ~SEBatch()
+    {
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            wait(slots[i]);
+        }
+    }
+
+    // command buffer and options of the batch recording now, fetch them again after each row
+    ncnn::VkCompute& cmd()
+    {
+        return *slots[current].worker->cmd;
+    }
+
+    const ncnn::Option& opt() const
+    {
+        return slots[current].opt;
+    }
+
+    void hold(const ncnn::VkMat& blob)
+    {
+        if (!blob.empty())
+            slots[current].blobs.push_back(blob);
+    }
+
+    void hold(const std::vector<ncnn::VkMat>& bindings)
+    {
+        for (size_t i = 0; i < bindings.size(); i++)
+        {
+            hold(bindings[i]);
+        }
+    }
+
+    // out, downloaded by the batch recording now, goes to the pixels at dst once the batch completes
+    void to_pixels(const ncnn::Mat& out, unsigned char* dst, int type)
+    {
+        Pixels pixels = {out, dst, type};
+        slots[current].pixels.push_back(pixels);
+    }
+
+    // call after recording a tile
+    void tile()
+    {
+        evaluations += orientations;
+    }
+
+    // call after recording a row, a full batch is submitted and the next worker takes the following rows
+    int row()
+    {
+        if (evaluations < SE_SUBMIT_EVALUATIONS)
+            return 0;
+
+        submit(slots[current]);
+
+        current = (current + 1) % slots.size();
+        return wait(slots[current]);
+    }
+
+    // submit the batch recording now and wait for every batch in flight, returns the first error
+    int flush()
+    {
+        submit(slots[current]);
+
+        int ret = 0;
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            int slot_ret = wait(slots[i]);
+            if (ret == 0)
+                ret = slot_ret;
+        }
+        return ret;
+    }
+
+private:
+    struct Pixels
+    {
+        ncnn::Mat out;
+        unsigned char* dst;
+        int type;
+    };
+
+    struct Slot
+    {
+        WorkerState* worker;
+        ncnn::Option opt;
+        std::vector<ncnn::VkMat> blobs;
+        std::vector<Pixels> pixels;
+        std::thread thread;
+        int ret;
+    };
+
+    void submit(Slot& slot)
+    {
+        evaluations = 0;
+
+        slot.thread = std::thread([&slot]() { slot.ret = slot.worker->cmd->submit_and_wait(); });
+    }
+
+    int wait(Slot& slot)
+    {
+        if (!slot.thread.joinable())
+            return 0;
+
+        slot.thread.join();
+        slot.worker->cmd->reset();
+        slot.blobs.clear();
+
+        if (slot.ret == 0)
+        {
+            for (size_t i = 0; i < slot.pixels.size(); i++)
+            {
+                slot.pixels[i].out.to_pixels(slot.pixels[i].dst, slot.pixels[i].type);
+            }
+        }
+        slot.pixels.clear();
+
+        int ret = slot.ret;
+        slot.ret = 0;
+        return ret;
+    }
+
+    int orientations;
+    int evaluations;
+    size_t current;
+    std::vector<Slot> slots;
+};
+
+RealCUGAN::RealCUGAN(int gpuid, bool _tta_mode, int num_threads) : owned_net(new ncnn::Net), net(*owned_net)
+{
+    vkdev = gpuid == -1 ? 0 : ncnn::get_gpu_device(gpuid);
+
+    net.opt.num_threads = num_threads;
+
+    realcugan_preproc = 0;
+    realcugan_postproc = 0;
+    realcugan_4x_postproc = 0;
+    realcugan_feature_avg = 0;
+    tta_mode = _tta_mode;
+    tta_level = 8;
+    pipeline_depth = 1;
+    tile_threads = 1;
+    tile_cache_size = 0;
+    feature_cache_budget = 0;
+    temporal_threshold = 0.f;
+    precision = 1;
+    tile_cache = new TileCache;
+    temporal = new TemporalFeatures;
+    stats = new Stats;
+    device_index = 0;
+    device_count = 1;
+}
+
+RealCUGAN::RealCUGAN(const std::vector<int>& gpuids, bool _tta_mode, int num_threads) : RealCUGAN(gpuids[0], _tta_mode, num_threads)
+{
+    for (size_t i = 1; i < gpuids.size(); i++)
+    {
+        RealCUGAN* peer = new RealCUGAN(gpuids[i], _tta_mode, num_threads);
+        peer->device_index = (int)i;
+        peer->device_count = (int)gpuids.size();
+
+        // tiles are cached once for all devices
+        delete peer->tile_cache;
+        peer->tile_cache = tile_cache;
+
+        peers.push_back(peer);
+    }
+
+    device_count = (int)gpuids.size();
+}
+
+RealCUGAN* RealCUGAN::create_context(const RealCUGAN& model)
+{
+    return new RealCUGAN(&model);
+}
+
+RealCUGAN::RealCUGAN(const RealCUGAN* _model) : owned_net(0), net(_model->net)
+{
+    const RealCUGAN& model = *_model;
+
+    vkdev = model.vkdev;
+
+    // the pipelines belong to the model
+    realcugan_preproc = model.realcugan_preproc;
+    realcugan_postproc = model.realcugan_postproc;
+    realcugan_4x_postproc = model.realcugan_4x_postproc;
+    realcugan_feature_avg = model.realcugan_feature_avg;
+    tta_mode = model.tta_mode;
+    tta_level = model.tta_level;
+
+    noise = model.noise;
+    scale = model.scale;
+    tilesize = model.tilesize;
+    prepadding = model.prepadding;
+    syncgap = model.syncgap;
+    pipeline_depth = model.pipeline_depth;
+    tile_threads = model.tile_threads;
+    tile_cache_size = model.tile_cache_size;
+    feature_cache_budget = model.feature_cache_budget;
+    temporal_threshold = model.temporal_threshold;
+    precision = model.precision;
+    cache_dir = model.cache_dir;
+
+    // cached tiles are shared with the model and its other contexts
+    tile_cache = model.tile_cache;
+    temporal = new TemporalFeatures;
+    stats = new Stats;
+
+    device_index = model.device_index;
+    device_count = model.device_count;
+
+    for (size_t i = 0; i < model.peers.size(); i++)
+    {
+        peers.push_back(create_context(*model.peers[i]));
+    }
+}
+
+RealCUGAN::~RealCUGAN()
+{
+    for (size_t i = 0; i < peers.size(); i++)
+    {
+        delete peers[i];
+    }
+
+    for (size_t i = 0; i < idle_workers.size(); i++)
+    {
+        delete idle_workers[i];
+    }
+
+    delete stats;
+    delete temporal;
+
+    // contexts only borrow the model
+    if (!owned_net)
+        return;
+
+    // the peers use the tile cache of the primary device
+    if (device_index == 0)
+    {
+        delete tile_cache;
+    }
+
+    // cleanup preprocess and postprocess pipeline
+    {
+        delete realcugan_preproc;
+        delete realcugan_postproc;
+        delete realcugan_feature_avg;
+    }
+
+    delete owned_net;
+}
+
+void RealCUGAN::sync_parameters()
+{
+    for (size_t i = 0; i < peers.size(); i++)
     {
-        feat = gpu_cache[make_key(yi, xi, ti, name)];
+        peers[i]->noise = noise;
+        peers[i]->scale = scale;
+        peers[i]->tilesize = tilesize;
+        peers[i]->prepadding = prepadding;
+        peers[i]->syncgap = syncgap;
+        peers[i]->pipeline_depth = pipeline_depth;
+        peers[i]->tile_threads = tile_threads;
+        peers[i]->tile_cache_size = tile_cache_size;
+        peers[i]->feature_cache_budget = feature_cache_budget;
+        peers[i]->temporal_threshold = temporal_threshold;
     }
 
-    void save(int yi, int xi, int ti, const std::string& name, ncnn::VkMat& feat)
+    tile_cache->set_capacity(tile_cache_size);
+}
+
+void RealCUGAN::get_stats(RealCUGANStats& _stats) const
+{
+    memset(&_stats, 0, sizeof(_stats));
+
+    stats->sum(_stats);
+    for (size_t i = 0; i < peers.size(); i++)
     {
-        gpu_cache[make_key(yi, xi, ti, name)] = feat;
+        peers[i]->stats->sum(_stats);
     }
+}
 
-    void load(int yi, int xi, int ti, const std::string& name, ncnn::Mat& feat)
+void RealCUGAN::reset_stats()
+{
+    stats->reset();
+    for (size_t i = 0; i < peers.size(); i++)
     {
-        feat = cpu_cache[make_key(yi, xi, ti, name)];
+        peers[i]->stats->reset();
     }
+}
 
-    void save(int yi, int xi, int ti, const std::string& name, ncnn::Mat& feat)
+WorkerState* RealCUGAN::acquire_worker() const
+{
+    // concurrent calls each take their own worker states, the pool grows to the peak number of workers
     {
-        cpu_cache[make_key(yi, xi, ti, name)] = feat;
+        ncnn::MutexLockGuard lock(workers_lock);
+
+        if (!idle_workers.empty())
+        {
+            WorkerState* worker = idle_workers.back();
+            idle_workers.pop_back();
+            return worker;
+        }
     }
 
-public:
-    std::map<std::string, ncnn::VkMat> gpu_cache;
-    std::map<std::string, ncnn::Mat> cpu_cache;
-};
+    return new WorkerState(vkdev);
+}
 
-RealCUGAN::RealCUGAN(int gpuid, bool _tta_mode, int num_threads)
+void RealCUGAN::release_worker(WorkerState* worker) const
 {
-    vkdev = gpuid == -1 ? 0 : ncnn::get_gpu_device(gpuid);
+    ncnn::MutexLockGuard lock(workers_lock);
 
-    net.opt.num_threads = num_threads;
+    idle_workers.push_back(worker);
+}
 
-    realcugan_preproc = 0;
-    realcugan_postproc = 0;
-    realcugan_4x_postproc = 0;
-    bicubic_2x = 0;
-    bicubic_3x = 0;
-    bicubic_4x = 0;
-    tta_mode = _tta_mode;
+// padded pixels of one direction over all tiles of size tile, the network runs on tile + 2 * prepadding
+static long long padded_extent(int size, int tile, int prepadding, int align)
+{
+    long long extent = 0;
+    for (int x0 = 0; x0 < size; x0 += tile)
+    {
+        const int nopad = std::min(x0 + tile, size) - x0;
+        extent += (nopad + align - 1) / align * align + prepadding * 2;
+    }
+    return extent;
 }
 
-RealCUGAN::~RealCUGAN()
+void RealCUGAN::plan_tiles(int w, int h, int& tile_w, int& tile_h) const
 {
-    // cleanup preprocess and postprocess pipeline
+    // no tile may need more memory than a tilesize x tilesize tile
+    const long long budget = (long long)(tilesize + prepadding * 2) * (tilesize + prepadding * 2);
+
+    // tiles are padded to a multiple of 4 for scale 1 and 3, and of 2 for scale 2 and 4
+    const int align = scale == 2 || scale == 4 ? 2 : 4;
+
+    tile_w = tilesize;
+    tile_h = tilesize;
+
+    const int max_xtiles = (w + tilesize - 1) / tilesize;
+    const int max_ytiles = (h + tilesize - 1) / tilesize;
+
+    std::vector<int> ths(max_ytiles + 1);
+    std::vector<long long> yextents(max_ytiles + 1);
+    for (int ytiles = 1; ytiles <= max_ytiles; ytiles++)
     {
-        delete realcugan_preproc;
-        delete realcugan_postproc;
+        ths[ytiles] = ((h + ytiles - 1) / ytiles + align - 1) / align * align;
+        yextents[ytiles] = padded_extent(h, ths[ytiles], prepadding, align);
     }
 
-    bicubic_2x->destroy_pipeline(net.opt);
-    delete bicubic_2x;
+    // balanced tiles for every tile count, keep the one running the fewest padded pixels
+    long long best = -1;
+    for (int xtiles = 1; xtiles <= max_xtiles; xtiles++)
+    {
+        const int tw = ((w + xtiles - 1) / xtiles + align - 1) / align * align;
+        const long long xextent = padded_extent(w, tw, prepadding, align);
+
+        for (int ytiles = 1; ytiles <= max_ytiles; ytiles++)
+        {
+            const int th = ths[ytiles];
+            if ((long long)(tw + prepadding * 2) * (th + prepadding * 2) > budget)
+                continue;
+
+            const long long cost = xextent * yextents[ytiles];
+            if (best == -1 || cost < best)
+            {
+                best = cost;
+                tile_w = tw;
+                tile_h = th;
+            }
+        }
+    }
+}
 
-    bicubic_3x->destroy_pipeline(net.opt);
-    delete bicubic_3x;
+bool RealCUGAN::single_tile(int w, int h) const
+{
+    int tile_w;
+    int tile_h;
+    plan_tiles(w, h, tile_w, tile_h);
 
-    bicubic_4x->destroy_pipeline(net.opt);
-    delete bicubic_4x;
+    return tile_w >= w && tile_h >= h;
 }
 
 int RealCUGAN::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
 {
-    bool syncgap_needed = tilesize < std::max(inimage.w, inimage.h);
+    // se features only need syncing when the frame spans several tiles
+    bool syncgap_needed = !single_tile(inimage.w, inimage.h);
+
+    if (noise == -1 && scale == 1)
+    {
+        copy_frame(inimage, outimage);
+        return 0;
+    }
 
     if (!vkdev)
     {
@@ -235,12 +1650,6 @@ int RealCUGAN::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
             return process_cpu(inimage, outimage);
     }
 
-    if (noise == -1 && scale == 1)
-    {
-        outimage = inimage;
-        return 0;
-    }
-
     if (syncgap_needed && syncgap)
     {
         if (syncgap == 1)
@@ -251,31 +1660,318 @@ int RealCUGAN::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
             return process_se_very_rough(inimage, outimage);
     }
 
-    const unsigned char* pixeldata = (const unsigned char*)inimage.data;
+    return process_frames(&inimage, &outimage, 1);
+}
+
+int RealCUGAN::process_batch(const std::vector<ncnn::Mat>& inimages, std::vector<ncnn::Mat>& outimages) const
+{
+    if (inimages.size() != outimages.size())
+        return -1;
+
+    if (inimages.empty())
+        return 0;
+
+    bool syncgap_needed = false;
+    for (size_t i = 0; i < inimages.size(); i++)
+    {
+        syncgap_needed = syncgap_needed || !single_tile(inimages[i].w, inimages[i].h);
+    }
+
+    // se needs all tiles of a frame before any output, cpu has no command buffers to keep
+    if (!vkdev || (noise == -1 && scale == 1) || (syncgap_needed && syncgap))
+    {
+        for (size_t i = 0; i < inimages.size(); i++)
+        {
+            ncnn::Mat dst = outimages[i];
+            int ret = process(inimages[i], outimages[i]);
+            if (ret != 0)
+                return ret;
+
+            // a path that rebinds the output leaves the caller's buffer unwritten
+            if (!dst.empty() && outimages[i].data != dst.data)
+            {
+                copy_frame(outimages[i], dst);
+                outimages[i] = dst;
+            }
+        }
+
+        return 0;
+    }
+
+    return process_frames(inimages.data(), outimages.data(), (int)inimages.size());
+}
+
+int RealCUGAN::process_stream(int w, int h, int channels, realcugan_read_rows reader, realcugan_write_rows writer, void* userdata) const
+{
+    int TILE_SIZE_X;
+    int TILE_SIZE_Y;
+    plan_tiles(w, h, TILE_SIZE_X, TILE_SIZE_Y);
+
+    const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
+    const int ytiles = (h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
+
+    // a band spans as many tile rows as there are gpu workers to keep them all busy
+    const int devices = (int)peers.size() + 1;
+    const int band_ytiles = vkdev ? std::max(pipeline_depth * devices, 1) : 1;
+
+    const int outscale = noise == -1 && scale == 1 ? 1 : scale;
+
+    for (int yi0 = 0; yi0 < ytiles; yi0 += band_ytiles)
+    {
+        const int yi1 = std::min(yi0 + band_ytiles, ytiles);
+
+        // input rows of the band with the prepadding of its first and last row of tiles
+        // the bottom prepadding grows by at most 3 rows to align the tile height
+        const int in_y0 = std::max(yi0 * TILE_SIZE_Y - prepadding, 0);
+        const int in_y1 = std::min(yi1 * TILE_SIZE_Y + prepadding + 3, h);
+
+        const int out_y0 = yi0 * TILE_SIZE_Y * outscale;
+        const int out_y1 = std::min(yi1 * TILE_SIZE_Y, h) * outscale;
+
+        ncnn::Mat inband(w, in_y1 - in_y0, (size_t)channels, channels);
+        if (inband.empty())
+            return -100;
+
+        int ret = reader(userdata, in_y0, in_y1 - in_y0, (unsigned char*)inband.data);
+        if (ret != 0)
+            return ret;
+
+        ncnn::Mat outband;
+        if (noise == -1 && scale == 1)
+        {
+            outband = inband.row_range(out_y0 - in_y0, out_y1 - out_y0);
+        }
+        else
+        {
+            outband.create(w * scale, out_y1 - out_y0, (size_t)channels, channels);
+            if (outband.empty())
+                return -100;
+
+            FrameBand band(h, yi0, in_y0, out_y0);
+
+            if (!vkdev)
+            {
+                TileQueue tiles(band, xtiles * (yi1 - yi0));
+                ret = process_cpu_frame(inband, outband, tiles);
+            }
+            else
+            {
+                RowQueue rows(band, yi1 - yi0);
+                ret = process_frames(&inband, &outband, rows);
+            }
+            if (ret != 0)
+                return ret;
+        }
+
+        ret = writer(userdata, out_y0, out_y1 - out_y0, (const unsigned char*)outband.data);
+        if (ret != 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+int RealCUGAN::process_gap_features(const ncnn::Mat& inimage, std::vector<ncnn::Mat>& feats) const
+{
+    feats.clear();
+
+    // only gpu se frames spanning several tiles have gap features
+    if (!vkdev || !syncgap || (noise == -1 && scale == 1) || single_tile(inimage.w, inimage.h))
+        return 0;
+
+    std::vector<SEDevice> devices;
+    acquire_se_devices(devices);
+
+    std::vector<std::string> gaps = {"gap0", "gap1", "gap2", "gap3"};
+    int ret = process_se_gaps(inimage, devices);
+    if (ret == 0)
+        ret = process_se_gap_download(gaps, devices, feats);
+
+    release_se_devices(devices);
+
+    return ret;
+}
+
+int RealCUGAN::process_roi(const ncnn::Mat& inimage, int roi_x, int roi_y, int roi_w, int roi_h, ncnn::Mat& outimage, const std::vector<ncnn::Mat>& feats) const
+{
     const int w = inimage.w;
     const int h = inimage.h;
     const int channels = inimage.elempack;
 
-    const int TILE_SIZE_X = tilesize;
-    const int TILE_SIZE_Y = tilesize;
+    if (roi_x < 0 || roi_y < 0 || roi_w <= 0 || roi_h <= 0 || roi_x + roi_w > w || roi_y + roi_h > h)
+        return -1;
+
+    if (outimage.w != w * scale || outimage.h != h * scale || outimage.elempack != channels)
+        return -1;
+
+    const int out_stride = w * scale * channels;
+
+    if (noise == -1 && scale == 1)
+    {
+        blit_rows((const unsigned char*)inimage.data + ((size_t)roi_y * w + roi_x) * channels, w * channels, (unsigned char*)outimage.data + ((size_t)roi_y * w + roi_x) * channels, out_stride, roi_w * channels, roi_h);
+        return 0;
+    }
+
+    // se features only need syncing when the frame spans several tiles
+    bool syncgap_needed = !single_tile(w, h);
+
+    int TILE_SIZE_X;
+    int TILE_SIZE_Y;
+    plan_tiles(w, h, TILE_SIZE_X, TILE_SIZE_Y);
 
-    ncnn::VkAllocator* blob_vkallocator = vkdev->acquire_blob_allocator();
-    ncnn::VkAllocator* staging_vkallocator = vkdev->acquire_staging_allocator();
+    // the tiles meeting the rectangle, on the grid of the whole frame so that their output matches process
+    FrameBand band(h, roi_y / TILE_SIZE_Y);
+    band.xi0 = roi_x / TILE_SIZE_X;
+    band.xi1 = (roi_x + roi_w + TILE_SIZE_X - 1) / TILE_SIZE_X;
+    band.yi1 = (roi_y + roi_h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
+    band.out_y0 = band.yi0 * TILE_SIZE_Y * scale;
+
+    // whole output rows of those tiles, the rectangle is copied out of them
+    const int out_y1 = std::min(band.yi1 * TILE_SIZE_Y, h) * scale;
+
+    ncnn::Mat outband(w * scale, out_y1 - band.out_y0, (size_t)channels, channels);
+    if (outband.empty())
+        return -100;
+
+    int ret = 0;
+    if (syncgap_needed && syncgap && !vkdev)
+    {
+        // the cpu se paths keep no features to hand over, the whole frame is run
+        outband.create(w * scale, h * scale, (size_t)channels, channels);
+        if (outband.empty())
+            return -100;
+
+        band.out_y0 = 0;
+        ret = process(inimage, outband);
+    }
+    else if (syncgap_needed && syncgap)
+    {
+        std::vector<SEDevice> devices;
+        acquire_se_devices(devices);
+
+        // gap features of the whole frame, from the caller or computed over every tile
+        std::vector<std::string> gaps = {"gap0", "gap1", "gap2", "gap3"};
+        if (feats.empty())
+            ret = process_se_gaps(inimage, devices);
+        else if (feats.size() != gaps.size())
+            ret = -1;
+        else
+            ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_gap_apply_host(inimage, gaps, feats, devices[d].opt, devices[d].cache); });
+
+        if (ret == 0)
+            ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_stage2(inimage, gaps, outband, devices[d].opt, devices[d].cache, band); });
+
+        release_se_devices(devices);
+    }
+    else if (!vkdev)
+    {
+        TileQueue tiles(band, (band.xi1 - band.xi0) * (band.yi1 - band.yi0));
+        ret = process_cpu_frame(inimage, outband, tiles);
+    }
+    else
+    {
+        RowQueue rows(band, band.yi1 - band.yi0);
+        ret = process_frames(&inimage, &outband, rows);
+    }
+    if (ret != 0)
+        return ret;
+
+    const int row_size = roi_w * scale * channels;
+    const unsigned char* src = (const unsigned char*)outband.data + ((size_t)(roi_y * scale - band.out_y0) * w * scale + roi_x * scale) * channels;
+    unsigned char* dst = (unsigned char*)outimage.data + (size_t)roi_y * scale * out_stride + (size_t)roi_x * scale * channels;
+    blit_rows(src, out_stride, dst, out_stride, row_size, roi_h * scale);
+
+    return 0;
+}
+
+int RealCUGAN::process_frames(const ncnn::Mat* inimages, ncnn::Mat* outimages, int count) const
+{
+    RowQueue rows(inimages, count, this);
+
+    return process_frames(inimages, outimages, rows);
+}
+
+int RealCUGAN::process_frames(const ncnn::Mat* inimages, ncnn::Mat* outimages, RowQueue& rows) const
+{
+    // keep up to pipeline_depth tile rows in flight per device, each worker records into its own command buffer
+    // so that the upload of one row and the download of another overlap with the inference of a third
+    // the workers of all devices pull rows from the same queue, so faster devices simply take more rows
+    // the queue spans all frames, the upload of the next frame starts while the last rows of this one are running
+    const int devices = (int)peers.size() + 1;
+    const int workers = std::max(std::min(pipeline_depth * devices, rows.size()), 1);
+
+    std::vector<int> results(workers, 0);
+    std::vector<std::thread> threads;
+    for (int i = 1; i < workers; i++)
+    {
+        const RealCUGAN* realcugan = i % devices == 0 ? this : peers[i % devices - 1];
+
+        threads.push_back(std::thread([&, i, realcugan]() { results[i] = realcugan->process_rows(inimages, outimages, rows); }));
+    }
+
+    results[0] = process_rows(inimages, outimages, rows);
+
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+
+    for (int i = 0; i < workers; i++)
+    {
+        if (results[i] != 0)
+            return results[i];
+    }
+
+    return 0;
+}
+
+int RealCUGAN::process_rows(const ncnn::Mat* inimages, ncnn::Mat* outimages, RowQueue& rows) const
+{
+    // allocators and command buffer live as long as the worker and go back to the pool for the next call
+    WorkerState* worker = acquire_worker();
+    ncnn::VkAllocator* blob_vkallocator = worker->blob_vkallocator;
+    ncnn::VkAllocator* staging_vkallocator = worker->staging_vkallocator;
 
     ncnn::Option opt = net.opt;
     opt.blob_vkallocator = blob_vkallocator;
     opt.workspace_vkallocator = blob_vkallocator;
     opt.staging_vkallocator = staging_vkallocator;
 
-    // each tile 400x400
-    const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
-    const int ytiles = (h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
-
     const size_t in_out_tile_elemsize = opt.use_fp16_storage ? 2u : 4u;
 
-    //#pragma omp parallel for num_threads(2)
-    for (int yi = 0; yi < ytiles; yi++)
+    ncnn::VkCompute& cmd = *worker->cmd;
+
+    StageTimer timer(stats, &cmd, vkdev);
+
+    int frame;
+    int yi;
+    while (rows.pop(frame, yi))
     {
+        const ncnn::Mat& inimage = inimages[frame];
+        ncnn::Mat& outimage = outimages[frame];
+
+        // the images may hold only a band of the frame rows
+        const FrameBand& band = rows.band(frame);
+
+        const unsigned char* pixeldata = (const unsigned char*)inimage.data;
+        const int w = inimage.w;
+        const int h = band.h;
+        const int format = band.format;
+        const int channels = format != REALCUGAN_FORMAT_PIXELS ? 3 : inimage.elempack;
+
+        int TILE_SIZE_X;
+        int TILE_SIZE_Y;
+        plan_tiles(w, h, TILE_SIZE_X, TILE_SIZE_Y);
+        if (format != REALCUGAN_FORMAT_PIXELS)
+            even_tiles(TILE_SIZE_X, TILE_SIZE_Y);
+
+        // each tile 400x400
+        const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
+
+        // columns of tiles run, all of them unless a region of interest is processed
+        const int xi0 = band.xi0;
+        const int xi1 = band.xi1 < 0 ? xtiles : std::min(band.xi1, xtiles);
+
         const int tile_h_nopad = std::min((yi + 1) * TILE_SIZE_Y, h) - yi * TILE_SIZE_Y;
 
         int prepadding_bottom = prepadding;
@@ -291,60 +1987,122 @@ int RealCUGAN::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
         int in_tile_y0 = std::max(yi * TILE_SIZE_Y - prepadding, 0);
         int in_tile_y1 = std::min((yi + 1) * TILE_SIZE_Y + prepadding_bottom, h);
 
+        // rows of the luma plane uploaded, an odd first row shares its chroma row with the row above
+        const int in_h = in_tile_y1 - in_tile_y0;
+        const int chroma_y = in_tile_y0 % 2;
+
+        // output tiles of this row already in the tile cache, a row made only of them is not run at all
+        // yuv frames are not cached, their tiles are not rows of interleaved pixels
+        const bool use_tile_cache = tile_cache->enabled() && format == REALCUGAN_FORMAT_PIXELS;
+        const int out_stride = w * scale * channels;
+        const int out_rows = tile_h_nopad * scale;
+        unsigned char* outrow = (unsigned char*)outimage.data + (yi * scale * TILE_SIZE_Y - band.out_y0) * w * scale * channels;
+
+        std::vector<TileKey> tile_keys;
+        std::vector<std::vector<unsigned char> > cached_tiles;
+        int cached_count = 0;
+        if (use_tile_cache)
+        {
+            tile_keys.resize(xtiles);
+            cached_tiles.resize(xtiles);
+            for (int xi = xi0; xi < xi1; xi++)
+            {
+                tile_keys[xi] = frame_tile_key(pixeldata, w, h, channels, band.in_y0, xi, yi, TILE_SIZE_X, TILE_SIZE_Y, prepadding, noise, scale, tta_mode ? tta_level : 0);
+                if (tile_cache->load(tile_keys[xi], cached_tiles[xi]))
+                    cached_count++;
+            }
+        }
+
+        if (use_tile_cache && cached_count == xi1 - xi0)
+        {
+            for (int xi = xi0; xi < xi1; xi++)
+            {
+                const int out_row_size = (std::min((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X) * scale * channels;
+                blit_rows(&cached_tiles[xi][0], out_row_size, outrow + xi * TILE_SIZE_X * scale * channels, out_stride, out_row_size, out_rows);
+            }
+
+            stats->add(stats->cached_tiles, xi1 - xi0);
+            timer.lap(REALCUGAN_STAGE_DOWNLOAD);
+            continue;
+        }
+
         ncnn::Mat in;
-        if (opt.use_fp16_storage && opt.use_int8_storage)
+        if (format != REALCUGAN_FORMAT_PIXELS)
         {
-            in = ncnn::Mat(w, (in_tile_y1 - in_tile_y0), (unsigned char*)pixeldata + in_tile_y0 * w * channels, (size_t)channels, 1);
+            // the luma rows and the chroma rows they touch, preproc converts them
+            in.create(w, in_h + (in_tile_y1 + 1) / 2 - in_tile_y0 / 2, (size_t)1u, 1);
+            pack_yuv_rows(pixeldata, w, h, format, in_tile_y0, in_tile_y1, (unsigned char*)in.data);
+        }
+        else if (opt.use_fp16_storage && opt.use_int8_storage)
+        {
+            in = ncnn::Mat(w, (in_tile_y1 - in_tile_y0), (unsigned char*)pixeldata + (in_tile_y0 - band.in_y0) * w * channels, (size_t)channels, 1);
         }
         else
         {
             if (channels == 3)
             {
 #if _WIN32
-                in = ncnn::Mat::from_pixels(pixeldata + in_tile_y0 * w * channels, ncnn::Mat::PIXEL_BGR2RGB, w, (in_tile_y1 - in_tile_y0));
+                in = ncnn::Mat::from_pixels(pixeldata + (in_tile_y0 - band.in_y0) * w * channels, ncnn::Mat::PIXEL_BGR2RGB, w, (in_tile_y1 - in_tile_y0));
 #else
-                in = ncnn::Mat::from_pixels(pixeldata + in_tile_y0 * w * channels, ncnn::Mat::PIXEL_RGB, w, (in_tile_y1 - in_tile_y0));
+                in = ncnn::Mat::from_pixels(pixeldata + (in_tile_y0 - band.in_y0) * w * channels, ncnn::Mat::PIXEL_RGB, w, (in_tile_y1 - in_tile_y0));
 #endif
             }
             if (channels == 4)
             {
 #if _WIN32
-                in = ncnn::Mat::from_pixels(pixeldata + in_tile_y0 * w * channels, ncnn::Mat::PIXEL_BGRA2RGBA, w, (in_tile_y1 - in_tile_y0));
+                in = ncnn::Mat::from_pixels(pixeldata + (in_tile_y0 - band.in_y0) * w * channels, ncnn::Mat::PIXEL_BGRA2RGBA, w, (in_tile_y1 - in_tile_y0));
 #else
-                in = ncnn::Mat::from_pixels(pixeldata + in_tile_y0 * w * channels, ncnn::Mat::PIXEL_RGBA, w, (in_tile_y1 - in_tile_y0));
+                in = ncnn::Mat::from_pixels(pixeldata + (in_tile_y0 - band.in_y0) * w * channels, ncnn::Mat::PIXEL_RGBA, w, (in_tile_y1 - in_tile_y0));
 #endif
             }
         }
 
-        ncnn::VkCompute cmd(vkdev);
+        timer.lap(REALCUGAN_STAGE_CROP);
 
         // upload
         ncnn::VkMat in_gpu;
         {
             cmd.record_clone(in, in_gpu, opt);
 
-            if (xtiles > 1)
+            stats->add(stats->bytes_uploaded, in.total() * in.elemsize);
+            timer.lap(REALCUGAN_STAGE_UPLOAD);
+
+            if (xi1 - xi0 > 1)
             {
-                cmd.submit_and_wait();
-                cmd.reset();
+                int ret = timer.submit();
+                if (ret != 0)
+                {
+                    release_worker(worker);
+                    return ret;
+                }
             }
         }
 
         int out_tile_y0 = std::max(yi * TILE_SIZE_Y, 0);
         int out_tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, h);
 
+        const int out_h = (out_tile_y1 - out_tile_y0) * scale;
+
         ncnn::VkMat out_gpu;
-        if (opt.use_fp16_storage && opt.use_int8_storage)
+        if (format != REALCUGAN_FORMAT_PIXELS)
+        {
+            // the luma rows then the chroma rows, postproc converts into them
+            out_gpu.create(w * scale, out_h + out_h / 2, (size_t)1u, 1, blob_vkallocator);
+        }
+        else if (opt.use_fp16_storage && opt.use_int8_storage)
         {
-            out_gpu.create(w * scale, (out_tile_y1 - out_tile_y0) * scale, (size_t)channels, 1, blob_vkallocator);
+            out_gpu.create(w * scale, out_h, (size_t)channels, 1, blob_vkallocator);
         }
         else
         {
-            out_gpu.create(w * scale, (out_tile_y1 - out_tile_y0) * scale, channels, (size_t)4u, 1, blob_vkallocator);
+            out_gpu.create(w * scale, out_h, channels, (size_t)4u, 1, blob_vkallocator);
         }
 
-        for (int xi = 0; xi < xtiles; xi++)
+        for (int xi = xi0; xi < xi1; xi++)
         {
+            if (use_tile_cache && !cached_tiles[xi].empty())
+                continue;
+
             const int tile_w_nopad = std::min((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X;
 
             int prepadding_right = prepadding;
@@ -369,14 +2127,14 @@ int RealCUGAN::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                     int tile_y0 = yi * TILE_SIZE_Y - prepadding;
                     int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, h) + prepadding_bottom;
 
-                    in_tile_gpu[0].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[1].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[2].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[3].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[4].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[5].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[6].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[7].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+                    // only the orientations of the tta level, the transposed ones swap width and height
+                    for (int ti = 0; ti < tta_level; ti++)
+                    {
+                        if (ti < 4)
+                            in_tile_gpu[ti].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+                        else
+                            in_tile_gpu[ti].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+                    }
 
                     if (channels == 4)
                     {
@@ -395,9 +2153,9 @@ int RealCUGAN::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                     bindings[8] = in_tile_gpu[7];
                     bindings[9] = in_alpha_tile_gpu;
 
-                    std::vector<ncnn::vk_constant_type> constants(13);
+                    std::vector<ncnn::vk_constant_type> constants(15);
                     constants[0].i = in_gpu.w;
-                    constants[1].i = in_gpu.h;
+                    constants[1].i = in_h;
                     constants[2].i = in_gpu.cstep;
                     constants[3].i = in_tile_gpu[0].w;
                     constants[4].i = in_tile_gpu[0].h;
@@ -409,6 +2167,8 @@ int RealCUGAN::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                     constants[10].i = channels;
                     constants[11].i = in_alpha_tile_gpu.w;
                     constants[12].i = in_alpha_tile_gpu.h;
+                    constants[13].i = format;
+                    constants[14].i = chroma_y;
 
                     ncnn::VkMat dispatcher;
                     dispatcher.w = in_tile_gpu[0].w;
@@ -418,9 +2178,11 @@ int RealCUGAN::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                     cmd.record_pipeline(realcugan_preproc, bindings, constants, dispatcher);
                 }
 
+                timer.lap(REALCUGAN_STAGE_PREPROC);
+
                 // realcugan
                 ncnn::VkMat out_tile_gpu[8];
-                for (int ti = 0; ti < 8; ti++)
+                for (int ti = 0; ti < tta_level; ti++)
                 {
                     ncnn::Extractor ex = net.create_extractor();
 
@@ -430,30 +2192,18 @@ int RealCUGAN::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
 
                     ex.input("in0", in_tile_gpu[ti]);
 
-                    ex.extract("out0", out_tile_gpu[ti], cmd);
-                }
-
-                ncnn::VkMat out_alpha_tile_gpu;
-                if (channels == 4)
-                {
-                    if (scale == 1)
-                    {
-                        out_alpha_tile_gpu = in_alpha_tile_gpu;
-                    }
-                    if (scale == 2)
-                    {
-                        bicubic_2x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
-                    }
-                    if (scale == 3)
-                    {
-                        bicubic_3x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
-                    }
-                    if (scale == 4)
+                    int ret = ex.extract("out0", out_tile_gpu[ti], cmd);
+                    if (ret != 0)
                     {
-                        bicubic_4x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
+                        // drop what the row recorded so far, the next user of the worker starts empty
+                        cmd.reset();
+                        release_worker(worker);
+                        return ret;
                     }
                 }
 
+                timer.lap(REALCUGAN_STAGE_INFERENCE);
+
                 // postproc
                 if (scale == 4)
                 {
@@ -467,30 +2217,33 @@ int RealCUGAN::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                     bindings[6] = out_tile_gpu[5];
                     bindings[7] = out_tile_gpu[6];
                     bindings[8] = out_tile_gpu[7];
-                    bindings[9] = out_alpha_tile_gpu;
+                    bindings[9] = in_alpha_tile_gpu;
                     bindings[10] = out_gpu;
 
-                    std::vector<ncnn::vk_constant_type> constants(16);
+                    std::vector<ncnn::vk_constant_type> constants(19);
                     constants[0].i = in_gpu.w;
-                    constants[1].i = in_gpu.h;
+                    constants[1].i = in_h;
                     constants[2].i = in_gpu.cstep;
                     constants[3].i = out_tile_gpu[0].w;
                     constants[4].i = out_tile_gpu[0].h;
                     constants[5].i = out_tile_gpu[0].cstep;
                     constants[6].i = out_gpu.w;
-                    constants[7].i = out_gpu.h;
+                    constants[7].i = out_h;
                     constants[8].i = out_gpu.cstep;
                     constants[9].i = xi * TILE_SIZE_X;
                     constants[10].i = std::min(yi * TILE_SIZE_Y, prepadding);
                     constants[11].i = xi * TILE_SIZE_X * scale;
                     constants[12].i = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
                     constants[13].i = channels;
-                    constants[14].i = out_alpha_tile_gpu.w;
-                    constants[15].i = out_alpha_tile_gpu.h;
+                    constants[14].i = in_alpha_tile_gpu.w;
+                    constants[15].i = in_alpha_tile_gpu.h;
+                    constants[16].i = scale;
+                    constants[17].i = format;
+                    constants[18].i = chroma_y;
 
                     ncnn::VkMat dispatcher;
                     dispatcher.w = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    dispatcher.h = out_gpu.h;
+                    dispatcher.h = out_h;
                     dispatcher.c = channels;
 
                     cmd.record_pipeline(realcugan_4x_postproc, bindings, constants, dispatcher);
@@ -506,25 +2259,27 @@ int RealCUGAN::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                     bindings[5] = out_tile_gpu[5];
                     bindings[6] = out_tile_gpu[6];
                     bindings[7] = out_tile_gpu[7];
-                    bindings[8] = out_alpha_tile_gpu;
+                    bindings[8] = in_alpha_tile_gpu;
                     bindings[9] = out_gpu;
 
-                    std::vector<ncnn::vk_constant_type> constants(11);
+                    std::vector<ncnn::vk_constant_type> constants(13);
                     constants[0].i = out_tile_gpu[0].w;
                     constants[1].i = out_tile_gpu[0].h;
                     constants[2].i = out_tile_gpu[0].cstep;
                     constants[3].i = out_gpu.w;
-                    constants[4].i = out_gpu.h;
+                    constants[4].i = out_h;
                     constants[5].i = out_gpu.cstep;
                     constants[6].i = xi * TILE_SIZE_X * scale;
                     constants[7].i = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
                     constants[8].i = channels;
-                    constants[9].i = out_alpha_tile_gpu.w;
-                    constants[10].i = out_alpha_tile_gpu.h;
+                    constants[9].i = in_alpha_tile_gpu.w;
+                    constants[10].i = in_alpha_tile_gpu.h;
+                    constants[11].i = scale;
+                    constants[12].i = format;
 
                     ncnn::VkMat dispatcher;
                     dispatcher.w = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    dispatcher.h = out_gpu.h;
+                    dispatcher.h = out_h;
                     dispatcher.c = channels;
 
                     cmd.record_pipeline(realcugan_postproc, bindings, constants, dispatcher);
@@ -554,9 +2309,9 @@ int RealCUGAN::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                     bindings[1] = in_tile_gpu;
                     bindings[2] = in_alpha_tile_gpu;
 
-                    std::vector<ncnn::vk_constant_type> constants(13);
+                    std::vector<ncnn::vk_constant_type> constants(15);
                     constants[0].i = in_gpu.w;
-                    constants[1].i = in_gpu.h;
+                    constants[1].i = in_h;
                     constants[2].i = in_gpu.cstep;
                     constants[3].i = in_tile_gpu.w;
                     constants[4].i = in_tile_gpu.h;
@@ -568,6 +2323,8 @@ int RealCUGAN::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                     constants[10].i = channels;
                     constants[11].i = in_alpha_tile_gpu.w;
                     constants[12].i = in_alpha_tile_gpu.h;
+                    constants[13].i = format;
+                    constants[14].i = chroma_y;
 
                     ncnn::VkMat dispatcher;
                     dispatcher.w = in_tile_gpu.w;
@@ -577,71 +2334,64 @@ int RealCUGAN::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                     cmd.record_pipeline(realcugan_preproc, bindings, constants, dispatcher);
                 }
 
+                timer.lap(REALCUGAN_STAGE_PREPROC);
+
                 // realcugan
                 ncnn::VkMat out_tile_gpu;
                 {
                     ncnn::Extractor ex = net.create_extractor();
-
-                    ex.set_blob_vkallocator(blob_vkallocator);
-                    ex.set_workspace_vkallocator(blob_vkallocator);
-                    ex.set_staging_vkallocator(staging_vkallocator);
-
-                    ex.input("in0", in_tile_gpu);
-
-                    ex.extract("out0", out_tile_gpu, cmd);
-                }
-
-                ncnn::VkMat out_alpha_tile_gpu;
-                if (channels == 4)
-                {
-                    if (scale == 1)
-                    {
-                        out_alpha_tile_gpu = in_alpha_tile_gpu;
-                    }
-                    if (scale == 2)
-                    {
-                        bicubic_2x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
-                    }
-                    if (scale == 3)
-                    {
-                        bicubic_3x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
-                    }
-                    if (scale == 4)
+
+                    ex.set_blob_vkallocator(blob_vkallocator);
+                    ex.set_workspace_vkallocator(blob_vkallocator);
+                    ex.set_staging_vkallocator(staging_vkallocator);
+
+                    ex.input("in0", in_tile_gpu);
+
+                    int ret = ex.extract("out0", out_tile_gpu, cmd);
+                    if (ret != 0)
                     {
-                        bicubic_4x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
+                        // drop what the row recorded so far, the next user of the worker starts empty
+                        cmd.reset();
+                        release_worker(worker);
+                        return ret;
                     }
                 }
 
+                timer.lap(REALCUGAN_STAGE_INFERENCE);
+
                 // postproc
                 if (scale == 4)
                 {
                     std::vector<ncnn::VkMat> bindings(4);
                     bindings[0] = in_gpu;
                     bindings[1] = out_tile_gpu;
-                    bindings[2] = out_alpha_tile_gpu;
+                    bindings[2] = in_alpha_tile_gpu;
                     bindings[3] = out_gpu;
 
-                    std::vector<ncnn::vk_constant_type> constants(16);
+                    std::vector<ncnn::vk_constant_type> constants(19);
                     constants[0].i = in_gpu.w;
-                    constants[1].i = in_gpu.h;
+                    constants[1].i = in_h;
                     constants[2].i = in_gpu.cstep;
                     constants[3].i = out_tile_gpu.w;
                     constants[4].i = out_tile_gpu.h;
                     constants[5].i = out_tile_gpu.cstep;
                     constants[6].i = out_gpu.w;
-                    constants[7].i = out_gpu.h;
+                    constants[7].i = out_h;
                     constants[8].i = out_gpu.cstep;
                     constants[9].i = xi * TILE_SIZE_X;
                     constants[10].i = std::min(yi * TILE_SIZE_Y, prepadding);
                     constants[11].i = xi * TILE_SIZE_X * scale;
                     constants[12].i = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
                     constants[13].i = channels;
-                    constants[14].i = out_alpha_tile_gpu.w;
-                    constants[15].i = out_alpha_tile_gpu.h;
+                    constants[14].i = in_alpha_tile_gpu.w;
+                    constants[15].i = in_alpha_tile_gpu.h;
+                    constants[16].i = scale;
+                    constants[17].i = format;
+                    constants[18].i = chroma_y;
 
                     ncnn::VkMat dispatcher;
                     dispatcher.w = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    dispatcher.h = out_gpu.h;
+                    dispatcher.h = out_h;
                     dispatcher.c = channels;
 
                     cmd.record_pipeline(realcugan_4x_postproc, bindings, constants, dispatcher);
@@ -650,35 +2400,43 @@ int RealCUGAN::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
                 {
                     std::vector<ncnn::VkMat> bindings(3);
                     bindings[0] = out_tile_gpu;
-                    bindings[1] = out_alpha_tile_gpu;
+                    bindings[1] = in_alpha_tile_gpu;
                     bindings[2] = out_gpu;
 
-                    std::vector<ncnn::vk_constant_type> constants(11);
+                    std::vector<ncnn::vk_constant_type> constants(13);
                     constants[0].i = out_tile_gpu.w;
                     constants[1].i = out_tile_gpu.h;
                     constants[2].i = out_tile_gpu.cstep;
                     constants[3].i = out_gpu.w;
-                    constants[4].i = out_gpu.h;
+                    constants[4].i = out_h;
                     constants[5].i = out_gpu.cstep;
                     constants[6].i = xi * TILE_SIZE_X * scale;
                     constants[7].i = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
                     constants[8].i = channels;
-                    constants[9].i = out_alpha_tile_gpu.w;
-                    constants[10].i = out_alpha_tile_gpu.h;
+                    constants[9].i = in_alpha_tile_gpu.w;
+                    constants[10].i = in_alpha_tile_gpu.h;
+                    constants[11].i = scale;
+                    constants[12].i = format;
 
                     ncnn::VkMat dispatcher;
                     dispatcher.w = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    dispatcher.h = out_gpu.h;
+                    dispatcher.h = out_h;
                     dispatcher.c = channels;
 
                     cmd.record_pipeline(realcugan_postproc, bindings, constants, dispatcher);
                 }
             }
 
-            if (xtiles > 1)
+            timer.lap(REALCUGAN_STAGE_POSTPROC);
+
+            if (xi1 - xi0 > 1)
             {
-                cmd.submit_and_wait();
-                cmd.reset();
+                int ret = timer.submit();
+                if (ret != 0)
+                {
+                    release_worker(worker);
+                    return ret;
+                }
             }
         }
 
@@ -686,67 +2444,267 @@ int RealCUGAN::process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
         {
             ncnn::Mat out;
 
-            if (opt.use_fp16_storage && opt.use_int8_storage)
+            if (format != REALCUGAN_FORMAT_PIXELS)
+            {
+                out.create(out_gpu.w, out_gpu.h, (size_t)1u, 1);
+            }
+            else if (opt.use_fp16_storage && opt.use_int8_storage)
             {
-                out = ncnn::Mat(out_gpu.w, out_gpu.h, (unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels, (size_t)channels, 1);
+                out = ncnn::Mat(out_gpu.w, out_gpu.h, (unsigned char*)outimage.data + (yi * scale * TILE_SIZE_Y - band.out_y0) * w * scale * channels, (size_t)channels, 1);
             }
 
             cmd.record_clone(out_gpu, out, opt);
 
-            cmd.submit_and_wait();
+            stats->add(stats->bytes_downloaded, out_gpu.total() * out_gpu.elemsize);
+            timer.lap(REALCUGAN_STAGE_DOWNLOAD);
 
-            if (!(opt.use_fp16_storage && opt.use_int8_storage))
+            int ret = timer.submit();
+            if (ret != 0)
+            {
+                release_worker(worker);
+                return ret;
+            }
+
+            if (format != REALCUGAN_FORMAT_PIXELS)
+            {
+                unpack_yuv_rows((const unsigned char*)out.data, w * scale, h * scale, format, yi * scale * TILE_SIZE_Y, yi * scale * TILE_SIZE_Y + out_h, (unsigned char*)outimage.data);
+            }
+            else if (!(opt.use_fp16_storage && opt.use_int8_storage))
             {
                 if (channels == 3)
                 {
 #if _WIN32
-                    out.to_pixels((unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels, ncnn::Mat::PIXEL_RGB2BGR);
+                    out.to_pixels((unsigned char*)outimage.data + (yi * scale * TILE_SIZE_Y - band.out_y0) * w * scale * channels, ncnn::Mat::PIXEL_RGB2BGR);
 #else
-                    out.to_pixels((unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels, ncnn::Mat::PIXEL_RGB);
+                    out.to_pixels((unsigned char*)outimage.data + (yi * scale * TILE_SIZE_Y - band.out_y0) * w * scale * channels, ncnn::Mat::PIXEL_RGB);
 #endif
                 }
                 if (channels == 4)
                 {
 #if _WIN32
-                    out.to_pixels((unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels, ncnn::Mat::PIXEL_RGBA2BGRA);
+                    out.to_pixels((unsigned char*)outimage.data + (yi * scale * TILE_SIZE_Y - band.out_y0) * w * scale * channels, ncnn::Mat::PIXEL_RGBA2BGRA);
 #else
-                    out.to_pixels((unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels, ncnn::Mat::PIXEL_RGBA);
+                    out.to_pixels((unsigned char*)outimage.data + (yi * scale * TILE_SIZE_Y - band.out_y0) * w * scale * channels, ncnn::Mat::PIXEL_RGBA);
 #endif
                 }
             }
         }
+
+        // fill in the cached tiles and keep the computed ones
+        if (use_tile_cache)
+        {
+            for (int xi = xi0; xi < xi1; xi++)
+            {
+                const int out_row_size = (std::min((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X) * scale * channels;
+                unsigned char* outtile = outrow + xi * TILE_SIZE_X * scale * channels;
+
+                if (!cached_tiles[xi].empty())
+                    blit_rows(&cached_tiles[xi][0], out_row_size, outtile, out_stride, out_row_size, out_rows);
+                else
+                    tile_cache->save(tile_keys[xi], outtile, out_stride, out_row_size, out_rows);
+            }
+        }
+
+        stats->add(stats->tiles, xi1 - xi0 - cached_count);
+        stats->add(stats->cached_tiles, cached_count);
+        timer.lap(REALCUGAN_STAGE_DOWNLOAD);
+    }
+
+    release_worker(worker);
+
+    return 0;
+}
+
+int RealCUGAN::process_yuv(const ncnn::Mat& inimage, ncnn::Mat& outimage, int format) const
+{
+    const int w = inimage.w;
+    const int h = inimage.h;
+
+    if (w % 2 != 0 || h % 2 != 0 || (format != REALCUGAN_FORMAT_I420 && format != REALCUGAN_FORMAT_NV12))
+        return -1;
+
+    if (noise == -1 && scale == 1)
+    {
+        memcpy(outimage.data, inimage.data, (size_t)w * h * 3 / 2);
+        return 0;
+    }
+
+    // the shaders convert the planes in preproc and postproc, se needs every tile of the frame before the output
+    // and the fp32 shaders take planar floats, those go through rgb on the host
+    const bool syncgap_needed = syncgap && !single_tile(w, h);
+    if (vkdev && net.opt.use_fp16_storage && net.opt.use_int8_storage && !syncgap_needed)
+    {
+        RowQueue rows(&inimage, 1, this, format);
+
+        return process_frames(&inimage, &outimage, rows);
     }
 
-    vkdev->reclaim_blob_allocator(blob_vkallocator);
-    vkdev->reclaim_staging_allocator(staging_vkallocator);
+#if _WIN32
+    const bool bgr = true;
+#else
+    const bool bgr = false;
+#endif
+    const bool nv12 = format == REALCUGAN_FORMAT_NV12;
+
+    ncnn::Mat inrgb(w, h, (size_t)3u, 3);
+    ncnn::Mat outrgb(w * scale, h * scale, (size_t)3u, 3);
+    if (inrgb.empty() || outrgb.empty())
+        return -100;
+
+    kernel_yuv_to_rgb((const unsigned char*)inimage.data, w, h, (unsigned char*)inrgb.data, nv12, bgr);
+
+    int ret = process(inrgb, outrgb);
+    if (ret != 0)
+        return ret;
+
+    kernel_rgb_to_yuv((const unsigned char*)outrgb.data, w * scale, h * scale, (unsigned char*)outimage.data, nv12, bgr);
 
     return 0;
 }
 
+int RealCUGAN::warm_up(int w, int h, int channels) const
+{
+    if (w <= 0 || h <= 0 || (channels != 3 && channels != 4))
+        return -1;
+
+    ncnn::Mat inimage(w, h, (size_t)channels, channels);
+    ncnn::Mat outimage(w * scale, h * scale, (size_t)channels, channels);
+    if (inimage.empty() || outimage.empty())
+        return -100;
+
+    // deterministic noise, a flat frame would let the tile cache skip the tiles
+    unsigned int state = 0x2545f491;
+    unsigned char* pixeldata = (unsigned char*)inimage.data;
+    for (size_t i = 0; i < (size_t)w * h * channels; i++)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        pixeldata[i] = (unsigned char)(state >> 24);
+    }
+
+    // a scratch context with stats, gap features and an empty tile cache of its own, the dummy frame leaves no trace
+    TileCache scratch_cache;
+    RealCUGAN* context = create_context(*this);
+    context->tile_cache = &scratch_cache;
+    for (size_t i = 0; i < context->peers.size(); i++)
+    {
+        context->peers[i]->tile_cache = &scratch_cache;
+    }
+
+    int ret = context->process(inimage, outimage);
+
+    // the workers of the call keep their grown allocators in the pool for the next one
+    adopt_workers(*context);
+    delete context;
+
+    return ret;
+}
+
+void RealCUGAN::adopt_workers(RealCUGAN& context) const
+{
+    {
+        ncnn::MutexLockGuard lock(workers_lock);
+
+        idle_workers.insert(idle_workers.end(), context.idle_workers.begin(), context.idle_workers.end());
+        context.idle_workers.clear();
+    }
+
+    for (size_t i = 0; i < peers.size(); i++)
+    {
+        peers[i]->adopt_workers(*context.peers[i]);
+    }
+}
+
 int RealCUGAN::process_cpu(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
 {
     if (noise == -1 && scale == 1)
     {
-        outimage = inimage;
+        copy_frame(inimage, outimage);
         return 0;
     }
 
+    int TILE_SIZE_X;
+    int TILE_SIZE_Y;
+    plan_tiles(inimage.w, inimage.h, TILE_SIZE_X, TILE_SIZE_Y);
+
+    const int xtiles = (inimage.w + TILE_SIZE_X - 1) / TILE_SIZE_X;
+    const int ytiles = (inimage.h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
+
+    TileQueue tiles(FrameBand(inimage.h), xtiles * ytiles);
+
+    return process_cpu_frame(inimage, outimage, tiles);
+}
+
+int RealCUGAN::process_cpu_frame(const ncnn::Mat& inimage, ncnn::Mat& outimage, TileQueue& tiles) const
+{
+    // tile_threads workers each run their own extractor on whole tiles
+    // and split num_threads between them for the layers inside
+    const int workers = std::max(std::min(tile_threads, tiles.size()), 1);
+    const int num_threads = std::max(net.opt.num_threads / workers, 1);
+
+    std::vector<int> results(workers, 0);
+    std::vector<std::thread> threads;
+    for (int i = 1; i < workers; i++)
+    {
+        threads.push_back(std::thread([&, i]() { results[i] = process_cpu_tiles(inimage, outimage, tiles, num_threads); }));
+    }
+
+    results[0] = process_cpu_tiles(inimage, outimage, tiles, num_threads);
+
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+
+    for (int i = 0; i < workers; i++)
+    {
+        if (results[i] != 0)
+            return results[i];
+    }
+
+    return 0;
+}
+
+int RealCUGAN::process_cpu_tiles(const ncnn::Mat& inimage, ncnn::Mat& outimage, TileQueue& tiles, int num_threads) const
+{
+    // the images may hold only a band of the frame rows
+    const FrameBand& band = tiles.band();
+
     const unsigned char* pixeldata = (const unsigned char*)inimage.data;
     const int w = inimage.w;
-    const int h = inimage.h;
+    const int h = band.h;
     const int channels = inimage.elempack;
 
-    const int TILE_SIZE_X = tilesize;
-    const int TILE_SIZE_Y = tilesize;
+    int TILE_SIZE_X;
+    int TILE_SIZE_Y;
+    plan_tiles(w, h, TILE_SIZE_X, TILE_SIZE_Y);
+
+    // tile scratch of this worker, no lock shared with the other workers
+    WorkerState* worker = acquire_worker();
+    ncnn::UnlockedPoolAllocator& blob_allocator = worker->blob_allocator;
+    ncnn::PoolAllocator& workspace_allocator = worker->workspace_allocator;
+
+    StageTimer timer(stats);
 
     ncnn::Option opt = net.opt;
+    opt.num_threads = num_threads;
+    opt.blob_allocator = &blob_allocator;
+    opt.workspace_allocator = &workspace_allocator;
 
     // each tile 400x400
     const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
-    const int ytiles = (h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
 
-    for (int yi = 0; yi < ytiles; yi++)
+    // columns of tiles run, all of them unless a region of interest is processed
+    const int xi0 = band.xi0;
+    const int xi1 = band.xi1 < 0 ? xtiles : std::min(band.xi1, xtiles);
+
+    int tile;
+    while (tiles.pop(tile))
     {
+        const int yi = band.yi0 + tile / (xi1 - xi0);
+        const int xi = xi0 + tile % (xi1 - xi0);
+
         const int tile_h_nopad = std::min((yi + 1) * TILE_SIZE_Y, h) - yi * TILE_SIZE_Y;
 
         int prepadding_bottom = prepadding;
@@ -762,491 +2720,729 @@ int RealCUGAN::process_cpu(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
         int in_tile_y0 = std::max(yi * TILE_SIZE_Y - prepadding, 0);
         int in_tile_y1 = std::min((yi + 1) * TILE_SIZE_Y + prepadding_bottom, h);
 
-        for (int xi = 0; xi < xtiles; xi++)
+        const int tile_w_nopad = std::min((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X;
+
+        int prepadding_right = prepadding;
+        if (scale == 1 || scale == 3)
         {
-            const int tile_w_nopad = std::min((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X;
+            prepadding_right += (tile_w_nopad + 3) / 4 * 4 - tile_w_nopad;
+        }
+        if (scale == 2 || scale == 4)
+        {
+            prepadding_right += (tile_w_nopad + 1) / 2 * 2 - tile_w_nopad;
+        }
 
-            int prepadding_right = prepadding;
-            if (scale == 1 || scale == 3)
-            {
-                prepadding_right += (tile_w_nopad + 3) / 4 * 4 - tile_w_nopad;
-            }
-            if (scale == 2 || scale == 4)
+        int in_tile_x0 = std::max(xi * TILE_SIZE_X - prepadding, 0);
+        int in_tile_x1 = std::min((xi + 1) * TILE_SIZE_X + prepadding_right, w);
+
+        // a tile seen before is copied from the tile cache instead of run
+        const bool use_tile_cache = tile_cache->enabled();
+        const int out_stride = w * scale * channels;
+        unsigned char* outtile = (unsigned char*)outimage.data + (yi * scale * TILE_SIZE_Y - band.out_y0) * w * scale * channels + xi * scale * TILE_SIZE_X * channels;
+
+        TileKey key;
+        if (use_tile_cache)
+        {
+            key = frame_tile_key(pixeldata, w, h, channels, band.in_y0, xi, yi, TILE_SIZE_X, TILE_SIZE_Y, prepadding, noise, scale, tta_mode ? tta_level : 0);
+            if (tile_cache->load(key, outtile, out_stride))
             {
-                prepadding_right += (tile_w_nopad + 1) / 2 * 2 - tile_w_nopad;
+                stats->add(stats->cached_tiles, 1);
+                timer.lap(REALCUGAN_STAGE_DOWNLOAD);
+                continue;
             }
+        }
 
-            int in_tile_x0 = std::max(xi * TILE_SIZE_X - prepadding, 0);
-            int in_tile_x1 = std::min((xi + 1) * TILE_SIZE_X + prepadding_right, w);
-
-            // crop tile
-            ncnn::Mat in;
+        // crop tile
+        ncnn::Mat in;
+        {
+            if (channels == 3)
             {
-                if (channels == 3)
-                {
 #if _WIN32
-                    in = ncnn::Mat::from_pixels_roi(pixeldata, ncnn::Mat::PIXEL_BGR2RGB, w, h, in_tile_x0, in_tile_y0, in_tile_x1 - in_tile_x0, in_tile_y1 - in_tile_y0);
+                in = ncnn::Mat::from_pixels_roi(pixeldata, ncnn::Mat::PIXEL_BGR2RGB, w, inimage.h, in_tile_x0, in_tile_y0 - band.in_y0, in_tile_x1 - in_tile_x0, in_tile_y1 - in_tile_y0);
 #else
-                    in = ncnn::Mat::from_pixels_roi(pixeldata, ncnn::Mat::PIXEL_RGB, w, h, in_tile_x0, in_tile_y0, in_tile_x1 - in_tile_x0, in_tile_y1 - in_tile_y0);
+                in = ncnn::Mat::from_pixels_roi(pixeldata, ncnn::Mat::PIXEL_RGB, w, inimage.h, in_tile_x0, in_tile_y0 - band.in_y0, in_tile_x1 - in_tile_x0, in_tile_y1 - in_tile_y0);
 #endif
-                }
-                if (channels == 4)
-                {
+            }
+            if (channels == 4)
+            {
 #if _WIN32
-                    in = ncnn::Mat::from_pixels_roi(pixeldata, ncnn::Mat::PIXEL_BGRA2RGBA, w, h, in_tile_x0, in_tile_y0, in_tile_x1 - in_tile_x0, in_tile_y1 - in_tile_y0);
+                in = ncnn::Mat::from_pixels_roi(pixeldata, ncnn::Mat::PIXEL_BGRA2RGBA, w, inimage.h, in_tile_x0, in_tile_y0 - band.in_y0, in_tile_x1 - in_tile_x0, in_tile_y1 - in_tile_y0);
 #else
-                    in = ncnn::Mat::from_pixels_roi(pixeldata, ncnn::Mat::PIXEL_RGBA, w, h, in_tile_x0, in_tile_y0, in_tile_x1 - in_tile_x0, in_tile_y1 - in_tile_y0);
+                in = ncnn::Mat::from_pixels_roi(pixeldata, ncnn::Mat::PIXEL_RGBA, w, inimage.h, in_tile_x0, in_tile_y0 - band.in_y0, in_tile_x1 - in_tile_x0, in_tile_y1 - in_tile_y0);
 #endif
-                }
             }
+        }
 
-            ncnn::Mat out;
+        timer.lap(REALCUGAN_STAGE_CROP);
 
-            if (tta_mode)
+        ncnn::Mat out;
+
+        if (tta_mode)
+        {
+            // split alpha and preproc
+            ncnn::Mat in_tile[8];
+            ncnn::Mat in_alpha_tile;
             {
-                // split alpha and preproc
-                ncnn::Mat in_tile[8];
-                ncnn::Mat in_alpha_tile;
+                in_tile[0].create(in.w, in.h, 3);
+                for (int q = 0; q < 3; q++)
                 {
-                    in_tile[0].create(in.w, in.h, 3);
-                    for (int q = 0; q < 3; q++)
-                    {
-                        const float* ptr = in.channel(q);
-                        float* outptr0 = in_tile[0].channel(q);
-
-                        for (int i = 0; i < in.h; i++)
-                        {
-                            for (int j = 0; j < in.w; j++)
-                            {
-                                *outptr0++ = *ptr++ * (1 / 255.f);
-                            }
-                        }
-                    }
-
-                    if (channels == 4)
-                    {
-                        in_alpha_tile = in.channel_range(3, 1).clone();
-                    }
+                    kernel_normalize(in.channel(q), in_tile[0].channel(q), in.w * in.h);
                 }
 
-                // border padding
+                if (channels == 4)
                 {
-                    int pad_top = std::max(prepadding - yi * TILE_SIZE_Y, 0);
-                    int pad_bottom = std::max(std::min((yi + 1) * TILE_SIZE_Y + prepadding_bottom - h, prepadding_bottom), 0);
-                    int pad_left = std::max(prepadding - xi * TILE_SIZE_X, 0);
-                    int pad_right = std::max(std::min((xi + 1) * TILE_SIZE_X + prepadding_right - w, prepadding_right), 0);
-
-                    ncnn::Mat in_tile_padded;
-                    ncnn::copy_make_border(in_tile[0], in_tile_padded, pad_top, pad_bottom, pad_left, pad_right, 2, 0.f, net.opt);
-                    in_tile[0] = in_tile_padded;
+                    // the alpha of the tile without its prepadding, the halo would shift it and overrun out
+                    const int alpha_top = yi * TILE_SIZE_Y - in_tile_y0;
+                    const int alpha_left = xi * TILE_SIZE_X - in_tile_x0;
+                    ncnn::copy_cut_border(in.channel_range(3, 1), in_alpha_tile, alpha_top, in.h - alpha_top - tile_h_nopad, alpha_left, in.w - alpha_left - tile_w_nopad, opt);
                 }
+            }
+
+            // border padding
+            {
+                int pad_top = std::max(prepadding - yi * TILE_SIZE_Y, 0);
+                int pad_bottom = std::max(std::min((yi + 1) * TILE_SIZE_Y + prepadding_bottom - h, prepadding_bottom), 0);
+                int pad_left = std::max(prepadding - xi * TILE_SIZE_X, 0);
+                int pad_right = std::max(std::min((xi + 1) * TILE_SIZE_X + prepadding_right - w, prepadding_right), 0);
+
+                ncnn::Mat in_tile_padded;
+                ncnn::copy_make_border(in_tile[0], in_tile_padded, pad_top, pad_bottom, pad_left, pad_right, 2, 0.f, opt);
+                in_tile[0] = in_tile_padded;
+            }
 
-                // the other 7 directions
+            // the other directions of the tta level, the vertical flip, the other flips and the transposes
+            {
+                if (tta_level >= 2)
                 {
                     in_tile[1].create(in_tile[0].w, in_tile[0].h, 3);
+                }
+                if (tta_level >= 4)
+                {
                     in_tile[2].create(in_tile[0].w, in_tile[0].h, 3);
                     in_tile[3].create(in_tile[0].w, in_tile[0].h, 3);
+                }
+                if (tta_level >= 8)
+                {
                     in_tile[4].create(in_tile[0].h, in_tile[0].w, 3);
                     in_tile[5].create(in_tile[0].h, in_tile[0].w, 3);
                     in_tile[6].create(in_tile[0].h, in_tile[0].w, 3);
                     in_tile[7].create(in_tile[0].h, in_tile[0].w, 3);
-
-                    for (int q = 0; q < 3; q++)
-                    {
-                        const ncnn::Mat in_tile_0 = in_tile[0].channel(q);
-                        ncnn::Mat in_tile_1 = in_tile[1].channel(q);
-                        ncnn::Mat in_tile_2 = in_tile[2].channel(q);
-                        ncnn::Mat in_tile_3 = in_tile[3].channel(q);
-                        ncnn::Mat in_tile_4 = in_tile[4].channel(q);
-                        ncnn::Mat in_tile_5 = in_tile[5].channel(q);
-                        ncnn::Mat in_tile_6 = in_tile[6].channel(q);
-                        ncnn::Mat in_tile_7 = in_tile[7].channel(q);
-
-                        for (int i = 0; i < in_tile[0].h; i++)
-                        {
-                            const float* outptr0 = in_tile_0.row(i);
-                            float* outptr1 = in_tile_1.row(in_tile[0].h - 1 - i);
-                            float* outptr2 = in_tile_2.row(i) + in_tile[0].w - 1;
-                            float* outptr3 = in_tile_3.row(in_tile[0].h - 1 - i) + in_tile[0].w - 1;
-
-                            for (int j = 0; j < in_tile[0].w; j++)
-                            {
-                                float* outptr4 = in_tile_4.row(j) + i;
-                                float* outptr5 = in_tile_5.row(in_tile[0].w - 1 - j) + i;
-                                float* outptr6 = in_tile_6.row(j) + in_tile[0].h - 1 - i;
-                                float* outptr7 = in_tile_7.row(in_tile[0].w - 1 - j) + in_tile[0].h - 1 - i;
-
-                                float v = *outptr0++;
-
-                                *outptr1++ = v;
-                                *outptr2-- = v;
-                                *outptr3-- = v;
-                                *outptr4 = v;
-                                *outptr5 = v;
-                                *outptr6 = v;
-                                *outptr7 = v;
-                            }
-                        }
-                    }
                 }
 
-                // realcugan
-                ncnn::Mat out_tile[8];
-                for (int ti = 0; ti < 8; ti++)
+                // flips of the tile and of its transpose, row by row instead of column strided writes
+                for (int q = 0; q < 3; q++)
                 {
-                    ncnn::Extractor ex = net.create_extractor();
-
-                    ex.input("in0", in_tile[ti]);
-
-                    ex.extract("out0", out_tile[ti]);
-                }
+                    const float* ptr0 = in_tile[0].channel(q);
 
-                ncnn::Mat out_alpha_tile;
-                if (channels == 4)
-                {
-                    if (scale == 1)
-                    {
-                        out_alpha_tile = in_alpha_tile;
-                    }
-                    if (scale == 2)
+                    if (tta_level >= 2)
                     {
-                        bicubic_2x->forward(in_alpha_tile, out_alpha_tile, opt);
+                        kernel_flip(ptr0, in_tile[0].w, in_tile[0].h, in_tile[1].channel(q), true, false);
                     }
-                    if (scale == 3)
+                    if (tta_level >= 4)
                     {
-                        bicubic_3x->forward(in_alpha_tile, out_alpha_tile, opt);
+                        kernel_flip(ptr0, in_tile[0].w, in_tile[0].h, in_tile[2].channel(q), false, true);
+                        kernel_flip(ptr0, in_tile[0].w, in_tile[0].h, in_tile[3].channel(q), true, true);
                     }
-                    if (scale == 4)
+                    if (tta_level >= 8)
                     {
-                        bicubic_4x->forward(in_alpha_tile, out_alpha_tile, opt);
+                        kernel_transpose(ptr0, in_tile[0].w, in_tile[0].h, in_tile[4].channel(q));
+
+                        const float* ptr4 = in_tile[4].channel(q);
+                        kernel_flip(ptr4, in_tile[4].w, in_tile[4].h, in_tile[5].channel(q), true, false);
+                        kernel_flip(ptr4, in_tile[4].w, in_tile[4].h, in_tile[6].channel(q), false, true);
+                        kernel_flip(ptr4, in_tile[4].w, in_tile[4].h, in_tile[7].channel(q), true, true);
                     }
                 }
+            }
 
-                // postproc and merge alpha
-                {
-                    out.create(tile_w_nopad * scale, tile_h_nopad * scale, channels);
-                    if (scale == 4)
-                    {
-                        for (int q = 0; q < 3; q++)
-                        {
-                            const ncnn::Mat out_tile_0 = out_tile[0].channel(q);
-                            const ncnn::Mat out_tile_1 = out_tile[1].channel(q);
-                            const ncnn::Mat out_tile_2 = out_tile[2].channel(q);
-                            const ncnn::Mat out_tile_3 = out_tile[3].channel(q);
-                            const ncnn::Mat out_tile_4 = out_tile[4].channel(q);
-                            const ncnn::Mat out_tile_5 = out_tile[5].channel(q);
-                            const ncnn::Mat out_tile_6 = out_tile[6].channel(q);
-                            const ncnn::Mat out_tile_7 = out_tile[7].channel(q);
-                            float* outptr = out.channel(q);
+            timer.lap(REALCUGAN_STAGE_PREPROC);
 
-                            for (int i = 0; i < out.h; i++)
-                            {
-                                const float* inptr = in_tile[0].channel(q).row(prepadding + i / 4) + prepadding;
-                                const float* ptr0 = out_tile_0.row(i);
-                                const float* ptr1 = out_tile_1.row(out_tile[0].h - 1 - i);
-                                const float* ptr2 = out_tile_2.row(i) + out_tile[0].w - 1;
-                                const float* ptr3 = out_tile_3.row(out_tile[0].h - 1 - i) + out_tile[0].w - 1;
+            // realcugan
+            ncnn::Mat out_tile[8];
+            for (int ti = 0; ti < tta_level; ti++)
+            {
+                ncnn::Extractor ex = net.create_extractor();
 
-                                for (int j = 0; j < out.w; j++)
-                                {
-                                    const float* ptr4 = out_tile_4.row(j) + i;
-                                    const float* ptr5 = out_tile_5.row(out_tile[0].w - 1 - j) + i;
-                                    const float* ptr6 = out_tile_6.row(j) + out_tile[0].h - 1 - i;
-                                    const float* ptr7 = out_tile_7.row(out_tile[0].w - 1 - j) + out_tile[0].h - 1 - i;
+                ex.set_num_threads(num_threads);
+                ex.set_blob_allocator(&blob_allocator);
+                ex.set_workspace_allocator(&workspace_allocator);
 
-                                    float v = (*ptr0++ + *ptr1++ + *ptr2-- + *ptr3-- + *ptr4 + *ptr5 + *ptr6 + *ptr7) / 8;
+                ex.input("in0", in_tile[ti]);
 
-                                    *outptr++ = v * 255.f + 0.5f + inptr[j / 4] * 255.f;
-                                }
-                            }
-                        }
-                    }
-                    else
+                int ret = ex.extract("out0", out_tile[ti]);
+                if (ret != 0)
+                {
+                    release_worker(worker);
+                    return ret;
+                }
+            }
+
+            timer.lap(REALCUGAN_STAGE_INFERENCE);
+
+            // postproc and merge alpha
+            {
+                out.create(tile_w_nopad * scale, tile_h_nopad * scale, channels);
+                if (scale == 4)
+                {
+                    // undo the flips and transposes of the tta directions and sum them up in the orientation of the tile
+                    ncnn::Mat sum_tile(out_tile[0].w, out_tile[0].h, (size_t)4u, opt.workspace_allocator);
+                    ncnn::Mat transposed_tile(out_tile[0].w, out_tile[0].h, (size_t)4u, opt.workspace_allocator);
+                    for (int q = 0; q < 3; q++)
                     {
-                        for (int q = 0; q < 3; q++)
+                        const int tile_w = out_tile[0].w;
+                        const int tile_h = out_tile[0].h;
+
+                        memcpy(sum_tile, out_tile[0].channel(q), tile_w * tile_h * sizeof(float));
+                        if (tta_level >= 2)
                         {
-                            const ncnn::Mat out_tile_0 = out_tile[0].channel(q);
-                            const ncnn::Mat out_tile_1 = out_tile[1].channel(q);
-                            const ncnn::Mat out_tile_2 = out_tile[2].channel(q);
-                            const ncnn::Mat out_tile_3 = out_tile[3].channel(q);
-                            const ncnn::Mat out_tile_4 = out_tile[4].channel(q);
-                            const ncnn::Mat out_tile_5 = out_tile[5].channel(q);
-                            const ncnn::Mat out_tile_6 = out_tile[6].channel(q);
-                            const ncnn::Mat out_tile_7 = out_tile[7].channel(q);
-                            float* outptr = out.channel(q);
+                            kernel_flip_add(out_tile[1].channel(q), tile_w, tile_h, sum_tile, true, false);
+                        }
+                        if (tta_level >= 4)
+                        {
+                            kernel_flip_add(out_tile[2].channel(q), tile_w, tile_h, sum_tile, false, true);
+                            kernel_flip_add(out_tile[3].channel(q), tile_w, tile_h, sum_tile, true, true);
+                        }
+                        if (tta_level >= 8)
+                        {
+                            kernel_transpose(out_tile[4].channel(q), tile_h, tile_w, transposed_tile);
+                            kernel_flip_add(transposed_tile, tile_w, tile_h, sum_tile, false, false);
+                            kernel_transpose(out_tile[5].channel(q), tile_h, tile_w, transposed_tile);
+                            kernel_flip_add(transposed_tile, tile_w, tile_h, sum_tile, false, true);
+                            kernel_transpose(out_tile[6].channel(q), tile_h, tile_w, transposed_tile);
+                            kernel_flip_add(transposed_tile, tile_w, tile_h, sum_tile, true, false);
+                            kernel_transpose(out_tile[7].channel(q), tile_h, tile_w, transposed_tile);
+                            kernel_flip_add(transposed_tile, tile_w, tile_h, sum_tile, true, true);
+                        }
 
-                            for (int i = 0; i < out.h; i++)
-                            {
-                                const float* ptr0 = out_tile_0.row(i);
-                                const float* ptr1 = out_tile_1.row(out_tile[0].h - 1 - i);
-                                const float* ptr2 = out_tile_2.row(i) + out_tile[0].w - 1;
-                                const float* ptr3 = out_tile_3.row(out_tile[0].h - 1 - i) + out_tile[0].w - 1;
+                        float* outptr = out.channel(q);
 
-                                for (int j = 0; j < out.w; j++)
-                                {
-                                    const float* ptr4 = out_tile_4.row(j) + i;
-                                    const float* ptr5 = out_tile_5.row(out_tile[0].w - 1 - j) + i;
-                                    const float* ptr6 = out_tile_6.row(j) + out_tile[0].h - 1 - i;
-                                    const float* ptr7 = out_tile_7.row(out_tile[0].w - 1 - j) + out_tile[0].h - 1 - i;
+                        for (int i = 0; i < out.h; i++)
+                        {
+                            const float* inptr = in_tile[0].channel(q).row(prepadding + i / 4) + prepadding;
 
-                                    float v = (*ptr0++ + *ptr1++ + *ptr2-- + *ptr3-- + *ptr4 + *ptr5 + *ptr6 + *ptr7) / 8;
+                            kernel_denormalize(sum_tile.row(i), outptr, out.w, 1.f / tta_level);
 
-                                    *outptr++ = v * 255.f + 0.5f;
-                                }
+                            for (int j = 0; j < out.w; j++)
+                            {
+                                *outptr++ += inptr[j / 4] * 255.f;
                             }
                         }
                     }
-
-                    if (channels == 4)
-                    {
-                        memcpy(out.channel_range(3, 1), out_alpha_tile, out_alpha_tile.total() * sizeof(float));
-                    }
                 }
-            }
-            else
-            {
-                // split alpha and preproc
-                ncnn::Mat in_tile;
-                ncnn::Mat in_alpha_tile;
+                else
                 {
-                    in_tile.create(in.w, in.h, 3);
+                    // undo the flips and transposes of the tta directions and sum them up in the orientation of the tile
+                    ncnn::Mat sum_tile(out_tile[0].w, out_tile[0].h, (size_t)4u, opt.workspace_allocator);
+                    ncnn::Mat transposed_tile(out_tile[0].w, out_tile[0].h, (size_t)4u, opt.workspace_allocator);
                     for (int q = 0; q < 3; q++)
                     {
-                        const float* ptr = in.channel(q);
-                        float* outptr = in_tile.channel(q);
+                        const int tile_w = out_tile[0].w;
+                        const int tile_h = out_tile[0].h;
 
-                        for (int i = 0; i < in.w * in.h; i++)
+                        memcpy(sum_tile, out_tile[0].channel(q), tile_w * tile_h * sizeof(float));
+                        if (tta_level >= 2)
                         {
-                            *outptr++ = *ptr++ * (1 / 255.f);
+                            kernel_flip_add(out_tile[1].channel(q), tile_w, tile_h, sum_tile, true, false);
+                        }
+                        if (tta_level >= 4)
+                        {
+                            kernel_flip_add(out_tile[2].channel(q), tile_w, tile_h, sum_tile, false, true);
+                            kernel_flip_add(out_tile[3].channel(q), tile_w, tile_h, sum_tile, true, true);
+                        }
+                        if (tta_level >= 8)
+                        {
+                            kernel_transpose(out_tile[4].channel(q), tile_h, tile_w, transposed_tile);
+                            kernel_flip_add(transposed_tile, tile_w, tile_h, sum_tile, false, false);
+                            kernel_transpose(out_tile[5].channel(q), tile_h, tile_w, transposed_tile);
+                            kernel_flip_add(transposed_tile, tile_w, tile_h, sum_tile, false, true);
+                            kernel_transpose(out_tile[6].channel(q), tile_h, tile_w, transposed_tile);
+                            kernel_flip_add(transposed_tile, tile_w, tile_h, sum_tile, true, false);
+                            kernel_transpose(out_tile[7].channel(q), tile_h, tile_w, transposed_tile);
+                            kernel_flip_add(transposed_tile, tile_w, tile_h, sum_tile, true, true);
                         }
-                    }
 
-                    if (channels == 4)
-                    {
-                        in_alpha_tile = in.channel_range(3, 1).clone();
+                        float* outptr = out.channel(q);
+
+                        for (int i = 0; i < out.h; i++)
+                        {
+                            kernel_denormalize(sum_tile.row(i), outptr, out.w, 1.f / tta_level);
+                            outptr += out.w;
+                        }
                     }
                 }
 
-                // border padding
+                if (channels == 4)
                 {
-                    int pad_top = std::max(prepadding - yi * TILE_SIZE_Y, 0);
-                    int pad_bottom = std::max(std::min((yi + 1) * TILE_SIZE_Y + prepadding_bottom - h, prepadding_bottom), 0);
-                    int pad_left = std::max(prepadding - xi * TILE_SIZE_X, 0);
-                    int pad_right = std::max(std::min((xi + 1) * TILE_SIZE_X + prepadding_right - w, prepadding_right), 0);
-
-                    ncnn::Mat in_tile_padded;
-                    ncnn::copy_make_border(in_tile, in_tile_padded, pad_top, pad_bottom, pad_left, pad_right, 2, 0.f, net.opt);
-                    in_tile = in_tile_padded;
+                    kernel_bicubic(in_alpha_tile, in_alpha_tile.w, in_alpha_tile.h, out.channel(3), scale);
+                }
+            }
+        }
+        else
+        {
+            // split alpha and preproc
+            ncnn::Mat in_tile;
+            ncnn::Mat in_alpha_tile;
+            {
+                in_tile.create(in.w, in.h, 3);
+                for (int q = 0; q < 3; q++)
+                {
+                    kernel_normalize(in.channel(q), in_tile.channel(q), in.w * in.h);
                 }
 
-                // realcugan
-                ncnn::Mat out_tile;
+                if (channels == 4)
                 {
-                    ncnn::Extractor ex = net.create_extractor();
+                    // the alpha of the tile without its prepadding, the halo would shift it and overrun out
+                    const int alpha_top = yi * TILE_SIZE_Y - in_tile_y0;
+                    const int alpha_left = xi * TILE_SIZE_X - in_tile_x0;
+                    ncnn::copy_cut_border(in.channel_range(3, 1), in_alpha_tile, alpha_top, in.h - alpha_top - tile_h_nopad, alpha_left, in.w - alpha_left - tile_w_nopad, opt);
+                }
+            }
 
-                    ex.input("in0", in_tile);
+            // border padding
+            {
+                int pad_top = std::max(prepadding - yi * TILE_SIZE_Y, 0);
+                int pad_bottom = std::max(std::min((yi + 1) * TILE_SIZE_Y + prepadding_bottom - h, prepadding_bottom), 0);
+                int pad_left = std::max(prepadding - xi * TILE_SIZE_X, 0);
+                int pad_right = std::max(std::min((xi + 1) * TILE_SIZE_X + prepadding_right - w, prepadding_right), 0);
+
+                ncnn::Mat in_tile_padded;
+                ncnn::copy_make_border(in_tile, in_tile_padded, pad_top, pad_bottom, pad_left, pad_right, 2, 0.f, opt);
+                in_tile = in_tile_padded;
+            }
 
-                    ex.extract("out0", out_tile);
-                }
+            timer.lap(REALCUGAN_STAGE_PREPROC);
 
-                ncnn::Mat out_alpha_tile;
-                if (channels == 4)
+            // realcugan
+            ncnn::Mat out_tile;
+            {
+                ncnn::Extractor ex = net.create_extractor();
+
+                ex.set_num_threads(num_threads);
+                ex.set_blob_allocator(&blob_allocator);
+                ex.set_workspace_allocator(&workspace_allocator);
+
+                ex.input("in0", in_tile);
+
+                int ret = ex.extract("out0", out_tile);
+                if (ret != 0)
                 {
-                    if (scale == 1)
-                    {
-                        out_alpha_tile = in_alpha_tile;
-                    }
-                    if (scale == 2)
-                    {
-                        bicubic_2x->forward(in_alpha_tile, out_alpha_tile, opt);
-                    }
-                    if (scale == 3)
-                    {
-                        bicubic_3x->forward(in_alpha_tile, out_alpha_tile, opt);
-                    }
-                    if (scale == 4)
-                    {
-                        bicubic_4x->forward(in_alpha_tile, out_alpha_tile, opt);
-                    }
+                    release_worker(worker);
+                    return ret;
                 }
+            }
 
-                // postproc and merge alpha
+            timer.lap(REALCUGAN_STAGE_INFERENCE);
+
+            // postproc and merge alpha
+            {
+                out.create(tile_w_nopad * scale, tile_h_nopad * scale, channels);
+                if (scale == 4)
                 {
-                    out.create(tile_w_nopad * scale, tile_h_nopad * scale, channels);
-                    if (scale == 4)
+                    for (int q = 0; q < 3; q++)
                     {
-                        for (int q = 0; q < 3; q++)
+                        float* outptr = out.channel(q);
+
+                        for (int i = 0; i < out.h; i++)
                         {
-                            float* outptr = out.channel(q);
+                            const float* inptr = in_tile.channel(q).row(prepadding + i / 4) + prepadding;
 
-                            for (int i = 0; i < out.h; i++)
-                            {
-                                const float* inptr = in_tile.channel(q).row(prepadding + i / 4) + prepadding;
-                                const float* ptr = out_tile.channel(q).row(i);
+                            kernel_denormalize(out_tile.channel(q).row(i), outptr, out.w, 1.f);
 
-                                for (int j = 0; j < out.w; j++)
-                                {
-                                    *outptr++ = *ptr++ * 255.f + 0.5f + inptr[j / 4] * 255.f;
-                                }
+                            for (int j = 0; j < out.w; j++)
+                            {
+                                *outptr++ += inptr[j / 4] * 255.f;
                             }
                         }
                     }
-                    else
+                }
+                else
+                {
+                    for (int q = 0; q < 3; q++)
                     {
-                        for (int q = 0; q < 3; q++)
-                        {
-                            float* outptr = out.channel(q);
-
-                            for (int i = 0; i < out.h; i++)
-                            {
-                                const float* ptr = out_tile.channel(q).row(i);
+                        float* outptr = out.channel(q);
 
-                                for (int j = 0; j < out.w; j++)
-                                {
-                                    *outptr++ = *ptr++ * 255.f + 0.5f;
-                                }
-                            }
+                        for (int i = 0; i < out.h; i++)
+                        {
+                            kernel_denormalize(out_tile.channel(q).row(i), outptr, out.w, 1.f);
+                            outptr += out.w;
                         }
                     }
+                }
 
-                    if (channels == 4)
-                    {
-                        memcpy(out.channel_range(3, 1), out_alpha_tile, out_alpha_tile.total() * sizeof(float));
-                    }
+                if (channels == 4)
+                {
+                    kernel_bicubic(in_alpha_tile, in_alpha_tile.w, in_alpha_tile.h, out.channel(3), scale);
                 }
             }
+        }
 
+        timer.lap(REALCUGAN_STAGE_POSTPROC);
+
+        {
+            if (channels == 3)
             {
-                if (channels == 3)
-                {
 #if _WIN32
-                    out.to_pixels((unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels + xi * scale * TILE_SIZE_X * channels, ncnn::Mat::PIXEL_RGB2BGR, w * scale * channels);
+                out.to_pixels((unsigned char*)outimage.data + (yi * scale * TILE_SIZE_Y - band.out_y0) * w * scale * channels + xi * scale * TILE_SIZE_X * channels, ncnn::Mat::PIXEL_RGB2BGR, w * scale * channels);
 #else
-                    out.to_pixels((unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels + xi * scale * TILE_SIZE_X * channels, ncnn::Mat::PIXEL_RGB, w * scale * channels);
+                out.to_pixels((unsigned char*)outimage.data + (yi * scale * TILE_SIZE_Y - band.out_y0) * w * scale * channels + xi * scale * TILE_SIZE_X * channels, ncnn::Mat::PIXEL_RGB, w * scale * channels);
 #endif
-                }
-                if (channels == 4)
-                {
+            }
+            if (channels == 4)
+            {
 #if _WIN32
-                    out.to_pixels((unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels + xi * scale * TILE_SIZE_X * channels, ncnn::Mat::PIXEL_RGBA2BGRA, w * scale * channels);
+                out.to_pixels((unsigned char*)outimage.data + (yi * scale * TILE_SIZE_Y - band.out_y0) * w * scale * channels + xi * scale * TILE_SIZE_X * channels, ncnn::Mat::PIXEL_RGBA2BGRA, w * scale * channels);
 #else
-                    out.to_pixels((unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels + xi * scale * TILE_SIZE_X * channels, ncnn::Mat::PIXEL_RGBA, w * scale * channels);
+                out.to_pixels((unsigned char*)outimage.data + (yi * scale * TILE_SIZE_Y - band.out_y0) * w * scale * channels + xi * scale * TILE_SIZE_X * channels, ncnn::Mat::PIXEL_RGBA, w * scale * channels);
 #endif
-                }
             }
         }
+
+        if (use_tile_cache)
+        {
+            tile_cache->save(key, outtile, out_stride, tile_w_nopad * scale * channels, tile_h_nopad * scale);
+        }
+
+        stats->add(stats->tiles, 1);
+        timer.lap(REALCUGAN_STAGE_DOWNLOAD);
     }
 
+    release_worker(worker);
+
     return 0;
 }
 
 int RealCUGAN::process_se(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
 {
-    ncnn::VkAllocator* blob_vkallocator = vkdev->acquire_blob_allocator();
-    ncnn::VkAllocator* staging_vkallocator = vkdev->acquire_staging_allocator();
+    std::vector<SEDevice> devices;
+    acquire_se_devices(devices);
 
-    ncnn::Option opt = net.opt;
-    opt.blob_vkallocator = blob_vkallocator;
-    opt.workspace_vkallocator = blob_vkallocator;
-    opt.staging_vkallocator = staging_vkallocator;
+    int ret = 0;
 
-    FeatureCache cache;
+    // frames of a video close to the one the features were last computed on take them as they are
+    std::vector<std::string> gaps = {"gap0", "gap1", "gap2", "gap3"};
+    if (!process_se_temporal_load(inimage, gaps, devices))
+    {
+        std::vector<std::string> in0 = {};
+        std::vector<std::string> out0 = {"gap0"};
+        ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_stage0(inimage, in0, out0, devices[d].opt, devices[d].cache); });
+
+        std::vector<std::string> gap0 = {"gap0"};
+        if (ret == 0)
+            ret = process_se_sync_gap(inimage, gap0, false, devices);
+
+        std::vector<std::string> in1 = {"gap0"};
+        std::vector<std::string> out1 = {"gap1"};
+        if (ret == 0)
+            ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_stage0(inimage, in1, out1, devices[d].opt, devices[d].cache); });
+
+        std::vector<std::string> gap1 = {"gap1"};
+        if (ret == 0)
+            ret = process_se_sync_gap(inimage, gap1, false, devices);
+
+        std::vector<std::string> in2 = {"gap0", "gap1"};
+        std::vector<std::string> out2 = {"gap2"};
+        if (ret == 0)
+            ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_stage0(inimage, in2, out2, devices[d].opt, devices[d].cache); });
+
+        std::vector<std::string> gap2 = {"gap2"};
+        if (ret == 0)
+            ret = process_se_sync_gap(inimage, gap2, false, devices);
+
+        std::vector<std::string> in3 = {"gap0", "gap1", "gap2"};
+        std::vector<std::string> out3 = {"gap3"};
+        if (ret == 0)
+            ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_stage0(inimage, in3, out3, devices[d].opt, devices[d].cache); });
+
+        std::vector<std::string> gap3 = {"gap3"};
+        if (ret == 0)
+            ret = process_se_sync_gap(inimage, gap3, false, devices);
+
+        if (ret == 0)
+            process_se_temporal_save(inimage, gaps, devices);
+    }
 
-    std::vector<std::string> in0 = {};
-    std::vector<std::string> out0 = {"gap0"};
-    process_se_stage0(inimage, in0, out0, opt, cache);
+    std::vector<std::string> in4 = {"gap0", "gap1", "gap2", "gap3"};
+    if (ret == 0)
+        ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_stage2(inimage, in4, outimage, devices[d].opt, devices[d].cache, FrameBand(inimage.h)); });
 
-    std::vector<std::string> gap0 = {"gap0"};
-    process_se_sync_gap(inimage, gap0, opt, cache);
+    release_se_devices(devices);
 
-    std::vector<std::string> in1 = {"gap0"};
-    std::vector<std::string> out1 = {"gap1"};
-    process_se_stage0(inimage, in1, out1, opt, cache);
+    return ret;
+}
 
-    std::vector<std::string> gap1 = {"gap1"};
-    process_se_sync_gap(inimage, gap1, opt, cache);
+int RealCUGAN::process_se_rough(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
+{
+    std::vector<SEDevice> devices;
+    acquire_se_devices(devices);
 
-    std::vector<std::string> in2 = {"gap0", "gap1"};
-    std::vector<std::string> out2 = {"gap2"};
-    process_se_stage0(inimage, in2, out2, opt, cache);
+    int ret = 0;
 
-    std::vector<std::string> gap2 = {"gap2"};
-    process_se_sync_gap(inimage, gap2, opt, cache);
+    // frames of a video close to the one the features were last computed on take them as they are
+    std::vector<std::string> gaps = {"gap0", "gap1", "gap2", "gap3"};
+    if (!process_se_temporal_load(inimage, gaps, devices))
+    {
+        std::vector<std::string> in0 = {};
+        std::vector<std::string> out0 = {"gap0", "gap1", "gap2", "gap3"};
+        ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_stage0(inimage, in0, out0, devices[d].opt, devices[d].cache); });
 
-    std::vector<std::string> in3 = {"gap0", "gap1", "gap2"};
-    std::vector<std::string> out3 = {"gap3"};
-    process_se_stage0(inimage, in3, out3, opt, cache);
+        std::vector<std::string> gap0 = {"gap0", "gap1", "gap2", "gap3"};
+        if (ret == 0)
+            ret = process_se_sync_gap(inimage, gap0, false, devices);
 
-    std::vector<std::string> gap3 = {"gap3"};
-    process_se_sync_gap(inimage, gap3, opt, cache);
+        if (ret == 0)
+            process_se_temporal_save(inimage, gaps, devices);
+    }
 
     std::vector<std::string> in4 = {"gap0", "gap1", "gap2", "gap3"};
-    process_se_stage2(inimage, in4, outimage, opt, cache);
-
-    cache.clear();
+    if (ret == 0)
+        ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_stage2(inimage, in4, outimage, devices[d].opt, devices[d].cache, FrameBand(inimage.h)); });
 
-    vkdev->reclaim_blob_allocator(blob_vkallocator);
-    vkdev->reclaim_staging_allocator(staging_vkallocator);
+    release_se_devices(devices);
 
-    return 0;
+    return ret;
 }
 
-int RealCUGAN::process_se_rough(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
+int RealCUGAN::process_se_very_rough(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
 {
-    ncnn::VkAllocator* blob_vkallocator = vkdev->acquire_blob_allocator();
-    ncnn::VkAllocator* staging_vkallocator = vkdev->acquire_staging_allocator();
+    std::vector<SEDevice> devices;
+    acquire_se_devices(devices);
 
-    ncnn::Option opt = net.opt;
-    opt.blob_vkallocator = blob_vkallocator;
-    opt.workspace_vkallocator = blob_vkallocator;
-    opt.staging_vkallocator = staging_vkallocator;
+    int ret = 0;
 
-    FeatureCache cache;
+    // frames of a video close to the one the features were last computed on take them as they are
+    std::vector<std::string> gaps = {"gap0", "gap1", "gap2", "gap3"};
+    if (!process_se_temporal_load(inimage, gaps, devices))
+    {
+        std::vector<std::string> in0 = {};
+        std::vector<std::string> out0 = {"gap0", "gap1", "gap2", "gap3"};
+        ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_very_rough_stage0(inimage, in0, out0, devices[d].opt, devices[d].cache); });
 
-    std::vector<std::string> in0 = {};
-    std::vector<std::string> out0 = {"gap0", "gap1", "gap2", "gap3"};
-    process_se_stage0(inimage, in0, out0, opt, cache);
+        std::vector<std::string> gap0 = {"gap0", "gap1", "gap2", "gap3"};
+        if (ret == 0)
+            ret = process_se_sync_gap(inimage, gap0, true, devices);
 
-    std::vector<std::string> gap0 = {"gap0", "gap1", "gap2", "gap3"};
-    process_se_sync_gap(inimage, gap0, opt, cache);
+        if (ret == 0)
+            process_se_temporal_save(inimage, gaps, devices);
+    }
 
     std::vector<std::string> in4 = {"gap0", "gap1", "gap2", "gap3"};
-    process_se_stage2(inimage, in4, outimage, opt, cache);
+    if (ret == 0)
+        ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_stage2(inimage, in4, outimage, devices[d].opt, devices[d].cache, FrameBand(inimage.h)); });
 
-    cache.clear();
+    release_se_devices(devices);
 
-    vkdev->reclaim_blob_allocator(blob_vkallocator);
-    vkdev->reclaim_staging_allocator(staging_vkallocator);
+    return ret;
+}
 
-    return 0;
+int RealCUGAN::process_se_gaps(const ncnn::Mat& inimage, std::vector<SEDevice>& devices) const
+{
+    // the stage0 passes and sync gaps of process_se, process_se_rough or process_se_very_rough without stage2
+    int ret = 0;
+    if (syncgap == 1)
+    {
+        std::vector<std::string> in0 = {};
+        std::vector<std::string> out0 = {"gap0"};
+        ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_stage0(inimage, in0, out0, devices[d].opt, devices[d].cache); });
+
+        std::vector<std::string> gap0 = {"gap0"};
+        if (ret == 0)
+            ret = process_se_sync_gap(inimage, gap0, false, devices);
+
+        std::vector<std::string> in1 = {"gap0"};
+        std::vector<std::string> out1 = {"gap1"};
+        if (ret == 0)
+            ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_stage0(inimage, in1, out1, devices[d].opt, devices[d].cache); });
+
+        std::vector<std::string> gap1 = {"gap1"};
+        if (ret == 0)
+            ret = process_se_sync_gap(inimage, gap1, false, devices);
+
+        std::vector<std::string> in2 = {"gap0", "gap1"};
+        std::vector<std::string> out2 = {"gap2"};
+        if (ret == 0)
+            ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_stage0(inimage, in2, out2, devices[d].opt, devices[d].cache); });
+
+        std::vector<std::string> gap2 = {"gap2"};
+        if (ret == 0)
+            ret = process_se_sync_gap(inimage, gap2, false, devices);
+
+        std::vector<std::string> in3 = {"gap0", "gap1", "gap2"};
+        std::vector<std::string> out3 = {"gap3"};
+        if (ret == 0)
+            ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_stage0(inimage, in3, out3, devices[d].opt, devices[d].cache); });
+
+        std::vector<std::string> gap3 = {"gap3"};
+        if (ret == 0)
+            ret = process_se_sync_gap(inimage, gap3, false, devices);
+    }
+    if (syncgap == 2)
+    {
+        std::vector<std::string> in0 = {};
+        std::vector<std::string> out0 = {"gap0", "gap1", "gap2", "gap3"};
+        ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_stage0(inimage, in0, out0, devices[d].opt, devices[d].cache); });
+
+        std::vector<std::string> gap0 = {"gap0", "gap1", "gap2", "gap3"};
+        if (ret == 0)
+            ret = process_se_sync_gap(inimage, gap0, false, devices);
+    }
+    if (syncgap == 3)
+    {
+        std::vector<std::string> in0 = {};
+        std::vector<std::string> out0 = {"gap0", "gap1", "gap2", "gap3"};
+        ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_very_rough_stage0(inimage, in0, out0, devices[d].opt, devices[d].cache); });
+
+        std::vector<std::string> gap0 = {"gap0", "gap1", "gap2", "gap3"};
+        if (ret == 0)
+            ret = process_se_sync_gap(inimage, gap0, true, devices);
+    }
+
+    return ret;
 }
 
-int RealCUGAN::process_se_very_rough(const ncnn::Mat& inimage, ncnn::Mat& outimage) const
+void RealCUGAN::acquire_se_devices(std::vector<SEDevice>& devices) const
 {
-    ncnn::VkAllocator* blob_vkallocator = vkdev->acquire_blob_allocator();
-    ncnn::VkAllocator* staging_vkallocator = vkdev->acquire_staging_allocator();
+    devices.resize(peers.size() + 1);
 
-    ncnn::Option opt = net.opt;
-    opt.blob_vkallocator = blob_vkallocator;
-    opt.workspace_vkallocator = blob_vkallocator;
-    opt.staging_vkallocator = staging_vkallocator;
+    for (size_t d = 0; d < devices.size(); d++)
+    {
+        const RealCUGAN* realcugan = d == 0 ? this : peers[d - 1];
+
+        WorkerState* worker = realcugan->acquire_worker();
+        ncnn::VkAllocator* blob_vkallocator = worker->blob_vkallocator;
+        ncnn::VkAllocator* staging_vkallocator = worker->staging_vkallocator;
+
+        devices[d].realcugan = realcugan;
+        devices[d].worker = worker;
+        devices[d].opt = realcugan->net.opt;
+        devices[d].opt.blob_vkallocator = blob_vkallocator;
+        devices[d].opt.workspace_vkallocator = blob_vkallocator;
+        devices[d].opt.staging_vkallocator = staging_vkallocator;
+
+        // an eighth of the device heap by default, the tiles and their intermediates need the rest
+        size_t budget = realcugan->feature_cache_budget;
+        if (budget == 0 && realcugan->vkdev)
+            budget = (size_t)realcugan->vkdev->get_heap_budget() * 1024 * 1024 / 8;
+        devices[d].cache.budget = budget;
+
+        // pipeline_depth batches of the se passes in flight while the next one records
+        for (int i = 0; i < std::max(realcugan->pipeline_depth, 1) + 1; i++)
+        {
+            devices[d].cache.workers.push_back(realcugan->acquire_worker());
+        }
+    }
+}
 
-    FeatureCache cache;
+void RealCUGAN::release_se_devices(std::vector<SEDevice>& devices) const
+{
+    for (size_t d = 0; d < devices.size(); d++)
+    {
+        devices[d].realcugan->stats->peak(devices[d].realcugan->stats->feature_cache_peak_bytes, devices[d].cache.peak_bytes);
 
-    std::vector<std::string> in0 = {};
-    std::vector<std::string> out0 = {"gap0", "gap1", "gap2", "gap3"};
-    process_se_very_rough_stage0(inimage, in0, out0, opt, cache);
+        devices[d].cache.clear();
 
-    std::vector<std::string> gap0 = {"gap0", "gap1", "gap2", "gap3"};
-    process_se_very_rough_sync_gap(inimage, gap0, opt, cache);
+        for (size_t i = 0; i < devices[d].cache.workers.size(); i++)
+        {
+            devices[d].realcugan->release_worker(devices[d].cache.workers[i]);
+        }
+        devices[d].cache.workers.clear();
 
-    std::vector<std::string> in4 = {"gap0", "gap1", "gap2", "gap3"};
-    process_se_stage2(inimage, in4, outimage, opt, cache);
+        devices[d].realcugan->release_worker(devices[d].worker);
+    }
 
-    cache.clear();
+    devices.clear();
+}
+
+bool RealCUGAN::process_se_temporal_load(const ncnn::Mat& inimage, const std::vector<std::string>& names, std::vector<SEDevice>& devices) const
+{
+    if (temporal_threshold <= 0.f)
+        return false;
+
+    std::vector<float> thumbnail;
+    frame_thumbnail(inimage, thumbnail);
+
+    std::vector<ncnn::Mat> avgfeats;
+    {
+        ncnn::MutexLockGuard guard(temporal->lock);
+
+        float diff = temporal->distance(inimage, thumbnail, names, syncgap, tilesize, prepadding);
+        if (diff < 0.f || diff > temporal_threshold)
+            return false;
+
+        avgfeats = temporal->feats;
+    }
+
+    // the uploaded features land in every tile slot, as after a sync gap
+    int ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_gap_apply_host(inimage, names, avgfeats, devices[d].opt, devices[d].cache); });
+    if (ret != 0)
+        return false;
+
+    stats->add(stats->reused_frames, 1);
+
+    return true;
+}
+
+void RealCUGAN::process_se_temporal_save(const ncnn::Mat& inimage, const std::vector<std::string>& names, std::vector<SEDevice>& devices) const
+{
+    if (temporal_threshold <= 0.f)
+        return;
+
+    std::vector<ncnn::Mat> avgfeats;
+    if (process_se_gap_download(names, devices, avgfeats) != 0)
+        return;
+
+    std::vector<float> thumbnail;
+    frame_thumbnail(inimage, thumbnail);
+
+    ncnn::MutexLockGuard guard(temporal->lock);
+
+    temporal->w = inimage.w;
+    temporal->h = inimage.h;
+    temporal->channels = inimage.elempack;
+    temporal->syncgap = syncgap;
+    temporal->tilesize = tilesize;
+    temporal->prepadding = prepadding;
+    temporal->thumbnail = thumbnail;
+    temporal->names = names;
+    temporal->feats = avgfeats;
+}
+
+int RealCUGAN::process_se_gap_download(const std::vector<std::string>& names, std::vector<SEDevice>& devices, std::vector<ncnn::Mat>& avgfeats) const
+{
+    // after the last sync gap every tile holds the same averaged features, the first tile of the primary device is enough
+    ncnn::VkCompute cmd(vkdev);
+
+    avgfeats.resize(names.size());
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        ncnn::VkMat feat;
+        devices[0].cache.load(0, 0, 0, names[i], feat);
+        if (feat.empty())
+            return -1;
+
+        cmd.record_download(feat, avgfeats[i], devices[0].opt);
+    }
+
+    int ret = cmd.submit_and_wait();
+    if (ret != 0)
+        return ret;
+
+    // stored as plain fp32, the way the host sync gap hands them to upload
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        if (avgfeats[i].elembits() == 16)
+        {
+            ncnn::Mat feat_fp32;
+            ncnn::cast_float16_to_float32(avgfeats[i], feat_fp32, devices[0].opt);
+            avgfeats[i] = feat_fp32;
+        }
 
-    vkdev->reclaim_blob_allocator(blob_vkallocator);
-    vkdev->reclaim_staging_allocator(staging_vkallocator);
+        if (avgfeats[i].elempack != 1)
+        {
+            ncnn::Mat feat_unpacked;
+            ncnn::convert_packing(avgfeats[i], feat_unpacked, 1, devices[0].opt);
+            avgfeats[i] = feat_unpacked;
+        }
+    }
 
     return 0;
 }
@@ -1286,6 +3482,8 @@ int RealCUGAN::process_cpu_se(const ncnn::Mat& inimage, ncnn::Mat& outimage) con
     std::vector<std::string> in4 = {"gap0", "gap1", "gap2", "gap3"};
     process_cpu_se_stage2(inimage, in4, outimage, cache);
 
+    stats->peak(stats->feature_cache_peak_bytes, cache.peak_bytes);
+
     cache.clear();
 
     return 0;
@@ -1305,6 +3503,8 @@ int RealCUGAN::process_cpu_se_rough(const ncnn::Mat& inimage, ncnn::Mat& outimag
     std::vector<std::string> in4 = {"gap0", "gap1", "gap2", "gap3"};
     process_cpu_se_stage2(inimage, in4, outimage, cache);
 
+    stats->peak(stats->feature_cache_peak_bytes, cache.peak_bytes);
+
     cache.clear();
 
     return 0;
@@ -1324,30 +3524,42 @@ int RealCUGAN::process_cpu_se_very_rough(const ncnn::Mat& inimage, ncnn::Mat& ou
     std::vector<std::string> in4 = {"gap0", "gap1", "gap2", "gap3"};
     process_cpu_se_stage2(inimage, in4, outimage, cache);
 
+    stats->peak(stats->feature_cache_peak_bytes, cache.peak_bytes);
+
     cache.clear();
 
     return 0;
 }
 
-int RealCUGAN::process_se_stage0(const ncnn::Mat& inimage, const std::vector<std::string>& names, const std::vector<std::string>& outnames, const ncnn::Option& opt, FeatureCache& cache) const
+int RealCUGAN::process_se_stage0(const ncnn::Mat& inimage, const std::vector<std::string>& names, const std::vector<std::string>& outnames, const ncnn::Option& device_opt, FeatureCache& cache) const
 {
     const unsigned char* pixeldata = (const unsigned char*)inimage.data;
     const int w = inimage.w;
     const int h = inimage.h;
     const int channels = inimage.elempack;
 
-    const int TILE_SIZE_X = tilesize;
-    const int TILE_SIZE_Y = tilesize;
+    int TILE_SIZE_X;
+    int TILE_SIZE_Y;
+    plan_tiles(w, h, TILE_SIZE_X, TILE_SIZE_Y);
 
     // each tile 400x400
     const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
     const int ytiles = (h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
 
-    const size_t in_out_tile_elemsize = opt.use_fp16_storage ? 2u : 4u;
+    const size_t in_out_tile_elemsize = device_opt.use_fp16_storage ? 2u : 4u;
 
-    //#pragma omp parallel for num_threads(2)
-    for (int yi = 0; yi < ytiles; yi++)
+    SEBatch batch(cache.workers, device_opt, tta_mode ? tta_level : 1);
+
+    // a pass is counted once however many of its rows spill
+    bool spilled = false;
+
+    // rows are split between devices so that every device finds the features it cached itself
+    for (int yi = device_index; yi < ytiles; yi += device_count)
     {
+        // the worker of the batch this row is recorded into
+        ncnn::VkCompute& cmd = batch.cmd();
+        const ncnn::Option& opt = batch.opt();
+
         const int tile_h_nopad = std::min((yi + 1) * TILE_SIZE_Y, h) - yi * TILE_SIZE_Y;
 
         int prepadding_bottom = prepadding;
@@ -1388,18 +3600,12 @@ int RealCUGAN::process_se_stage0(const ncnn::Mat& inimage, const std::vector<std
             }
         }
 
-        ncnn::VkCompute cmd(vkdev);
-
         // upload
         ncnn::VkMat in_gpu;
         {
             cmd.record_clone(in, in_gpu, opt);
 
-            if (xtiles > 1)
-            {
-                cmd.submit_and_wait();
-                cmd.reset();
-            }
+            batch.hold(in_gpu);
         }
 
         int out_tile_y0 = std::max(yi * TILE_SIZE_Y, 0);
@@ -1441,14 +3647,14 @@ int RealCUGAN::process_se_stage0(const ncnn::Mat& inimage, const std::vector<std
                     int tile_y0 = yi * TILE_SIZE_Y - prepadding;
                     int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, h) + prepadding_bottom;
 
-                    in_tile_gpu[0].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[1].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[2].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[3].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[4].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[5].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[6].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[7].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
+                    // only the orientations of the tta level, the transposed ones swap width and height
+                    for (int ti = 0; ti < tta_level; ti++)
+                    {
+                        if (ti < 4)
+                            in_tile_gpu[ti].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
+                        else
+                            in_tile_gpu[ti].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
+                    }
 
                     if (channels == 4)
                     {
@@ -1467,7 +3673,7 @@ int RealCUGAN::process_se_stage0(const ncnn::Mat& inimage, const std::vector<std
                     bindings[8] = in_tile_gpu[7];
                     bindings[9] = in_alpha_tile_gpu;
 
-                    std::vector<ncnn::vk_constant_type> constants(13);
+                    std::vector<ncnn::vk_constant_type> constants(15);
                     constants[0].i = in_gpu.w;
                     constants[1].i = in_gpu.h;
                     constants[2].i = in_gpu.cstep;
@@ -1481,6 +3687,8 @@ int RealCUGAN::process_se_stage0(const ncnn::Mat& inimage, const std::vector<std
                     constants[10].i = channels;
                     constants[11].i = in_alpha_tile_gpu.w;
                     constants[12].i = in_alpha_tile_gpu.h;
+                    constants[13].i = REALCUGAN_FORMAT_PIXELS;
+                    constants[14].i = 0;
 
                     ncnn::VkMat dispatcher;
                     dispatcher.w = in_tile_gpu[0].w;
@@ -1488,11 +3696,13 @@ int RealCUGAN::process_se_stage0(const ncnn::Mat& inimage, const std::vector<std
                     dispatcher.c = channels;
 
                     cmd.record_pipeline(realcugan_preproc, bindings, constants, dispatcher);
+
+                    batch.hold(bindings);
                 }
 
                 // realcugan
                 ncnn::VkMat out_tile_gpu[8];
-                for (int ti = 0; ti < 8; ti++)
+                for (int ti = 0; ti < tta_level; ti++)
                 {
                     ncnn::Extractor ex = net.create_extractor();
 
@@ -1543,7 +3753,7 @@ int RealCUGAN::process_se_stage0(const ncnn::Mat& inimage, const std::vector<std
                     bindings[1] = in_tile_gpu;
                     bindings[2] = in_alpha_tile_gpu;
 
-                    std::vector<ncnn::vk_constant_type> constants(13);
+                    std::vector<ncnn::vk_constant_type> constants(15);
                     constants[0].i = in_gpu.w;
                     constants[1].i = in_gpu.h;
                     constants[2].i = in_gpu.cstep;
@@ -1557,6 +3767,8 @@ int RealCUGAN::process_se_stage0(const ncnn::Mat& inimage, const std::vector<std
                     constants[10].i = channels;
                     constants[11].i = in_alpha_tile_gpu.w;
                     constants[12].i = in_alpha_tile_gpu.h;
+                    constants[13].i = REALCUGAN_FORMAT_PIXELS;
+                    constants[14].i = 0;
 
                     ncnn::VkMat dispatcher;
                     dispatcher.w = in_tile_gpu.w;
@@ -1564,6 +3776,8 @@ int RealCUGAN::process_se_stage0(const ncnn::Mat& inimage, const std::vector<std
                     dispatcher.c = channels;
 
                     cmd.record_pipeline(realcugan_preproc, bindings, constants, dispatcher);
+
+                    batch.hold(bindings);
                 }
 
                 // realcugan
@@ -1593,40 +3807,65 @@ int RealCUGAN::process_se_stage0(const ncnn::Mat& inimage, const std::vector<std
                     }
                 }
             }
-
-            if (xtiles > 1)
-            {
-                cmd.submit_and_wait();
-                cmd.reset();
-            }
+
+            batch.tile();
         }
 
-        cmd.submit_and_wait();
-        cmd.reset();
+        int ret = batch.row();
+
+        // spilled rows have to be finished first
+        if (ret == 0 && cache.over_budget(outnames))
+        {
+            ret = batch.flush();
+            if (ret == 0)
+                ret = cache.spill(yi, outnames, cmd, opt);
+            if (ret == 0 && !spilled)
+                stats->add(stats->spilled_passes, 1);
+            spilled = true;
+        }
+        if (ret != 0)
+            return ret;
     }
 
-    return 0;
+    return batch.flush();
 }
 
-int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std::string>& names, ncnn::Mat& outimage, const ncnn::Option& opt, FeatureCache& cache) const
+int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std::string>& names, ncnn::Mat& outimage, const ncnn::Option& device_opt, FeatureCache& cache, const FrameBand& band) const
 {
     const unsigned char* pixeldata = (const unsigned char*)inimage.data;
     const int w = inimage.w;
     const int h = inimage.h;
     const int channels = inimage.elempack;
 
-    const int TILE_SIZE_X = tilesize;
-    const int TILE_SIZE_Y = tilesize;
+    int TILE_SIZE_X;
+    int TILE_SIZE_Y;
+    plan_tiles(w, h, TILE_SIZE_X, TILE_SIZE_Y);
 
     // each tile 400x400
     const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
     const int ytiles = (h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
 
-    const size_t in_out_tile_elemsize = opt.use_fp16_storage ? 2u : 4u;
+    // tiles run, all of them unless a region of interest is processed, outimage holds the rows from band.out_y0
+    const int xi0 = band.xi0;
+    const int xi1 = band.xi1 < 0 ? xtiles : std::min(band.xi1, xtiles);
+    const int yi1 = band.yi1 < 0 ? ytiles : std::min(band.yi1, ytiles);
 
-    //#pragma omp parallel for num_threads(2)
-    for (int yi = 0; yi < ytiles; yi++)
+    const size_t in_out_tile_elemsize = device_opt.use_fp16_storage ? 2u : 4u;
+
+    SEBatch batch(cache.workers, device_opt, tta_mode ? tta_level : 1);
+
+    // rows are split between devices so that every device finds the features it cached itself
+    for (int yi = device_index; yi < yi1; yi += device_count)
     {
+        if (yi < band.yi0)
+            continue;
+
+        // the worker of the batch this row is recorded into
+        ncnn::VkCompute& cmd = batch.cmd();
+        const ncnn::Option& opt = batch.opt();
+
+        stats->add(stats->tiles, xi1 - xi0);
+
         const int tile_h_nopad = std::min((yi + 1) * TILE_SIZE_Y, h) - yi * TILE_SIZE_Y;
 
         int prepadding_bottom = prepadding;
@@ -1667,18 +3906,12 @@ int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std
             }
         }
 
-        ncnn::VkCompute cmd(vkdev);
-
         // upload
         ncnn::VkMat in_gpu;
         {
             cmd.record_clone(in, in_gpu, opt);
 
-            if (xtiles > 1)
-            {
-                cmd.submit_and_wait();
-                cmd.reset();
-            }
+            batch.hold(in_gpu);
         }
 
         int out_tile_y0 = std::max(yi * TILE_SIZE_Y, 0);
@@ -1694,7 +3927,7 @@ int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std
             out_gpu.create(w * scale, (out_tile_y1 - out_tile_y0) * scale, channels, (size_t)4u, 1, opt.blob_vkallocator);
         }
 
-        for (int xi = 0; xi < xtiles; xi++)
+        for (int xi = xi0; xi < xi1; xi++)
         {
             const int tile_w_nopad = std::min((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X;
 
@@ -1720,14 +3953,14 @@ int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std
                     int tile_y0 = yi * TILE_SIZE_Y - prepadding;
                     int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, h) + prepadding_bottom;
 
-                    in_tile_gpu[0].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[1].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[2].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[3].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[4].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[5].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[6].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[7].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
+                    // only the orientations of the tta level, the transposed ones swap width and height
+                    for (int ti = 0; ti < tta_level; ti++)
+                    {
+                        if (ti < 4)
+                            in_tile_gpu[ti].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
+                        else
+                            in_tile_gpu[ti].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
+                    }
 
                     if (channels == 4)
                     {
@@ -1746,7 +3979,7 @@ int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std
                     bindings[8] = in_tile_gpu[7];
                     bindings[9] = in_alpha_tile_gpu;
 
-                    std::vector<ncnn::vk_constant_type> constants(13);
+                    std::vector<ncnn::vk_constant_type> constants(15);
                     constants[0].i = in_gpu.w;
                     constants[1].i = in_gpu.h;
                     constants[2].i = in_gpu.cstep;
@@ -1760,6 +3993,8 @@ int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std
                     constants[10].i = channels;
                     constants[11].i = in_alpha_tile_gpu.w;
                     constants[12].i = in_alpha_tile_gpu.h;
+                    constants[13].i = REALCUGAN_FORMAT_PIXELS;
+                    constants[14].i = 0;
 
                     ncnn::VkMat dispatcher;
                     dispatcher.w = in_tile_gpu[0].w;
@@ -1767,11 +4002,13 @@ int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std
                     dispatcher.c = channels;
 
                     cmd.record_pipeline(realcugan_preproc, bindings, constants, dispatcher);
+
+                    batch.hold(bindings);
                 }
 
                 // realcugan
                 ncnn::VkMat out_tile_gpu[8];
-                for (int ti = 0; ti < 8; ti++)
+                for (int ti = 0; ti < tta_level; ti++)
                 {
                     ncnn::Extractor ex = net.create_extractor();
 
@@ -1792,27 +4029,6 @@ int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std
                     ex.extract("out0", out_tile_gpu[ti], cmd);
                 }
 
-                ncnn::VkMat out_alpha_tile_gpu;
-                if (channels == 4)
-                {
-                    if (scale == 1)
-                    {
-                        out_alpha_tile_gpu = in_alpha_tile_gpu;
-                    }
-                    if (scale == 2)
-                    {
-                        bicubic_2x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
-                    }
-                    if (scale == 3)
-                    {
-                        bicubic_3x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
-                    }
-                    if (scale == 4)
-                    {
-                        bicubic_4x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
-                    }
-                }
-
                 // postproc
                 if (scale == 4)
                 {
@@ -1826,10 +4042,10 @@ int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std
                     bindings[6] = out_tile_gpu[5];
                     bindings[7] = out_tile_gpu[6];
                     bindings[8] = out_tile_gpu[7];
-                    bindings[9] = out_alpha_tile_gpu;
+                    bindings[9] = in_alpha_tile_gpu;
                     bindings[10] = out_gpu;
 
-                    std::vector<ncnn::vk_constant_type> constants(16);
+                    std::vector<ncnn::vk_constant_type> constants(19);
                     constants[0].i = in_gpu.w;
                     constants[1].i = in_gpu.h;
                     constants[2].i = in_gpu.cstep;
@@ -1844,8 +4060,11 @@ int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std
                     constants[11].i = xi * TILE_SIZE_X * scale;
                     constants[12].i = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
                     constants[13].i = channels;
-                    constants[14].i = out_alpha_tile_gpu.w;
-                    constants[15].i = out_alpha_tile_gpu.h;
+                    constants[14].i = in_alpha_tile_gpu.w;
+                    constants[15].i = in_alpha_tile_gpu.h;
+                    constants[16].i = scale;
+                    constants[17].i = REALCUGAN_FORMAT_PIXELS;
+                    constants[18].i = 0;
 
                     ncnn::VkMat dispatcher;
                     dispatcher.w = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
@@ -1853,6 +4072,8 @@ int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std
                     dispatcher.c = channels;
 
                     cmd.record_pipeline(realcugan_4x_postproc, bindings, constants, dispatcher);
+
+                    batch.hold(bindings);
                 }
                 else
                 {
@@ -1865,10 +4086,10 @@ int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std
                     bindings[5] = out_tile_gpu[5];
                     bindings[6] = out_tile_gpu[6];
                     bindings[7] = out_tile_gpu[7];
-                    bindings[8] = out_alpha_tile_gpu;
+                    bindings[8] = in_alpha_tile_gpu;
                     bindings[9] = out_gpu;
 
-                    std::vector<ncnn::vk_constant_type> constants(11);
+                    std::vector<ncnn::vk_constant_type> constants(13);
                     constants[0].i = out_tile_gpu[0].w;
                     constants[1].i = out_tile_gpu[0].h;
                     constants[2].i = out_tile_gpu[0].cstep;
@@ -1878,8 +4099,10 @@ int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std
                     constants[6].i = xi * TILE_SIZE_X * scale;
                     constants[7].i = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
                     constants[8].i = channels;
-                    constants[9].i = out_alpha_tile_gpu.w;
-                    constants[10].i = out_alpha_tile_gpu.h;
+                    constants[9].i = in_alpha_tile_gpu.w;
+                    constants[10].i = in_alpha_tile_gpu.h;
+                    constants[11].i = scale;
+                    constants[12].i = REALCUGAN_FORMAT_PIXELS;
 
                     ncnn::VkMat dispatcher;
                     dispatcher.w = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
@@ -1887,6 +4110,8 @@ int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std
                     dispatcher.c = channels;
 
                     cmd.record_pipeline(realcugan_postproc, bindings, constants, dispatcher);
+
+                    batch.hold(bindings);
                 }
             }
             else
@@ -1913,7 +4138,7 @@ int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std
                     bindings[1] = in_tile_gpu;
                     bindings[2] = in_alpha_tile_gpu;
 
-                    std::vector<ncnn::vk_constant_type> constants(13);
+                    std::vector<ncnn::vk_constant_type> constants(15);
                     constants[0].i = in_gpu.w;
                     constants[1].i = in_gpu.h;
                     constants[2].i = in_gpu.cstep;
@@ -1927,6 +4152,8 @@ int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std
                     constants[10].i = channels;
                     constants[11].i = in_alpha_tile_gpu.w;
                     constants[12].i = in_alpha_tile_gpu.h;
+                    constants[13].i = REALCUGAN_FORMAT_PIXELS;
+                    constants[14].i = 0;
 
                     ncnn::VkMat dispatcher;
                     dispatcher.w = in_tile_gpu.w;
@@ -1934,6 +4161,8 @@ int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std
                     dispatcher.c = channels;
 
                     cmd.record_pipeline(realcugan_preproc, bindings, constants, dispatcher);
+
+                    batch.hold(bindings);
                 }
 
                 // realcugan
@@ -1958,201 +4187,524 @@ int RealCUGAN::process_se_stage2(const ncnn::Mat& inimage, const std::vector<std
                     ex.extract("out0", out_tile_gpu, cmd);
                 }
 
-                ncnn::VkMat out_alpha_tile_gpu;
+                // postproc
+                if (scale == 4)
+                {
+                    std::vector<ncnn::VkMat> bindings(4);
+                    bindings[0] = in_gpu;
+                    bindings[1] = out_tile_gpu;
+                    bindings[2] = in_alpha_tile_gpu;
+                    bindings[3] = out_gpu;
+
+                    std::vector<ncnn::vk_constant_type> constants(19);
+                    constants[0].i = in_gpu.w;
+                    constants[1].i = in_gpu.h;
+                    constants[2].i = in_gpu.cstep;
+                    constants[3].i = out_tile_gpu.w;
+                    constants[4].i = out_tile_gpu.h;
+                    constants[5].i = out_tile_gpu.cstep;
+                    constants[6].i = out_gpu.w;
+                    constants[7].i = out_gpu.h;
+                    constants[8].i = out_gpu.cstep;
+                    constants[9].i = xi * TILE_SIZE_X;
+                    constants[10].i = std::min(yi * TILE_SIZE_Y, prepadding);
+                    constants[11].i = xi * TILE_SIZE_X * scale;
+                    constants[12].i = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
+                    constants[13].i = channels;
+                    constants[14].i = in_alpha_tile_gpu.w;
+                    constants[15].i = in_alpha_tile_gpu.h;
+                    constants[16].i = scale;
+                    constants[17].i = REALCUGAN_FORMAT_PIXELS;
+                    constants[18].i = 0;
+
+                    ncnn::VkMat dispatcher;
+                    dispatcher.w = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
+                    dispatcher.h = out_gpu.h;
+                    dispatcher.c = channels;
+
+                    cmd.record_pipeline(realcugan_4x_postproc, bindings, constants, dispatcher);
+
+                    batch.hold(bindings);
+                }
+                else
+                {
+                    std::vector<ncnn::VkMat> bindings(3);
+                    bindings[0] = out_tile_gpu;
+                    bindings[1] = in_alpha_tile_gpu;
+                    bindings[2] = out_gpu;
+
+                    std::vector<ncnn::vk_constant_type> constants(13);
+                    constants[0].i = out_tile_gpu.w;
+                    constants[1].i = out_tile_gpu.h;
+                    constants[2].i = out_tile_gpu.cstep;
+                    constants[3].i = out_gpu.w;
+                    constants[4].i = out_gpu.h;
+                    constants[5].i = out_gpu.cstep;
+                    constants[6].i = xi * TILE_SIZE_X * scale;
+                    constants[7].i = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
+                    constants[8].i = channels;
+                    constants[9].i = in_alpha_tile_gpu.w;
+                    constants[10].i = in_alpha_tile_gpu.h;
+                    constants[11].i = scale;
+                    constants[12].i = REALCUGAN_FORMAT_PIXELS;
+
+                    ncnn::VkMat dispatcher;
+                    dispatcher.w = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
+                    dispatcher.h = out_gpu.h;
+                    dispatcher.c = channels;
+
+                    cmd.record_pipeline(realcugan_postproc, bindings, constants, dispatcher);
+
+                    batch.hold(bindings);
+                }
+            }
+
+            batch.tile();
+        }
+
+        // download
+        {
+            ncnn::Mat out;
+
+            if (opt.use_fp16_storage && opt.use_int8_storage)
+            {
+                out = ncnn::Mat(out_gpu.w, out_gpu.h, (unsigned char*)outimage.data + (yi * scale * TILE_SIZE_Y - band.out_y0) * w * scale * channels, (size_t)channels, 1);
+            }
+
+            cmd.record_clone(out_gpu, out, opt);
+
+            if (!(opt.use_fp16_storage && opt.use_int8_storage))
+            {
+                unsigned char* outrow = (unsigned char*)outimage.data + (yi * scale * TILE_SIZE_Y - band.out_y0) * w * scale * channels;
+                if (channels == 3)
+                {
+#if _WIN32
+                    batch.to_pixels(out, outrow, ncnn::Mat::PIXEL_RGB2BGR);
+#else
+                    batch.to_pixels(out, outrow, ncnn::Mat::PIXEL_RGB);
+#endif
+                }
                 if (channels == 4)
                 {
-                    if (scale == 1)
-                    {
-                        out_alpha_tile_gpu = in_alpha_tile_gpu;
-                    }
-                    if (scale == 2)
-                    {
-                        bicubic_2x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
-                    }
-                    if (scale == 3)
+#if _WIN32
+                    batch.to_pixels(out, outrow, ncnn::Mat::PIXEL_RGBA2BGRA);
+#else
+                    batch.to_pixels(out, outrow, ncnn::Mat::PIXEL_RGBA);
+#endif
+                }
+            }
+        }
+
+        // the row goes to the pixels once its batch completes, the next rows record meanwhile
+        int ret = batch.row();
+        if (ret != 0)
+            return ret;
+    }
+
+    return batch.flush();
+}
+
+int RealCUGAN::process_se_sync_gap(const ncnn::Mat& inimage, const std::vector<std::string>& names, bool very_rough, std::vector<SEDevice>& devices) const
+{
+    StageScope scope(stats, REALCUGAN_STAGE_SYNC_GAP);
+
+    // fp16 packed without fp16 storage keeps two halves per float, the reduction shader reads plain scalars
+    if (net.opt.use_fp16_packed && !net.opt.use_fp16_storage)
+        return process_se_sync_gap_host(inimage, names, very_rough, devices);
+
+    // rows spilled out of vram are summed on the host next to the downloads of the resident ones
+    for (size_t d = 0; d < devices.size(); d++)
+    {
+        if (devices[d].cache.spilled)
+            return process_se_sync_gap_host(inimage, names, very_rough, devices);
+    }
+
+    // every device sums up the features of the tiles it owns on the gpu
+    std::vector< std::vector<ncnn::VkMat> > sums(devices.size());
+    std::vector< std::vector<ncnn::VkMat> > shapes(devices.size());
+    std::vector<int> counts(devices.size(), 0);
+
+    int ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_gap_sum(inimage, names, very_rough, devices[d].opt, devices[d].cache, sums[d], shapes[d], counts[d]); });
+    if (ret != 0)
+        return ret;
+
+    int tiles = 0;
+    for (size_t d = 0; d < devices.size(); d++)
+    {
+        tiles += counts[d];
+    }
+
+    if (tiles == 0)
+        return -1;
+
+    if (devices.size() > 1)
+    {
+        // combine the partial sums through the host, one small fp32 vector per gap and device
+        std::vector< std::vector<ncnn::Mat> > sums_cpu(devices.size());
+
+        ret = for_each_device(devices, [&](size_t d) -> int {
+            if (counts[d] == 0)
+                return 0;
+
+            ncnn::VkCompute cmd(devices[d].realcugan->vkdev);
+
+            sums_cpu[d].resize(names.size());
+            for (size_t i = 0; i < names.size(); i++)
+            {
+                cmd.record_clone(sums[d][i], sums_cpu[d][i], devices[d].opt);
+            }
+
+            return cmd.submit_and_wait();
+        });
+        if (ret != 0)
+            return ret;
+
+        std::vector<ncnn::Mat> totals(names.size());
+        std::vector<ncnn::VkMat> shape(names.size());
+        for (size_t d = 0; d < devices.size(); d++)
+        {
+            if (counts[d] == 0)
+                continue;
+
+            for (size_t i = 0; i < names.size(); i++)
+            {
+                if (totals[i].empty())
+                {
+                    totals[i] = sums_cpu[d][i];
+                    shape[i] = shapes[d][i];
+                    continue;
+                }
+
+                const ncnn::Mat f = sums_cpu[d][i];
+
+                int len = totals[i].total();
+
+                for (int k = 0; k < len; k++)
+                {
+                    totals[i][k] += f[k];
+                }
+            }
+        }
+
+        ret = for_each_device(devices, [&](size_t d) -> int {
+            ncnn::VkCompute cmd(devices[d].realcugan->vkdev);
+
+            sums[d].resize(names.size());
+            shapes[d] = shape;
+            for (size_t i = 0; i < names.size(); i++)
+            {
+                cmd.record_clone(totals[i], sums[d][i], devices[d].opt);
+            }
+
+            return cmd.submit_and_wait();
+        });
+        if (ret != 0)
+            return ret;
+    }
+
+    const float scale = 1.f / tiles;
+
+    return for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_gap_apply(inimage, names, sums[d], shapes[d], scale, devices[d].opt, devices[d].cache); });
+}
+
+int RealCUGAN::process_se_gap_sum(const ncnn::Mat& inimage, const std::vector<std::string>& names, bool very_rough, const ncnn::Option& opt, FeatureCache& cache, std::vector<ncnn::VkMat>& sums, std::vector<ncnn::VkMat>& shapes, int& tiles) const
+{
+    const int w = inimage.w;
+    const int h = inimage.h;
+
+    int TILE_SIZE_X = 32;
+    int TILE_SIZE_Y = 32;
+    if (!very_rough)
+        plan_tiles(w, h, TILE_SIZE_X, TILE_SIZE_Y);
+
+    // very rough stage0 only visits every third tile in both directions
+    const int step = very_rough ? 3 : 1;
+
+    // each tile 400x400
+    const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
+    const int ytiles = (h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
+
+    std::vector< std::vector<ncnn::VkMat> > feats(names.size());
+    for (int yi = step * device_index; yi + step - 1 < ytiles; yi += step * device_count)
+    {
+        for (int xi = 0; xi + step - 1 < xtiles; xi += step)
+        {
+            {
+                for (size_t i = 0; i < names.size(); i++)
+                {
+                    if (tta_mode)
+                    {
+                        for (int ti = 0; ti < tta_level; ti++)
+                        {
+                            ncnn::VkMat feat;
+                            cache.load(yi, xi, ti, names[i], feat);
+
+                            feats[i].push_back(feat);
+                        }
+                    }
+                    else
+                    {
+                        ncnn::VkMat feat;
+                        cache.load(yi, xi, 0, names[i], feat);
+
+                        feats[i].push_back(feat);
+                    }
+                }
+            }
+        }
+    }
+
+    sums.resize(names.size());
+    shapes.resize(names.size());
+
+    tiles = names.empty() ? 0 : (int)feats[0].size();
+    if (tiles == 0)
+        return 0;
+
+    ncnn::VkCompute cmd(vkdev);
+
+    // sum in fp32 on the gpu, the features never leave the device
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        shapes[i] = feats[i][0];
+
+        const int size = (int)(feats[i][0].total() * feats[i][0].elempack);
+
+        sums[i].create(size, (size_t)4u, 1, opt.blob_vkallocator);
+
+        for (int j = 0; j < tiles; j++)
+        {
+            std::vector<ncnn::VkMat> bindings(3);
+            bindings[0] = feats[i][j];
+            bindings[1] = sums[i];
+
+            std::vector<ncnn::vk_constant_type> constants(3);
+            constants[0].i = size;
+            constants[1].i = j == 0 ? 0 : 1;
+            constants[2].f = 1.f;
+
+            ncnn::VkMat dispatcher;
+            dispatcher.w = size;
+            dispatcher.h = 1;
+            dispatcher.c = 1;
+
+            cmd.record_pipeline(realcugan_feature_avg, bindings, constants, dispatcher);
+        }
+    }
+
+    return cmd.submit_and_wait();
+}
+
+int RealCUGAN::process_se_gap_apply(const ncnn::Mat& inimage, const std::vector<std::string>& names, const std::vector<ncnn::VkMat>& sums, const std::vector<ncnn::VkMat>& shapes, float scale, const ncnn::Option& opt, FeatureCache& cache) const
+{
+    const int w = inimage.w;
+    const int h = inimage.h;
+
+    int TILE_SIZE_X;
+    int TILE_SIZE_Y;
+    plan_tiles(w, h, TILE_SIZE_X, TILE_SIZE_Y);
+
+    // each tile 400x400
+    const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
+    const int ytiles = (h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
+
+    ncnn::VkCompute cmd(vkdev);
+
+    // average back into the layout of the features
+    std::vector<ncnn::VkMat> avgfeats(names.size());
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        avgfeats[i].create_like(shapes[i], opt.blob_vkallocator);
+
+        std::vector<ncnn::VkMat> bindings(3);
+        bindings[1] = sums[i];
+        bindings[2] = avgfeats[i];
+
+        std::vector<ncnn::vk_constant_type> constants(3);
+        constants[0].i = sums[i].w;
+        constants[1].i = 2;
+        constants[2].f = scale;
+
+        ncnn::VkMat dispatcher;
+        dispatcher.w = sums[i].w;
+        dispatcher.h = 1;
+        dispatcher.c = 1;
+
+        cmd.record_pipeline(realcugan_feature_avg, bindings, constants, dispatcher);
+    }
+
+    int ret = cmd.submit_and_wait();
+    cmd.reset();
+    if (ret != 0)
+        return ret;
+
+    // the averaged features are shared by every tile row the following passes run on this device
+    for (int yi = device_index; yi < ytiles; yi += device_count)
+    {
+        for (int xi = 0; xi < xtiles; xi++)
+        {
+            {
+                for (size_t i = 0; i < names.size(); i++)
+                {
+                    if (tta_mode)
                     {
-                        bicubic_3x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
+                        for (int ti = 0; ti < tta_level; ti++)
+                        {
+                            cache.save(yi, xi, ti, names[i], avgfeats[i]);
+                        }
                     }
-                    if (scale == 4)
+                    else
                     {
-                        bicubic_4x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
+                        cache.save(yi, xi, 0, names[i], avgfeats[i]);
                     }
                 }
+            }
+        }
+    }
 
-                // postproc
-                if (scale == 4)
-                {
-                    std::vector<ncnn::VkMat> bindings(4);
-                    bindings[0] = in_gpu;
-                    bindings[1] = out_tile_gpu;
-                    bindings[2] = out_alpha_tile_gpu;
-                    bindings[3] = out_gpu;
-
-                    std::vector<ncnn::vk_constant_type> constants(16);
-                    constants[0].i = in_gpu.w;
-                    constants[1].i = in_gpu.h;
-                    constants[2].i = in_gpu.cstep;
-                    constants[3].i = out_tile_gpu.w;
-                    constants[4].i = out_tile_gpu.h;
-                    constants[5].i = out_tile_gpu.cstep;
-                    constants[6].i = out_gpu.w;
-                    constants[7].i = out_gpu.h;
-                    constants[8].i = out_gpu.cstep;
-                    constants[9].i = xi * TILE_SIZE_X;
-                    constants[10].i = std::min(yi * TILE_SIZE_Y, prepadding);
-                    constants[11].i = xi * TILE_SIZE_X * scale;
-                    constants[12].i = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    constants[13].i = channels;
-                    constants[14].i = out_alpha_tile_gpu.w;
-                    constants[15].i = out_alpha_tile_gpu.h;
+    return 0;
+}
 
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    dispatcher.h = out_gpu.h;
-                    dispatcher.c = channels;
+int RealCUGAN::process_se_sync_gap_host(const ncnn::Mat& inimage, const std::vector<std::string>& names, bool very_rough, std::vector<SEDevice>& devices) const
+{
+    stats->add(stats->host_sync_gaps, 1);
 
-                    cmd.record_pipeline(realcugan_4x_postproc, bindings, constants, dispatcher);
-                }
-                else
-                {
-                    std::vector<ncnn::VkMat> bindings(3);
-                    bindings[0] = out_tile_gpu;
-                    bindings[1] = out_alpha_tile_gpu;
-                    bindings[2] = out_gpu;
+    // every device sums up the features of the tiles it owns
+    std::vector< std::vector<ncnn::Mat> > sums(devices.size());
+    std::vector<int> counts(devices.size(), 0);
 
-                    std::vector<ncnn::vk_constant_type> constants(11);
-                    constants[0].i = out_tile_gpu.w;
-                    constants[1].i = out_tile_gpu.h;
-                    constants[2].i = out_tile_gpu.cstep;
-                    constants[3].i = out_gpu.w;
-                    constants[4].i = out_gpu.h;
-                    constants[5].i = out_gpu.cstep;
-                    constants[6].i = xi * TILE_SIZE_X * scale;
-                    constants[7].i = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    constants[8].i = channels;
-                    constants[9].i = out_alpha_tile_gpu.w;
-                    constants[10].i = out_alpha_tile_gpu.h;
+    int ret = for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_gap_sum_host(inimage, names, very_rough, devices[d].opt, devices[d].cache, sums[d], counts[d]); });
+    if (ret != 0)
+        return ret;
 
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    dispatcher.h = out_gpu.h;
-                    dispatcher.c = channels;
+    int tiles = 0;
+    for (size_t d = 0; d < devices.size(); d++)
+    {
+        tiles += counts[d];
+    }
 
-                    cmd.record_pipeline(realcugan_postproc, bindings, constants, dispatcher);
-                }
-            }
+    if (tiles == 0)
+        return -1;
 
-            if (xtiles > 1)
-            {
-                cmd.submit_and_wait();
-                cmd.reset();
-            }
-        }
+    // global average
+    std::vector<ncnn::Mat> avgfeats(names.size());
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        ncnn::Mat avgfeat;
 
-        // download
+        for (size_t d = 0; d < devices.size(); d++)
         {
-            ncnn::Mat out;
+            if (counts[d] == 0)
+                continue;
 
-            if (opt.use_fp16_storage && opt.use_int8_storage)
+            if (avgfeat.empty())
             {
-                out = ncnn::Mat(out_gpu.w, out_gpu.h, (unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels, (size_t)channels, 1);
+                avgfeat = sums[d][i];
+                continue;
             }
 
-            cmd.record_clone(out_gpu, out, opt);
+            const ncnn::Mat f = sums[d][i];
 
-            cmd.submit_and_wait();
+            int len = avgfeat.total();
 
-            if (!(opt.use_fp16_storage && opt.use_int8_storage))
+            for (int k = 0; k < len; k++)
             {
-                if (channels == 3)
-                {
-#if _WIN32
-                    out.to_pixels((unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels, ncnn::Mat::PIXEL_RGB2BGR);
-#else
-                    out.to_pixels((unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels, ncnn::Mat::PIXEL_RGB);
-#endif
-                }
-                if (channels == 4)
-                {
-#if _WIN32
-                    out.to_pixels((unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels, ncnn::Mat::PIXEL_RGBA2BGRA);
-#else
-                    out.to_pixels((unsigned char*)outimage.data + yi * scale * TILE_SIZE_Y * w * scale * channels, ncnn::Mat::PIXEL_RGBA);
-#endif
-                }
+                avgfeat[k] += f[k];
             }
         }
+
+        int len = avgfeat.total();
+
+        for (int k = 0; k < len; k++)
+        {
+            avgfeat[k] /= tiles;
+        }
+
+        avgfeats[i] = avgfeat;
     }
 
-    return 0;
+    return for_each_device(devices, [&](size_t d) { return devices[d].realcugan->process_se_gap_apply_host(inimage, names, avgfeats, devices[d].opt, devices[d].cache); });
 }
 
-int RealCUGAN::process_se_sync_gap(const ncnn::Mat& inimage, const std::vector<std::string>& names, const ncnn::Option& opt, FeatureCache& cache) const
+int RealCUGAN::process_se_gap_sum_host(const ncnn::Mat& inimage, const std::vector<std::string>& names, bool very_rough, const ncnn::Option& opt, FeatureCache& cache, std::vector<ncnn::Mat>& sums, int& tiles) const
 {
-    const unsigned char* pixeldata = (const unsigned char*)inimage.data;
     const int w = inimage.w;
     const int h = inimage.h;
-    const int channels = inimage.elempack;
 
-    const int TILE_SIZE_X = tilesize;
-    const int TILE_SIZE_Y = tilesize;
+    int TILE_SIZE_X = 32;
+    int TILE_SIZE_Y = 32;
+    if (!very_rough)
+        plan_tiles(w, h, TILE_SIZE_X, TILE_SIZE_Y);
+
+    // very rough stage0 only visits every third tile in both directions
+    const int step = very_rough ? 3 : 1;
 
     // each tile 400x400
     const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
     const int ytiles = (h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
 
+    // spilled tiles are already in host memory and leave an empty gpu slot
     std::vector< std::vector<ncnn::VkMat> > feats(names.size());
-    for (int yi = 0; yi < ytiles; yi++)
+    std::vector< std::vector<ncnn::Mat> > feats_cpu(names.size());
+    for (int yi = step * device_index; yi + step - 1 < ytiles; yi += step * device_count)
     {
-        for (int xi = 0; xi < xtiles; xi++)
+        for (int xi = 0; xi + step - 1 < xtiles; xi += step)
         {
             {
                 for (size_t i = 0; i < names.size(); i++)
                 {
                     if (tta_mode)
                     {
-                        for (int ti = 0; ti < 8; ti++)
+                        for (int ti = 0; ti < tta_level; ti++)
                         {
                             ncnn::VkMat feat;
-                            cache.load(yi, xi, ti, names[i], feat);
+                            ncnn::Mat feat_cpu;
+                            if (!cache.load_spilled(yi, xi, ti, names[i], feat_cpu))
+                                cache.load(yi, xi, ti, names[i], feat);
 
                             feats[i].push_back(feat);
+                            feats_cpu[i].push_back(feat_cpu);
                         }
                     }
                     else
                     {
                         ncnn::VkMat feat;
-                        cache.load(yi, xi, 0, names[i], feat);
+                        ncnn::Mat feat_cpu;
+                        if (!cache.load_spilled(yi, xi, 0, names[i], feat_cpu))
+                            cache.load(yi, xi, 0, names[i], feat);
 
                         feats[i].push_back(feat);
+                        feats_cpu[i].push_back(feat_cpu);
                     }
                 }
             }
         }
     }
 
-    const int tiles = ytiles * xtiles * (tta_mode ? 8 : 1);
+    sums.resize(names.size());
+
+    tiles = names.empty() ? 0 : (int)feats[0].size();
+    if (tiles == 0)
+        return 0;
 
     ncnn::VkCompute cmd(vkdev);
 
     // download
-    std::vector< std::vector<ncnn::Mat> > feats_cpu(names.size());
     for (size_t i = 0; i < names.size(); i++)
     {
-        feats_cpu[i].resize(tiles);
-
         for (int j = 0; j < tiles; j++)
         {
-            cmd.record_download(feats[i][j], feats_cpu[i][j], opt);
+            if (feats_cpu[i][j].empty())
+                cmd.record_download(feats[i][j], feats_cpu[i][j], opt);
         }
     }
 
-    cmd.submit_and_wait();
+    int ret = cmd.submit_and_wait();
     cmd.reset();
+    if (ret != 0)
+        return ret;
 
-    // global average
-    // upload
-    std::vector<ncnn::VkMat> avgfeats(names.size());
+    // partial sum
     for (size_t i = 0; i < names.size(); i++)
     {
         for (int j = 0; j < tiles; j++)
@@ -2174,11 +4726,11 @@ int RealCUGAN::process_se_sync_gap(const ncnn::Mat& inimage, const std::vector<s
 
         // handle feats_cpu[i] vector
         {
-            ncnn::Mat avgfeat;
-            avgfeat.create_like(feats_cpu[i][0]);
-            avgfeat.fill(0.f);
+            ncnn::Mat sumfeat;
+            sumfeat.create_like(feats_cpu[i][0]);
+            sumfeat.fill(0.f);
 
-            int len = avgfeat.total();
+            int len = sumfeat.total();
 
             for (int j = 0; j < tiles; j++)
             {
@@ -2186,24 +4738,46 @@ int RealCUGAN::process_se_sync_gap(const ncnn::Mat& inimage, const std::vector<s
 
                 for (int k = 0; k < len; k++)
                 {
-                    avgfeat[k] += f[k];
+                    sumfeat[k] += f[k];
                 }
             }
 
-            for (int k = 0; k < len; k++)
-            {
-                avgfeat[k] /= tiles;
-            }
-
-            cmd.record_upload(avgfeat, avgfeats[i], opt);
+            sums[i] = sumfeat;
         }
     }
 
-    cmd.submit_and_wait();
-    cmd.reset();
+    return 0;
+}
+
+int RealCUGAN::process_se_gap_apply_host(const ncnn::Mat& inimage, const std::vector<std::string>& names, const std::vector<ncnn::Mat>& avgfeats_cpu, const ncnn::Option& opt, FeatureCache& cache) const
+{
+    const int w = inimage.w;
+    const int h = inimage.h;
 
+    int TILE_SIZE_X;
+    int TILE_SIZE_Y;
+    plan_tiles(w, h, TILE_SIZE_X, TILE_SIZE_Y);
 
-    for (int yi = 0; yi < ytiles; yi++)
+    // each tile 400x400
+    const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
+    const int ytiles = (h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
+
+    ncnn::VkCompute cmd(vkdev);
+
+    // upload
+    std::vector<ncnn::VkMat> avgfeats(names.size());
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        cmd.record_upload(avgfeats_cpu[i], avgfeats[i], opt);
+    }
+
+    int ret = cmd.submit_and_wait();
+    cmd.reset();
+    if (ret != 0)
+        return ret;
+
+    // the averaged features are shared by every tile row the following passes run on this device
+    for (int yi = device_index; yi < ytiles; yi += device_count)
     {
         for (int xi = 0; xi < xtiles; xi++)
         {
@@ -2212,7 +4786,7 @@ int RealCUGAN::process_se_sync_gap(const ncnn::Mat& inimage, const std::vector<s
                 {
                     if (tta_mode)
                     {
-                        for (int ti = 0; ti < 8; ti++)
+                        for (int ti = 0; ti < tta_level; ti++)
                         {
                             cache.save(yi, xi, ti, names[i], avgfeats[i]);
                         }
@@ -2226,10 +4800,12 @@ int RealCUGAN::process_se_sync_gap(const ncnn::Mat& inimage, const std::vector<s
         }
     }
 
+    cache.drop_spilled(names);
+
     return 0;
 }
 
-int RealCUGAN::process_se_very_rough_stage0(const ncnn::Mat& inimage, const std::vector<std::string>& names, const std::vector<std::string>& outnames, const ncnn::Option& opt, FeatureCache& cache) const
+int RealCUGAN::process_se_very_rough_stage0(const ncnn::Mat& inimage, const std::vector<std::string>& names, const std::vector<std::string>& outnames, const ncnn::Option& device_opt, FeatureCache& cache) const
 {
     const unsigned char* pixeldata = (const unsigned char*)inimage.data;
     const int w = inimage.w;
@@ -2243,11 +4819,20 @@ int RealCUGAN::process_se_very_rough_stage0(const ncnn::Mat& inimage, const std:
     const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
     const int ytiles = (h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
 
-    const size_t in_out_tile_elemsize = opt.use_fp16_storage ? 2u : 4u;
+    const size_t in_out_tile_elemsize = device_opt.use_fp16_storage ? 2u : 4u;
 
-    //#pragma omp parallel for num_threads(2)
-    for (int yi = 0; yi + 2 < ytiles; yi += 3)
+    SEBatch batch(cache.workers, device_opt, tta_mode ? tta_level : 1);
+
+    // a pass is counted once however many of its rows spill
+    bool spilled = false;
+
+    // rows are split between devices so that every device finds the features it cached itself
+    for (int yi = 3 * device_index; yi + 2 < ytiles; yi += 3 * device_count)
     {
+        // the worker of the batch this row is recorded into
+        ncnn::VkCompute& cmd = batch.cmd();
+        const ncnn::Option& opt = batch.opt();
+
         const int tile_h_nopad = std::min((yi + 1) * TILE_SIZE_Y, h) - yi * TILE_SIZE_Y;
 
         int prepadding_bottom = prepadding;
@@ -2288,18 +4873,12 @@ int RealCUGAN::process_se_very_rough_stage0(const ncnn::Mat& inimage, const std:
             }
         }
 
-        ncnn::VkCompute cmd(vkdev);
-
         // upload
         ncnn::VkMat in_gpu;
         {
             cmd.record_clone(in, in_gpu, opt);
 
-            if (xtiles > 1)
-            {
-                cmd.submit_and_wait();
-                cmd.reset();
-            }
+            batch.hold(in_gpu);
         }
 
         int out_tile_y0 = std::max(yi * TILE_SIZE_Y, 0);
@@ -2341,14 +4920,14 @@ int RealCUGAN::process_se_very_rough_stage0(const ncnn::Mat& inimage, const std:
                     int tile_y0 = yi * TILE_SIZE_Y - prepadding;
                     int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, h) + prepadding_bottom;
 
-                    in_tile_gpu[0].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[1].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[2].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[3].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[4].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[5].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[6].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
-                    in_tile_gpu[7].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
+                    // only the orientations of the tta level, the transposed ones swap width and height
+                    for (int ti = 0; ti < tta_level; ti++)
+                    {
+                        if (ti < 4)
+                            in_tile_gpu[ti].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
+                        else
+                            in_tile_gpu[ti].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, opt.blob_vkallocator);
+                    }
 
                     if (channels == 4)
                     {
@@ -2367,7 +4946,7 @@ int RealCUGAN::process_se_very_rough_stage0(const ncnn::Mat& inimage, const std:
                     bindings[8] = in_tile_gpu[7];
                     bindings[9] = in_alpha_tile_gpu;
 
-                    std::vector<ncnn::vk_constant_type> constants(13);
+                    std::vector<ncnn::vk_constant_type> constants(15);
                     constants[0].i = in_gpu.w;
                     constants[1].i = in_gpu.h;
                     constants[2].i = in_gpu.cstep;
@@ -2381,6 +4960,8 @@ int RealCUGAN::process_se_very_rough_stage0(const ncnn::Mat& inimage, const std:
                     constants[10].i = channels;
                     constants[11].i = in_alpha_tile_gpu.w;
                     constants[12].i = in_alpha_tile_gpu.h;
+                    constants[13].i = REALCUGAN_FORMAT_PIXELS;
+                    constants[14].i = 0;
 
                     ncnn::VkMat dispatcher;
                     dispatcher.w = in_tile_gpu[0].w;
@@ -2388,11 +4969,13 @@ int RealCUGAN::process_se_very_rough_stage0(const ncnn::Mat& inimage, const std:
                     dispatcher.c = channels;
 
                     cmd.record_pipeline(realcugan_preproc, bindings, constants, dispatcher);
+
+                    batch.hold(bindings);
                 }
 
                 // realcugan
                 ncnn::VkMat out_tile_gpu[8];
-                for (int ti = 0; ti < 8; ti++)
+                for (int ti = 0; ti < tta_level; ti++)
                 {
                     ncnn::Extractor ex = net.create_extractor();
 
@@ -2443,7 +5026,7 @@ int RealCUGAN::process_se_very_rough_stage0(const ncnn::Mat& inimage, const std:
                     bindings[1] = in_tile_gpu;
                     bindings[2] = in_alpha_tile_gpu;
 
-                    std::vector<ncnn::vk_constant_type> constants(13);
+                    std::vector<ncnn::vk_constant_type> constants(15);
                     constants[0].i = in_gpu.w;
                     constants[1].i = in_gpu.h;
                     constants[2].i = in_gpu.cstep;
@@ -2452,218 +5035,72 @@ int RealCUGAN::process_se_very_rough_stage0(const ncnn::Mat& inimage, const std:
                     constants[5].i = in_tile_gpu.cstep;
                     constants[6].i = prepadding;
                     constants[7].i = prepadding;
-                    constants[8].i = xi * TILE_SIZE_X;
-                    constants[9].i = std::min(yi * TILE_SIZE_Y, prepadding);
-                    constants[10].i = channels;
-                    constants[11].i = in_alpha_tile_gpu.w;
-                    constants[12].i = in_alpha_tile_gpu.h;
-
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = in_tile_gpu.w;
-                    dispatcher.h = in_tile_gpu.h;
-                    dispatcher.c = channels;
-
-                    cmd.record_pipeline(realcugan_preproc, bindings, constants, dispatcher);
-                }
-
-                // realcugan
-                {
-                    ncnn::Extractor ex = net.create_extractor();
-
-                    ex.set_blob_vkallocator(opt.blob_vkallocator);
-                    ex.set_workspace_vkallocator(opt.blob_vkallocator);
-                    ex.set_staging_vkallocator(opt.staging_vkallocator);
-
-                    ex.input("in0", in_tile_gpu);
-
-                    for (size_t i = 0; i < names.size(); i++)
-                    {
-                        ncnn::VkMat feat;
-                        cache.load(yi, xi, 0, names[i], feat);
-
-                        ex.input(names[i].c_str(), feat);
-                    }
-
-                    for (size_t i = 0; i < outnames.size(); i++)
-                    {
-                        ncnn::VkMat feat;
-                        ex.extract(outnames[i].c_str(), feat, cmd);
-
-                        cache.save(yi, xi, 0, outnames[i], feat);
-                    }
-                }
-            }
-
-            if (xtiles > 1)
-            {
-                cmd.submit_and_wait();
-                cmd.reset();
-            }
-        }
-
-        cmd.submit_and_wait();
-        cmd.reset();
-    }
-
-    return 0;
-}
-
-int RealCUGAN::process_se_very_rough_sync_gap(const ncnn::Mat& inimage, const std::vector<std::string>& names, const ncnn::Option& opt, FeatureCache& cache) const
-{
-    const unsigned char* pixeldata = (const unsigned char*)inimage.data;
-    const int w = inimage.w;
-    const int h = inimage.h;
-    const int channels = inimage.elempack;
-
-    const int TILE_SIZE_X = 32;
-    const int TILE_SIZE_Y = 32;
-
-    // each tile 400x400
-    const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
-    const int ytiles = (h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
-
-    std::vector< std::vector<ncnn::VkMat> > feats(names.size());
-    for (int yi = 0; yi + 2 < ytiles; yi += 3)
-    {
-        for (int xi = 0; xi + 2 < xtiles; xi += 3)
-        {
-            {
-                for (size_t i = 0; i < names.size(); i++)
-                {
-                    if (tta_mode)
-                    {
-                        for (int ti = 0; ti < 8; ti++)
-                        {
-                            ncnn::VkMat feat;
-                            cache.load(yi, xi, ti, names[i], feat);
-
-                            feats[i].push_back(feat);
-                        }
-                    }
-                    else
-                    {
-                        ncnn::VkMat feat;
-                        cache.load(yi, xi, 0, names[i], feat);
-
-                        feats[i].push_back(feat);
-                    }
-                }
-            }
-        }
-    }
-
-    const int tiles = (ytiles / 3) * (xtiles / 3) * (tta_mode ? 8 : 1);
+                    constants[8].i = xi * TILE_SIZE_X;
+                    constants[9].i = std::min(yi * TILE_SIZE_Y, prepadding);
+                    constants[10].i = channels;
+                    constants[11].i = in_alpha_tile_gpu.w;
+                    constants[12].i = in_alpha_tile_gpu.h;
+                    constants[13].i = REALCUGAN_FORMAT_PIXELS;
+                    constants[14].i = 0;
 
-    ncnn::VkCompute cmd(vkdev);
+                    ncnn::VkMat dispatcher;
+                    dispatcher.w = in_tile_gpu.w;
+                    dispatcher.h = in_tile_gpu.h;
+                    dispatcher.c = channels;
 
-    // download
-    std::vector< std::vector<ncnn::Mat> > feats_cpu(names.size());
-    for (size_t i = 0; i < names.size(); i++)
-    {
-        feats_cpu[i].resize(tiles);
+                    cmd.record_pipeline(realcugan_preproc, bindings, constants, dispatcher);
 
-        for (int j = 0; j < tiles; j++)
-        {
-            cmd.record_download(feats[i][j], feats_cpu[i][j], opt);
-        }
-    }
+                    batch.hold(bindings);
+                }
 
-    cmd.submit_and_wait();
-    cmd.reset();
+                // realcugan
+                {
+                    ncnn::Extractor ex = net.create_extractor();
 
-    // global average
-    // upload
-    std::vector<ncnn::VkMat> avgfeats(names.size());
-    for (size_t i = 0; i < names.size(); i++)
-    {
-        for (int j = 0; j < tiles; j++)
-        {
-            if (opt.use_fp16_storage && ncnn::cpu_support_arm_asimdhp() && feats_cpu[i][j].elembits() == 16)
-            {
-                ncnn::Mat feat_fp32;
-                ncnn::cast_float16_to_float32(feats_cpu[i][j], feat_fp32, opt);
-                feats_cpu[i][j] = feat_fp32;
-            }
+                    ex.set_blob_vkallocator(opt.blob_vkallocator);
+                    ex.set_workspace_vkallocator(opt.blob_vkallocator);
+                    ex.set_staging_vkallocator(opt.staging_vkallocator);
 
-            if (opt.use_packing_layout && feats_cpu[i][j].elempack != 1)
-            {
-                ncnn::Mat feat_cpu_unpacked;
-                ncnn::convert_packing(feats_cpu[i][j], feat_cpu_unpacked, 1, opt);
-                feats_cpu[i][j] = feat_cpu_unpacked;
-            }
-        }
+                    ex.input("in0", in_tile_gpu);
 
-        // handle feats_cpu[i] vector
-        {
-            ncnn::Mat avgfeat;
-            avgfeat.create_like(feats_cpu[i][0]);
-            avgfeat.fill(0.f);
+                    for (size_t i = 0; i < names.size(); i++)
+                    {
+                        ncnn::VkMat feat;
+                        cache.load(yi, xi, 0, names[i], feat);
 
-            int len = avgfeat.total();
+                        ex.input(names[i].c_str(), feat);
+                    }
 
-            for (int j = 0; j < tiles; j++)
-            {
-                const ncnn::Mat f = feats_cpu[i][j];
+                    for (size_t i = 0; i < outnames.size(); i++)
+                    {
+                        ncnn::VkMat feat;
+                        ex.extract(outnames[i].c_str(), feat, cmd);
 
-                for (int k = 0; k < len; k++)
-                {
-                    avgfeat[k] += f[k];
+                        cache.save(yi, xi, 0, outnames[i], feat);
+                    }
                 }
             }
 
-            for (int k = 0; k < len; k++)
-            {
-                avgfeat[k] /= tiles;
-            }
-
-            cmd.record_upload(avgfeat, avgfeats[i], opt);
+            batch.tile();
         }
-    }
-
-    cmd.submit_and_wait();
-    cmd.reset();
 
+        int ret = batch.row();
 
-    for (int yi = 0; yi + 2 < ytiles; yi += 3)
-    {
-        for (int xi = 0; xi + 2 < xtiles; xi += 3)
+        // spilled rows have to be finished first
+        if (ret == 0 && cache.over_budget(outnames))
         {
-            {
-                for (size_t i = 0; i < names.size(); i++)
-                {
-                    if (tta_mode)
-                    {
-                        for (int ti = 0; ti < 8; ti++)
-                        {
-                            cache.save(yi, xi, ti, names[i], avgfeats[i]);
-                            cache.save(yi, xi + 1, ti, names[i], avgfeats[i]);
-                            cache.save(yi, xi + 2, ti, names[i], avgfeats[i]);
-                            cache.save(yi + 1, xi, ti, names[i], avgfeats[i]);
-                            cache.save(yi + 1, xi + 1, ti, names[i], avgfeats[i]);
-                            cache.save(yi + 1, xi + 2, ti, names[i], avgfeats[i]);
-                            cache.save(yi + 2, xi, ti, names[i], avgfeats[i]);
-                            cache.save(yi + 2, xi + 1, ti, names[i], avgfeats[i]);
-                            cache.save(yi + 2, xi + 2, ti, names[i], avgfeats[i]);
-                        }
-                    }
-                    else
-                    {
-                        cache.save(yi, xi, 0, names[i], avgfeats[i]);
-                        cache.save(yi, xi + 1, 0, names[i], avgfeats[i]);
-                        cache.save(yi, xi + 2, 0, names[i], avgfeats[i]);
-                        cache.save(yi + 1, xi, 0, names[i], avgfeats[i]);
-                        cache.save(yi + 1, xi + 1, 0, names[i], avgfeats[i]);
-                        cache.save(yi + 1, xi + 2, 0, names[i], avgfeats[i]);
-                        cache.save(yi + 2, xi, 0, names[i], avgfeats[i]);
-                        cache.save(yi + 2, xi + 1, 0, names[i], avgfeats[i]);
-                        cache.save(yi + 2, xi + 2, 0, names[i], avgfeats[i]);
-                    }
-                }
-            }
+            ret = batch.flush();
+            if (ret == 0)
+                ret = cache.spill(yi, outnames, cmd, opt);
+            if (ret == 0 && !spilled)
+                stats->add(stats->spilled_passes, 1);
+            spilled = true;
         }
+        if (ret != 0)
+            return ret;
     }
 
-    return 0;
+    return batch.flush();
 }
 
 int RealCUGAN::process_cpu_se_stage0(const ncnn::Mat& inimage, const std::vector<std::string>& names, const std::vector<std::string>& outnames, FeatureCache& cache) const
@@ -2673,8 +5110,9 @@ int RealCUGAN::process_cpu_se_stage0(const ncnn::Mat& inimage, const std::vector
     const int h = inimage.h;
     const int channels = inimage.elempack;
 
-    const int TILE_SIZE_X = tilesize;
-    const int TILE_SIZE_Y = tilesize;
+    int TILE_SIZE_X;
+    int TILE_SIZE_Y;
+    plan_tiles(w, h, TILE_SIZE_X, TILE_SIZE_Y);
 
     ncnn::Option opt = net.opt;
 
@@ -2748,16 +5186,7 @@ int RealCUGAN::process_cpu_se_stage0(const ncnn::Mat& inimage, const std::vector
                     in_tile[0].create(in.w, in.h, 3);
                     for (int q = 0; q < 3; q++)
                     {
-                        const float* ptr = in.channel(q);
-                        float* outptr0 = in_tile[0].channel(q);
-
-                        for (int i = 0; i < in.h; i++)
-                        {
-                            for (int j = 0; j < in.w; j++)
-                            {
-                                *outptr0++ = *ptr++ * (1 / 255.f);
-                            }
-                        }
+                        kernel_normalize(in.channel(q), in_tile[0].channel(q), in.w * in.h);
                     }
 
                     if (channels == 4)
@@ -2778,58 +5207,54 @@ int RealCUGAN::process_cpu_se_stage0(const ncnn::Mat& inimage, const std::vector
                     in_tile[0] = in_tile_padded;
                 }
 
-                // the other 7 directions
+                // the other directions of the tta level, the vertical flip, the other flips and the transposes
                 {
-                    in_tile[1].create(in_tile[0].w, in_tile[0].h, 3);
-                    in_tile[2].create(in_tile[0].w, in_tile[0].h, 3);
-                    in_tile[3].create(in_tile[0].w, in_tile[0].h, 3);
-                    in_tile[4].create(in_tile[0].h, in_tile[0].w, 3);
-                    in_tile[5].create(in_tile[0].h, in_tile[0].w, 3);
-                    in_tile[6].create(in_tile[0].h, in_tile[0].w, 3);
-                    in_tile[7].create(in_tile[0].h, in_tile[0].w, 3);
+                    if (tta_level >= 2)
+                    {
+                        in_tile[1].create(in_tile[0].w, in_tile[0].h, 3);
+                    }
+                    if (tta_level >= 4)
+                    {
+                        in_tile[2].create(in_tile[0].w, in_tile[0].h, 3);
+                        in_tile[3].create(in_tile[0].w, in_tile[0].h, 3);
+                    }
+                    if (tta_level >= 8)
+                    {
+                        in_tile[4].create(in_tile[0].h, in_tile[0].w, 3);
+                        in_tile[5].create(in_tile[0].h, in_tile[0].w, 3);
+                        in_tile[6].create(in_tile[0].h, in_tile[0].w, 3);
+                        in_tile[7].create(in_tile[0].h, in_tile[0].w, 3);
+                    }
 
+                    // flips of the tile and of its transpose, row by row instead of column strided writes
                     for (int q = 0; q < 3; q++)
                     {
-                        const ncnn::Mat in_tile_0 = in_tile[0].channel(q);
-                        ncnn::Mat in_tile_1 = in_tile[1].channel(q);
-                        ncnn::Mat in_tile_2 = in_tile[2].channel(q);
-                        ncnn::Mat in_tile_3 = in_tile[3].channel(q);
-                        ncnn::Mat in_tile_4 = in_tile[4].channel(q);
-                        ncnn::Mat in_tile_5 = in_tile[5].channel(q);
-                        ncnn::Mat in_tile_6 = in_tile[6].channel(q);
-                        ncnn::Mat in_tile_7 = in_tile[7].channel(q);
+                        const float* ptr0 = in_tile[0].channel(q);
 
-                        for (int i = 0; i < in_tile[0].h; i++)
+                        if (tta_level >= 2)
+                        {
+                            kernel_flip(ptr0, in_tile[0].w, in_tile[0].h, in_tile[1].channel(q), true, false);
+                        }
+                        if (tta_level >= 4)
+                        {
+                            kernel_flip(ptr0, in_tile[0].w, in_tile[0].h, in_tile[2].channel(q), false, true);
+                            kernel_flip(ptr0, in_tile[0].w, in_tile[0].h, in_tile[3].channel(q), true, true);
+                        }
+                        if (tta_level >= 8)
                         {
-                            const float* outptr0 = in_tile_0.row(i);
-                            float* outptr1 = in_tile_1.row(in_tile[0].h - 1 - i);
-                            float* outptr2 = in_tile_2.row(i) + in_tile[0].w - 1;
-                            float* outptr3 = in_tile_3.row(in_tile[0].h - 1 - i) + in_tile[0].w - 1;
+                            kernel_transpose(ptr0, in_tile[0].w, in_tile[0].h, in_tile[4].channel(q));
 
-                            for (int j = 0; j < in_tile[0].w; j++)
-                            {
-                                float* outptr4 = in_tile_4.row(j) + i;
-                                float* outptr5 = in_tile_5.row(in_tile[0].w - 1 - j) + i;
-                                float* outptr6 = in_tile_6.row(j) + in_tile[0].h - 1 - i;
-                                float* outptr7 = in_tile_7.row(in_tile[0].w - 1 - j) + in_tile[0].h - 1 - i;
-
-                                float v = *outptr0++;
-
-                                *outptr1++ = v;
-                                *outptr2-- = v;
-                                *outptr3-- = v;
-                                *outptr4 = v;
-                                *outptr5 = v;
-                                *outptr6 = v;
-                                *outptr7 = v;
-                            }
+                            const float* ptr4 = in_tile[4].channel(q);
+                            kernel_flip(ptr4, in_tile[4].w, in_tile[4].h, in_tile[5].channel(q), true, false);
+                            kernel_flip(ptr4, in_tile[4].w, in_tile[4].h, in_tile[6].channel(q), false, true);
+                            kernel_flip(ptr4, in_tile[4].w, in_tile[4].h, in_tile[7].channel(q), true, true);
                         }
                     }
                 }
 
                 // realcugan
                 ncnn::Mat out_tile[8];
-                for (int ti = 0; ti < 8; ti++)
+                for (int ti = 0; ti < tta_level; ti++)
                 {
                     ncnn::Extractor ex = net.create_extractor();
 
@@ -2861,13 +5286,7 @@ int RealCUGAN::process_cpu_se_stage0(const ncnn::Mat& inimage, const std::vector
                     in_tile.create(in.w, in.h, 3);
                     for (int q = 0; q < 3; q++)
                     {
-                        const float* ptr = in.channel(q);
-                        float* outptr = in_tile.channel(q);
-
-                        for (int i = 0; i < in.w * in.h; i++)
-                        {
-                            *outptr++ = *ptr++ * (1 / 255.f);
-                        }
+                        kernel_normalize(in.channel(q), in_tile.channel(q), in.w * in.h);
                     }
 
                     if (channels == 4)
@@ -2923,8 +5342,9 @@ int RealCUGAN::process_cpu_se_stage2(const ncnn::Mat& inimage, const std::vector
     const int h = inimage.h;
     const int channels = inimage.elempack;
 
-    const int TILE_SIZE_X = tilesize;
-    const int TILE_SIZE_Y = tilesize;
+    int TILE_SIZE_X;
+    int TILE_SIZE_Y;
+    plan_tiles(w, h, TILE_SIZE_X, TILE_SIZE_Y);
 
     ncnn::Option opt = net.opt;
 
@@ -2934,6 +5354,8 @@ int RealCUGAN::process_cpu_se_stage2(const ncnn::Mat& inimage, const std::vector
 
     for (int yi = 0; yi < ytiles; yi++)
     {
+        stats->add(stats->tiles, xtiles);
+
         const int tile_h_nopad = std::min((yi + 1) * TILE_SIZE_Y, h) - yi * TILE_SIZE_Y;
 
         int prepadding_bottom = prepadding;
@@ -2998,21 +5420,15 @@ int RealCUGAN::process_cpu_se_stage2(const ncnn::Mat& inimage, const std::vector
                     in_tile[0].create(in.w, in.h, 3);
                     for (int q = 0; q < 3; q++)
                     {
-                        const float* ptr = in.channel(q);
-                        float* outptr0 = in_tile[0].channel(q);
-
-                        for (int i = 0; i < in.h; i++)
-                        {
-                            for (int j = 0; j < in.w; j++)
-                            {
-                                *outptr0++ = *ptr++ * (1 / 255.f);
-                            }
-                        }
+                        kernel_normalize(in.channel(q), in_tile[0].channel(q), in.w * in.h);
                     }
 
                     if (channels == 4)
                     {
-                        in_alpha_tile = in.channel_range(3, 1).clone();
+                        // the alpha of the tile without its prepadding, the halo would shift it and overrun out
+                        const int alpha_top = yi * TILE_SIZE_Y - in_tile_y0;
+                        const int alpha_left = xi * TILE_SIZE_X - in_tile_x0;
+                        ncnn::copy_cut_border(in.channel_range(3, 1), in_alpha_tile, alpha_top, in.h - alpha_top - tile_h_nopad, alpha_left, in.w - alpha_left - tile_w_nopad, opt);
                     }
                 }
 
@@ -3028,58 +5444,54 @@ int RealCUGAN::process_cpu_se_stage2(const ncnn::Mat& inimage, const std::vector
                     in_tile[0] = in_tile_padded;
                 }
 
-                // the other 7 directions
+                // the other directions of the tta level, the vertical flip, the other flips and the transposes
                 {
-                    in_tile[1].create(in_tile[0].w, in_tile[0].h, 3);
-                    in_tile[2].create(in_tile[0].w, in_tile[0].h, 3);
-                    in_tile[3].create(in_tile[0].w, in_tile[0].h, 3);
-                    in_tile[4].create(in_tile[0].h, in_tile[0].w, 3);
-                    in_tile[5].create(in_tile[0].h, in_tile[0].w, 3);
-                    in_tile[6].create(in_tile[0].h, in_tile[0].w, 3);
-                    in_tile[7].create(in_tile[0].h, in_tile[0].w, 3);
+                    if (tta_level >= 2)
+                    {
+                        in_tile[1].create(in_tile[0].w, in_tile[0].h, 3);
+                    }
+                    if (tta_level >= 4)
+                    {
+                        in_tile[2].create(in_tile[0].w, in_tile[0].h, 3);
+                        in_tile[3].create(in_tile[0].w, in_tile[0].h, 3);
+                    }
+                    if (tta_level >= 8)
+                    {
+                        in_tile[4].create(in_tile[0].h, in_tile[0].w, 3);
+                        in_tile[5].create(in_tile[0].h, in_tile[0].w, 3);
+                        in_tile[6].create(in_tile[0].h, in_tile[0].w, 3);
+                        in_tile[7].create(in_tile[0].h, in_tile[0].w, 3);
+                    }
 
+                    // flips of the tile and of its transpose, row by row instead of column strided writes
                     for (int q = 0; q < 3; q++)
                     {
-                        const ncnn::Mat in_tile_0 = in_tile[0].channel(q);
-                        ncnn::Mat in_tile_1 = in_tile[1].channel(q);
-                        ncnn::Mat in_tile_2 = in_tile[2].channel(q);
-                        ncnn::Mat in_tile_3 = in_tile[3].channel(q);
-                        ncnn::Mat in_tile_4 = in_tile[4].channel(q);
-                        ncnn::Mat in_tile_5 = in_tile[5].channel(q);
-                        ncnn::Mat in_tile_6 = in_tile[6].channel(q);
-                        ncnn::Mat in_tile_7 = in_tile[7].channel(q);
+                        const float* ptr0 = in_tile[0].channel(q);
 
-                        for (int i = 0; i < in_tile[0].h; i++)
+                        if (tta_level >= 2)
+                        {
+                            kernel_flip(ptr0, in_tile[0].w, in_tile[0].h, in_tile[1].channel(q), true, false);
+                        }
+                        if (tta_level >= 4)
+                        {
+                            kernel_flip(ptr0, in_tile[0].w, in_tile[0].h, in_tile[2].channel(q), false, true);
+                            kernel_flip(ptr0, in_tile[0].w, in_tile[0].h, in_tile[3].channel(q), true, true);
+                        }
+                        if (tta_level >= 8)
                         {
-                            const float* outptr0 = in_tile_0.row(i);
-                            float* outptr1 = in_tile_1.row(in_tile[0].h - 1 - i);
-                            float* outptr2 = in_tile_2.row(i) + in_tile[0].w - 1;
-                            float* outptr3 = in_tile_3.row(in_tile[0].h - 1 - i) + in_tile[0].w - 1;
+                            kernel_transpose(ptr0, in_tile[0].w, in_tile[0].h, in_tile[4].channel(q));
 
-                            for (int j = 0; j < in_tile[0].w; j++)
-                            {
-                                float* outptr4 = in_tile_4.row(j) + i;
-                                float* outptr5 = in_tile_5.row(in_tile[0].w - 1 - j) + i;
-                                float* outptr6 = in_tile_6.row(j) + in_tile[0].h - 1 - i;
-                                float* outptr7 = in_tile_7.row(in_tile[0].w - 1 - j) + in_tile[0].h - 1 - i;
-
-                                float v = *outptr0++;
-
-                                *outptr1++ = v;
-                                *outptr2-- = v;
-                                *outptr3-- = v;
-                                *outptr4 = v;
-                                *outptr5 = v;
-                                *outptr6 = v;
-                                *outptr7 = v;
-                            }
+                            const float* ptr4 = in_tile[4].channel(q);
+                            kernel_flip(ptr4, in_tile[4].w, in_tile[4].h, in_tile[5].channel(q), true, false);
+                            kernel_flip(ptr4, in_tile[4].w, in_tile[4].h, in_tile[6].channel(q), false, true);
+                            kernel_flip(ptr4, in_tile[4].w, in_tile[4].h, in_tile[7].channel(q), true, true);
                         }
                     }
                 }
 
                 // realcugan
                 ncnn::Mat out_tile[8];
-                for (int ti = 0; ti < 8; ti++)
+                for (int ti = 0; ti < tta_level; ti++)
                 {
                     ncnn::Extractor ex = net.create_extractor();
 
@@ -3096,105 +5508,101 @@ int RealCUGAN::process_cpu_se_stage2(const ncnn::Mat& inimage, const std::vector
                     ex.extract("out0", out_tile[ti]);
                 }
 
-                ncnn::Mat out_alpha_tile;
-                if (channels == 4)
-                {
-                    if (scale == 1)
-                    {
-                        out_alpha_tile = in_alpha_tile;
-                    }
-                    if (scale == 2)
-                    {
-                        bicubic_2x->forward(in_alpha_tile, out_alpha_tile, opt);
-                    }
-                    if (scale == 3)
-                    {
-                        bicubic_3x->forward(in_alpha_tile, out_alpha_tile, opt);
-                    }
-                    if (scale == 4)
-                    {
-                        bicubic_4x->forward(in_alpha_tile, out_alpha_tile, opt);
-                    }
-                }
-
                 // postproc and merge alpha
                 {
                     out.create(tile_w_nopad * scale, tile_h_nopad * scale, channels);
                     if (scale == 4)
                     {
+                        // undo the flips and transposes of the tta directions and sum them up in the orientation of the tile
+                        ncnn::Mat sum_tile(out_tile[0].w, out_tile[0].h, (size_t)4u, opt.workspace_allocator);
+                        ncnn::Mat transposed_tile(out_tile[0].w, out_tile[0].h, (size_t)4u, opt.workspace_allocator);
                         for (int q = 0; q < 3; q++)
                         {
-                            const ncnn::Mat out_tile_0 = out_tile[0].channel(q);
-                            const ncnn::Mat out_tile_1 = out_tile[1].channel(q);
-                            const ncnn::Mat out_tile_2 = out_tile[2].channel(q);
-                            const ncnn::Mat out_tile_3 = out_tile[3].channel(q);
-                            const ncnn::Mat out_tile_4 = out_tile[4].channel(q);
-                            const ncnn::Mat out_tile_5 = out_tile[5].channel(q);
-                            const ncnn::Mat out_tile_6 = out_tile[6].channel(q);
-                            const ncnn::Mat out_tile_7 = out_tile[7].channel(q);
+                            const int tile_w = out_tile[0].w;
+                            const int tile_h = out_tile[0].h;
+
+                            memcpy(sum_tile, out_tile[0].channel(q), tile_w * tile_h * sizeof(float));
+                            if (tta_level >= 2)
+                            {
+                                kernel_flip_add(out_tile[1].channel(q), tile_w, tile_h, sum_tile, true, false);
+                            }
+                            if (tta_level >= 4)
+                            {
+                                kernel_flip_add(out_tile[2].channel(q), tile_w, tile_h, sum_tile, false, true);
+                                kernel_flip_add(out_tile[3].channel(q), tile_w, tile_h, sum_tile, true, true);
+                            }
+                            if (tta_level >= 8)
+                            {
+                                kernel_transpose(out_tile[4].channel(q), tile_h, tile_w, transposed_tile);
+                                kernel_flip_add(transposed_tile, tile_w, tile_h, sum_tile, false, false);
+                                kernel_transpose(out_tile[5].channel(q), tile_h, tile_w, transposed_tile);
+                                kernel_flip_add(transposed_tile, tile_w, tile_h, sum_tile, false, true);
+                                kernel_transpose(out_tile[6].channel(q), tile_h, tile_w, transposed_tile);
+                                kernel_flip_add(transposed_tile, tile_w, tile_h, sum_tile, true, false);
+                                kernel_transpose(out_tile[7].channel(q), tile_h, tile_w, transposed_tile);
+                                kernel_flip_add(transposed_tile, tile_w, tile_h, sum_tile, true, true);
+                            }
+
                             float* outptr = out.channel(q);
 
                             for (int i = 0; i < out.h; i++)
                             {
                                 const float* inptr = in_tile[0].channel(q).row(prepadding + i / 4) + prepadding;
-                                const float* ptr0 = out_tile_0.row(i);
-                                const float* ptr1 = out_tile_1.row(out_tile[0].h - 1 - i);
-                                const float* ptr2 = out_tile_2.row(i) + out_tile[0].w - 1;
-                                const float* ptr3 = out_tile_3.row(out_tile[0].h - 1 - i) + out_tile[0].w - 1;
+
+                                kernel_denormalize(sum_tile.row(i), outptr, out.w, 1.f / tta_level);
 
                                 for (int j = 0; j < out.w; j++)
                                 {
-                                    const float* ptr4 = out_tile_4.row(j) + i;
-                                    const float* ptr5 = out_tile_5.row(out_tile[0].w - 1 - j) + i;
-                                    const float* ptr6 = out_tile_6.row(j) + out_tile[0].h - 1 - i;
-                                    const float* ptr7 = out_tile_7.row(out_tile[0].w - 1 - j) + out_tile[0].h - 1 - i;
-
-                                    float v = (*ptr0++ + *ptr1++ + *ptr2-- + *ptr3-- + *ptr4 + *ptr5 + *ptr6 + *ptr7) / 8;
-
-                                    *outptr++ = v * 255.f + 0.5f + inptr[j / 4] * 255.f;
+                                    *outptr++ += inptr[j / 4] * 255.f;
                                 }
                             }
                         }
                     }
                     else
                     {
+                        // undo the flips and transposes of the tta directions and sum them up in the orientation of the tile
+                        ncnn::Mat sum_tile(out_tile[0].w, out_tile[0].h, (size_t)4u, opt.workspace_allocator);
+                        ncnn::Mat transposed_tile(out_tile[0].w, out_tile[0].h, (size_t)4u, opt.workspace_allocator);
                         for (int q = 0; q < 3; q++)
                         {
-                            const ncnn::Mat out_tile_0 = out_tile[0].channel(q);
-                            const ncnn::Mat out_tile_1 = out_tile[1].channel(q);
-                            const ncnn::Mat out_tile_2 = out_tile[2].channel(q);
-                            const ncnn::Mat out_tile_3 = out_tile[3].channel(q);
-                            const ncnn::Mat out_tile_4 = out_tile[4].channel(q);
-                            const ncnn::Mat out_tile_5 = out_tile[5].channel(q);
-                            const ncnn::Mat out_tile_6 = out_tile[6].channel(q);
-                            const ncnn::Mat out_tile_7 = out_tile[7].channel(q);
-                            float* outptr = out.channel(q);
+                            const int tile_w = out_tile[0].w;
+                            const int tile_h = out_tile[0].h;
 
-                            for (int i = 0; i < out.h; i++)
+                            memcpy(sum_tile, out_tile[0].channel(q), tile_w * tile_h * sizeof(float));
+                            if (tta_level >= 2)
                             {
-                                const float* ptr0 = out_tile_0.row(i);
-                                const float* ptr1 = out_tile_1.row(out_tile[0].h - 1 - i);
-                                const float* ptr2 = out_tile_2.row(i) + out_tile[0].w - 1;
-                                const float* ptr3 = out_tile_3.row(out_tile[0].h - 1 - i) + out_tile[0].w - 1;
-
-                                for (int j = 0; j < out.w; j++)
-                                {
-                                    const float* ptr4 = out_tile_4.row(j) + i;
-                                    const float* ptr5 = out_tile_5.row(out_tile[0].w - 1 - j) + i;
-                                    const float* ptr6 = out_tile_6.row(j) + out_tile[0].h - 1 - i;
-                                    const float* ptr7 = out_tile_7.row(out_tile[0].w - 1 - j) + out_tile[0].h - 1 - i;
+                                kernel_flip_add(out_tile[1].channel(q), tile_w, tile_h, sum_tile, true, false);
+                            }
+                            if (tta_level >= 4)
+                            {
+                                kernel_flip_add(out_tile[2].channel(q), tile_w, tile_h, sum_tile, false, true);
+                                kernel_flip_add(out_tile[3].channel(q), tile_w, tile_h, sum_tile, true, true);
+                            }
+                            if (tta_level >= 8)
+                            {
+                                kernel_transpose(out_tile[4].channel(q), tile_h, tile_w, transposed_tile);
+                                kernel_flip_add(transposed_tile, tile_w, tile_h, sum_tile, false, false);
+                                kernel_transpose(out_tile[5].channel(q), tile_h, tile_w, transposed_tile);
+                                kernel_flip_add(transposed_tile, tile_w, tile_h, sum_tile, false, true);
+                                kernel_transpose(out_tile[6].channel(q), tile_h, tile_w, transposed_tile);
+                                kernel_flip_add(transposed_tile, tile_w, tile_h, sum_tile, true, false);
+                                kernel_transpose(out_tile[7].channel(q), tile_h, tile_w, transposed_tile);
+                                kernel_flip_add(transposed_tile, tile_w, tile_h, sum_tile, true, true);
+                            }
 
-                                    float v = (*ptr0++ + *ptr1++ + *ptr2-- + *ptr3-- + *ptr4 + *ptr5 + *ptr6 + *ptr7) / 8;
+                            float* outptr = out.channel(q);
 
-                                    *outptr++ = v * 255.f + 0.5f;
-                                }
+                            for (int i = 0; i < out.h; i++)
+                            {
+                                kernel_denormalize(sum_tile.row(i), outptr, out.w, 1.f / tta_level);
+                                outptr += out.w;
                             }
                         }
                     }
 
                     if (channels == 4)
                     {
-                        memcpy(out.channel_range(3, 1), out_alpha_tile, out_alpha_tile.total() * sizeof(float));
+                        kernel_bicubic(in_alpha_tile, in_alpha_tile.w, in_alpha_tile.h, out.channel(3), scale);
                     }
                 }
             }
@@ -3207,18 +5615,15 @@ int RealCUGAN::process_cpu_se_stage2(const ncnn::Mat& inimage, const std::vector
                     in_tile.create(in.w, in.h, 3);
                     for (int q = 0; q < 3; q++)
                     {
-                        const float* ptr = in.channel(q);
-                        float* outptr = in_tile.channel(q);
-
-                        for (int i = 0; i < in.w * in.h; i++)
-                        {
-                            *outptr++ = *ptr++ * (1 / 255.f);
-                        }
+                        kernel_normalize(in.channel(q), in_tile.channel(q), in.w * in.h);
                     }
 
                     if (channels == 4)
                     {
-                        in_alpha_tile = in.channel_range(3, 1).clone();
+                        // the alpha of the tile without its prepadding, the halo would shift it and overrun out
+                        const int alpha_top = yi * TILE_SIZE_Y - in_tile_y0;
+                        const int alpha_left = xi * TILE_SIZE_X - in_tile_x0;
+                        ncnn::copy_cut_border(in.channel_range(3, 1), in_alpha_tile, alpha_top, in.h - alpha_top - tile_h_nopad, alpha_left, in.w - alpha_left - tile_w_nopad, opt);
                     }
                 }
 
@@ -3252,27 +5657,6 @@ int RealCUGAN::process_cpu_se_stage2(const ncnn::Mat& inimage, const std::vector
                     ex.extract("out0", out_tile);
                 }
 
-                ncnn::Mat out_alpha_tile;
-                if (channels == 4)
-                {
-                    if (scale == 1)
-                    {
-                        out_alpha_tile = in_alpha_tile;
-                    }
-                    if (scale == 2)
-                    {
-                        bicubic_2x->forward(in_alpha_tile, out_alpha_tile, opt);
-                    }
-                    if (scale == 3)
-                    {
-                        bicubic_3x->forward(in_alpha_tile, out_alpha_tile, opt);
-                    }
-                    if (scale == 4)
-                    {
-                        bicubic_4x->forward(in_alpha_tile, out_alpha_tile, opt);
-                    }
-                }
-
                 // postproc and merge alpha
                 {
                     out.create(tile_w_nopad * scale, tile_h_nopad * scale, channels);
@@ -3285,11 +5669,12 @@ int RealCUGAN::process_cpu_se_stage2(const ncnn::Mat& inimage, const std::vector
                             for (int i = 0; i < out.h; i++)
                             {
                                 const float* inptr = in_tile.channel(q).row(prepadding + i / 4) + prepadding;
-                                const float* ptr = out_tile.channel(q).row(i);
+
+                                kernel_denormalize(out_tile.channel(q).row(i), outptr, out.w, 1.f);
 
                                 for (int j = 0; j < out.w; j++)
                                 {
-                                    *outptr++ = *ptr++ * 255.f + 0.5f + inptr[j / 4] * 255.f;
+                                    *outptr++ += inptr[j / 4] * 255.f;
                                 }
                             }
                         }
@@ -3302,19 +5687,15 @@ int RealCUGAN::process_cpu_se_stage2(const ncnn::Mat& inimage, const std::vector
 
                             for (int i = 0; i < out.h; i++)
                             {
-                                const float* ptr = out_tile.channel(q).row(i);
-
-                                for (int j = 0; j < out.w; j++)
-                                {
-                                    *outptr++ = *ptr++ * 255.f + 0.5f;
-                                }
+                                kernel_denormalize(out_tile.channel(q).row(i), outptr, out.w, 1.f);
+                                outptr += out.w;
                             }
                         }
                     }
 
                     if (channels == 4)
                     {
-                        memcpy(out.channel_range(3, 1), out_alpha_tile, out_alpha_tile.total() * sizeof(float));
+                        kernel_bicubic(in_alpha_tile, in_alpha_tile.w, in_alpha_tile.h, out.channel(3), scale);
                     }
                 }
             }
@@ -3345,13 +5726,16 @@ int RealCUGAN::process_cpu_se_stage2(const ncnn::Mat& inimage, const std::vector
 
 int RealCUGAN::process_cpu_se_sync_gap(const ncnn::Mat& inimage, const std::vector<std::string>& names, FeatureCache& cache) const
 {
+    StageScope scope(stats, REALCUGAN_STAGE_SYNC_GAP);
+
     const unsigned char* pixeldata = (const unsigned char*)inimage.data;
     const int w = inimage.w;
     const int h = inimage.h;
     const int channels = inimage.elempack;
 
-    const int TILE_SIZE_X = tilesize;
-    const int TILE_SIZE_Y = tilesize;
+    int TILE_SIZE_X;
+    int TILE_SIZE_Y;
+    plan_tiles(w, h, TILE_SIZE_X, TILE_SIZE_Y);
 
     ncnn::Option opt = net.opt;
 
@@ -3369,7 +5753,7 @@ int RealCUGAN::process_cpu_se_sync_gap(const ncnn::Mat& inimage, const std::vect
                 {
                     if (tta_mode)
                     {
-                        for (int ti = 0; ti < 8; ti++)
+                        for (int ti = 0; ti < tta_level; ti++)
                         {
                             ncnn::Mat feat;
                             cache.load(yi, xi, ti, names[i], feat);
@@ -3389,7 +5773,7 @@ int RealCUGAN::process_cpu_se_sync_gap(const ncnn::Mat& inimage, const std::vect
         }
     }
 
-    const int tiles = ytiles * xtiles * (tta_mode ? 8 : 1);
+    const int tiles = ytiles * xtiles * (tta_mode ? tta_level : 1);
 
     // global average
     std::vector<ncnn::Mat> avgfeats(names.size());
@@ -3431,7 +5815,7 @@ int RealCUGAN::process_cpu_se_sync_gap(const ncnn::Mat& inimage, const std::vect
                 {
                     if (tta_mode)
                     {
-                        for (int ti = 0; ti < 8; ti++)
+                        for (int ti = 0; ti < tta_level; ti++)
                         {
                             cache.save(yi, xi, ti, names[i], avgfeats[i]);
                         }
@@ -3530,16 +5914,7 @@ int RealCUGAN::process_cpu_se_very_rough_stage0(const ncnn::Mat& inimage, const
                     in_tile[0].create(in.w, in.h, 3);
                     for (int q = 0; q < 3; q++)
                     {
-                        const float* ptr = in.channel(q);
-                        float* outptr0 = in_tile[0].channel(q);
-
-                        for (int i = 0; i < in.h; i++)
-                        {
-                            for (int j = 0; j < in.w; j++)
-                            {
-                                *outptr0++ = *ptr++ * (1 / 255.f);
-                            }
-                        }
+                        kernel_normalize(in.channel(q), in_tile[0].channel(q), in.w * in.h);
                     }
 
                     if (channels == 4)
@@ -3560,58 +5935,54 @@ int RealCUGAN::process_cpu_se_very_rough_stage0(const ncnn::Mat& inimage, const
                     in_tile[0] = in_tile_padded;
                 }
 
-                // the other 7 directions
+                // the other directions of the tta level, the vertical flip, the other flips and the transposes
                 {
-                    in_tile[1].create(in_tile[0].w, in_tile[0].h, 3);
-                    in_tile[2].create(in_tile[0].w, in_tile[0].h, 3);
-                    in_tile[3].create(in_tile[0].w, in_tile[0].h, 3);
-                    in_tile[4].create(in_tile[0].h, in_tile[0].w, 3);
-                    in_tile[5].create(in_tile[0].h, in_tile[0].w, 3);
-                    in_tile[6].create(in_tile[0].h, in_tile[0].w, 3);
-                    in_tile[7].create(in_tile[0].h, in_tile[0].w, 3);
+                    if (tta_level >= 2)
+                    {
+                        in_tile[1].create(in_tile[0].w, in_tile[0].h, 3);
+                    }
+                    if (tta_level >= 4)
+                    {
+                        in_tile[2].create(in_tile[0].w, in_tile[0].h, 3);
+                        in_tile[3].create(in_tile[0].w, in_tile[0].h, 3);
+                    }
+                    if (tta_level >= 8)
+                    {
+                        in_tile[4].create(in_tile[0].h, in_tile[0].w, 3);
+                        in_tile[5].create(in_tile[0].h, in_tile[0].w, 3);
+                        in_tile[6].create(in_tile[0].h, in_tile[0].w, 3);
+                        in_tile[7].create(in_tile[0].h, in_tile[0].w, 3);
+                    }
 
+                    // flips of the tile and of its transpose, row by row instead of column strided writes
                     for (int q = 0; q < 3; q++)
                     {
-                        const ncnn::Mat in_tile_0 = in_tile[0].channel(q);
-                        ncnn::Mat in_tile_1 = in_tile[1].channel(q);
-                        ncnn::Mat in_tile_2 = in_tile[2].channel(q);
-                        ncnn::Mat in_tile_3 = in_tile[3].channel(q);
-                        ncnn::Mat in_tile_4 = in_tile[4].channel(q);
-                        ncnn::Mat in_tile_5 = in_tile[5].channel(q);
-                        ncnn::Mat in_tile_6 = in_tile[6].channel(q);
-                        ncnn::Mat in_tile_7 = in_tile[7].channel(q);
+                        const float* ptr0 = in_tile[0].channel(q);
 
-                        for (int i = 0; i < in_tile[0].h; i++)
+                        if (tta_level >= 2)
+                        {
+                            kernel_flip(ptr0, in_tile[0].w, in_tile[0].h, in_tile[1].channel(q), true, false);
+                        }
+                        if (tta_level >= 4)
                         {
-                            const float* outptr0 = in_tile_0.row(i);
-                            float* outptr1 = in_tile_1.row(in_tile[0].h - 1 - i);
-                            float* outptr2 = in_tile_2.row(i) + in_tile[0].w - 1;
-                            float* outptr3 = in_tile_3.row(in_tile[0].h - 1 - i) + in_tile[0].w - 1;
+                            kernel_flip(ptr0, in_tile[0].w, in_tile[0].h, in_tile[2].channel(q), false, true);
+                            kernel_flip(ptr0, in_tile[0].w, in_tile[0].h, in_tile[3].channel(q), true, true);
+                        }
+                        if (tta_level >= 8)
+                        {
+                            kernel_transpose(ptr0, in_tile[0].w, in_tile[0].h, in_tile[4].channel(q));
 
-                            for (int j = 0; j < in_tile[0].w; j++)
-                            {
-                                float* outptr4 = in_tile_4.row(j) + i;
-                                float* outptr5 = in_tile_5.row(in_tile[0].w - 1 - j) + i;
-                                float* outptr6 = in_tile_6.row(j) + in_tile[0].h - 1 - i;
-                                float* outptr7 = in_tile_7.row(in_tile[0].w - 1 - j) + in_tile[0].h - 1 - i;
-
-                                float v = *outptr0++;
-
-                                *outptr1++ = v;
-                                *outptr2-- = v;
-                                *outptr3-- = v;
-                                *outptr4 = v;
-                                *outptr5 = v;
-                                *outptr6 = v;
-                                *outptr7 = v;
-                            }
+                            const float* ptr4 = in_tile[4].channel(q);
+                            kernel_flip(ptr4, in_tile[4].w, in_tile[4].h, in_tile[5].channel(q), true, false);
+                            kernel_flip(ptr4, in_tile[4].w, in_tile[4].h, in_tile[6].channel(q), false, true);
+                            kernel_flip(ptr4, in_tile[4].w, in_tile[4].h, in_tile[7].channel(q), true, true);
                         }
                     }
                 }
 
                 // realcugan
                 ncnn::Mat out_tile[8];
-                for (int ti = 0; ti < 8; ti++)
+                for (int ti = 0; ti < tta_level; ti++)
                 {
                     ncnn::Extractor ex = net.create_extractor();
 
@@ -3643,13 +6014,7 @@ int RealCUGAN::process_cpu_se_very_rough_stage0(const ncnn::Mat& inimage, const
                     in_tile.create(in.w, in.h, 3);
                     for (int q = 0; q < 3; q++)
                     {
-                        const float* ptr = in.channel(q);
-                        float* outptr = in_tile.channel(q);
-
-                        for (int i = 0; i < in.w * in.h; i++)
-                        {
-                            *outptr++ = *ptr++ * (1 / 255.f);
-                        }
+                        kernel_normalize(in.channel(q), in_tile.channel(q), in.w * in.h);
                     }
 
                     if (channels == 4)
@@ -3700,6 +6065,8 @@ int RealCUGAN::process_cpu_se_very_rough_stage0(const ncnn::Mat& inimage, const
 
 int RealCUGAN::process_cpu_se_very_rough_sync_gap(const ncnn::Mat& inimage, const std::vector<std::string>& names, FeatureCache& cache) const
 {
+    StageScope scope(stats, REALCUGAN_STAGE_SYNC_GAP);
+
     const unsigned char* pixeldata = (const unsigned char*)inimage.data;
     const int w = inimage.w;
     const int h = inimage.h;
@@ -3724,7 +6091,7 @@ int RealCUGAN::process_cpu_se_very_rough_sync_gap(const ncnn::Mat& inimage, cons
                 {
                     if (tta_mode)
                     {
-                        for (int ti = 0; ti < 8; ti++)
+                        for (int ti = 0; ti < tta_level; ti++)
                         {
                             ncnn::Mat feat;
                             cache.load(yi, xi, ti, names[i], feat);
@@ -3744,7 +6111,7 @@ int RealCUGAN::process_cpu_se_very_rough_sync_gap(const ncnn::Mat& inimage, cons
         }
     }
 
-    const int tiles = (ytiles / 3) * (xtiles / 3) * (tta_mode ? 8 : 1);
+    const int tiles = (ytiles / 3) * (xtiles / 3) * (tta_mode ? tta_level : 1);
 
     // global average
     std::vector<ncnn::Mat> avgfeats(names.size());
@@ -3786,7 +6153,7 @@ int RealCUGAN::process_cpu_se_very_rough_sync_gap(const ncnn::Mat& inimage, cons
                 {
                     if (tta_mode)
                     {
-                        for (int ti = 0; ti < 8; ti++)
+                        for (int ti = 0; ti < tta_level; ti++)
                         {
                             cache.save(yi, xi, ti, names[i], avgfeats[i]);
                             cache.save(yi, xi + 1, ti, names[i], avgfeats[i]);
@@ -3,24 +3,130 @@
 #ifndef REALCUGAN_H
 #define REALCUGAN_H
 
+#include <stdint.h>
 #include <string>
+#include <vector>
 
 // ncnn
 #include "net.h"
 #include "gpu.h"
 #include "layer.h"
 
+// fill rows y to y + rows of the input image, w * channels bytes each, return 0 on success
+typedef int (*realcugan_read_rows)(void* userdata, int y, int rows, unsigned char* pixels);
+// take rows y to y + rows of the output image, w * scale * channels bytes each, return 0 on success
+typedef int (*realcugan_write_rows)(void* userdata, int y, int rows, const unsigned char* pixels);
+
+// layouts of process_yuv, 4:2:0 planes one after the other, chroma at half the width and height
+enum
+{
+    REALCUGAN_FORMAT_PIXELS = 0,    // interleaved rgb or rgba of process
+    REALCUGAN_FORMAT_I420,          // y plane, u plane, v plane
+    REALCUGAN_FORMAT_NV12,          // y plane, interleaved uv plane
+};
+
+// stages of the tile loops
+enum
+{
+    REALCUGAN_STAGE_CROP = 0,   // input pixels to the tile, tile cache lookups
+    REALCUGAN_STAGE_UPLOAD,
+    REALCUGAN_STAGE_PREPROC,
+    REALCUGAN_STAGE_INFERENCE,
+    REALCUGAN_STAGE_POSTPROC,
+    REALCUGAN_STAGE_DOWNLOAD,   // output tile to pixels, tile cache fills
+    REALCUGAN_STAGE_WAIT,       // host blocked in submit_and_wait
+    REALCUGAN_STAGE_SYNC_GAP,   // se feature download, average and upload
+    REALCUGAN_STAGE_COUNT
+};
+
+// totals since creation or the last reset_stats, summed over the devices
+struct RealCUGANStats
+{
+    uint64_t tiles;
+    uint64_t cached_tiles;
+    uint64_t bytes_uploaded;
+    uint64_t bytes_downloaded;
+    uint64_t feature_cache_peak_bytes;
+    // se frames that took the gap features of an earlier frame instead of running stage0
+    uint64_t reused_frames;
+    // se passes of one device that moved feature rows past feature_cache_budget to host memory
+    uint64_t spilled_passes;
+    // se sync gaps averaged on the host, after a spill or with fp16 packing without fp16 storage
+    uint64_t host_sync_gaps;
+    // wall time of each stage on the host, gpu stages only record and submit, their gpu time lands in wait
+    uint64_t host_ns[REALCUGAN_STAGE_COUNT];
+    // gpu time of each stage from timestamp queries, only with ncnn built with NCNN_BENCHMARK
+    uint64_t gpu_ns[REALCUGAN_STAGE_COUNT];
+};
+
 class FeatureCache;
+struct FrameBand;
+class RowQueue;
+class TileQueue;
+class TemporalFeatures;
+class TileCache;
+class Stats;
+class SEDevice;
+class WorkerState;
 class RealCUGAN
 {
 public:
     RealCUGAN(int gpuid, bool tta_mode = false, int num_threads = 1);
+    // one instance spread over several gpus, the first one is the primary device
+    RealCUGAN(const std::vector<int>& gpuids, bool tta_mode = false, int num_threads = 1);
     ~RealCUGAN();
 
+    // execution context on the weights and pipelines of a loaded model, which must outlive it
+    // the context keeps its allocators and command buffers across calls and has its own parameters
+    static RealCUGAN* create_context(const RealCUGAN& model);
+
+    // instances own their net or pipelines, copies would free them twice
+    RealCUGAN(const RealCUGAN&) = delete;
+    RealCUGAN& operator=(const RealCUGAN&) = delete;
+
     int load_files(FILE *param, FILE *bin);
 
+    // param is the nul terminated text of the .param file
+    // bin must be 4 byte aligned and outlive this instance, the weights are not copied
+    int load_memory(const char* param, const unsigned char* bin);
+
+    // copy the realcugan parameters to the peer devices, call after changing them
+    void sync_parameters();
+
+    // balanced tile width and height for a w x h frame, padded tiles never exceed the memory of tilesize x tilesize ones
+    // the whole frame is one tile when it fits
+    void plan_tiles(int w, int h, int& tile_w, int& tile_h) const;
+
+    // reentrant, concurrent calls run on separate worker states from a pool and overlap on the gpu
     int process(const ncnn::Mat& inimage, ncnn::Mat& outimage) const;
 
+    // frames share allocators and command buffers, outimages must be allocated already
+    int process_batch(const std::vector<ncnn::Mat>& inimages, std::vector<ncnn::Mat>& outimages) const;
+
+    // only a band of tile rows is held in memory, input rows are pulled from reader and output rows pushed to writer
+    // tiles are processed independently as with syncgap 0, se needs the features of every tile before any output
+    int process_stream(int w, int h, int channels, realcugan_read_rows reader, realcugan_write_rows writer, void* userdata) const;
+
+    // inimage is the w x h luma plane of 1 byte elements with the chroma planes of format following it, w and h even
+    // outimage is allocated the same way at the output size, bt.601 limited range
+    // the gpu converts inside preproc and postproc, se models, fp32 precision and the cpu convert on the host
+    int process_yuv(const ncnn::Mat& inimage, ncnn::Mat& outimage, int format) const;
+
+    // gpu se only, the averaged gap features of the whole frame as process would compute them, for process_roi
+    // left empty when the frame needs none, a single tile or syncgap 0
+    int process_gap_features(const ncnn::Mat& inimage, std::vector<ncnn::Mat>& feats) const;
+
+    // run only the tiles meeting the roi_w x roi_h rectangle at roi_x, roi_y and write its upscaled pixels into the
+    // same place of outimage, which holds the whole output frame already, the rest of outimage is left as it is
+    // tiles lie on the grid of the whole frame so the rectangle matches process, se takes the gap features of the
+    // whole frame from feats or computes them when feats is empty, the cpu se paths run the whole frame
+    int process_roi(const ncnn::Mat& inimage, int roi_x, int roi_y, int roi_w, int roi_h, ncnn::Mat& outimage, const std::vector<ncnn::Mat>& feats) const;
+
+    // run a w x h frame of channels 3 or 4 through the path process takes for such frames, so the allocator pools,
+    // layer workspaces and driver pipelines are ready before the first request, on a scratch context that leaves
+    // the stats, the tile cache and the temporal features as they were
+    int warm_up(int w, int h, int channels) const;
+
     int process_cpu(const ncnn::Mat& inimage, ncnn::Mat& outimage) const;
 
     int process_se(const ncnn::Mat& inimage, ncnn::Mat& outimage) const;
@@ -35,13 +141,48 @@ public:
 
     int process_cpu_se_very_rough(const ncnn::Mat& inimage, ncnn::Mat& outimage) const;
 
+    // cheap relaxed counters, always on
+    void get_stats(RealCUGANStats& stats) const;
+    void reset_stats();
+
 protected:
-    int process_se_stage0(const ncnn::Mat& inimage, const std::vector<std::string>& names, const std::vector<std::string>& outnames, const ncnn::Option& opt, FeatureCache& cache) const;
-    int process_se_stage2(const ncnn::Mat& inimage, const std::vector<std::string>& names, ncnn::Mat& outimage, const ncnn::Option& opt, FeatureCache& cache) const;
-    int process_se_sync_gap(const ncnn::Mat& inimage, const std::vector<std::string>& names, const ncnn::Option& opt, FeatureCache& cache) const;
+    // the context of create_context
+    explicit RealCUGAN(const RealCUGAN* model);
+
+    void prepare_net();
+    void create_pipelines();
+
+    bool single_tile(int w, int h) const;
+
+    WorkerState* acquire_worker() const;
+    void release_worker(WorkerState* worker) const;
+    // take over the idle workers of a context of this instance and of its peers
+    void adopt_workers(RealCUGAN& context) const;
+
+    int process_frames(const ncnn::Mat* inimages, ncnn::Mat* outimages, int count) const;
+    int process_frames(const ncnn::Mat* inimages, ncnn::Mat* outimages, RowQueue& rows) const;
+    int process_rows(const ncnn::Mat* inimages, ncnn::Mat* outimages, RowQueue& rows) const;
+    int process_cpu_frame(const ncnn::Mat& inimage, ncnn::Mat& outimage, TileQueue& tiles) const;
+    int process_cpu_tiles(const ncnn::Mat& inimage, ncnn::Mat& outimage, TileQueue& tiles, int num_threads) const;
 
-    int process_se_very_rough_stage0(const ncnn::Mat& inimage, const std::vector<std::string>& names, const std::vector<std::string>& outnames, const ncnn::Option& opt, FeatureCache& cache) const;
-    int process_se_very_rough_sync_gap(const ncnn::Mat& inimage, const std::vector<std::string>& names, const ncnn::Option& opt, FeatureCache& cache) const;
+    void acquire_se_devices(std::vector<SEDevice>& devices) const;
+    void release_se_devices(std::vector<SEDevice>& devices) const;
+
+    int process_se_stage0(const ncnn::Mat& inimage, const std::vector<std::string>& names, const std::vector<std::string>& outnames, const ncnn::Option& device_opt, FeatureCache& cache) const;
+    int process_se_stage2(const ncnn::Mat& inimage, const std::vector<std::string>& names, ncnn::Mat& outimage, const ncnn::Option& device_opt, FeatureCache& cache, const FrameBand& band) const;
+    int process_se_gaps(const ncnn::Mat& inimage, std::vector<SEDevice>& devices) const;
+    int process_se_sync_gap(const ncnn::Mat& inimage, const std::vector<std::string>& names, bool very_rough, std::vector<SEDevice>& devices) const;
+    int process_se_gap_sum(const ncnn::Mat& inimage, const std::vector<std::string>& names, bool very_rough, const ncnn::Option& opt, FeatureCache& cache, std::vector<ncnn::VkMat>& sums, std::vector<ncnn::VkMat>& shapes, int& tiles) const;
+    int process_se_gap_apply(const ncnn::Mat& inimage, const std::vector<std::string>& names, const std::vector<ncnn::VkMat>& sums, const std::vector<ncnn::VkMat>& shapes, float scale, const ncnn::Option& opt, FeatureCache& cache) const;
+    int process_se_sync_gap_host(const ncnn::Mat& inimage, const std::vector<std::string>& names, bool very_rough, std::vector<SEDevice>& devices) const;
+    int process_se_gap_sum_host(const ncnn::Mat& inimage, const std::vector<std::string>& names, bool very_rough, const ncnn::Option& opt, FeatureCache& cache, std::vector<ncnn::Mat>& sums, int& tiles) const;
+    int process_se_gap_apply_host(const ncnn::Mat& inimage, const std::vector<std::string>& names, const std::vector<ncnn::Mat>& avgfeats, const ncnn::Option& opt, FeatureCache& cache) const;
+
+    bool process_se_temporal_load(const ncnn::Mat& inimage, const std::vector<std::string>& names, std::vector<SEDevice>& devices) const;
+    void process_se_temporal_save(const ncnn::Mat& inimage, const std::vector<std::string>& names, std::vector<SEDevice>& devices) const;
+    int process_se_gap_download(const std::vector<std::string>& names, std::vector<SEDevice>& devices, std::vector<ncnn::Mat>& avgfeats) const;
+
+    int process_se_very_rough_stage0(const ncnn::Mat& inimage, const std::vector<std::string>& names, const std::vector<std::string>& outnames, const ncnn::Option& device_opt, FeatureCache& cache) const;
 
     int process_cpu_se_stage0(const ncnn::Mat& inimage, const std::vector<std::string>& names, const std::vector<std::string>& outnames, FeatureCache& cache) const;
     int process_cpu_se_stage2(const ncnn::Mat& inimage, const std::vector<std::string>& names, ncnn::Mat& outimage, FeatureCache& cache) const;
@@ -57,17 +198,51 @@ public:
     int tilesize;
     int prepadding;
     int syncgap;
+    int pipeline_depth;
+    // cpu only, tiles processed in parallel, each with num_threads / tile_threads threads
+    int tile_threads;
+    // bytes of output tiles kept for inputs seen again, shared with contexts, 0 disables the cache
+    // se tiles depend on the whole frame and are never cached
+    size_t tile_cache_size;
+    // vram bytes of se features per device before rows spill to host memory, 0 = an eighth of the heap budget
+    size_t feature_cache_budget;
+    // gpu se only, frames whose thumbnail stays within this mean absolute difference, in 0 to 255 pixel units, of the frame
+    // the gap features were last computed on reuse them and skip stage0, a scene cut or drift beyond it recomputes, 0 disables
+    float temporal_threshold;
+    // 0 = fp32, 1 = fp16 storage, 2 = fp16 arithmetic, 3 = int8 for models quantized with ncnn2int8, before load_files
+    int precision;
+    // orientations averaged with tta_mode, 2 adds the vertical flip, 4 the other flips, 8 the transposes, before load_files
+    int tta_level;
+    // compiled shaders are kept here across processes when set, before load_files
+    std::string cache_dir;
 
 private:
     ncnn::VulkanDevice* vkdev;
-    ncnn::Net net;
+    // null for contexts, which run on the net of their model
+    ncnn::Net* owned_net;
+    ncnn::Net& net;
     ncnn::Pipeline* realcugan_preproc;
     ncnn::Pipeline* realcugan_postproc;
     ncnn::Pipeline* realcugan_4x_postproc;
-    ncnn::Layer* bicubic_2x;
-    ncnn::Layer* bicubic_3x;
-    ncnn::Layer* bicubic_4x;
+    ncnn::Pipeline* realcugan_feature_avg;
     bool tta_mode;
+
+    TileCache* tile_cache;
+
+    // averaged se features of the last key frame, every context follows its own video
+    TemporalFeatures* temporal;
+
+    // each device and context counts its own work
+    Stats* stats;
+
+    // multi gpu, rows of tiles are shared between this device and its peers
+    std::vector<RealCUGAN*> peers;
+    int device_index;
+    int device_count;
+
+    // allocators and command buffers of finished workers, handed to the next call
+    mutable ncnn::Mutex workers_lock;
+    mutable std::vector<WorkerState*> idle_workers;
 };
 
 #endif // REALCUGAN_H
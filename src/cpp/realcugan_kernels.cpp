@@ -0,0 +1,707 @@
+// simd kernels for the cpu path of realcugan
+
+#include "realcugan_kernels.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+// ncnn
+#include "cpu.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define REALCUGAN_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#define REALCUGAN_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if REALCUGAN_X86
+// avx is picked at runtime, the rest of the library is built for the baseline sse2
+#if defined(__GNUC__) || defined(__clang__)
+#define REALCUGAN_TARGET_AVX __attribute__((target("avx")))
+#else
+#define REALCUGAN_TARGET_AVX
+#endif
+
+static bool support_avx()
+{
+    static const bool avx = ncnn::cpu_support_x86_avx() != 0;
+    return avx;
+}
+
+REALCUGAN_TARGET_AVX static int normalize_avx(const float* src, float* dst, int size)
+{
+    const __m256 _scale = _mm256_set1_ps(1 / 255.f);
+
+    int i = 0;
+    for (; i + 7 < size; i += 8)
+    {
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(src + i), _scale));
+    }
+    return i;
+}
+
+REALCUGAN_TARGET_AVX static int denormalize_avx(const float* src, float* dst, int size, float scale)
+{
+    const __m256 _scale = _mm256_set1_ps(scale);
+    const __m256 _255 = _mm256_set1_ps(255.f);
+    const __m256 _half = _mm256_set1_ps(0.5f);
+
+    int i = 0;
+    for (; i + 7 < size; i += 8)
+    {
+        __m256 _v = _mm256_mul_ps(_mm256_loadu_ps(src + i), _scale);
+        _v = _mm256_add_ps(_mm256_mul_ps(_v, _255), _half);
+        _mm256_storeu_ps(dst + i, _v);
+    }
+    return i;
+}
+
+REALCUGAN_TARGET_AVX static inline __m256 reverse_avx(__m256 _v)
+{
+    _v = _mm256_permute_ps(_v, _MM_SHUFFLE(0, 1, 2, 3));
+    return _mm256_permute2f128_ps(_v, _v, 1);
+}
+
+REALCUGAN_TARGET_AVX static int reverse_row_avx(const float* src, float* dst, int n)
+{
+    int j = 0;
+    for (; j + 7 < n; j += 8)
+    {
+        _mm256_storeu_ps(dst + j, reverse_avx(_mm256_loadu_ps(src + n - 8 - j)));
+    }
+    return j;
+}
+
+REALCUGAN_TARGET_AVX static int add_row_avx(const float* src, float* dst, int n)
+{
+    int j = 0;
+    for (; j + 7 < n; j += 8)
+    {
+        _mm256_storeu_ps(dst + j, _mm256_add_ps(_mm256_loadu_ps(dst + j), _mm256_loadu_ps(src + j)));
+    }
+    return j;
+}
+
+REALCUGAN_TARGET_AVX static int add_reverse_row_avx(const float* src, float* dst, int n)
+{
+    int j = 0;
+    for (; j + 7 < n; j += 8)
+    {
+        _mm256_storeu_ps(dst + j, _mm256_add_ps(_mm256_loadu_ps(dst + j), reverse_avx(_mm256_loadu_ps(src + n - 8 - j))));
+    }
+    return j;
+}
+
+REALCUGAN_TARGET_AVX static int cubic_rows_avx(const float* rows[4], const float* beta, float* dst, int n)
+{
+    const __m256 _b0 = _mm256_set1_ps(beta[0]);
+    const __m256 _b1 = _mm256_set1_ps(beta[1]);
+    const __m256 _b2 = _mm256_set1_ps(beta[2]);
+    const __m256 _b3 = _mm256_set1_ps(beta[3]);
+
+    int j = 0;
+    for (; j + 7 < n; j += 8)
+    {
+        __m256 _v = _mm256_mul_ps(_mm256_loadu_ps(rows[0] + j), _b0);
+        _v = _mm256_add_ps(_v, _mm256_mul_ps(_mm256_loadu_ps(rows[1] + j), _b1));
+        _v = _mm256_add_ps(_v, _mm256_mul_ps(_mm256_loadu_ps(rows[2] + j), _b2));
+        _v = _mm256_add_ps(_v, _mm256_mul_ps(_mm256_loadu_ps(rows[3] + j), _b3));
+        _mm256_storeu_ps(dst + j, _v);
+    }
+    return j;
+}
+
+// 8x8 blocks, returns the number of rows and columns covered
+REALCUGAN_TARGET_AVX static void transpose_avx(const float* src, int w, int h, float* dst, int& w8, int& h8)
+{
+    w8 = w / 8 * 8;
+    h8 = h / 8 * 8;
+
+    for (int i = 0; i < h8; i += 8)
+    {
+        for (int j = 0; j < w8; j += 8)
+        {
+            const float* p = src + i * w + j;
+
+            __m256 _r0 = _mm256_loadu_ps(p);
+            __m256 _r1 = _mm256_loadu_ps(p + w);
+            __m256 _r2 = _mm256_loadu_ps(p + w * 2);
+            __m256 _r3 = _mm256_loadu_ps(p + w * 3);
+            __m256 _r4 = _mm256_loadu_ps(p + w * 4);
+            __m256 _r5 = _mm256_loadu_ps(p + w * 5);
+            __m256 _r6 = _mm256_loadu_ps(p + w * 6);
+            __m256 _r7 = _mm256_loadu_ps(p + w * 7);
+
+            __m256 _t0 = _mm256_unpacklo_ps(_r0, _r1);
+            __m256 _t1 = _mm256_unpackhi_ps(_r0, _r1);
+            __m256 _t2 = _mm256_unpacklo_ps(_r2, _r3);
+            __m256 _t3 = _mm256_unpackhi_ps(_r2, _r3);
+            __m256 _t4 = _mm256_unpacklo_ps(_r4, _r5);
+            __m256 _t5 = _mm256_unpackhi_ps(_r4, _r5);
+            __m256 _t6 = _mm256_unpacklo_ps(_r6, _r7);
+            __m256 _t7 = _mm256_unpackhi_ps(_r6, _r7);
+
+            __m256 _s0 = _mm256_shuffle_ps(_t0, _t2, _MM_SHUFFLE(1, 0, 1, 0));
+            __m256 _s1 = _mm256_shuffle_ps(_t0, _t2, _MM_SHUFFLE(3, 2, 3, 2));
+            __m256 _s2 = _mm256_shuffle_ps(_t1, _t3, _MM_SHUFFLE(1, 0, 1, 0));
+            __m256 _s3 = _mm256_shuffle_ps(_t1, _t3, _MM_SHUFFLE(3, 2, 3, 2));
+            __m256 _s4 = _mm256_shuffle_ps(_t4, _t6, _MM_SHUFFLE(1, 0, 1, 0));
+            __m256 _s5 = _mm256_shuffle_ps(_t4, _t6, _MM_SHUFFLE(3, 2, 3, 2));
+            __m256 _s6 = _mm256_shuffle_ps(_t5, _t7, _MM_SHUFFLE(1, 0, 1, 0));
+            __m256 _s7 = _mm256_shuffle_ps(_t5, _t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+            float* q = dst + j * h + i;
+
+            _mm256_storeu_ps(q, _mm256_permute2f128_ps(_s0, _s4, 0x20));
+            _mm256_storeu_ps(q + h, _mm256_permute2f128_ps(_s1, _s5, 0x20));
+            _mm256_storeu_ps(q + h * 2, _mm256_permute2f128_ps(_s2, _s6, 0x20));
+            _mm256_storeu_ps(q + h * 3, _mm256_permute2f128_ps(_s3, _s7, 0x20));
+            _mm256_storeu_ps(q + h * 4, _mm256_permute2f128_ps(_s0, _s4, 0x31));
+            _mm256_storeu_ps(q + h * 5, _mm256_permute2f128_ps(_s1, _s5, 0x31));
+            _mm256_storeu_ps(q + h * 6, _mm256_permute2f128_ps(_s2, _s6, 0x31));
+            _mm256_storeu_ps(q + h * 7, _mm256_permute2f128_ps(_s3, _s7, 0x31));
+        }
+    }
+}
+
+static int normalize_sse2(const float* src, float* dst, int size)
+{
+    const __m128 _scale = _mm_set1_ps(1 / 255.f);
+
+    int i = 0;
+    for (; i + 3 < size; i += 4)
+    {
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(src + i), _scale));
+    }
+    return i;
+}
+
+static int denormalize_sse2(const float* src, float* dst, int size, float scale)
+{
+    const __m128 _scale = _mm_set1_ps(scale);
+    const __m128 _255 = _mm_set1_ps(255.f);
+    const __m128 _half = _mm_set1_ps(0.5f);
+
+    int i = 0;
+    for (; i + 3 < size; i += 4)
+    {
+        __m128 _v = _mm_mul_ps(_mm_loadu_ps(src + i), _scale);
+        _v = _mm_add_ps(_mm_mul_ps(_v, _255), _half);
+        _mm_storeu_ps(dst + i, _v);
+    }
+    return i;
+}
+
+static inline __m128 reverse_sse2(__m128 _v)
+{
+    return _mm_shuffle_ps(_v, _v, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+static int reverse_row_sse2(const float* src, float* dst, int n)
+{
+    int j = 0;
+    for (; j + 3 < n; j += 4)
+    {
+        _mm_storeu_ps(dst + j, reverse_sse2(_mm_loadu_ps(src + n - 4 - j)));
+    }
+    return j;
+}
+
+static int add_row_sse2(const float* src, float* dst, int n)
+{
+    int j = 0;
+    for (; j + 3 < n; j += 4)
+    {
+        _mm_storeu_ps(dst + j, _mm_add_ps(_mm_loadu_ps(dst + j), _mm_loadu_ps(src + j)));
+    }
+    return j;
+}
+
+static int add_reverse_row_sse2(const float* src, float* dst, int n)
+{
+    int j = 0;
+    for (; j + 3 < n; j += 4)
+    {
+        _mm_storeu_ps(dst + j, _mm_add_ps(_mm_loadu_ps(dst + j), reverse_sse2(_mm_loadu_ps(src + n - 4 - j))));
+    }
+    return j;
+}
+
+static int cubic_rows_sse2(const float* rows[4], const float* beta, float* dst, int n)
+{
+    const __m128 _b0 = _mm_set1_ps(beta[0]);
+    const __m128 _b1 = _mm_set1_ps(beta[1]);
+    const __m128 _b2 = _mm_set1_ps(beta[2]);
+    const __m128 _b3 = _mm_set1_ps(beta[3]);
+
+    int j = 0;
+    for (; j + 3 < n; j += 4)
+    {
+        __m128 _v = _mm_mul_ps(_mm_loadu_ps(rows[0] + j), _b0);
+        _v = _mm_add_ps(_v, _mm_mul_ps(_mm_loadu_ps(rows[1] + j), _b1));
+        _v = _mm_add_ps(_v, _mm_mul_ps(_mm_loadu_ps(rows[2] + j), _b2));
+        _v = _mm_add_ps(_v, _mm_mul_ps(_mm_loadu_ps(rows[3] + j), _b3));
+        _mm_storeu_ps(dst + j, _v);
+    }
+    return j;
+}
+
+static void transpose_sse2(const float* src, int w, int h, float* dst, int& w4, int& h4)
+{
+    w4 = w / 4 * 4;
+    h4 = h / 4 * 4;
+
+    for (int i = 0; i < h4; i += 4)
+    {
+        for (int j = 0; j < w4; j += 4)
+        {
+            const float* p = src + i * w + j;
+
+            __m128 _r0 = _mm_loadu_ps(p);
+            __m128 _r1 = _mm_loadu_ps(p + w);
+            __m128 _r2 = _mm_loadu_ps(p + w * 2);
+            __m128 _r3 = _mm_loadu_ps(p + w * 3);
+
+            _MM_TRANSPOSE4_PS(_r0, _r1, _r2, _r3);
+
+            float* q = dst + j * h + i;
+
+            _mm_storeu_ps(q, _r0);
+            _mm_storeu_ps(q + h, _r1);
+            _mm_storeu_ps(q + h * 2, _r2);
+            _mm_storeu_ps(q + h * 3, _r3);
+        }
+    }
+}
+#endif // REALCUGAN_X86
+
+#if REALCUGAN_NEON
+static int normalize_neon(const float* src, float* dst, int size)
+{
+    const float32x4_t _scale = vdupq_n_f32(1 / 255.f);
+
+    int i = 0;
+    for (; i + 3 < size; i += 4)
+    {
+        vst1q_f32(dst + i, vmulq_f32(vld1q_f32(src + i), _scale));
+    }
+    return i;
+}
+
+static int denormalize_neon(const float* src, float* dst, int size, float scale)
+{
+    const float32x4_t _scale = vdupq_n_f32(scale);
+    const float32x4_t _255 = vdupq_n_f32(255.f);
+    const float32x4_t _half = vdupq_n_f32(0.5f);
+
+    int i = 0;
+    for (; i + 3 < size; i += 4)
+    {
+        float32x4_t _v = vmulq_f32(vld1q_f32(src + i), _scale);
+        _v = vaddq_f32(vmulq_f32(_v, _255), _half);
+        vst1q_f32(dst + i, _v);
+    }
+    return i;
+}
+
+static inline float32x4_t reverse_neon(float32x4_t _v)
+{
+    _v = vrev64q_f32(_v);
+    return vcombine_f32(vget_high_f32(_v), vget_low_f32(_v));
+}
+
+static int reverse_row_neon(const float* src, float* dst, int n)
+{
+    int j = 0;
+    for (; j + 3 < n; j += 4)
+    {
+        vst1q_f32(dst + j, reverse_neon(vld1q_f32(src + n - 4 - j)));
+    }
+    return j;
+}
+
+static int add_row_neon(const float* src, float* dst, int n)
+{
+    int j = 0;
+    for (; j + 3 < n; j += 4)
+    {
+        vst1q_f32(dst + j, vaddq_f32(vld1q_f32(dst + j), vld1q_f32(src + j)));
+    }
+    return j;
+}
+
+static int add_reverse_row_neon(const float* src, float* dst, int n)
+{
+    int j = 0;
+    for (; j + 3 < n; j += 4)
+    {
+        vst1q_f32(dst + j, vaddq_f32(vld1q_f32(dst + j), reverse_neon(vld1q_f32(src + n - 4 - j))));
+    }
+    return j;
+}
+
+static int cubic_rows_neon(const float* rows[4], const float* beta, float* dst, int n)
+{
+    int j = 0;
+    for (; j + 3 < n; j += 4)
+    {
+        float32x4_t _v = vmulq_n_f32(vld1q_f32(rows[0] + j), beta[0]);
+        _v = vmlaq_n_f32(_v, vld1q_f32(rows[1] + j), beta[1]);
+        _v = vmlaq_n_f32(_v, vld1q_f32(rows[2] + j), beta[2]);
+        _v = vmlaq_n_f32(_v, vld1q_f32(rows[3] + j), beta[3]);
+        vst1q_f32(dst + j, _v);
+    }
+    return j;
+}
+
+static void transpose_neon(const float* src, int w, int h, float* dst, int& w4, int& h4)
+{
+    w4 = w / 4 * 4;
+    h4 = h / 4 * 4;
+
+    for (int i = 0; i < h4; i += 4)
+    {
+        for (int j = 0; j < w4; j += 4)
+        {
+            const float* p = src + i * w + j;
+
+            float32x4x2_t _t01 = vtrnq_f32(vld1q_f32(p), vld1q_f32(p + w));
+            float32x4x2_t _t23 = vtrnq_f32(vld1q_f32(p + w * 2), vld1q_f32(p + w * 3));
+
+            float* q = dst + j * h + i;
+
+            vst1q_f32(q, vcombine_f32(vget_low_f32(_t01.val[0]), vget_low_f32(_t23.val[0])));
+            vst1q_f32(q + h, vcombine_f32(vget_low_f32(_t01.val[1]), vget_low_f32(_t23.val[1])));
+            vst1q_f32(q + h * 2, vcombine_f32(vget_high_f32(_t01.val[0]), vget_high_f32(_t23.val[0])));
+            vst1q_f32(q + h * 3, vcombine_f32(vget_high_f32(_t01.val[1]), vget_high_f32(_t23.val[1])));
+        }
+    }
+}
+#endif // REALCUGAN_NEON
+
+static void reverse_row(const float* src, float* dst, int n)
+{
+    int j = 0;
+#if REALCUGAN_X86
+    j = support_avx() ? reverse_row_avx(src, dst, n) : reverse_row_sse2(src, dst, n);
+#elif REALCUGAN_NEON
+    j = reverse_row_neon(src, dst, n);
+#endif
+    for (; j < n; j++)
+    {
+        dst[j] = src[n - 1 - j];
+    }
+}
+
+static void add_row(const float* src, float* dst, int n)
+{
+    int j = 0;
+#if REALCUGAN_X86
+    j = support_avx() ? add_row_avx(src, dst, n) : add_row_sse2(src, dst, n);
+#elif REALCUGAN_NEON
+    j = add_row_neon(src, dst, n);
+#endif
+    for (; j < n; j++)
+    {
+        dst[j] += src[j];
+    }
+}
+
+static void add_reverse_row(const float* src, float* dst, int n)
+{
+    int j = 0;
+#if REALCUGAN_X86
+    j = support_avx() ? add_reverse_row_avx(src, dst, n) : add_reverse_row_sse2(src, dst, n);
+#elif REALCUGAN_NEON
+    j = add_reverse_row_neon(src, dst, n);
+#endif
+    for (; j < n; j++)
+    {
+        dst[j] += src[n - 1 - j];
+    }
+}
+
+// dst = the 4 rows weighted by beta
+static void cubic_rows(const float* rows[4], const float* beta, float* dst, int n)
+{
+    int j = 0;
+#if REALCUGAN_X86
+    j = support_avx() ? cubic_rows_avx(rows, beta, dst, n) : cubic_rows_sse2(rows, beta, dst, n);
+#elif REALCUGAN_NEON
+    j = cubic_rows_neon(rows, beta, dst, n);
+#endif
+    for (; j < n; j++)
+    {
+        dst[j] = rows[0][j] * beta[0] + rows[1][j] * beta[1] + rows[2][j] * beta[2] + rows[3][j] * beta[3];
+    }
+}
+
+// cubic weights of the 4 taps around a sample at fraction fx, as the bicubic ncnn Interp
+static void cubic_coeffs(float fx, float* coeffs)
+{
+    const float A = -0.75f;
+
+    float fx0 = fx + 1.f;
+    float fx1 = fx;
+    float fx2 = 1.f - fx;
+
+    coeffs[0] = A * fx0 * fx0 * fx0 - 5.f * A * fx0 * fx0 + 8.f * A * fx0 - 4.f * A;
+    coeffs[1] = (A + 2.f) * fx1 * fx1 * fx1 - (A + 3.f) * fx1 * fx1 + 1.f;
+    coeffs[2] = (A + 2.f) * fx2 * fx2 * fx2 - (A + 3.f) * fx2 * fx2 + 1.f;
+    coeffs[3] = 1.f - coeffs[0] - coeffs[1] - coeffs[2];
+}
+
+// source taps and weights of each of the n * scale samples along an axis of n, taps past the border repeat the edge
+static void cubic_taps(int n, int scale, std::vector<int>& ofs, std::vector<float>& coeffs)
+{
+    ofs.resize(n * scale * 4);
+    coeffs.resize(n * scale * 4);
+
+    for (int i = 0; i < n * scale; i++)
+    {
+        float fx = (i + 0.5f) / scale - 0.5f;
+        int sx = (int)floorf(fx);
+
+        cubic_coeffs(fx - sx, &coeffs[i * 4]);
+
+        for (int k = 0; k < 4; k++)
+        {
+            ofs[i * 4 + k] = std::min(std::max(sx - 1 + k, 0), n - 1);
+        }
+    }
+}
+
+void kernel_normalize(const float* src, float* dst, int size)
+{
+    int i = 0;
+#if REALCUGAN_X86
+    i = support_avx() ? normalize_avx(src, dst, size) : normalize_sse2(src, dst, size);
+#elif REALCUGAN_NEON
+    i = normalize_neon(src, dst, size);
+#endif
+    for (; i < size; i++)
+    {
+        dst[i] = src[i] * (1 / 255.f);
+    }
+}
+
+void kernel_denormalize(const float* src, float* dst, int size, float scale)
+{
+    int i = 0;
+#if REALCUGAN_X86
+    i = support_avx() ? denormalize_avx(src, dst, size, scale) : denormalize_sse2(src, dst, size, scale);
+#elif REALCUGAN_NEON
+    i = denormalize_neon(src, dst, size, scale);
+#endif
+    for (; i < size; i++)
+    {
+        float v = src[i] * scale;
+        dst[i] = v * 255.f + 0.5f;
+    }
+}
+
+void kernel_flip(const float* src, int w, int h, float* dst, bool flip_v, bool flip_h)
+{
+    for (int i = 0; i < h; i++)
+    {
+        const float* ptr = src + (flip_v ? h - 1 - i : i) * w;
+        float* outptr = dst + i * w;
+
+        if (flip_h)
+            reverse_row(ptr, outptr, w);
+        else
+            memcpy(outptr, ptr, w * sizeof(float));
+    }
+}
+
+void kernel_flip_add(const float* src, int w, int h, float* dst, bool flip_v, bool flip_h)
+{
+    for (int i = 0; i < h; i++)
+    {
+        const float* ptr = src + (flip_v ? h - 1 - i : i) * w;
+        float* outptr = dst + i * w;
+
+        if (flip_h)
+            add_reverse_row(ptr, outptr, w);
+        else
+            add_row(ptr, outptr, w);
+    }
+}
+
+void kernel_transpose(const float* src, int w, int h, float* dst)
+{
+    // blocks keep the column writes of each block within a few cache lines
+    int wb = 0;
+    int hb = 0;
+#if REALCUGAN_X86
+    if (support_avx())
+        transpose_avx(src, w, h, dst, wb, hb);
+    else
+        transpose_sse2(src, w, h, dst, wb, hb);
+#elif REALCUGAN_NEON
+    transpose_neon(src, w, h, dst, wb, hb);
+#endif
+
+    // right edge of the blocked rows
+    for (int i = 0; i < hb; i++)
+    {
+        for (int j = wb; j < w; j++)
+        {
+            dst[j * h + i] = src[i * w + j];
+        }
+    }
+
+    // bottom rows
+    for (int i = hb; i < h; i++)
+    {
+        for (int j = 0; j < w; j++)
+        {
+            dst[j * h + i] = src[i * w + j];
+        }
+    }
+}
+
+void kernel_bicubic(const float* src, int w, int h, float* dst, int scale)
+{
+    if (scale == 1)
+    {
+        memcpy(dst, src, w * h * sizeof(float));
+        return;
+    }
+
+    const int outw = w * scale;
+    const int outh = h * scale;
+
+    std::vector<int> xofs;
+    std::vector<float> alpha;
+    cubic_taps(w, scale, xofs, alpha);
+
+    std::vector<int> yofs;
+    std::vector<float> beta;
+    cubic_taps(h, scale, yofs, beta);
+
+    // every source row is resized horizontally once, the output rows blend 4 of them
+    std::vector<float> rows(outw * h);
+    for (int i = 0; i < h; i++)
+    {
+        const float* ptr = src + i * w;
+        float* rowptr = &rows[i * outw];
+
+        for (int j = 0; j < outw; j++)
+        {
+            const int* ofs = &xofs[j * 4];
+            const float* a = &alpha[j * 4];
+
+            rowptr[j] = ptr[ofs[0]] * a[0] + ptr[ofs[1]] * a[1] + ptr[ofs[2]] * a[2] + ptr[ofs[3]] * a[3];
+        }
+    }
+
+    for (int i = 0; i < outh; i++)
+    {
+        const float* taps[4];
+        for (int k = 0; k < 4; k++)
+        {
+            taps[k] = &rows[yofs[i * 4 + k] * outw];
+        }
+
+        cubic_rows(taps, &beta[i * 4], dst + i * outw, outw);
+    }
+}
+
+static inline unsigned char clamp_u8(float v)
+{
+    return (unsigned char)std::min(std::max(v + 0.5f, 0.f), 255.f);
+}
+
+void kernel_yuv_to_rgb(const unsigned char* src, int w, int h, unsigned char* dst, bool nv12, bool bgr)
+{
+    const int cw = w / 2;
+    const unsigned char* uplane = src + w * h;
+    const unsigned char* vplane = uplane + cw * (h / 2);
+
+    for (int i = 0; i < h; i++)
+    {
+        const unsigned char* yptr = src + i * w;
+        unsigned char* outptr = dst + i * w * 3;
+
+        for (int j = 0; j < w; j++)
+        {
+            float U;
+            float V;
+            if (nv12)
+            {
+                U = uplane[(i / 2) * w + j / 2 * 2] - 128.f;
+                V = uplane[(i / 2) * w + j / 2 * 2 + 1] - 128.f;
+            }
+            else
+            {
+                U = uplane[(i / 2) * cw + j / 2] - 128.f;
+                V = vplane[(i / 2) * cw + j / 2] - 128.f;
+            }
+
+            const float Y = 1.164f * (yptr[j] - 16.f);
+
+            outptr[bgr ? 2 : 0] = clamp_u8(Y + 1.596f * V);
+            outptr[1] = clamp_u8(Y - 0.392f * U - 0.813f * V);
+            outptr[bgr ? 0 : 2] = clamp_u8(Y + 2.017f * U);
+            outptr += 3;
+        }
+    }
+}
+
+void kernel_rgb_to_yuv(const unsigned char* src, int w, int h, unsigned char* dst, bool nv12, bool bgr)
+{
+    const int cw = w / 2;
+    unsigned char* uplane = dst + w * h;
+    unsigned char* vplane = uplane + cw * (h / 2);
+
+    const int r = bgr ? 2 : 0;
+    const int b = bgr ? 0 : 2;
+
+    for (int i = 0; i < h; i++)
+    {
+        const unsigned char* ptr = src + i * w * 3;
+        unsigned char* yptr = dst + i * w;
+
+        for (int j = 0; j < w; j++)
+        {
+            yptr[j] = clamp_u8(16.f + 0.257f * ptr[r] + 0.504f * ptr[1] + 0.098f * ptr[b]);
+            ptr += 3;
+        }
+    }
+
+    for (int i = 0; i < h / 2; i++)
+    {
+        const unsigned char* ptr0 = src + i * 2 * w * 3;
+        const unsigned char* ptr1 = ptr0 + w * 3;
+
+        for (int j = 0; j < cw; j++)
+        {
+            const float R = (ptr0[r] + ptr0[3 + r] + ptr1[r] + ptr1[3 + r]) * 0.25f;
+            const float G = (ptr0[1] + ptr0[4] + ptr1[1] + ptr1[4]) * 0.25f;
+            const float B = (ptr0[b] + ptr0[3 + b] + ptr1[b] + ptr1[3 + b]) * 0.25f;
+
+            const unsigned char U = clamp_u8(128.f - 0.148f * R - 0.291f * G + 0.439f * B);
+            const unsigned char V = clamp_u8(128.f + 0.439f * R - 0.368f * G - 0.071f * B);
+
+            if (nv12)
+            {
+                uplane[i * w + j * 2] = U;
+                uplane[i * w + j * 2 + 1] = V;
+            }
+            else
+            {
+                uplane[i * cw + j] = U;
+                vplane[i * cw + j] = V;
+            }
+
+            ptr0 += 6;
+            ptr1 += 6;
+        }
+    }
+}
@@ -0,0 +1,32 @@
+// simd kernels for the cpu path of realcugan
+
+#ifndef REALCUGAN_KERNELS_H
+#define REALCUGAN_KERNELS_H
+
+// planes are w x h floats with contiguous rows, as the channels of a ncnn::Mat
+
+// dst = src / 255
+void kernel_normalize(const float* src, float* dst, int size);
+
+// dst = src * scale * 255 + 0.5
+void kernel_denormalize(const float* src, float* dst, int size, float scale);
+
+// dst = src flipped upside down and / or left to right
+void kernel_flip(const float* src, int w, int h, float* dst, bool flip_v, bool flip_h);
+
+// dst += src flipped upside down and / or left to right
+void kernel_flip_add(const float* src, int w, int h, float* dst, bool flip_v, bool flip_h);
+
+// dst is h x w, dst row j is src column j
+void kernel_transpose(const float* src, int w, int h, float* dst);
+
+// dst is w * scale x h * scale, the bicubic upscale of src as the ncnn Interp layer
+void kernel_bicubic(const float* src, int w, int h, float* dst, int scale);
+
+// 4:2:0 planes of w x h bytes, y then u and v or interleaved uv, to interleaved rgb bytes, bt.601 limited range
+void kernel_yuv_to_rgb(const unsigned char* src, int w, int h, unsigned char* dst, bool nv12, bool bgr);
+
+// the inverse, each chroma sample is the average of its 2x2 block
+void kernel_rgb_to_yuv(const unsigned char* src, int w, int h, unsigned char* dst, bool nv12, bool bgr);
+
+#endif // REALCUGAN_KERNELS_H
@@ -7,6 +7,7 @@
 #include "realcugan.h"
 
 #include <algorithm>
+#include <cstring>
 #include <vector>
 #include <map>
 
@@ -31,14 +32,38 @@ extern "C" RealCUGAN *realcugan_init(int gpuid, bool tta_mode, int num_threads)
   return new RealCUGAN(gpuid, tta_mode, num_threads);
 }
 
+extern "C" RealCUGAN *realcugan_init_multi(const int *gpuids, int gpu_count, bool tta_mode, int num_threads) {
+  return new RealCUGAN(std::vector<int>(gpuids, gpuids + gpu_count), tta_mode, num_threads);
+}
+
+extern "C" RealCUGAN *realcugan_init_context(const RealCUGAN *model) {
+  return RealCUGAN::create_context(*model);
+}
+
 extern "C" int realcugan_get_gpu_count() {
   return ncnn::get_gpu_count();
 }
 
+extern "C" const char *realcugan_get_gpu_name(int gpuid) {
+  return ncnn::get_gpu_info(gpuid).device_name();
+}
+
 extern "C" void realcugan_destroy_gpu_instance() {
   ncnn::destroy_gpu_instance();
 }
 
+extern "C" void realcugan_set_cache_dir(RealCUGAN *realcugan, const char *cache_dir) {
+  realcugan->cache_dir = cache_dir;
+}
+
+extern "C" void realcugan_set_precision(RealCUGAN *realcugan, int precision) {
+  realcugan->precision = precision;
+}
+
+extern "C" void realcugan_set_tta_level(RealCUGAN *realcugan, int tta_level) {
+  realcugan->tta_level = tta_level;
+}
+
 extern "C" int realcugan_load_files(
   RealCUGAN *realcugan,
   FILE* param,
@@ -47,6 +72,14 @@ extern "C" int realcugan_load_files(
   return realcugan->load_files(param, bin);
 }
 
+extern "C" int realcugan_load_memory(
+  RealCUGAN *realcugan,
+  const char *param,
+  const unsigned char *bin
+) {
+  return realcugan->load_memory(param, bin);
+}
+
 extern "C" void realcugan_set_parameters(
   RealCUGAN *realcugan,
   int scale,
@@ -60,6 +93,37 @@ extern "C" void realcugan_set_parameters(
   realcugan->prepadding = prepadding;
   realcugan->syncgap = syncgap;
   realcugan->tilesize = tilesize;
+  realcugan->sync_parameters();
+}
+
+extern "C" void realcugan_set_tilesize(RealCUGAN *realcugan, int tilesize) {
+  realcugan->tilesize = tilesize;
+  realcugan->sync_parameters();
+}
+
+extern "C" void realcugan_set_pipeline_depth(RealCUGAN *realcugan, int pipeline_depth) {
+  realcugan->pipeline_depth = pipeline_depth;
+  realcugan->sync_parameters();
+}
+
+extern "C" void realcugan_set_tile_threads(RealCUGAN *realcugan, int tile_threads) {
+  realcugan->tile_threads = tile_threads;
+  realcugan->sync_parameters();
+}
+
+extern "C" void realcugan_set_tile_cache_size(RealCUGAN *realcugan, size_t tile_cache_size) {
+  realcugan->tile_cache_size = tile_cache_size;
+  realcugan->sync_parameters();
+}
+
+extern "C" void realcugan_set_feature_cache_budget(RealCUGAN *realcugan, size_t feature_cache_budget) {
+  realcugan->feature_cache_budget = feature_cache_budget;
+  realcugan->sync_parameters();
+}
+
+extern "C" void realcugan_set_temporal_threshold(RealCUGAN *realcugan, float temporal_threshold) {
+  realcugan->temporal_threshold = temporal_threshold;
+  realcugan->sync_parameters();
 }
 
 extern "C" int realcugan_process(
@@ -95,10 +159,157 @@ extern "C" int realcugan_process_cpu(
   return result;
 }
 
+extern "C" int realcugan_process_into(
+  RealCUGAN *realcugan,
+  const Image *in_image,
+  const Image *out_image
+) {
+  // download straight into the caller's buffer, w * h * c bytes without row padding
+  int c = in_image->c;
+  ncnn::Mat in_image_mat = ncnn::Mat(in_image->w, in_image->h, (void *)in_image->data, (size_t)c, c);
+  ncnn::Mat out_image_mat = ncnn::Mat(out_image->w, out_image->h, (void *)out_image->data, (size_t)c, c);
+
+  int result = realcugan->process(in_image_mat, out_image_mat);
+  if (result == 0 && out_image_mat.data != out_image->data) {
+    memcpy(out_image->data, out_image_mat.data, (size_t)out_image->w * out_image->h * c);
+  }
+  return result;
+}
+
+extern "C" int realcugan_process_cpu_into(
+  RealCUGAN *realcugan,
+  const Image *in_image,
+  const Image *out_image
+) {
+  int c = in_image->c;
+  ncnn::Mat in_image_mat = ncnn::Mat(in_image->w, in_image->h, (void *)in_image->data, (size_t)c, c);
+  ncnn::Mat out_image_mat = ncnn::Mat(out_image->w, out_image->h, (void *)out_image->data, (size_t)c, c);
+
+  int result = realcugan->process_cpu(in_image_mat, out_image_mat);
+  if (result == 0 && out_image_mat.data != out_image->data) {
+    memcpy(out_image->data, out_image_mat.data, (size_t)out_image->w * out_image->h * c);
+  }
+  return result;
+}
+
+extern "C" int realcugan_process_yuv_into(
+  RealCUGAN *realcugan,
+  const Image *in_image,
+  const Image *out_image,
+  int format
+) {
+  // c is unused, data holds the 4:2:0 planes of format one after the other, w * h * 3 / 2 bytes
+  ncnn::Mat in_image_mat = ncnn::Mat(in_image->w, in_image->h, (void *)in_image->data, (size_t)1u, 1);
+  ncnn::Mat out_image_mat = ncnn::Mat(out_image->w, out_image->h, (void *)out_image->data, (size_t)1u, 1);
+
+  return realcugan->process_yuv(in_image_mat, out_image_mat, format);
+}
+
+extern "C" std::vector<ncnn::Mat> *realcugan_gap_features(RealCUGAN *realcugan, const Image *in_image) {
+  // owned by the caller until realcugan_free_gap_features
+  int c = in_image->c;
+  ncnn::Mat in_image_mat = ncnn::Mat(in_image->w, in_image->h, (void *)in_image->data, (size_t)c, c);
+
+  auto *feats = new std::vector<ncnn::Mat>();
+  if (realcugan->process_gap_features(in_image_mat, *feats) != 0) {
+    delete feats;
+    return nullptr;
+  }
+  return feats;
+}
+
+extern "C" void realcugan_free_gap_features(std::vector<ncnn::Mat> *feats) {
+  delete feats;
+}
+
+extern "C" int realcugan_process_roi_into(
+  RealCUGAN *realcugan,
+  const Image *in_image,
+  int roi_x,
+  int roi_y,
+  int roi_w,
+  int roi_h,
+  const Image *out_image,
+  const std::vector<ncnn::Mat> *feats
+) {
+  // out_image holds the whole output frame, only the rectangle is written
+  int c = in_image->c;
+  ncnn::Mat in_image_mat = ncnn::Mat(in_image->w, in_image->h, (void *)in_image->data, (size_t)c, c);
+  ncnn::Mat out_image_mat = ncnn::Mat(out_image->w, out_image->h, (void *)out_image->data, (size_t)c, c);
+
+  const std::vector<ncnn::Mat> no_feats;
+  return realcugan->process_roi(in_image_mat, roi_x, roi_y, roi_w, roi_h, out_image_mat, feats ? *feats : no_feats);
+}
+
+extern "C" int realcugan_process_batch(
+  RealCUGAN *realcugan,
+  const Image *in_images,
+  const Image *out_images,
+  int count
+) {
+  // the output of every frame is written straight into the caller's buffers
+  std::vector<ncnn::Mat> in_image_mats(count);
+  std::vector<ncnn::Mat> out_image_mats(count);
+  for (int i = 0; i < count; i++) {
+    int c = in_images[i].c;
+    in_image_mats[i] = ncnn::Mat(in_images[i].w, in_images[i].h, (void *)in_images[i].data, (size_t)c, c);
+    out_image_mats[i] = ncnn::Mat(out_images[i].w, out_images[i].h, (void *)out_images[i].data, (size_t)c, c);
+  }
+
+  return realcugan->process_batch(in_image_mats, out_image_mats);
+}
+
+extern "C" int realcugan_process_stream(
+  RealCUGAN *realcugan,
+  int w,
+  int h,
+  int c,
+  realcugan_read_rows reader,
+  realcugan_write_rows writer,
+  void *userdata
+) {
+  return realcugan->process_stream(w, h, c, reader, writer, userdata);
+}
+
+extern "C" int realcugan_warm_up(RealCUGAN *realcugan, int w, int h, int c) {
+  return realcugan->warm_up(w, h, c);
+}
+
+extern "C" void realcugan_get_stats(const RealCUGAN *realcugan, RealCUGANStats *stats) {
+  realcugan->get_stats(*stats);
+}
+
+extern "C" void realcugan_reset_stats(RealCUGAN *realcugan) {
+  realcugan->reset_stats();
+}
+
 extern "C" uint32_t realcugan_get_heap_budget(int gpuid) {
   return ncnn::get_gpu_device(gpuid)->get_heap_budget();
 }
 
+// device local memory the process holds on the gpu in MB, 0 when the driver does not report it
+extern "C" uint32_t realcugan_get_heap_usage(int gpuid) {
+  const ncnn::GpuInfo &info = ncnn::get_gpu_info(gpuid);
+  if (!info.support_VK_EXT_memory_budget() || !ncnn::vkGetPhysicalDeviceMemoryProperties2KHR)
+    return 0;
+
+  VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = {};
+  budget.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+
+  VkPhysicalDeviceMemoryProperties2KHR properties = {};
+  properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2_KHR;
+  properties.pNext = &budget;
+
+  ncnn::vkGetPhysicalDeviceMemoryProperties2KHR(info.physical_device(), &properties);
+
+  uint64_t usage = 0;
+  for (uint32_t i = 0; i < properties.memoryProperties.memoryHeapCount; i++) {
+    if (properties.memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+      usage += budget.heapUsage[i];
+  }
+  return (uint32_t)(usage / 1024 / 1024);
+}
+
 extern "C" void realcugan_free_image(ncnn::Mat *mat_ptr) {
   delete mat_ptr;
 }
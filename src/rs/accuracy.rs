@@ -0,0 +1,33 @@
+use image::DynamicImage;
+
+/// Peak signal to noise ratio of image against reference in dB over every 8 bit channel,
+/// infinite for identical images. Reports what a lower precision costs against fp32
+pub fn psnr(reference: &DynamicImage, image: &DynamicImage) -> Result<f64, String> {
+    if reference.width() != image.width() || reference.height() != image.height() {
+        return Err(format!(
+            "image size {}x{} differs from reference {}x{}",
+            image.width(), image.height(), reference.width(), reference.height()
+        ))
+    }
+    if reference.color() != image.color() {
+        return Err(format!("image color type {:?} differs from reference {:?}", image.color(), reference.color()))
+    }
+
+    let reference = reference.as_bytes();
+    let image = image.as_bytes();
+    if reference.is_empty() {
+        return Err(format!("empty image"))
+    }
+
+    let mut squared = 0u64;
+    for (a, b) in reference.iter().zip(image.iter()) {
+        let diff = *a as i64 - *b as i64;
+        squared += (diff * diff) as u64;
+    }
+    if squared == 0 {
+        return Ok(f64::INFINITY)
+    }
+
+    let mse = squared as f64 / reference.len() as f64;
+    Ok(10.0 * (255.0 * 255.0 / mse).log10())
+}
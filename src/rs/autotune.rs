@@ -0,0 +1,178 @@
+use crate::realcugan::RealCugan;
+
+use std::collections::BTreeMap;
+use std::path::Path;
+use std::time::{Duration, Instant};
+
+use image::{DynamicImage, RgbImage};
+
+/// Tile sizes tried by the autotuner, the probe spans the largest one
+const CANDIDATES: [u32; 8] = [96, 128, 192, 256, 320, 384, 448, 512];
+
+/// Edge of the square probe image
+const PROBE_SIZE: u32 = 512;
+
+/// Timed runs per candidate after the warm up run
+const RUNS: u32 = 2;
+
+/// Name of the file holding the tuned tile sizes
+const FILE_NAME: &str = "autotune.txt";
+
+/// Everything the best tile size depends on
+pub(crate) struct AutotuneKey {
+    pub(crate) gpus: Vec<i32>,
+    pub(crate) threads: i32,
+    pub(crate) scale: i32,
+    pub(crate) noise: i32,
+    // orientations, 1 without tta
+    pub(crate) tta: i32,
+    pub(crate) precision: i32,
+    pub(crate) sync_gap: i32,
+    pub(crate) param: Vec<u8>,
+    pub(crate) bin_len: usize,
+}
+
+impl AutotuneKey {
+    fn devices(&self) -> Result<String, String> {
+        let mut devices = Vec::with_capacity(self.gpus.len());
+        for gpu in &self.gpus {
+            if *gpu == -1 {
+                devices.push(format!("cpu{}", self.threads));
+            } else {
+                devices.push(RealCugan::gpu_name(*gpu as u32)?);
+            }
+        }
+        Ok(devices.join("+"))
+    }
+
+    fn model_hash(&self) -> u64 {
+        // fnv1a over the network description and the size of the weights
+        let mut hash = 0xcbf29ce484222325u64;
+        for byte in self.param.iter().chain(self.bin_len.to_le_bytes().iter()) {
+            hash ^= *byte as u64;
+            hash = hash.wrapping_mul(0x100000001b3);
+        }
+        hash
+    }
+
+    fn name(&self) -> Result<String, String> {
+        Ok(format!(
+            "{} scale{} noise{} tta{} precision{} syncgap{} model{:016x}",
+            self.devices()?.replace('=', "-"),
+            self.scale,
+            self.noise,
+            if self.tta > 1 { self.tta } else { 0 },
+            self.precision,
+            self.sync_gap,
+            self.model_hash()
+        ))
+    }
+}
+
+/// Picks the tile size with the highest measured throughput, candidates that fail to run
+/// or whose allocations grow past the heap budget of a gpu are skipped. The result is
+/// remembered in dir per device, model and settings so later runs skip the measurement
+pub(crate) fn tile_size(realcugan: &RealCugan, key: &AutotuneKey, dir: &Path) -> Result<i32, String> {
+    let gpus = key.gpus.clone();
+    let key = key.name()?;
+    let path = dir.join(FILE_NAME);
+
+    let mut tuned = load(&path);
+    if let Some(tile_size) = tuned.get(&key) {
+        return Ok(*tile_size as i32)
+    }
+
+    let probe = probe();
+    let pixels = (PROBE_SIZE * PROBE_SIZE * RUNS) as f64;
+
+    let mut best: Option<(u32, f64)> = None;
+    for candidate in CANDIDATES {
+        realcugan.set_tile_size(candidate as i32);
+
+        // the warm up run grows the allocator pools, out of memory shows up here
+        if realcugan.process_image(probe.clone()).is_err() || over_budget(&gpus) {
+            continue
+        }
+
+        let mut elapsed = Duration::ZERO;
+        let mut failed = false;
+        for _ in 0..RUNS {
+            let start = Instant::now();
+            failed = realcugan.process_image(probe.clone()).is_err();
+            elapsed += start.elapsed();
+            if failed {
+                break
+            }
+        }
+        if failed {
+            continue
+        }
+
+        let throughput = pixels / elapsed.as_secs_f64().max(1e-9);
+        if best.map_or(true, |(_, best)| throughput > best) {
+            best = Some((candidate, throughput));
+        }
+    }
+
+    let (tile_size, _) = best.ok_or(format!("autotune failed: no tile size could be processed"))?;
+
+    tuned.insert(key, tile_size);
+    save(&path, &tuned)?;
+
+    Ok(tile_size as i32)
+}
+
+/// Whether the memory held on any of the gpus passed its heap budget, allocations past it
+/// may still succeed but page out to host memory, which the timing alone does not always show
+fn over_budget(gpus: &[i32]) -> bool {
+    gpus.iter()
+        .filter(|gpu| **gpu != -1)
+        .filter_map(|gpu| RealCugan::heap_usage(*gpu as u32).ok())
+        .any(|(usage, budget)| usage > budget)
+}
+
+/// Deterministic noise, flat images would favor whatever keeps the caches warm
+fn probe() -> DynamicImage {
+    let mut state = 0x2545f491u32;
+    let mut bytes = vec![0u8; (PROBE_SIZE * PROBE_SIZE * 3) as usize];
+    for byte in bytes.iter_mut() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        *byte = (state >> 24) as u8;
+    }
+    DynamicImage::from(RgbImage::from_raw(PROBE_SIZE, PROBE_SIZE, bytes).unwrap())
+}
+
+fn load(path: &Path) -> BTreeMap<String, u32> {
+    let mut tuned = BTreeMap::new();
+    if let Ok(text) = std::fs::read_to_string(path) {
+        for line in text.lines() {
+            if let Some((key, tile_size)) = line.rsplit_once('=') {
+                if let Ok(tile_size) = tile_size.trim().parse() {
+                    tuned.insert(key.trim().to_string(), tile_size);
+                }
+            }
+        }
+    }
+    tuned
+}
+
+fn save(path: &Path, tuned: &BTreeMap<String, u32>) -> Result<(), String> {
+    if let Some(dir) = path.parent() {
+        std::fs::create_dir_all(dir)
+            .map_err(|e| format!("failed to create autotune dir: {}", e))?;
+    }
+
+    let mut text = String::new();
+    for (key, tile_size) in tuned {
+        text += &format!("{} = {}\n", key, tile_size);
+    }
+
+    // written aside and renamed, so concurrent processes never read half a file
+    let tmp = path.with_extension(format!("{}.tmp", std::process::id()));
+    std::fs::write(&tmp, text)
+        .map_err(|e| format!("failed to write autotune file: {}", e))?;
+    std::fs::rename(&tmp, path)
+        .map_err(|e| format!("failed to write autotune file: {}", e))
+}
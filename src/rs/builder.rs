@@ -1,4 +1,17 @@
-use crate::realcugan::RealCugan;
+use crate::autotune::{self, AutotuneKey};
+use crate::realcugan::{ModelBin, RealCugan};
+use std::path::{Path, PathBuf};
+
+/// include_bytes with the 4 byte alignment ncnn needs to reference the weights in place
+#[cfg(any(feature = "models-nose", feature = "models-pro", feature = "models-se"))]
+macro_rules! include_weights {
+    ($path:literal) => {{
+        #[repr(C, align(4))]
+        struct Aligned<T: ?Sized>(T);
+        const ALIGNED: &Aligned<[u8]> = &Aligned(*include_bytes!($path));
+        &ALIGNED.0
+    }};
+}
 
 #[cfg(any(feature = "models-nose", feature = "models-pro", feature = "models-se"))]
 #[derive(Debug, Copy, Clone, PartialEq)]
@@ -49,13 +62,33 @@ pub enum SyncGap {
     Strict,        // 3 (default)
 }
 
+/// Numeric precision of the network, lower precisions trade a small PSNR loss for throughput
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub enum Precision {
+    Fp32,           // 0
+    Fp16Storage,    // 1 (default)
+    Fp16Arithmetic, // 2, fp16 storage where the gpu has no fp16 arithmetic
+    Int8,           // 3, needs a model quantized with ncnn2int8
+}
+
 #[derive(Debug, Clone)]
 struct GeneralParameters {
-    gpu: i32,
+    gpus: Vec<i32>,
     tile_size: i32,
     sync_gap: i32,
     threads: i32,
-    tta: bool,
+    pipeline_depth: i32,
+    tile_threads: i32,
+    tile_cache: usize,
+    feature_cache_budget: usize,
+    temporal_threshold: f32,
+    precision: i32,
+    // orientations averaged per tile, 1 disables tta
+    tta: i32,
+    autotune: bool,
+    cache_dir: Option<PathBuf>,
+    // width, height and channels of the dummy image run by build
+    warm_up: Option<(u32, u32, u8)>,
 }
 
 #[derive(Debug, Clone)]
@@ -70,6 +103,8 @@ struct ModelParameters<'a> {
 #[derive(Debug, Clone)]
 pub struct Builder<'a> {
     files: Option<(&'a str, &'a str)>,
+    // weights of a built-in model, referenced in place by every instance
+    embedded_bin: Option<&'static [u8]>,
     parameters: GeneralParameters,
     model_parameters: ModelParameters<'a>
 }
@@ -78,12 +113,22 @@ impl <'a>Default for Builder<'a> {
     fn default() -> Self {
         Self {
             files: None,
+            embedded_bin: None,
             parameters: GeneralParameters{
-                gpu: 0,
+                gpus: vec![0],
                 tile_size: 0,
                 sync_gap: 3,
-                tta: false,
+                tta: 1,
                 threads: 1,
+                pipeline_depth: 1,
+                tile_threads: 1,
+                tile_cache: 0,
+                feature_cache_budget: 0,
+                temporal_threshold: 0.0,
+                precision: 1,
+                autotune: false,
+                cache_dir: None,
+                warm_up: None,
             },
             model_parameters: ModelParameters {
                 param: &[],
@@ -103,17 +148,32 @@ impl <'a>Builder<'a> {
     }
 
     pub fn gpu(mut self, gpu: u32) -> Self {
-        self.parameters.gpu = gpu as i32;
+        self.parameters.gpus = vec![gpu as i32];
+        self
+    }
+
+    /// Spread the tiles of every image over several gpus
+    pub fn gpus(mut self, gpus: &[u32]) -> Self {
+        self.parameters.gpus = gpus.iter().map(|gpu| *gpu as i32).collect();
         self
     }
 
     pub fn cpu(mut self) -> Self {
-        self.parameters.gpu = -1;
+        self.parameters.gpus = vec![-1];
         self
     }
 
+    /// Average the output over all 8 flips and transposes of every tile
     pub fn tta(mut self) -> Self {
-        self.parameters.tta = true;
+        self.parameters.tta = 8;
+        self
+    }
+
+    /// Average the output over the first level orientations of every tile: 2 adds the vertical
+    /// flip, 4 the horizontal and double flips, 8 the transposes. Other levels round down,
+    /// 1 disables tta. The cost grows with the level, 8 runs the network eight times per tile
+    pub fn tta_level(mut self, level: u32) -> Self {
+        self.parameters.tta = level.max(1) as i32;
         self
     }
 
@@ -137,6 +197,76 @@ impl <'a>Builder<'a> {
         self
     }
 
+    /// Number of tile rows kept in flight on the gpu, 1 processes rows strictly one after another
+    pub fn pipeline_depth(mut self, pipeline_depth: u32) -> Self {
+        self.parameters.pipeline_depth = pipeline_depth as i32;
+        self
+    }
+
+    /// Number of tiles processed in parallel on the cpu, the threads are split between them
+    pub fn tile_threads(mut self, tile_threads: u32) -> Self {
+        self.parameters.tile_threads = tile_threads as i32;
+        self
+    }
+
+    /// Keep up to this many bytes of output tiles and reuse them when the same input tile, with
+    /// the same padding and settings, comes back, as in static regions of video or screen captures.
+    /// Models using the sync gap are not cached since their tiles depend on the whole image
+    pub fn tile_cache(mut self, bytes: usize) -> Self {
+        self.parameters.tile_cache = bytes;
+        self
+    }
+
+    /// Bytes of GPU memory the SE features of one pass may use on each device before whole tile
+    /// rows are moved to host memory, 0 uses an eighth of the device heap budget
+    pub fn feature_cache_budget(mut self, bytes: usize) -> Self {
+        self.parameters.feature_cache_budget = bytes;
+        self
+    }
+
+    /// Video mode for SE models on the GPU: a frame whose coarse thumbnail differs from the frame
+    /// the sync gap features were last computed on by at most threshold, the mean absolute
+    /// difference in 0 to 255 pixel units, reuses those features and skips the stage 0 passes.
+    /// A scene cut or a slow drift past the threshold computes them again, 0 disables the reuse
+    pub fn temporal_reuse(mut self, threshold: f32) -> Self {
+        self.parameters.temporal_threshold = threshold;
+        self
+    }
+
+    /// Numeric precision of the model weights, activations and arithmetic,
+    /// set before building since the pipelines are compiled for it
+    pub fn precision(mut self, precision: Precision) -> Self {
+        self.parameters.precision = match precision {
+            Precision::Fp32 => 0,
+            Precision::Fp16Storage => 1,
+            Precision::Fp16Arithmetic => 2,
+            Precision::Int8 => 3,
+        };
+        self
+    }
+
+    /// Measure the throughput of several tile sizes on a probe image at first use and keep the
+    /// fastest one that fits in memory. The choice is remembered per device, model and settings
+    /// in the cache dir, or in the temp dir without one, so later runs skip the measurement
+    pub fn autotune(mut self) -> Self {
+        self.parameters.autotune = true;
+        self
+    }
+
+    /// Run a dummy image of this shape at the end of build, so the instance is returned with
+    /// its memory pools and pipelines ready and the first real image is not a latency outlier.
+    /// channels is 3 for rgb and 4 for rgba inputs
+    pub fn warm_up(mut self, width: u32, height: u32, channels: u8) -> Self {
+        self.parameters.warm_up = Some((width, height, channels));
+        self
+    }
+
+    /// Keep the compiled shaders in this directory, so later runs on the same gpu and driver skip compiling them
+    pub fn cache_dir<P: AsRef<Path>>(mut self, cache_dir: P) -> Self {
+        self.parameters.cache_dir = Some(cache_dir.as_ref().to_path_buf());
+        self
+    }
+
     pub fn scale(mut self, scale: i32) -> Self {
         self.model_parameters.scale = scale;
         self
@@ -149,6 +279,7 @@ impl <'a>Builder<'a> {
 
     pub fn model_files(mut self, param_file: &'a str, bin_file: &'a str) -> Self {
         self.files = Some((param_file, bin_file));
+        self.embedded_bin = None;
         self
     }
 
@@ -156,6 +287,7 @@ impl <'a>Builder<'a> {
         self.model_parameters.param = param;
         self.model_parameters.bin = bin;
         self.files = None;
+        self.embedded_bin = None;
         self
     }
 
@@ -200,42 +332,84 @@ impl <'a>Builder<'a> {
             Model::Se4xHighDenoise => MODEL_SE_4X_DENOISE_X3,
         };
         self.files = None;
+        self.embedded_bin = Some(model.bin);
         self.model_parameters = model;
         self
     }
 
-    fn get_bytes(&self) -> Result<(Vec<u8>, Vec<u8>), String> {
+    fn get_bytes(&self) -> Result<(Vec<u8>, ModelBin), String> {
         if let Some((param_file, bin_file)) = &self.files {
             let param = std::fs::read(param_file)
                 .map_err(|e| format!("failed to read param file: {}", e))?;
-            let bin = std::fs::read(bin_file)
-                .map_err(|e| format!("failed to read bin file: {}", e))?;
+            let bin = ModelBin::read(bin_file)?;
             Ok((param, bin))
+        } else if let Some(bin) = self.embedded_bin {
+            Ok((self.model_parameters.param.to_vec(), ModelBin::from_static(bin)))
         } else {
-            Ok((self.model_parameters.param.to_vec(), self.model_parameters.bin.to_vec()))
+            Ok((self.model_parameters.param.to_vec(), ModelBin::copy(self.model_parameters.bin)))
         }
     }
 
     pub fn build(&self) -> Result<RealCugan, String> {
 
+        // the built-in weights are float, int8 needs a calibrated model
+        if self.parameters.precision == 3 && self.embedded_bin.is_some() {
+            return Err(format!("int8 precision needs a model quantized with ncnn2int8, the built-in models are float"))
+        }
+
         let (param, bin) = self.get_bytes()?;
+        let bin_len = bin.len();
 
         let sync_gap = if self.model_parameters.allow_sync_gap { 
             self.parameters.sync_gap
         } else {
             0
         };
-        RealCugan::new(
-            self.parameters.gpu,
+        let realcugan = RealCugan::with_model(
+            &self.parameters.gpus,
             self.parameters.threads,
             self.parameters.tta,
+            self.parameters.precision,
             sync_gap,
             self.parameters.tile_size,
             self.model_parameters.scale,
             self.model_parameters.noise,
             &param,
-            &bin
-        )
+            bin,
+            self.parameters.cache_dir.as_deref(),
+        )?;
+        realcugan.set_pipeline_depth(self.parameters.pipeline_depth);
+        realcugan.set_tile_threads(self.parameters.tile_threads);
+        realcugan.set_feature_cache_budget(self.parameters.feature_cache_budget);
+
+        if self.parameters.autotune {
+            let key = AutotuneKey {
+                gpus: self.parameters.gpus.clone(),
+                threads: self.parameters.threads,
+                scale: self.model_parameters.scale,
+                noise: self.model_parameters.noise,
+                tta: self.parameters.tta,
+                precision: self.parameters.precision,
+                sync_gap,
+                param,
+                bin_len,
+            };
+            let dir = self.parameters.cache_dir.clone()
+                .unwrap_or_else(|| std::env::temp_dir().join("realcugan-rs"));
+            let tile_size = autotune::tile_size(&realcugan, &key, &dir)?;
+            realcugan.set_tile_size(tile_size);
+        }
+
+        // before the caches are enabled, the dummy image leaves nothing in them
+        if let Some((width, height, channels)) = self.parameters.warm_up {
+            realcugan.warm_up(width, height, channels)?;
+        }
+
+        // enabled after autotuning, the repeated probe would only measure the caches
+        realcugan.set_tile_cache_size(self.parameters.tile_cache);
+        realcugan.set_temporal_threshold(self.parameters.temporal_threshold);
+
+        Ok(realcugan)
     }
 
     pub fn unwrap(&self) -> RealCugan {
@@ -247,7 +421,7 @@ impl <'a>Builder<'a> {
 #[cfg(feature = "models-nose")]
 const MODEL_NOSE_2X_NO_DENOISE: ModelParameters = ModelParameters {
     param: include_bytes!("../../models/models-nose/up2x-no-denoise.param"),
-    bin: include_bytes!("../../models/models-nose/up2x-no-denoise.bin"),
+    bin: include_weights!("../../models/models-nose/up2x-no-denoise.bin"),
     scale: 2,
     noise: 0,
     allow_sync_gap: true,
@@ -256,7 +430,7 @@ const MODEL_NOSE_2X_NO_DENOISE: ModelParameters = ModelParameters {
 #[cfg(feature = "models-pro")]
 const MODEL_PRO_2X_NO_DENOISE: ModelParameters = ModelParameters {
     param: include_bytes!("../../models/models-pro/up2x-no-denoise.param"),
-    bin: include_bytes!("../../models/models-pro/up2x-no-denoise.bin"),
+    bin: include_weights!("../../models/models-pro/up2x-no-denoise.bin"),
     scale: 2,
     noise: 0,
     allow_sync_gap: true,
@@ -265,7 +439,7 @@ const MODEL_PRO_2X_NO_DENOISE: ModelParameters = ModelParameters {
 #[cfg(feature = "models-pro")]
 const MODEL_PRO_2X_CONSERVATIVE: ModelParameters = ModelParameters {
     param: include_bytes!("../../models/models-pro/up2x-conservative.param"),
-    bin: include_bytes!("../../models/models-pro/up2x-conservative.bin"),
+    bin: include_weights!("../../models/models-pro/up2x-conservative.bin"),
     scale: 2,
     noise: -1,
     allow_sync_gap: true,
@@ -274,7 +448,7 @@ const MODEL_PRO_2X_CONSERVATIVE: ModelParameters = ModelParameters {
 #[cfg(feature = "models-pro")]
 const MODEL_PRO_2X_DENOISE_X3: ModelParameters = ModelParameters {
     param: include_bytes!("../../models/models-pro/up2x-denoise3x.param"),
-    bin: include_bytes!("../../models/models-pro/up2x-denoise3x.bin"),
+    bin: include_weights!("../../models/models-pro/up2x-denoise3x.bin"),
     scale: 2,
     noise: 3,
     allow_sync_gap: true,
@@ -283,7 +457,7 @@ const MODEL_PRO_2X_DENOISE_X3: ModelParameters = ModelParameters {
 #[cfg(feature = "models-pro")]
 const MODEL_PRO_3X_NO_DENOISE: ModelParameters = ModelParameters {
     param: include_bytes!("../../models/models-pro/up3x-no-denoise.param"),
-    bin: include_bytes!("../../models/models-pro/up3x-no-denoise.bin"),
+    bin: include_weights!("../../models/models-pro/up3x-no-denoise.bin"),
     scale: 3,
     noise: 0,
     allow_sync_gap: true,
@@ -292,7 +466,7 @@ const MODEL_PRO_3X_NO_DENOISE: ModelParameters = ModelParameters {
 #[cfg(feature = "models-pro")]
 const MODEL_PRO_3X_CONSERVATIVE: ModelParameters = ModelParameters {
     param: include_bytes!("../../models/models-pro/up3x-conservative.param"),
-    bin: include_bytes!("../../models/models-pro/up3x-conservative.bin"),
+    bin: include_weights!("../../models/models-pro/up3x-conservative.bin"),
     scale: 3,
     noise: -1,
     allow_sync_gap: true,
@@ -301,7 +475,7 @@ const MODEL_PRO_3X_CONSERVATIVE: ModelParameters = ModelParameters {
 #[cfg(feature = "models-pro")]
 const MODEL_PRO_3X_DENOISE_X3: ModelParameters = ModelParameters {
     param: include_bytes!("../../models/models-pro/up3x-denoise3x.param"),
-    bin: include_bytes!("../../models/models-pro/up3x-denoise3x.bin"),
+    bin: include_weights!("../../models/models-pro/up3x-denoise3x.bin"),
     scale: 3,
     noise: 3,
     allow_sync_gap: true,
@@ -310,7 +484,7 @@ const MODEL_PRO_3X_DENOISE_X3: ModelParameters = ModelParameters {
 #[cfg(feature = "models-se")]
 const MODEL_SE_2X_NO_DENOISE: ModelParameters = ModelParameters {
     param: include_bytes!("../../models/models-se/up2x-no-denoise.param"),
-    bin: include_bytes!("../../models/models-se/up2x-no-denoise.bin"),
+    bin: include_weights!("../../models/models-se/up2x-no-denoise.bin"),
     scale: 2,
     noise: 0,
     allow_sync_gap: false,
@@ -319,7 +493,7 @@ const MODEL_SE_2X_NO_DENOISE: ModelParameters = ModelParameters {
 #[cfg(feature = "models-se")]
 const MODEL_SE_2X_CONSERVATIVE: ModelParameters = ModelParameters {
     param: include_bytes!("../../models/models-se/up2x-conservative.param"),
-    bin: include_bytes!("../../models/models-se/up2x-conservative.bin"),
+    bin: include_weights!("../../models/models-se/up2x-conservative.bin"),
     scale: 2,
     noise: -1,
     allow_sync_gap: false,
@@ -328,7 +502,7 @@ const MODEL_SE_2X_CONSERVATIVE: ModelParameters = ModelParameters {
 #[cfg(feature = "models-se")]
 const MODEL_SE_2X_DENOISE_X1: ModelParameters = ModelParameters {
     param: include_bytes!("../../models/models-se/up2x-denoise1x.param"),
-    bin: include_bytes!("../../models/models-se/up2x-denoise1x.bin"),
+    bin: include_weights!("../../models/models-se/up2x-denoise1x.bin"),
     scale: 2,
     noise: 1,
     allow_sync_gap: false,
@@ -337,7 +511,7 @@ const MODEL_SE_2X_DENOISE_X1: ModelParameters = ModelParameters {
 #[cfg(feature = "models-se")]
 const MODEL_SE_2X_DENOISE_X2: ModelParameters = ModelParameters {
     param: include_bytes!("../../models/models-se/up2x-denoise2x.param"),
-    bin: include_bytes!("../../models/models-se/up2x-denoise2x.bin"),
+    bin: include_weights!("../../models/models-se/up2x-denoise2x.bin"),
     scale: 2,
     noise: 2,
     allow_sync_gap: false,
@@ -346,7 +520,7 @@ const MODEL_SE_2X_DENOISE_X2: ModelParameters = ModelParameters {
 #[cfg(feature = "models-se")]
 const MODEL_SE_2X_DENOISE_X3: ModelParameters = ModelParameters {
     param: include_bytes!("../../models/models-se/up2x-denoise3x.param"),
-    bin: include_bytes!("../../models/models-se/up2x-denoise3x.bin"),
+    bin: include_weights!("../../models/models-se/up2x-denoise3x.bin"),
     scale: 2,
     noise: 3,
     allow_sync_gap: false,
@@ -355,7 +529,7 @@ const MODEL_SE_2X_DENOISE_X3: ModelParameters = ModelParameters {
 #[cfg(feature = "models-se")]
 const MODEL_SE_3X_NO_DENOISE: ModelParameters = ModelParameters {
     param: include_bytes!("../../models/models-se/up3x-no-denoise.param"),
-    bin: include_bytes!("../../models/models-se/up3x-no-denoise.bin"),
+    bin: include_weights!("../../models/models-se/up3x-no-denoise.bin"),
     scale: 3,
     noise: 0,
     allow_sync_gap: false,
@@ -364,7 +538,7 @@ const MODEL_SE_3X_NO_DENOISE: ModelParameters = ModelParameters {
 #[cfg(feature = "models-se")]
 const MODEL_SE_3X_CONSERVATIVE: ModelParameters = ModelParameters {
     param: include_bytes!("../../models/models-se/up3x-conservative.param"),
-    bin: include_bytes!("../../models/models-se/up3x-conservative.bin"),
+    bin: include_weights!("../../models/models-se/up3x-conservative.bin"),
     scale: 3,
     noise: -1,
     allow_sync_gap: false,
@@ -373,7 +547,7 @@ const MODEL_SE_3X_CONSERVATIVE: ModelParameters = ModelParameters {
 #[cfg(feature = "models-se")]
 const MODEL_SE_3X_DENOISE_X3: ModelParameters = ModelParameters {
     param: include_bytes!("../../models/models-se/up3x-denoise3x.param"),
-    bin: include_bytes!("../../models/models-se/up3x-denoise3x.bin"),
+    bin: include_weights!("../../models/models-se/up3x-denoise3x.bin"),
     scale: 3,
     noise: 3,
     allow_sync_gap: false,
@@ -382,7 +556,7 @@ const MODEL_SE_3X_DENOISE_X3: ModelParameters = ModelParameters {
 #[cfg(feature = "models-se")]
 const MODEL_SE_4X_NO_DENOISE: ModelParameters = ModelParameters {
     param: include_bytes!("../../models/models-se/up4x-no-denoise.param"),
-    bin: include_bytes!("../../models/models-se/up4x-no-denoise.bin"),
+    bin: include_weights!("../../models/models-se/up4x-no-denoise.bin"),
     scale: 4,
     noise: 0,
     allow_sync_gap: false,
@@ -391,7 +565,7 @@ const MODEL_SE_4X_NO_DENOISE: ModelParameters = ModelParameters {
 #[cfg(feature = "models-se")]
 const MODEL_SE_4X_CONSERVATIVE: ModelParameters = ModelParameters {
     param: include_bytes!("../../models/models-se/up4x-conservative.param"),
-    bin: include_bytes!("../../models/models-se/up4x-conservative.bin"),
+    bin: include_weights!("../../models/models-se/up4x-conservative.bin"),
     scale: 4,
     noise: -1,
     allow_sync_gap: false,
@@ -400,7 +574,7 @@ const MODEL_SE_4X_CONSERVATIVE: ModelParameters = ModelParameters {
 #[cfg(feature = "models-se")]
 const MODEL_SE_4X_DENOISE_X3: ModelParameters = ModelParameters {
     param: include_bytes!("../../models/models-se/up4x-denoise3x.param"),
-    bin: include_bytes!("../../models/models-se/up4x-denoise3x.bin"),
+    bin: include_weights!("../../models/models-se/up4x-denoise3x.bin"),
     scale: 4,
     noise: 3,
     allow_sync_gap: false,
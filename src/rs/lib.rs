@@ -1,8 +1,14 @@
+mod accuracy;
+mod autotune;
 mod builder;
+mod pipeline;
 mod realcugan;
+mod ticket;
 
 #[cfg(any(feature = "models-nose", feature = "models-pro", feature = "models-se"))]
 pub use builder::Model;
-pub use builder::SyncGap;
-pub use realcugan::RealCugan;
+pub use accuracy::psnr;
+pub use builder::{Builder, Precision, SyncGap};
+pub use realcugan::{Frames, GapFeatures, RealCugan, StageTimes, Stats, YuvFormat};
+pub use ticket::{Submitter, Ticket};
 pub use image;
\ No newline at end of file
@@ -0,0 +1,109 @@
+use crate::realcugan::RealCugan;
+
+use std::io::Cursor;
+use std::sync::mpsc::{sync_channel, Receiver};
+use std::sync::Mutex;
+
+use image::{DynamicImage, ImageFormat};
+
+/// Images waiting between two stages per worker, bounds the memory of decoded images
+const QUEUE_DEPTH: usize = 2;
+
+/// An image between two stages with the position of its input and the format to encode it in
+type Staged = (usize, Result<(DynamicImage, ImageFormat), String>);
+
+/// Takes the next item of a stage queue shared by several workers
+fn next<T>(receiver: &Mutex<Receiver<T>>) -> Option<T> {
+    // the lock is only held while taking the item, not while working on it
+    receiver.lock().unwrap().recv().ok()
+}
+
+fn decode(realcugan: &RealCugan, bytes: &[u8]) -> Result<(DynamicImage, ImageFormat), String> {
+    let format = image::guess_format(bytes).unwrap_or(ImageFormat::Png);
+    let image = image::load_from_memory(bytes)
+        .map_err(|x| format!("failed to load raw image: {}", x))?;
+    // the gray to rgb copy happens here, off the gpu thread
+    let (image, _) = realcugan.prepare_image(image);
+    Ok((image, format))
+}
+
+fn encode(image: &DynamicImage, format: ImageFormat) -> Result<Vec<u8>, String> {
+    let mut bytes = Cursor::new(Vec::new());
+    image.write_to(&mut bytes, format)
+        .map_err(|e| format!("Failed to write to buffer: {}", e))
+        .map(|_| bytes.into_inner())
+}
+
+/// Runs process_raw_image over inputs as three concurrent stages joined by bounded queues:
+/// decode workers, one gpu stage and encode workers. A full queue blocks the stage before it,
+/// so a slow encoder holds back decoding instead of piling up upscaled images, while the gpu
+/// stage always has the next decoded image ready. Results are handed to output on the calling
+/// thread in completion order, together with the position of the input
+pub(crate) fn process_raw_images<I, F>(realcugan: &RealCugan, inputs: I, workers: usize, mut output: F)
+where
+    I: Iterator<Item = Vec<u8>> + Send,
+    F: FnMut(usize, Result<Vec<u8>, String>),
+{
+    let workers = workers.max(1);
+    let depth = QUEUE_DEPTH * workers;
+
+    let (raw_sender, raw_receiver) = sync_channel::<(usize, Vec<u8>)>(depth);
+    let (decoded_sender, decoded_receiver) = sync_channel::<Staged>(depth);
+    let (upscaled_sender, upscaled_receiver) = sync_channel::<Staged>(depth);
+    let (encoded_sender, encoded_receiver) = sync_channel::<(usize, Result<Vec<u8>, String>)>(depth);
+
+    let raw_receiver = Mutex::new(raw_receiver);
+    let upscaled_receiver = Mutex::new(upscaled_receiver);
+
+    std::thread::scope(|scope| {
+        scope.spawn(move || {
+            for input in inputs.enumerate() {
+                if raw_sender.send(input).is_err() {
+                    break
+                }
+            }
+        });
+
+        for _ in 0..workers {
+            let raw_receiver = &raw_receiver;
+            let decoded_sender = decoded_sender.clone();
+            scope.spawn(move || {
+                while let Some((index, bytes)) = next(raw_receiver) {
+                    if decoded_sender.send((index, decode(realcugan, &bytes))).is_err() {
+                        break
+                    }
+                }
+            });
+        }
+        drop(decoded_sender);
+
+        scope.spawn(move || {
+            for (index, decoded) in decoded_receiver {
+                let upscaled = decoded.and_then(|(image, format)| {
+                    realcugan.process_image(image).map(|image| (image, format))
+                });
+                if upscaled_sender.send((index, upscaled)).is_err() {
+                    break
+                }
+            }
+        });
+
+        for _ in 0..workers {
+            let upscaled_receiver = &upscaled_receiver;
+            let encoded_sender = encoded_sender.clone();
+            scope.spawn(move || {
+                while let Some((index, upscaled)) = next(upscaled_receiver) {
+                    let encoded = upscaled.and_then(|(image, format)| encode(&image, format));
+                    if encoded_sender.send((index, encoded)).is_err() {
+                        break
+                    }
+                }
+            });
+        }
+        drop(encoded_sender);
+
+        for (index, encoded) in encoded_receiver {
+            output(index, encoded);
+        }
+    });
+}
@@ -1,17 +1,25 @@
 use crate::builder::Builder;
 #[cfg(any(feature = "models-nose", feature = "models-pro", feature = "models-se"))]
 use crate::builder::Model;
+use crate::pipeline;
+use crate::ticket::Submitter;
 
-use std::io::Cursor;
+use std::collections::VecDeque;
+use std::ffi::CString;
+use std::io::{Cursor, Read};
 use std::path::Path;
 use std::sync::Arc;
 use std::sync::atomic::{AtomicPtr, AtomicU8, Ordering};
+use std::time::Duration;
 
 use image::{DynamicImage, GrayAlphaImage, GrayImage, RgbImage, RgbaImage};
-use libc::{c_char, c_int, c_uchar, c_uint, c_void, FILE};
+use libc::{c_char, c_float, c_int, c_uchar, c_uint, c_void, size_t};
 
 static INSTANCES: AtomicU8 = AtomicU8::new(0);
 
+/// Number of frames handed to the gpu at once by process_frames
+const FRAMES_PER_BATCH: usize = 4;
+
 #[repr(C)]
 #[derive(Debug)]
 pub struct Image {
@@ -21,6 +29,115 @@ pub struct Image {
     pub c: c_int,
 }
 
+/// Layouts of 4:2:0 video frames, the planes follow each other and the chroma planes
+/// have half the width and height of the luma plane
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum YuvFormat {
+    /// Y plane, U plane, V plane
+    I420,
+    /// Y plane, interleaved UV plane
+    Nv12,
+}
+
+impl YuvFormat {
+    /// REALCUGAN_FORMAT_* of realcugan.h
+    fn id(self) -> c_int {
+        match self {
+            YuvFormat::I420 => 1,
+            YuvFormat::Nv12 => 2,
+        }
+    }
+}
+
+/// Averaged SE gap features of a whole frame, computed once by gap_features and handed to
+/// process_roi_into so that every region of the frame is upscaled as in a full frame run
+pub struct GapFeatures {
+    pointer: *mut c_void,
+}
+
+// the features are plain host buffers, only read once created
+unsafe impl Send for GapFeatures {}
+unsafe impl Sync for GapFeatures {}
+
+impl Drop for GapFeatures {
+    fn drop(&mut self) {
+        unsafe { realcugan_free_gap_features(self.pointer) };
+    }
+}
+
+/// Stages of the tile loops, in the order of realcugan.h
+const STAGES: usize = 8;
+
+#[repr(C)]
+#[derive(Default)]
+struct RawStats {
+    tiles: u64,
+    cached_tiles: u64,
+    bytes_uploaded: u64,
+    bytes_downloaded: u64,
+    feature_cache_peak_bytes: u64,
+    reused_frames: u64,
+    spilled_passes: u64,
+    host_sync_gaps: u64,
+    host_ns: [u64; STAGES],
+    gpu_ns: [u64; STAGES],
+}
+
+/// Time spent in each stage of the tile loops
+#[derive(Debug, Copy, Clone, Default, PartialEq)]
+pub struct StageTimes {
+    /// Input pixels to tiles, including tile cache lookups
+    pub crop: Duration,
+    pub upload: Duration,
+    pub preproc: Duration,
+    pub inference: Duration,
+    pub postproc: Duration,
+    /// Output tiles to pixels, including tile cache fills
+    pub download: Duration,
+    /// Host blocked until the gpu finished the submitted work
+    pub wait: Duration,
+    /// Feature download, average and upload of the se models
+    pub sync_gap: Duration,
+}
+
+impl StageTimes {
+    fn from_ns(ns: &[u64; STAGES]) -> Self {
+        Self {
+            crop: Duration::from_nanos(ns[0]),
+            upload: Duration::from_nanos(ns[1]),
+            preproc: Duration::from_nanos(ns[2]),
+            inference: Duration::from_nanos(ns[3]),
+            postproc: Duration::from_nanos(ns[4]),
+            download: Duration::from_nanos(ns[5]),
+            wait: Duration::from_nanos(ns[6]),
+            sync_gap: Duration::from_nanos(ns[7]),
+        }
+    }
+}
+
+/// Work done since the instance was created or its stats reset, summed over its gpus
+#[derive(Debug, Copy, Clone, Default, PartialEq)]
+pub struct Stats {
+    /// Tiles run through the network
+    pub tiles: u64,
+    /// Tiles copied from the tile cache
+    pub cached_tiles: u64,
+    pub bytes_uploaded: u64,
+    pub bytes_downloaded: u64,
+    /// Largest amount of se features held by one pass
+    pub feature_cache_peak_bytes: u64,
+    /// SE frames that reused the features of an earlier frame of the video
+    pub reused_frames: u64,
+    /// SE passes of one device that moved feature rows past the feature cache budget to host memory
+    pub spilled_passes: u64,
+    /// SE sync gaps averaged on the host instead of the gpu
+    pub host_sync_gaps: u64,
+    /// Wall time on the host, gpu stages only record commands so their gpu time lands in wait
+    pub host: StageTimes,
+    /// Gpu time from timestamp queries, zero unless ncnn is built with NCNN_BENCHMARK
+    pub gpu: StageTimes,
+}
+
 extern "C" {
     fn realcugan_init(
         gpuid: c_int,
@@ -28,6 +145,15 @@ extern "C" {
         num_threads: c_int,
     ) -> *mut c_void;
 
+    fn realcugan_init_multi(
+        gpuids: *const c_int,
+        gpu_count: c_int,
+        tta_mode: bool,
+        num_threads: c_int,
+    ) -> *mut c_void;
+
+    fn realcugan_init_context(model: *const c_void) -> *mut c_void;
+
     fn realcugan_set_parameters(
         realcugan: *mut c_void,
         scale: c_int,
@@ -37,46 +163,203 @@ extern "C" {
         tilesize: c_int,
     );
 
+    fn realcugan_set_tilesize(realcugan: *mut c_void, tilesize: c_int);
+
+    fn realcugan_set_pipeline_depth(realcugan: *mut c_void, pipeline_depth: c_int);
+
+    fn realcugan_set_tile_threads(realcugan: *mut c_void, tile_threads: c_int);
+
+    fn realcugan_set_tile_cache_size(realcugan: *mut c_void, tile_cache_size: size_t);
+
+    fn realcugan_set_feature_cache_budget(realcugan: *mut c_void, feature_cache_budget: size_t);
+
+    fn realcugan_set_temporal_threshold(realcugan: *mut c_void, temporal_threshold: c_float);
+
     fn realcugan_get_gpu_count() -> c_int;
 
+    fn realcugan_get_stats(realcugan: *const c_void, stats: *mut RawStats);
+
+    fn realcugan_reset_stats(realcugan: *mut c_void);
+
+    fn realcugan_get_gpu_name(gpuid: c_int) -> *const c_char;
+
     fn realcugan_destroy_gpu_instance();
 
     fn realcugan_get_heap_budget(gpuid: c_int) -> c_uint;
 
-    fn realcugan_free_image(mat_ptr: *mut c_void);
+    fn realcugan_get_heap_usage(gpuid: c_int) -> c_uint;
 
     fn realcugan_free(realcugan: *mut c_void);
 
-    fn realcugan_load_files(
-        realcugan: *mut c_void, 
-        param_path: *mut FILE,
-        model_path: *mut FILE
+    fn realcugan_set_precision(realcugan: *mut c_void, precision: c_int);
+
+    fn realcugan_set_tta_level(realcugan: *mut c_void, tta_level: c_int);
+
+    fn realcugan_set_cache_dir(realcugan: *mut c_void, cache_dir: *const c_char);
+
+    fn realcugan_load_memory(
+        realcugan: *mut c_void,
+        param: *const c_char,
+        bin: *const c_uchar,
+    ) -> c_int;
+
+    fn realcugan_process_into(
+        realcugan: *mut c_void,
+        in_image: *const Image,
+        out_image: *const Image,
+    ) -> c_int;
+
+    fn realcugan_process_cpu_into(
+        realcugan: *mut c_void,
+        in_image: *const Image,
+        out_image: *const Image,
+    ) -> c_int;
+
+    fn realcugan_process_yuv_into(
+        realcugan: *mut c_void,
+        in_image: *const Image,
+        out_image: *const Image,
+        format: c_int,
     ) -> c_int;
 
-    fn realcugan_process(
+    fn realcugan_warm_up(realcugan: *mut c_void, w: c_int, h: c_int, c: c_int) -> c_int;
+
+    fn realcugan_gap_features(realcugan: *mut c_void, in_image: *const Image) -> *mut c_void;
+
+    fn realcugan_free_gap_features(feats: *mut c_void);
+
+    fn realcugan_process_roi_into(
         realcugan: *mut c_void,
         in_image: *const Image,
+        roi_x: c_int,
+        roi_y: c_int,
+        roi_w: c_int,
+        roi_h: c_int,
         out_image: *const Image,
-        mat_ptr: *mut *mut c_void,
+        feats: *const c_void,
     ) -> c_int;
 
-    fn realcugan_process_cpu(
+    fn realcugan_process_batch(
         realcugan: *mut c_void,
-        in_image: &Image,
-        out_image: &Image,
-        mat_ptr: *mut *mut c_void,
+        in_images: *const Image,
+        out_images: *const Image,
+        count: c_int,
     ) -> c_int;
+
+    fn realcugan_process_stream(
+        realcugan: *mut c_void,
+        w: c_int,
+        h: c_int,
+        c: c_int,
+        reader: extern "C" fn(*mut c_void, c_int, c_int, *mut c_uchar) -> c_int,
+        writer: extern "C" fn(*mut c_void, c_int, c_int, *const c_uchar) -> c_int,
+        userdata: *mut c_void,
+    ) -> c_int;
+}
+
+/// Reader and writer of process_stream, handed to the c++ side as userdata
+struct Stream<'a> {
+    reader: &'a mut dyn FnMut(u32, &mut [u8]) -> Result<(), String>,
+    writer: &'a mut dyn FnMut(u32, &[u8]) -> Result<(), String>,
+    in_row_len: usize,
+    out_row_len: usize,
+    error: Option<String>,
+}
+
+extern "C" fn stream_read_rows(userdata: *mut c_void, y: c_int, rows: c_int, pixels: *mut c_uchar) -> c_int {
+    let stream = unsafe { &mut *(userdata as *mut Stream) };
+    let pixels = unsafe { std::slice::from_raw_parts_mut(pixels, rows as usize * stream.in_row_len) };
+    match (stream.reader)(y as u32, pixels) {
+        Ok(()) => 0,
+        Err(e) => {
+            stream.error = Some(e);
+            -1
+        }
+    }
+}
+
+extern "C" fn stream_write_rows(userdata: *mut c_void, y: c_int, rows: c_int, pixels: *const c_uchar) -> c_int {
+    let stream = unsafe { &mut *(userdata as *mut Stream) };
+    let pixels = unsafe { std::slice::from_raw_parts(pixels, rows as usize * stream.out_row_len) };
+    match (stream.writer)(y as u32, pixels) {
+        Ok(()) => 0,
+        Err(e) => {
+            stream.error = Some(e);
+            -1
+        }
+    }
+}
+
+/// Model weights referenced in place by ncnn, 4 byte aligned and alive as long as the instance
+#[derive(Debug, Clone)]
+pub(crate) enum ModelBin {
+    Static(&'static [u8]),
+    Owned(Arc<Vec<u32>>),
+}
+
+impl ModelBin {
+    /// Embedded weights are used in place when aligned, otherwise copied once
+    pub(crate) fn from_static(bin: &'static [u8]) -> Self {
+        if bin.as_ptr() as usize % std::mem::align_of::<u32>() == 0 {
+            ModelBin::Static(bin)
+        } else {
+            Self::copy(bin)
+        }
+    }
+
+    pub(crate) fn copy(bin: &[u8]) -> Self {
+        let mut words = vec![0u32; (bin.len() + 3) / 4];
+        unsafe { std::ptr::copy_nonoverlapping(bin.as_ptr(), words.as_mut_ptr() as *mut u8, bin.len()) }
+        ModelBin::Owned(Arc::new(words))
+    }
+
+    /// Reads the weights straight into aligned memory, without an intermediate buffer
+    pub(crate) fn read<P: AsRef<Path>>(path: P) -> Result<Self, String> {
+        let mut file = std::fs::File::open(path)
+            .map_err(|e| format!("failed to read bin file: {}", e))?;
+        let len = file.metadata()
+            .map_err(|e| format!("failed to read bin file: {}", e))?
+            .len() as usize;
+        let mut words = vec![0u32; (len + 3) / 4];
+        let bytes = unsafe { std::slice::from_raw_parts_mut(words.as_mut_ptr() as *mut u8, len) };
+        file.read_exact(bytes)
+            .map_err(|e| format!("failed to read bin file: {}", e))?;
+        Ok(ModelBin::Owned(Arc::new(words)))
+    }
+
+    pub(crate) fn len(&self) -> usize {
+        match self {
+            ModelBin::Static(bin) => bin.len(),
+            ModelBin::Owned(words) => words.len() * 4,
+        }
+    }
+
+    fn as_ptr(&self) -> *const c_uchar {
+        match self {
+            ModelBin::Static(bin) => bin.as_ptr(),
+            ModelBin::Owned(words) => words.as_ptr() as *const c_uchar,
+        }
+    }
 }
 
 #[derive(Debug)]
 pub struct RealCugan {
     pointer: Arc<AtomicPtr<c_void>>,
     scale_factor: i32,
-    use_cpu: bool
+    use_cpu: bool,
+    // referenced by the weights of the network
+    #[allow(dead_code)]
+    model: ModelBin,
+    // the instance whose weights and pipelines a context runs on
+    #[allow(dead_code)]
+    shared: Option<Box<RealCugan>>,
 }
 
 unsafe impl Send for RealCugan {}
 
+// the c++ instance is reentrant, every call takes its own allocators and command buffers from a pool
+unsafe impl Sync for RealCugan {}
+
 impl RealCugan {
 
     fn calculate_prepadding(scale: i32) -> Result<i32, String> {
@@ -130,20 +413,10 @@ impl RealCugan {
         Ok(())
     }
 
-    fn create_file_pointer(contents: &[u8]) -> *mut FILE {
-        let buffer = contents.as_ptr() as *mut c_void;
-        let size = contents.len();
-        
-        unsafe { libc::fmemopen(buffer, size, "rb\0".as_ptr() as *const c_char) }
-    }
-
-    fn load_model(realcugan: *mut c_void, param: &[u8], bin: &[u8]) -> Result<(), String> {
-        let file_bin_pointer = Self::create_file_pointer(bin);
-        let file_param_pointer = Self::create_file_pointer(param);
-        if file_bin_pointer.is_null() || file_param_pointer.is_null() {
-            return Err(format!("failed to create file pointers"));
-        }
-        let result = unsafe { realcugan_load_files(realcugan, file_param_pointer, file_bin_pointer) };
+    fn load_model(realcugan: *mut c_void, param: &[u8], bin: &ModelBin) -> Result<(), String> {
+        let param = CString::new(param.split(|b| *b == 0).next().unwrap_or(&[]))
+            .map_err(|e| format!("invalid param file: {}", e))?;
+        let result = unsafe { realcugan_load_memory(realcugan, param.as_ptr(), bin.as_ptr()) };
 
         if result != 0 {
             Err(format!("failed to load model files. error code: {}", result))
@@ -163,11 +436,70 @@ impl RealCugan {
         param: &[u8],
         bin: &[u8],
     ) -> Result<Self, String> {
-        Self::validate_gpu(gpu)?;
+        Self::with_gpus(&[gpu], threads, tta, sync_gap, tile_size, scale, noise, param, bin, None)
+    }
+
+    /// Spreads the tiles of every image over all the given gpus,
+    /// compiled shaders are kept in cache_dir across runs when given
+    pub fn with_gpus(
+        gpus: &[i32],
+        threads: i32,
+        tta: bool,
+        sync_gap: i32,
+        tile_size: i32,
+        scale: i32,
+        noise: i32,
+        param: &[u8],
+        bin: &[u8],
+        cache_dir: Option<&Path>,
+    ) -> Result<Self, String> {
+        let tta = if tta { 8 } else { 1 };
+        Self::with_model(gpus, threads, tta, 1, sync_gap, tile_size, scale, noise, param, ModelBin::copy(bin), cache_dir)
+    }
+
+    pub(crate) fn with_model(
+        gpus: &[i32],
+        threads: i32,
+        tta: i32,
+        precision: i32,
+        sync_gap: i32,
+        tile_size: i32,
+        scale: i32,
+        noise: i32,
+        param: &[u8],
+        bin: ModelBin,
+        cache_dir: Option<&Path>,
+    ) -> Result<Self, String> {
+        if gpus.is_empty() {
+            return Err(format!("no gpu given"))
+        }
+        if gpus.len() > 1 && gpus.contains(&-1) {
+            return Err(format!("cpu can not be combined with other gpus"))
+        }
+        for gpu in gpus {
+            Self::validate_gpu(*gpu)?;
+        }
         let prepading = Self::calculate_prepadding(scale)?;
-        let tile_size = Self::calculate_tile_size(tile_size, scale, gpu);
-        let pointer = unsafe { realcugan_init(gpu,tta, threads) };
-        Self::load_model(pointer, param, bin)?;
+        let tile_size = gpus
+            .iter()
+            .map(|gpu| Self::calculate_tile_size(tile_size, scale, *gpu))
+            .min()
+            .unwrap_or(tile_size);
+        let pointer = if gpus.len() == 1 {
+            unsafe { realcugan_init(gpus[0], tta > 1, threads) }
+        } else {
+            unsafe { realcugan_init_multi(gpus.as_ptr(), gpus.len() as c_int, tta > 1, threads) }
+        };
+        if let Some(cache_dir) = cache_dir {
+            std::fs::create_dir_all(cache_dir)
+                .map_err(|e| format!("failed to create cache dir: {}", e))?;
+            let cache_dir = CString::new(cache_dir.to_string_lossy().as_bytes())
+                .map_err(|e| format!("invalid cache dir: {}", e))?;
+            unsafe { realcugan_set_cache_dir(pointer, cache_dir.as_ptr()) }
+        }
+        unsafe { realcugan_set_precision(pointer, precision) }
+        unsafe { realcugan_set_tta_level(pointer, tta) }
+        Self::load_model(pointer, param, &bin)?;
 
         unsafe {
             realcugan_set_parameters(
@@ -185,10 +517,131 @@ impl RealCugan {
         Ok(Self {
             pointer: Arc::new(AtomicPtr::new(pointer)),
             scale_factor: scale,
-            use_cpu: gpu == -1,
+            use_cpu: gpus[0] == -1,
+            model: bin,
+            shared: None,
+        })
+    }
+
+    /// Creates an execution context on the weights and pipelines of this instance, nothing is
+    /// loaded again. Each context keeps its own allocators and command buffers across calls,
+    /// so one context per worker thread costs only the memory of the tiles in flight
+    pub fn context(&self) -> Result<Self, String> {
+        let ptr = self.pointer.load(Ordering::Acquire);
+        if ptr.is_null() {
+            return Err(format!("invalid pointer"))
+        }
+
+        let pointer = unsafe { realcugan_init_context(ptr) };
+        if pointer.is_null() {
+            return Err(format!("failed to create context"))
+        }
+
+        INSTANCES.fetch_add(1, Ordering::Relaxed);
+
+        Ok(Self {
+            pointer: Arc::new(AtomicPtr::new(pointer)),
+            scale_factor: self.scale_factor,
+            use_cpu: self.use_cpu,
+            model: self.model.clone(),
+            shared: Some(Box::new(self.clone())),
         })
     }
 
+    /// Counters and stage timings of this instance, cheap enough to leave on.
+    /// Contexts count their own work apart from the instance they were created from
+    pub fn stats(&self) -> Stats {
+        let ptr = self.pointer.load(Ordering::Acquire);
+        let mut raw = RawStats::default();
+        if !ptr.is_null() {
+            unsafe { realcugan_get_stats(ptr, &mut raw) }
+        }
+        Stats {
+            tiles: raw.tiles,
+            cached_tiles: raw.cached_tiles,
+            bytes_uploaded: raw.bytes_uploaded,
+            bytes_downloaded: raw.bytes_downloaded,
+            feature_cache_peak_bytes: raw.feature_cache_peak_bytes,
+            reused_frames: raw.reused_frames,
+            spilled_passes: raw.spilled_passes,
+            host_sync_gaps: raw.host_sync_gaps,
+            host: StageTimes::from_ns(&raw.host_ns),
+            gpu: StageTimes::from_ns(&raw.gpu_ns),
+        }
+    }
+
+    pub fn reset_stats(&self) {
+        let ptr = self.pointer.load(Ordering::Acquire);
+        if !ptr.is_null() {
+            unsafe { realcugan_reset_stats(ptr) }
+        }
+    }
+
+    /// Number of vulkan capable gpus
+    pub fn gpu_count() -> u32 {
+        unsafe { realcugan_get_gpu_count() as u32 }
+    }
+
+    /// Name of the gpu as reported by the driver
+    pub fn gpu_name(gpu: u32) -> Result<String, String> {
+        if gpu >= Self::gpu_count() {
+            return Err(format!("gpu {} not found. available gpus: {}", gpu, Self::gpu_count()))
+        }
+        let name = unsafe { std::ffi::CStr::from_ptr(realcugan_get_gpu_name(gpu as c_int)) };
+        Ok(name.to_string_lossy().into_owned())
+    }
+
+    /// Device memory the process holds on the gpu and the heap budget of the gpu in MB,
+    /// the usage is 0 when the driver does not report it
+    pub fn heap_usage(gpu: u32) -> Result<(u32, u32), String> {
+        if gpu >= Self::gpu_count() {
+            return Err(format!("gpu {} not found. available gpus: {}", gpu, Self::gpu_count()))
+        }
+        Ok(unsafe { (realcugan_get_heap_usage(gpu as c_int), realcugan_get_heap_budget(gpu as c_int)) })
+    }
+
+    pub(crate) fn set_tile_size(&self, tile_size: i32) {
+        let ptr = self.pointer.load(Ordering::Acquire);
+        if !ptr.is_null() {
+            unsafe { realcugan_set_tilesize(ptr, tile_size.max(1)) }
+        }
+    }
+
+    pub(crate) fn set_pipeline_depth(&self, pipeline_depth: i32) {
+        let ptr = self.pointer.load(Ordering::Acquire);
+        if !ptr.is_null() {
+            unsafe { realcugan_set_pipeline_depth(ptr, pipeline_depth.max(1)) }
+        }
+    }
+
+    pub(crate) fn set_tile_threads(&self, tile_threads: i32) {
+        let ptr = self.pointer.load(Ordering::Acquire);
+        if !ptr.is_null() {
+            unsafe { realcugan_set_tile_threads(ptr, tile_threads.max(1)) }
+        }
+    }
+
+    pub(crate) fn set_tile_cache_size(&self, tile_cache_size: usize) {
+        let ptr = self.pointer.load(Ordering::Acquire);
+        if !ptr.is_null() {
+            unsafe { realcugan_set_tile_cache_size(ptr, tile_cache_size as size_t) }
+        }
+    }
+
+    pub(crate) fn set_feature_cache_budget(&self, feature_cache_budget: usize) {
+        let ptr = self.pointer.load(Ordering::Acquire);
+        if !ptr.is_null() {
+            unsafe { realcugan_set_feature_cache_budget(ptr, feature_cache_budget as size_t) }
+        }
+    }
+
+    pub(crate) fn set_temporal_threshold(&self, temporal_threshold: f32) {
+        let ptr = self.pointer.load(Ordering::Acquire);
+        if !ptr.is_null() {
+            unsafe { realcugan_set_temporal_threshold(ptr, temporal_threshold as c_float) }
+        }
+    }
+
     #[cfg(any(feature = "models-nose", feature = "models-pro", feature = "models-se"))]
     pub fn from_model(model: Model) -> Self {
         Builder::new().model(model).unwrap()
@@ -208,7 +661,7 @@ impl RealCugan {
         }.ok_or(format!("invalid number of channels: {}. expected 1, 2, 3, or 4", channels))
     }
 
-    fn prepare_image(&self, image: DynamicImage) -> (DynamicImage, u8) {
+    pub(crate) fn prepare_image(&self, image: DynamicImage) -> (DynamicImage, u8) {
         let bytes_per_pixel = image.color().bytes_per_pixel();
         match bytes_per_pixel {
             1 => (DynamicImage::from(image.to_rgb8()), 3),
@@ -235,50 +688,335 @@ impl RealCugan {
         }
     }
 
-    fn process(&self, in_buffer: Image, out_buffer: Image, channels: u8) -> Result<DynamicImage, String> {
-        let mut mat_ptr = std::ptr::null_mut();
+    fn process(&self, in_buffer: Image, mut out_buffer: Image, channels: u8) -> Result<DynamicImage, String> {
+        let length = usize::try_from(out_buffer.h * out_buffer.w * out_buffer.c)
+            .map_err(|e| format!("invalid buffer length: {}", e))?;
+
+        let mut bytes = vec![0u8; length];
+        out_buffer.data = bytes.as_mut_ptr();
+        self.process_buffers(&in_buffer, &out_buffer)?;
+
+        Self::convert_image(
+            out_buffer.w as u32,
+            out_buffer.h as u32,
+            channels,
+            bytes,
+        )
+    }
+
+    fn process_buffers(&self, in_buffer: &Image, out_buffer: &Image) -> Result<(), String> {
         let ptr = self.pointer.load(Ordering::Acquire);
         if ptr.is_null() {
             return Err(format!("invalid pointer"))
         }
 
         let result = if self.use_cpu {
-            unsafe {
-                realcugan_process_cpu(
-                    ptr,
-                    &in_buffer,
-                    &out_buffer,
-                    &mut mat_ptr,
-                )
-            }
+            unsafe { realcugan_process_cpu_into(ptr, in_buffer, out_buffer) }
         } else {
-            unsafe {
-                realcugan_process(
-                    ptr,
-                    &in_buffer,
-                    &out_buffer,
-                    &mut mat_ptr,
-                )
-            }
+            unsafe { realcugan_process_into(ptr, in_buffer, out_buffer) }
         };
 
         if result != 0 {
-            unsafe { realcugan_free_image(mat_ptr) };
             return Err(format!("failed to process image"))
         }
 
-        let length = usize::try_from(out_buffer.h * out_buffer.w * out_buffer.c)
-            .map_err(|e| format!("invalid buffer length: {}", e))?;
+        Ok(())
+    }
 
-        let copied_bytes = unsafe { std::slice::from_raw_parts(out_buffer.data as *const u8, length).to_vec() };
-        unsafe { realcugan_free_image(mat_ptr) }
+    /// Number of bytes process_into writes for this image
+    pub fn output_len(&self, image: &DynamicImage) -> usize {
+        let channels = match image.color().bytes_per_pixel() {
+            1 => 3,
+            2 => 4,
+            bytes_per_pixel => bytes_per_pixel as usize,
+        };
+        let scale = self.scale_factor as usize;
+        image.width() as usize * scale * image.height() as usize * scale * channels
+    }
 
-        Self::convert_image(
-            out_buffer.w as u32,
-            out_buffer.h as u32,
-            channels,
-            copied_bytes,
-        )
+    /// Upscales into a caller provided buffer of output_len bytes, tightly packed rows of
+    /// rgb or rgba pixels, so no intermediate image is allocated and nothing is copied
+    pub fn process_into(&self, image: &DynamicImage, out: &mut [u8]) -> Result<(), String> {
+        let expected = self.output_len(image);
+        if out.len() != expected {
+            return Err(format!("invalid output buffer length: {}. expected {}", out.len(), expected))
+        }
+
+        let converted;
+        let (image, channels) = match image.color().bytes_per_pixel() {
+            1 | 2 => {
+                converted = self.prepare_image(image.clone());
+                (&converted.0, converted.1)
+            }
+            bytes_per_pixel => (image, bytes_per_pixel),
+        };
+
+        let in_buffer = self.create_input_buffer(image, channels)?;
+        let mut out_buffer = self.create_output_buffer(&in_buffer, channels);
+        out_buffer.data = out.as_mut_ptr();
+        self.process_buffers(&in_buffer, &out_buffer)
+    }
+
+    /// Runs a dummy width x height image of channels, 3 or 4, through the same path as
+    /// process_image takes for that shape, with the tta, sync gap and scale of this instance.
+    /// The allocator pools grow to the size the shape needs and stay with the instance, so
+    /// the first real image runs at steady state latency. The stats and the tile cache are left
+    /// as they were
+    pub fn warm_up(&self, width: u32, height: u32, channels: u8) -> Result<(), String> {
+        let ptr = self.pointer.load(Ordering::Acquire);
+        if ptr.is_null() {
+            return Err(format!("invalid pointer"))
+        }
+        if channels != 3 && channels != 4 {
+            return Err(format!("invalid number of channels: {}. expected 3 or 4", channels))
+        }
+
+        let w = i32::try_from(width).map_err(|e| format!("invalid width: {}", e))?;
+        let h = i32::try_from(height).map_err(|e| format!("invalid height: {}", e))?;
+        let result = unsafe { realcugan_warm_up(ptr, w, h, c_int::from(channels)) };
+        if result != 0 {
+            return Err(format!("failed to warm up"))
+        }
+
+        Ok(())
+    }
+
+    /// Computes the SE gap features of the whole image for process_roi_into. Without a sync
+    /// gap, on the cpu or when the image fits in one tile there is nothing to compute and
+    /// the returned features are empty
+    pub fn gap_features(&self, image: &DynamicImage) -> Result<GapFeatures, String> {
+        let ptr = self.pointer.load(Ordering::Acquire);
+        if ptr.is_null() {
+            return Err(format!("invalid pointer"))
+        }
+
+        let converted;
+        let (image, channels) = match image.color().bytes_per_pixel() {
+            1 | 2 => {
+                converted = self.prepare_image(image.clone());
+                (&converted.0, converted.1)
+            }
+            bytes_per_pixel => (image, bytes_per_pixel),
+        };
+
+        let in_buffer = self.create_input_buffer(image, channels)?;
+        let pointer = unsafe { realcugan_gap_features(ptr, &in_buffer) };
+        if pointer.is_null() {
+            return Err(format!("failed to compute gap features"))
+        }
+
+        Ok(GapFeatures { pointer })
+    }
+
+    /// Upscales only the tiles meeting the width x height rectangle at x, y and writes the
+    /// rectangle into out, a buffer of output_len bytes holding the whole upscaled image, for
+    /// example from an earlier process_into. The rest of out is left as it is. Tiles lie on the
+    /// grid of the whole image, so the rectangle matches a full run. SE models take the gap
+    /// features of the whole image from features, or compute them when None is given
+    pub fn process_roi_into(&self, image: &DynamicImage, x: u32, y: u32, width: u32, height: u32, features: Option<&GapFeatures>, out: &mut [u8]) -> Result<(), String> {
+        let ptr = self.pointer.load(Ordering::Acquire);
+        if ptr.is_null() {
+            return Err(format!("invalid pointer"))
+        }
+        if width == 0 || height == 0 || x as u64 + width as u64 > image.width() as u64 || y as u64 + height as u64 > image.height() as u64 {
+            return Err(format!("invalid region: {}x{} at {},{} of a {}x{} image", width, height, x, y, image.width(), image.height()))
+        }
+        let expected = self.output_len(image);
+        if out.len() != expected {
+            return Err(format!("invalid output buffer length: {}. expected {}", out.len(), expected))
+        }
+
+        let converted;
+        let (image, channels) = match image.color().bytes_per_pixel() {
+            1 | 2 => {
+                converted = self.prepare_image(image.clone());
+                (&converted.0, converted.1)
+            }
+            bytes_per_pixel => (image, bytes_per_pixel),
+        };
+
+        let in_buffer = self.create_input_buffer(image, channels)?;
+        let mut out_buffer = self.create_output_buffer(&in_buffer, channels);
+        out_buffer.data = out.as_mut_ptr();
+
+        let feats = features.map_or(std::ptr::null(), |features| features.pointer as *const c_void);
+        let result = unsafe { realcugan_process_roi_into(ptr, &in_buffer, x as c_int, y as c_int, width as c_int, height as c_int, &out_buffer, feats) };
+        if result != 0 {
+            return Err(format!("failed to process region"))
+        }
+
+        Ok(())
+    }
+
+    /// Number of bytes of a 4:2:0 frame of width x height
+    pub fn yuv_len(width: u32, height: u32) -> usize {
+        width as usize * height as usize * 3 / 2
+    }
+
+    /// Upscales a 4:2:0 frame of even width and height into a caller provided buffer of
+    /// yuv_len bytes at the output size, BT.601 limited range. On the gpu the shaders convert
+    /// the planes as they read and write tiles, so no rgb frame is ever built on the host.
+    /// SE models with a sync gap, Precision::Fp32 and the cpu convert through rgb on the host
+    pub fn process_yuv_into(&self, format: YuvFormat, width: u32, height: u32, input: &[u8], out: &mut [u8]) -> Result<(), String> {
+        let ptr = self.pointer.load(Ordering::Acquire);
+        if ptr.is_null() {
+            return Err(format!("invalid pointer"))
+        }
+        if width % 2 != 0 || height % 2 != 0 {
+            return Err(format!("invalid yuv frame size: {}x{}. expected even width and height", width, height))
+        }
+        if input.len() != Self::yuv_len(width, height) {
+            return Err(format!("invalid input buffer length: {}. expected {}", input.len(), Self::yuv_len(width, height)))
+        }
+        let scale = self.scale_factor as u32;
+        let expected = Self::yuv_len(width * scale, height * scale);
+        if out.len() != expected {
+            return Err(format!("invalid output buffer length: {}. expected {}", out.len(), expected))
+        }
+
+        let in_buffer = Image {
+            data: input.as_ptr(),
+            w: i32::try_from(width).map_err(|e| format!("invalid width: {}", e))?,
+            h: i32::try_from(height).map_err(|e| format!("invalid height: {}", e))?,
+            c: 0,
+        };
+        let out_buffer = Image {
+            data: out.as_mut_ptr(),
+            w: in_buffer.w * self.scale_factor,
+            h: in_buffer.h * self.scale_factor,
+            c: 0,
+        };
+
+        let result = unsafe { realcugan_process_yuv_into(ptr, &in_buffer, &out_buffer, format.id()) };
+        if result != 0 {
+            return Err(format!("failed to process yuv frame"))
+        }
+
+        Ok(())
+    }
+
+    fn process_batch(&self, images: Vec<DynamicImage>) -> Vec<Result<DynamicImage, String>> {
+        let ptr = self.pointer.load(Ordering::Acquire);
+        if ptr.is_null() {
+            return images.iter().map(|_| Err(format!("invalid pointer"))).collect()
+        }
+
+        let mut prepared = Vec::with_capacity(images.len());
+        for image in images {
+            prepared.push(self.prepare_image(image));
+        }
+
+        let mut in_buffers = Vec::with_capacity(prepared.len());
+        let mut out_bytes = Vec::with_capacity(prepared.len());
+        let mut out_buffers = Vec::with_capacity(prepared.len());
+        for (image, channels) in &prepared {
+            let in_buffer = match self.create_input_buffer(image, *channels) {
+                Ok(in_buffer) => in_buffer,
+                Err(e) => return prepared.iter().map(|_| Err(e.clone())).collect(),
+            };
+            let mut out_buffer = self.create_output_buffer(&in_buffer, *channels);
+            let mut bytes = vec![0u8; (out_buffer.w * out_buffer.h * out_buffer.c) as usize];
+            out_buffer.data = bytes.as_mut_ptr();
+            in_buffers.push(in_buffer);
+            out_bytes.push(bytes);
+            out_buffers.push(out_buffer);
+        }
+
+        let result = unsafe {
+            realcugan_process_batch(
+                ptr,
+                in_buffers.as_ptr(),
+                out_buffers.as_ptr(),
+                in_buffers.len() as c_int,
+            )
+        };
+
+        if result != 0 {
+            return prepared.iter().map(|_| Err(format!("failed to process image"))).collect()
+        }
+
+        out_bytes
+            .into_iter()
+            .zip(out_buffers.iter())
+            .zip(prepared.iter())
+            .map(|((bytes, out_buffer), (_, channels))| {
+                Self::convert_image(out_buffer.w as u32, out_buffer.h as u32, *channels, bytes)
+            })
+            .collect()
+    }
+
+    /// Upscales a stream of frames, e.g. the frames of a video, through this instance.
+    /// Frames are handed over in small batches that share the gpu allocators and command
+    /// buffers, and the upload of a frame overlaps with the inference of the one before
+    pub fn process_frames<I: IntoIterator<Item = DynamicImage>>(&self, frames: I) -> Frames<'_, I::IntoIter> {
+        Frames {
+            realcugan: self,
+            frames: frames.into_iter(),
+            processed: VecDeque::new(),
+        }
+    }
+
+    /// Upscales an image larger than memory, only a band of rows around the current row of
+    /// tiles is held at once. reader fills the buffer with the input rows starting at the given
+    /// row, writer takes the finished output rows starting at the given row, both as tightly
+    /// packed rgb or rgba pixels. Tiles are processed independently as with SyncGap::Disabled
+    pub fn process_stream<R, W>(
+        &self,
+        width: u32,
+        height: u32,
+        channels: u8,
+        mut reader: R,
+        mut writer: W,
+    ) -> Result<(), String>
+    where
+        R: FnMut(u32, &mut [u8]) -> Result<(), String>,
+        W: FnMut(u32, &[u8]) -> Result<(), String>,
+    {
+        let ptr = self.pointer.load(Ordering::Acquire);
+        if ptr.is_null() {
+            return Err(format!("invalid pointer"))
+        }
+        if channels != 3 && channels != 4 {
+            return Err(format!("invalid number of channels: {}. expected 3 or 4", channels))
+        }
+        let w = i32::try_from(width).map_err(|e| format!("invalid width: {}", e))?;
+        let h = i32::try_from(height).map_err(|e| format!("invalid height: {}", e))?;
+
+        let mut stream = Stream {
+            reader: &mut reader,
+            writer: &mut writer,
+            in_row_len: width as usize * channels as usize,
+            out_row_len: width as usize * self.scale_factor as usize * channels as usize,
+            error: None,
+        };
+
+        let result = unsafe {
+            realcugan_process_stream(
+                ptr,
+                w,
+                h,
+                c_int::from(channels),
+                stream_read_rows,
+                stream_write_rows,
+                &mut stream as *mut Stream as *mut c_void,
+            )
+        };
+
+        if let Some(e) = stream.error {
+            return Err(e)
+        }
+        if result != 0 {
+            return Err(format!("failed to process image"))
+        }
+
+        Ok(())
+    }
+
+    /// Starts in_flight workers, each on its own context, that process submitted images in
+    /// the background. Images submitted together overlap on the GPU, and each one resolves
+    /// when its command buffers have completed
+    pub fn submitter(&self, in_flight: usize) -> Result<Submitter, String> {
+        Submitter::new(self, in_flight)
     }
 
     pub fn process_image(&self, image: DynamicImage) -> Result<DynamicImage, String> {
@@ -301,6 +1039,20 @@ impl RealCugan {
             })
     }
 
+    /// Runs process_raw_image over many encoded images, with decoding, upscaling and encoding
+    /// running at once on workers decode threads, the calling instance and workers encode
+    /// threads. Queues between the stages are bounded, so inputs are only read as fast as
+    /// the slowest stage. output receives each result with the position of its input, in
+    /// completion order
+    pub fn process_raw_images<I, F>(&self, inputs: I, workers: usize, output: F)
+    where
+        I: IntoIterator<Item = Vec<u8>>,
+        I::IntoIter: Send,
+        F: FnMut(usize, Result<Vec<u8>, String>),
+    {
+        pipeline::process_raw_images(self, inputs.into_iter(), workers, output)
+    }
+
     pub fn process_image_from_path<P: AsRef<Path>>(&self, path: &P) -> Result<DynamicImage, String> {
         let image = image::open(path)
             .map_err(|x| format!("failed to open image from path: {}", x))?;
@@ -309,6 +1061,27 @@ impl RealCugan {
 
 }
 
+pub struct Frames<'a, I> {
+    realcugan: &'a RealCugan,
+    frames: I,
+    processed: VecDeque<Result<DynamicImage, String>>,
+}
+
+impl <'a, I: Iterator<Item = DynamicImage>>Iterator for Frames<'a, I> {
+    type Item = Result<DynamicImage, String>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        if self.processed.is_empty() {
+            let batch: Vec<DynamicImage> = self.frames.by_ref().take(FRAMES_PER_BATCH).collect();
+            if batch.is_empty() {
+                return None
+            }
+            self.processed.extend(self.realcugan.process_batch(batch));
+        }
+        self.processed.pop_front()
+    }
+}
+
 impl Clone for RealCugan {
 
     fn clone(&self) -> Self {
@@ -316,6 +1089,8 @@ impl Clone for RealCugan {
             pointer: self.pointer.clone(),
             scale_factor: self.scale_factor,
             use_cpu: self.use_cpu,
+            model: self.model.clone(),
+            shared: self.shared.clone(),
         }
     }
 
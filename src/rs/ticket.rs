@@ -0,0 +1,144 @@
+use crate::realcugan::RealCugan;
+
+use std::future::Future;
+use std::pin::Pin;
+use std::sync::mpsc::{channel, Sender};
+use std::sync::{Arc, Condvar, Mutex};
+use std::task::{Context, Poll, Waker};
+use std::thread::JoinHandle;
+
+use image::DynamicImage;
+
+/// Result of one submission, filled in by the worker that ran it
+#[derive(Default)]
+struct TicketState {
+    result: Mutex<Option<Result<DynamicImage, String>>>,
+    waker: Mutex<Option<Waker>>,
+    done: Condvar,
+}
+
+impl TicketState {
+    fn complete(&self, result: Result<DynamicImage, String>) {
+        *self.result.lock().unwrap() = Some(result);
+        self.done.notify_all();
+        if let Some(waker) = self.waker.lock().unwrap().take() {
+            waker.wake();
+        }
+    }
+}
+
+/// Handle of an image handed to a Submitter, resolves to the upscaled image.
+/// Await it, poll it with try_wait, or block on it with wait
+pub struct Ticket {
+    state: Arc<TicketState>,
+}
+
+impl Ticket {
+    /// Whether the image has been processed, or failed
+    pub fn is_done(&self) -> bool {
+        self.state.result.lock().unwrap().is_some()
+    }
+
+    /// Takes the result once the image is done and uses up the ticket, or hands the ticket
+    /// back as the error while the image is still queued or running
+    pub fn try_wait(self) -> Result<Result<DynamicImage, String>, Self> {
+        let result = self.state.result.lock().unwrap().take();
+        match result {
+            Some(result) => Ok(result),
+            None => Err(self),
+        }
+    }
+
+    /// Blocks the calling thread until the image is done
+    pub fn wait(self) -> Result<DynamicImage, String> {
+        let mut result = self.state.result.lock().unwrap();
+        loop {
+            if let Some(result) = result.take() {
+                return result
+            }
+            result = self.state.done.wait(result).unwrap();
+        }
+    }
+}
+
+impl Future for Ticket {
+    type Output = Result<DynamicImage, String>;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        // the waker is stored before looking at the result, so a completion in between still wakes
+        *self.state.waker.lock().unwrap() = Some(cx.waker().clone());
+        match self.state.result.lock().unwrap().take() {
+            Some(result) => Poll::Ready(result),
+            None => Poll::Pending,
+        }
+    }
+}
+
+struct Job {
+    image: DynamicImage,
+    state: Arc<TicketState>,
+}
+
+/// Queue of images processed in the background by a few worker threads, each on its own
+/// execution context of the instance, so several images are in flight on the gpu at once.
+/// submit returns as soon as the image is queued and the caller is free to decode or encode
+/// other images meanwhile. Dropping the submitter finishes the queued images first
+pub struct Submitter {
+    sender: Option<Mutex<Sender<Job>>>,
+    workers: Vec<JoinHandle<()>>,
+}
+
+impl Submitter {
+    pub(crate) fn new(realcugan: &RealCugan, in_flight: usize) -> Result<Self, String> {
+        let (sender, receiver) = channel::<Job>();
+        let receiver = Arc::new(Mutex::new(receiver));
+
+        let mut workers = Vec::with_capacity(in_flight.max(1));
+        for _ in 0..in_flight.max(1) {
+            let context = realcugan.context()?;
+            let receiver = receiver.clone();
+            workers.push(std::thread::spawn(move || loop {
+                // the lock is only held while taking the next job, not while running it
+                let job = match receiver.lock().unwrap().recv() {
+                    Ok(job) => job,
+                    Err(_) => break,
+                };
+                job.state.complete(context.process_image(job.image));
+            }));
+        }
+
+        Ok(Self {
+            sender: Some(Mutex::new(sender)),
+            workers,
+        })
+    }
+
+    /// Queues image for upscaling and returns at once
+    pub fn submit(&self, image: DynamicImage) -> Ticket {
+        let state = Arc::new(TicketState::default());
+        let job = Job {
+            image,
+            state: state.clone(),
+        };
+
+        let sent = match &self.sender {
+            Some(sender) => sender.lock().unwrap().send(job).is_ok(),
+            None => false,
+        };
+        if !sent {
+            state.complete(Err(format!("submitter is shut down")));
+        }
+
+        Ticket { state }
+    }
+}
+
+impl Drop for Submitter {
+    fn drop(&mut self) {
+        // closing the channel lets the workers drain the queue and exit
+        self.sender = None;
+        for worker in self.workers.drain(..) {
+            let _ = worker.join();
+        }
+    }
+}
@@ -1,7 +1,27 @@
 use std::path::Path;
 
 const IMAGE: &str = "./tests/image.jpg";
-const MODEL: &str = "./models/models-se/up2x-conservative";
+const PARAM: &str = "./models/models-se/up2x-conservative.param";
+const BIN: &str = "./models/models-se/up2x-conservative.bin";
+
+/// The model of every test at scale 2 without denoise, tests only add what they change
+fn builder() -> realcugan_rs::Builder<'static> {
+    realcugan_rs::RealCugan::build()
+    .model_files(PARAM, BIN)
+    .scale(2)
+    .noise(-1)
+}
+
+fn open() -> image::DynamicImage {
+    image::open(IMAGE).expect("Failed to open test image")
+}
+
+/// The test image and its upscale by realcugan, the reference the other results are compared with
+fn expected(realcugan: &realcugan_rs::RealCugan) -> (image::DynamicImage, image::DynamicImage) {
+    let d_image = open();
+    let expected = realcugan.process_image(d_image.clone()).expect("Failed to upscale image");
+    (d_image, expected)
+}
 
 #[test]
 fn base() {
@@ -9,18 +29,14 @@ fn base() {
     assert!(Path::new(IMAGE).exists(), "Test image does not exist");
 
     // Create RealCugan instance
-    let result = realcugan_rs::RealCugan::build()
-    .model_files(&format!("{}.param", MODEL),&format!("{}.bin", MODEL))
-    .scale(2)
-    .noise(-1)
-    .build();
+    let result = builder().build();
 
     // Assert that RealCugan instance was created successfully
     assert!(result.is_ok(), "{}", result.err().unwrap().to_string());
     let realcugan = result.unwrap();
 
     // Open the original image
-    let d_image = image::open(IMAGE).expect("Failed to open test image");
+    let d_image = open();
     let original_with = d_image.width();
     let original_height = d_image.height();
 
@@ -52,11 +68,7 @@ fn base() {
 
 #[test]
 fn threads() {
-    let realcugan = realcugan_rs::RealCugan::build()
-    .model_files(&format!("{}.param", MODEL),&format!("{}.bin", MODEL))
-    .scale(2)
-    .noise(-1)
-    .unwrap();
+    let realcugan = builder().unwrap();
 
     let mut threads = Vec::new();
 
@@ -83,6 +95,522 @@ fn threads() {
     }
 }
 
+#[test]
+fn frames() {
+    let realcugan = builder().unwrap();
+    let (d_image, expected) = expected(&realcugan);
+
+    let frames = vec![d_image; 6];
+    let mut count = 0;
+    for frame in realcugan.process_frames(frames) {
+        let frame = frame.expect("Failed to upscale frame");
+        assert_eq!(frame.as_bytes(), expected.as_bytes(), "Frame differs from single image result");
+        count += 1;
+    }
+    assert_eq!(count, 6);
+}
+
+#[test]
+fn frames_per_frame() {
+    // passthrough and the cpu take every frame of a batch on its own, still into the batch buffers
+    let d_image = image::DynamicImage::from(open().to_rgb8());
+    let frames = vec![d_image.clone(); 3];
+    for frame in builder().scale(1).unwrap().process_frames(frames.clone()) {
+        let frame = frame.expect("Failed to process frame");
+        assert_eq!(frame.as_bytes(), d_image.as_bytes(), "Passthrough frame differs from the input");
+    }
+
+    let cpu = builder()
+    .cpu()
+    .unwrap();
+    let expected = cpu.process_image(d_image).expect("Failed to upscale image");
+    for frame in cpu.process_frames(frames) {
+        let frame = frame.expect("Failed to upscale frame");
+        assert_eq!(frame.as_bytes(), expected.as_bytes(), "Cpu frame differs from single image result");
+    }
+}
+
+#[test]
+fn concurrent() {
+    let realcugan = builder().unwrap();
+    let (d_image, expected) = expected(&realcugan);
+
+    std::thread::scope(|scope| {
+        for _ in 0..4 {
+            scope.spawn(|| {
+                let result = realcugan.process_image(d_image.clone()).expect("Failed to upscale image");
+                assert_eq!(result.as_bytes(), expected.as_bytes(), "Concurrent call differs from single image result");
+            });
+        }
+    });
+}
+
+#[test]
+fn contexts() {
+    let realcugan = builder().unwrap();
+    let (d_image, expected) = expected(&realcugan);
+
+    let mut threads = Vec::new();
+    for _ in 0..4 {
+        let context = realcugan.context().expect("Failed to create context");
+        let d_image = d_image.clone();
+        threads.push(std::thread::spawn(move || {
+            let mut results = Vec::new();
+            for _ in 0..2 {
+                results.push(context.process_image(d_image.clone()).expect("Failed to upscale image"));
+            }
+            results
+        }));
+    }
+
+    drop(realcugan);
+
+    for thread in threads {
+        for result in thread.join().unwrap() {
+            assert_eq!(result.as_bytes(), expected.as_bytes(), "Context differs from single image result");
+        }
+    }
+}
+
+#[test]
+fn stream() {
+    let realcugan = builder()
+    .sync_gap(realcugan_rs::SyncGap::Disabled)
+    .tile_size(64)
+    .unwrap();
+
+    let d_image = image::DynamicImage::from(open().to_rgb8());
+    let expected = realcugan.process_image(d_image.clone()).expect("Failed to upscale image");
+
+    let input = d_image.as_bytes();
+    let in_row = d_image.width() as usize * 3;
+    let out_row = expected.width() as usize * 3;
+    let mut output = vec![0u8; expected.as_bytes().len()];
+    realcugan.process_stream(d_image.width(), d_image.height(), 3,
+        |y, rows| {
+            let start = y as usize * in_row;
+            rows.copy_from_slice(&input[start..start + rows.len()]);
+            Ok(())
+        },
+        |y, rows| {
+            let start = y as usize * out_row;
+            output[start..start + rows.len()].copy_from_slice(rows);
+            Ok(())
+        },
+    ).expect("Failed to stream image");
+
+    assert_eq!(output, expected.as_bytes(), "Streamed image differs from single image result");
+}
+
+#[test]
+fn tile_cache() {
+    let realcugan = builder()
+    .sync_gap(realcugan_rs::SyncGap::Disabled)
+    .tile_size(64)
+    .tile_cache(64 << 20)
+    .unwrap();
+
+    let d_image = open();
+    let first = realcugan.process_image(d_image.clone()).expect("Failed to upscale image");
+    let cached = realcugan.process_image(d_image).expect("Failed to upscale image");
+
+    assert_eq!(cached.as_bytes(), first.as_bytes(), "Cached tiles differ from processed ones");
+    assert!(realcugan.stats().cached_tiles > 0, "No tile was taken from the cache");
+}
+
+#[test]
+fn stats() {
+    let realcugan = builder()
+    .sync_gap(realcugan_rs::SyncGap::Disabled)
+    .unwrap();
+
+    let d_image = open();
+    realcugan.process_image(d_image).expect("Failed to upscale image");
+
+    let stats = realcugan.stats();
+    assert!(stats.tiles > 0, "No tile was counted");
+    assert!(stats.host.inference > std::time::Duration::ZERO, "Inference was not timed");
+
+    realcugan.reset_stats();
+    assert_eq!(realcugan.stats(), realcugan_rs::Stats::default(), "Stats were not reset");
+}
+
+#[test]
+fn spill() {
+    // gap2 has twice the channels of the others, some budget spills its pass alone
+    let d_image = open();
+    let mut partial = false;
+    for kb in (0..11).map(|i| 1usize << i) {
+        let realcugan = builder()
+        .sync_gap(realcugan_rs::SyncGap::Loose)
+        .tile_size(64)
+        .feature_cache_budget(kb << 10)
+        .unwrap();
+        realcugan.process_image(d_image.clone()).expect("Failed to upscale image");
+
+        // only the sync gap after a pass that spilled averages on the host
+        let stats = realcugan.stats();
+        assert_eq!(stats.host_sync_gaps, stats.spilled_passes, "A {} KB budget averaged a gap on the host that did not spill", kb);
+        partial = partial || (stats.spilled_passes > 0 && stats.spilled_passes < 4);
+    }
+    assert!(partial, "No budget spilled only some of the passes");
+}
+
+#[test]
+fn precision() {
+    let build = |precision| builder()
+    .precision(precision)
+    .unwrap();
+
+    let d_image = open();
+    let reference = build(realcugan_rs::Precision::Fp32).process_image(d_image.clone()).expect("Failed to upscale image");
+    let fast = build(realcugan_rs::Precision::Fp16Arithmetic).process_image(d_image).expect("Failed to upscale image");
+
+    let psnr = realcugan_rs::psnr(&reference, &fast).expect("Failed to compare images");
+    assert!(psnr > 30.0, "fp16 arithmetic is {} dB from fp32", psnr);
+}
+
+#[test]
+fn precision_fp32() {
+    // fp32 uploads and downloads float pixels, the shaders have to agree with the host on that layout
+    let fp32 = builder()
+    .precision(realcugan_rs::Precision::Fp32)
+    .unwrap();
+
+    let (d_image, reference) = expected(&builder().unwrap());
+    let upscaled = fp32.process_image(d_image).expect("Failed to upscale image");
+
+    assert_eq!((upscaled.width(), upscaled.height()), (reference.width(), reference.height()), "Fp32 changed the output size");
+    let psnr = realcugan_rs::psnr(&reference, &upscaled).expect("Failed to compare images");
+    assert!(psnr > 35.0, "fp32 is {} dB from the default precision", psnr);
+}
+
+#[test]
+fn tta_level() {
+    let build = |level| builder()
+    .tta_level(level)
+    .unwrap();
+
+    let d_image = open();
+    let full = build(8).process_image(d_image.clone()).expect("Failed to upscale image");
+    let reduced = build(4).process_image(d_image).expect("Failed to upscale image");
+
+    assert_eq!((full.width(), full.height()), (reduced.width(), reduced.height()), "Reduced tta changed the output size");
+    let psnr = realcugan_rs::psnr(&full, &reduced).expect("Failed to compare images");
+    assert!(psnr > 30.0, "tta level 4 is {} dB from level 8", psnr);
+}
+
+#[test]
+fn tta_then_plain() {
+    // the shaders of both variants are cached side by side, an instance never takes those of the other
+    let tta = builder()
+    .tta()
+    .unwrap();
+    let d_image = open();
+    let averaged = tta.process_image(d_image.clone()).expect("Failed to upscale image");
+
+    let plain = builder().unwrap();
+    let upscaled = plain.process_image(d_image).expect("Failed to upscale image");
+
+    let (_, expected) = expected(&builder().unwrap());
+    assert_eq!(upscaled.as_bytes(), expected.as_bytes(), "A plain instance after a tta one differs from a fresh one");
+    let psnr = realcugan_rs::psnr(&averaged, &expected).expect("Failed to compare images");
+    assert!(psnr > 30.0, "tta is {} dB from the plain output", psnr);
+}
+
+#[test]
+fn rgba_cpu() {
+    let build = |builder: realcugan_rs::Builder<'static>| builder
+    .sync_gap(realcugan_rs::SyncGap::Disabled)
+    .tile_size(64)
+    .unwrap();
+
+    // a diagonal alpha ramp, any shift of the alpha tiles against the color shows up at every seam
+    let mut rgba = open().to_rgba8();
+    for (x, y, pixel) in rgba.enumerate_pixels_mut() {
+        pixel[3] = ((x + y) % 256) as u8;
+    }
+    let d_image = image::DynamicImage::from(rgba);
+
+    let gpu = build(builder()).process_image(d_image.clone()).expect("Failed to upscale image on the gpu");
+    let cpu = build(builder().cpu()).process_image(d_image).expect("Failed to upscale image on the cpu");
+
+    let psnr = realcugan_rs::psnr(&gpu, &cpu).expect("Failed to compare images");
+    assert!(psnr > 30.0, "cpu rgba is {} dB from gpu", psnr);
+    for (g, c) in gpu.as_bytes().chunks(4).zip(cpu.as_bytes().chunks(4)) {
+        assert!((g[3] as i32 - c[3] as i32).abs() <= 2, "cpu alpha {} differs from gpu alpha {}", c[3], g[3]);
+    }
+}
+
+#[test]
+fn tta_cpu() {
+    let build = |builder: realcugan_rs::Builder<'static>| builder.tta().sync_gap(realcugan_rs::SyncGap::Disabled).tile_size(48).unwrap();
+
+    // odd sides, so the edge tiles are no multiple of the 8 wide blocks of the shuffle kernels
+    let d_image = open().crop_imm(0, 0, 125, 93);
+    let threaded = build(builder().cpu().threads(4).tile_threads(3)).process_image(d_image.clone()).expect("Failed to upscale image");
+    let single = build(builder().cpu().threads(4).tile_threads(1)).process_image(d_image.clone()).expect("Failed to upscale image");
+    let gpu = build(builder()).process_image(d_image).expect("Failed to upscale image");
+
+    assert_eq!((threaded.width(), threaded.height()), (250, 186), "Cpu tta changed the output size");
+    assert_eq!(threaded.as_bytes(), single.as_bytes(), "Tile threads changed the cpu tta output");
+    let psnr = realcugan_rs::psnr(&threaded, &gpu).expect("Failed to compare images");
+    assert!(psnr > 30.0, "Cpu tta is {} dB from the gpu", psnr);
+}
+
+#[test]
+fn temporal_reuse() {
+    let realcugan = builder()
+    .sync_gap(realcugan_rs::SyncGap::Loose)
+    .temporal_reuse(2.0)
+    .unwrap();
+
+    let d_image = open();
+    let first = realcugan.process_image(d_image.clone()).expect("Failed to upscale image");
+    let second = realcugan.process_image(d_image.clone()).expect("Failed to upscale image");
+
+    assert_eq!(realcugan.stats().reused_frames, 1, "The second frame did not reuse the features");
+    assert_eq!(second.as_bytes(), first.as_bytes(), "Reused features changed the output");
+
+    // a cut far past the threshold computes the features again, as an instance without reuse would
+    let mut cut = d_image;
+    cut.invert();
+    let third = realcugan.process_image(cut.clone()).expect("Failed to upscale image");
+
+    assert_eq!(realcugan.stats().reused_frames, 1, "The cut reused the features of the previous frame");
+    let fresh = builder()
+    .sync_gap(realcugan_rs::SyncGap::Loose)
+    .unwrap();
+    let computed = fresh.process_image(cut).expect("Failed to upscale image");
+    assert_eq!(third.as_bytes(), computed.as_bytes(), "The cut was not upscaled with its own features");
+}
+
+fn clamp_u8(value: f32) -> u8 {
+    (value + 0.5).max(0.0).min(255.0) as u8
+}
+
+/// BT.601 limited range to rgb with the formulas of kernel_yuv_to_rgb
+fn yuv_to_rgb(yuv: &[u8], width: usize, height: usize, nv12: bool) -> Vec<u8> {
+    let (luma, cw) = (width * height, width / 2);
+    let mut rgb = vec![0u8; luma * 3];
+    for i in 0..height {
+        for j in 0..width {
+            let (u, v) = if nv12 {
+                (yuv[luma + i / 2 * width + j / 2 * 2], yuv[luma + i / 2 * width + j / 2 * 2 + 1])
+            } else {
+                (yuv[luma + i / 2 * cw + j / 2], yuv[luma + cw * (height / 2) + i / 2 * cw + j / 2])
+            };
+            let (u, v) = (u as f32 - 128.0, v as f32 - 128.0);
+            let y = 1.164 * (yuv[i * width + j] as f32 - 16.0);
+
+            let pixel = &mut rgb[(i * width + j) * 3..][..3];
+            pixel[0] = clamp_u8(y + 1.596 * v);
+            pixel[1] = clamp_u8(y - 0.392 * u - 0.813 * v);
+            pixel[2] = clamp_u8(y + 2.017 * u);
+        }
+    }
+    rgb
+}
+
+/// rgb to BT.601 limited range with the formulas of kernel_rgb_to_yuv, chroma from the mean of 2x2 pixels
+fn rgb_to_yuv(rgb: &[u8], width: usize, height: usize, nv12: bool) -> Vec<u8> {
+    let (luma, cw) = (width * height, width / 2);
+    let mut yuv = vec![0u8; luma + luma / 2];
+    for i in 0..height {
+        for j in 0..width {
+            let pixel = &rgb[(i * width + j) * 3..][..3];
+            yuv[i * width + j] = clamp_u8(16.0 + 0.257 * pixel[0] as f32 + 0.504 * pixel[1] as f32 + 0.098 * pixel[2] as f32);
+        }
+    }
+    for i in 0..height / 2 {
+        for j in 0..cw {
+            let mean = |c: usize| {
+                let at = |y: usize, x: usize| rgb[(y * width + x) * 3 + c] as f32;
+                (at(i * 2, j * 2) + at(i * 2, j * 2 + 1) + at(i * 2 + 1, j * 2) + at(i * 2 + 1, j * 2 + 1)) * 0.25
+            };
+            let (r, g, b) = (mean(0), mean(1), mean(2));
+            let u = clamp_u8(128.0 - 0.148 * r - 0.291 * g + 0.439 * b);
+            let v = clamp_u8(128.0 + 0.439 * r - 0.368 * g - 0.071 * b);
+            if nv12 {
+                yuv[luma + i * width + j * 2] = u;
+                yuv[luma + i * width + j * 2 + 1] = v;
+            } else {
+                yuv[luma + i * cw + j] = u;
+                yuv[luma + cw * (height / 2) + i * cw + j] = v;
+            }
+        }
+    }
+    yuv
+}
+
+#[test]
+fn yuv() {
+    let realcugan = builder()
+    .sync_gap(realcugan_rs::SyncGap::Disabled)
+    .tile_size(64)
+    .unwrap();
+
+    // ramps in every plane, over several rows of tiles
+    let (width, height) = (96u32, 160u32);
+    let (w, h) = (width as usize, height as usize);
+    let (luma, cw) = (w * h, w / 2);
+
+    for format in [realcugan_rs::YuvFormat::I420, realcugan_rs::YuvFormat::Nv12] {
+        let nv12 = format == realcugan_rs::YuvFormat::Nv12;
+
+        let mut frame = vec![0u8; realcugan_rs::RealCugan::yuv_len(width, height)];
+        for i in 0..h {
+            for j in 0..w {
+                frame[i * w + j] = (60 + (i + j) * 120 / (w + h)) as u8;
+            }
+        }
+        for i in 0..h / 2 {
+            for j in 0..cw {
+                let (u, v) = ((100 + j * 56 / cw) as u8, (100 + i * 56 / (h / 2)) as u8);
+                if nv12 {
+                    frame[luma + i * w + j * 2] = u;
+                    frame[luma + i * w + j * 2 + 1] = v;
+                } else {
+                    frame[luma + i * cw + j] = u;
+                    frame[luma + cw * (h / 2) + i * cw + j] = v;
+                }
+            }
+        }
+
+        let mut out = vec![0u8; realcugan_rs::RealCugan::yuv_len(width * 2, height * 2)];
+        realcugan.process_yuv_into(format, width, height, &frame, &mut out).expect("Failed to upscale yuv frame");
+
+        // the same frame through rgb on the host
+        let rgb = image::DynamicImage::from(image::RgbImage::from_raw(width, height, yuv_to_rgb(&frame, w, h, nv12)).unwrap());
+        let mut upscaled = vec![0u8; realcugan.output_len(&rgb)];
+        realcugan.process_into(&rgb, &mut upscaled).expect("Failed to upscale image");
+        let expected = rgb_to_yuv(&upscaled, w * 2, h * 2, nv12);
+
+        let diffs: Vec<i32> = out.iter().zip(expected.iter()).map(|(a, b)| (*a as i32 - *b as i32).abs()).collect();
+        let max = *diffs.iter().max().unwrap();
+        let mean = diffs.iter().sum::<i32>() as f64 / diffs.len() as f64;
+        assert!(max <= 6 && mean < 1.5, "{:?} is up to {} and on average {} off the rgb path", format, max, mean);
+    }
+}
+
+#[test]
+fn passthrough_into() {
+    // without denoise or upscale the input is copied, into the caller's buffer on both paths
+    let d_image = image::DynamicImage::from(open().to_rgb8());
+    for realcugan in [builder().scale(1).unwrap(), builder().scale(1).cpu().unwrap()] {
+        let mut out = vec![0u8; realcugan.output_len(&d_image)];
+        realcugan.process_into(&d_image, &mut out).expect("Failed to process image");
+        assert_eq!(&out[..], d_image.as_bytes(), "Passthrough did not write the caller's buffer");
+    }
+}
+
+#[test]
+fn submit() {
+    let realcugan = builder().unwrap();
+    let (d_image, expected) = expected(&realcugan);
+
+    let submitter = realcugan.submitter(2).expect("Failed to start submitter");
+    let tickets: Vec<_> = (0..3).map(|_| submitter.submit(d_image.clone())).collect();
+    for ticket in tickets {
+        let image = ticket.wait().expect("Failed to upscale submitted image");
+        assert_eq!(image.as_bytes(), expected.as_bytes(), "Submitted image differs from process_image");
+    }
+
+    // a ticket polled with try_wait is handed back until its image is done
+    let mut ticket = submitter.submit(d_image);
+    let image = loop {
+        match ticket.try_wait() {
+            Ok(result) => break result.expect("Failed to upscale submitted image"),
+            Err(pending) => ticket = pending,
+        }
+        std::thread::yield_now();
+    };
+    assert_eq!(image.as_bytes(), expected.as_bytes(), "Polled image differs from process_image");
+}
+
+#[test]
+fn raw_pipeline() {
+    let realcugan = builder().unwrap();
+
+    let raw = std::fs::read(IMAGE).expect("Failed to read test image");
+    let expected = realcugan.process_raw_image(&raw).expect("Failed to upscale raw image");
+
+    let mut outputs = vec![None; 3];
+    realcugan.process_raw_images(vec![raw; 3], 2, |index, output| {
+        outputs[index] = Some(output.expect("Failed to upscale raw image in the pipeline"));
+    });
+    for output in outputs {
+        assert_eq!(output.as_ref(), Some(&expected), "Pipeline output differs from process_raw_image");
+    }
+}
+
+#[test]
+fn roi() {
+    let realcugan = builder()
+    .sync_gap(realcugan_rs::SyncGap::Loose)
+    .tile_size(64)
+    .unwrap();
+
+    let d_image = open();
+    let mut full = vec![0u8; realcugan.output_len(&d_image)];
+    realcugan.process_into(&d_image, &mut full).expect("Failed to upscale image");
+
+    let (x, y, width, height) = (d_image.width() / 3, d_image.height() / 3, d_image.width() / 3, d_image.height() / 3);
+    let features = realcugan.gap_features(&d_image).expect("Failed to compute gap features");
+    let mut roi = vec![0u8; full.len()];
+    realcugan.process_roi_into(&d_image, x, y, width, height, Some(&features), &mut roi).expect("Failed to upscale region");
+
+    let channels = full.len() / (d_image.width() * 2 * d_image.height() * 2) as usize;
+    let stride = d_image.width() as usize * 2 * channels;
+    for row in y as usize * 2..(y + height) as usize * 2 {
+        let start = row * stride + x as usize * 2 * channels;
+        let end = start + width as usize * 2 * channels;
+        assert_eq!(&roi[start..end], &full[start..end], "Region row {} differs from the full frame", row);
+    }
+    assert!(roi[..y as usize * 2 * stride].iter().all(|byte| *byte == 0), "Rows above the region were written");
+}
+
+#[test]
+fn roi_passthrough_cpu() {
+    // without denoise or upscale the cpu copies the rectangle instead of running the network
+    let realcugan = builder()
+    .scale(1)
+    .cpu()
+    .unwrap();
+
+    let d_image = image::DynamicImage::from(open().to_rgb8());
+    let (x, y, width, height) = (d_image.width() / 3, d_image.height() / 3, d_image.width() / 3, d_image.height() / 3);
+    let mut roi = vec![0u8; realcugan.output_len(&d_image)];
+    realcugan.process_roi_into(&d_image, x, y, width, height, None, &mut roi).expect("Failed to copy region");
+
+    let stride = d_image.width() as usize * 3;
+    for row in y as usize..(y + height) as usize {
+        let start = row * stride + x as usize * 3;
+        let end = start + width as usize * 3;
+        assert_eq!(&roi[start..end], &d_image.as_bytes()[start..end], "Region row {} differs from the input", row);
+    }
+    assert!(roi[..y as usize * stride].iter().all(|byte| *byte == 0), "Rows above the region were written");
+}
+
+#[test]
+fn warm_up() {
+    let d_image = open();
+    let realcugan = builder()
+    .warm_up(d_image.width(), d_image.height(), 3)
+    .unwrap();
+
+    assert_eq!(realcugan.stats(), realcugan_rs::Stats::default(), "Warm up changed the stats");
+    assert!(realcugan.warm_up(16, 16, 2).is_err(), "Warm up accepted two channels");
+
+    // nor does a later one with the tile cache on
+    let cached = builder()
+    .tile_cache(64 << 20)
+    .unwrap();
+    cached.warm_up(d_image.width(), d_image.height(), 3).expect("Failed to warm up");
+    assert_eq!(cached.stats(), realcugan_rs::Stats::default(), "Warm up changed the stats");
+    realcugan.process_image(d_image).expect("Failed to upscale image after warm up");
+}
+
 #[cfg(feature = "models")]
 #[test]
 fn model() {